@@ -18,9 +18,11 @@
 
 #pragma once
 
+#include <folly/Optional.h>
 #include <folly/futures/Future.h>
 
 #include <atomic>
+#include <mutex>
 #include <string>
 #include <type_traits>
 
@@ -45,6 +47,10 @@ folly::Future<folly::Unit> GenerateDelayedFuture(folly::Duration delay);
  * futures succeeds, the exception from the primary future is used to fulfill
  * the returned future.
  *
+ * If cancel_loser is true, once one of the futures fulfills the returned
+ * future, the other one is cancelled by raising folly::FutureCancellation on
+ * it. It is up to its producer to act on the interrupt.
+ *
  * @T The value type of the future
  * @F The functor type that returns the backup future
  *
@@ -52,6 +58,7 @@ folly::Future<folly::Unit> GenerateDelayedFuture(folly::Duration delay);
  * @backup_future_func A functor used to build a backup future. It will be
  *                     called at most once
  * @speculative_timeout Timeout
+ * @cancel_loser Whether to cancel the future not used
  *
  * @return the derived future
  */
@@ -59,7 +66,8 @@ template <typename T, typename F>
 folly::Future<T> GetSpeculativeFuture(
     folly::Future<T>&& primary_future,
     F&& backup_future_func,
-    folly::Duration speculative_timeout) {
+    folly::Duration speculative_timeout,
+    const bool cancel_loser = false) {
   static_assert(
     std::is_same<decltype(backup_future_func()), folly::Future<T>>::value,
     "backup_future_func and primary_future types mismatch");
@@ -67,13 +75,19 @@ folly::Future<T> GetSpeculativeFuture(
   static const std::string kBackupFired = "speculative_failover_fired";
   static const std::string kPrimaryTimeout = "original_request_timeout";
 
+  enum { kPrimary = 0, kBackup = 1 };
+
   struct Context {
-    explicit Context(F&& func)
+    Context(F&& func, const bool cancel)
       : fulfilled(false)
       , backup_fired(false)
       , promise()
       , backup_future_func(std::forward<F>(func))
-      , primary_exception() {}
+      , primary_exception()
+      , cancel_loser(cancel)
+      , attempts_mutex()
+      , attempts()
+      , winner(-1) {}
 
     ~Context() {
       if (!fulfilled.load()) {
@@ -87,35 +101,84 @@ folly::Future<T> GetSpeculativeFuture(
       }
 
       auto backup_future = backup_future_func();
-      std::move(backup_future).then([ctx = std::move(ctx)] (folly::Try<T>&& t) mutable {
-        if (!t.hasException() && ctx->fulfilled.exchange(true) == false) {
-          ctx->promise.setTry(std::move(t));
-        }
-      });
+      auto self = ctx.get();
+      self->setAttempt(kBackup, std::move(backup_future).then(
+        [ctx = std::move(ctx)] (folly::Try<T>&& t) mutable {
+          if (!t.hasException() && ctx->fulfilled.exchange(true) == false) {
+            ctx->cancelLoser(kBackup);
+            ctx->promise.setTry(std::move(t));
+          }
+        }));
 
       common::Stats::get()->Incr(kBackupFired);
     }
 
+    // Keep the continuation of attempt i around for cancelLoser(), or cancel
+    // it right away if the other attempt has already won.
+    void setAttempt(const int i, folly::Future<folly::Unit>&& attempt) {
+      if (!cancel_loser) {
+        return;
+      }
+
+      {
+        std::lock_guard<std::mutex> g(attempts_mutex);
+        if (winner < 0 || winner == i) {
+          attempts[i] = std::move(attempt);
+          return;
+        }
+      }
+
+      attempt.cancel();
+    }
+
+    void cancelLoser(const int i) {
+      if (!cancel_loser) {
+        return;
+      }
+
+      folly::Optional<folly::Future<folly::Unit>> loser;
+      {
+        std::lock_guard<std::mutex> g(attempts_mutex);
+        winner = i;
+        loser.swap(attempts[1 - i]);
+      }
+
+      // interrupts propagate back to the future the continuation hangs off
+      if (loser.hasValue()) {
+        loser->cancel();
+      }
+    }
+
     std::atomic<bool> fulfilled;
     std::atomic<bool> backup_fired;
     folly::Promise<T> promise;
     F backup_future_func;
     folly::Try<T> primary_exception;
+
+    const bool cancel_loser;
+    // protects attempts and winner
+    std::mutex attempts_mutex;
+    // continuations of the primary and backup futures, until one wins
+    folly::Optional<folly::Future<folly::Unit>> attempts[2];
+    int winner;
   };
 
-  auto ctx = std::make_shared<Context>(std::forward<F>(backup_future_func));
+  auto ctx = std::make_shared<Context>(std::forward<F>(backup_future_func),
+                                       cancel_loser);
   auto future = ctx->promise.getFuture();
 
-  std::move(primary_future).then([ctx] (folly::Try<T>&& t) mutable {
-    if (t.hasException()) {
-      if (!ctx->fulfilled.load()) {
-        ctx->tryToFireBackupFuture(ctx);
-        ctx->primary_exception = std::move(t);
+  ctx->setAttempt(kPrimary, std::move(primary_future).then(
+    [ctx] (folly::Try<T>&& t) mutable {
+      if (t.hasException()) {
+        if (!ctx->fulfilled.load()) {
+          ctx->tryToFireBackupFuture(ctx);
+          ctx->primary_exception = std::move(t);
+        }
+      } else if (ctx->fulfilled.exchange(true) == false) {
+        ctx->cancelLoser(kPrimary);
+        ctx->promise.setTry(std::move(t));
       }
-    } else if (ctx->fulfilled.exchange(true) == false) {
-      ctx->promise.setTry(std::move(t));
-    }
-  });
+    }));
 
   auto timeout_future = GenerateDelayedFuture(speculative_timeout);
   std::weak_ptr<Context> weak_ctx = ctx;
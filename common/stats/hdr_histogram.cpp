@@ -0,0 +1,223 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+
+#include "common/stats/hdr_histogram.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace common {
+
+namespace {
+
+const int kMinSignificantDigits = 1;
+const int kMaxSignificantDigits = 5;
+
+// The # of bits needed to represent value
+inline uint32_t BitLength(uint64_t value) {
+  return value == 0 ? 0 : 64 - __builtin_clzll(value);
+}
+
+}  // namespace
+
+HdrHistogram::HdrHistogram(int significant_digits, int64_t max_value)
+    : max_value_(std::max<int64_t>(max_value, 1)),
+      sub_bucket_count_(0),
+      sub_bucket_count_magnitude_(0),
+      bucket_count_(0),
+      buckets_(),
+      sum_(0) {
+  significant_digits = std::min(std::max(significant_digits,
+                                         kMinSignificantDigits),
+                                kMaxSignificantDigits);
+  // Values up to this are counted exactly. Any larger value v shares its
+  // slot with less than v / largest_exact_value * 2 other values.
+  int64_t largest_exact_value = 2;
+  for (int i = 0; i < significant_digits; ++i) {
+    largest_exact_value *= 10;
+  }
+
+  sub_bucket_count_magnitude_ = BitLength(largest_exact_value - 1);
+  sub_bucket_count_ = 1u << sub_bucket_count_magnitude_;
+  // bucket b covers values up to (sub_bucket_count_ << b) - 1
+  bucket_count_ = 1;
+  while ((static_cast<uint64_t>(sub_bucket_count_) << (bucket_count_ - 1)) <=
+         static_cast<uint64_t>(max_value_)) {
+    ++bucket_count_;
+  }
+
+  buckets_.reset(new std::atomic<Slot*>[bucket_count_]);
+  for (uint32_t i = 0; i < bucket_count_; ++i) {
+    buckets_[i].store(nullptr, std::memory_order_relaxed);
+  }
+}
+
+HdrHistogram::~HdrHistogram() {
+  for (uint32_t i = 0; i < bucket_count_; ++i) {
+    delete[] buckets_[i].load();
+  }
+}
+
+void HdrHistogram::record(int64_t value, uint64_t count) {
+  value = std::min(std::max<int64_t>(value, 0), max_value_);
+  // Values below sub_bucket_count_ go to bucket 0. Each following bucket
+  // covers twice the range of the previous one with the same # of slots.
+  const uint64_t v = value;
+  const uint32_t bucket =
+    BitLength(v | (sub_bucket_count_ - 1)) - sub_bucket_count_magnitude_;
+  uint32_t slot = v >> bucket;
+  if (bucket > 0) {
+    // the lower half of sub buckets is covered by the previous buckets
+    slot -= sub_bucket_count_ / 2;
+  }
+
+  getOrCreateBucket(bucket)[slot].fetch_add(count, std::memory_order_relaxed);
+  sum_.fetch_add(value * count, std::memory_order_relaxed);
+}
+
+void HdrHistogram::add(const HdrHistogram& other) {
+  for (uint32_t b = 0; b < std::min(bucket_count_, other.bucket_count_); ++b) {
+    auto from = other.buckets_[b].load(std::memory_order_acquire);
+    if (from == nullptr) {
+      continue;
+    }
+
+    Slot* to = nullptr;
+    for (uint32_t i = 0; i < bucketSize(b); ++i) {
+      auto n = from[i].load(std::memory_order_relaxed);
+      if (n > 0) {
+        if (to == nullptr) {
+          to = getOrCreateBucket(b);
+        }
+        to[i].fetch_add(n, std::memory_order_relaxed);
+      }
+    }
+  }
+
+  sum_.fetch_add(other.sum(), std::memory_order_relaxed);
+}
+
+void HdrHistogram::drainFrom(HdrHistogram* other) {
+  for (uint32_t b = 0; b < std::min(bucket_count_, other->bucket_count_);
+       ++b) {
+    auto from = other->buckets_[b].load(std::memory_order_acquire);
+    if (from == nullptr) {
+      continue;
+    }
+
+    Slot* to = nullptr;
+    for (uint32_t i = 0; i < bucketSize(b); ++i) {
+      // skip the write for empty slots, which are the vast majority
+      if (from[i].load(std::memory_order_relaxed) == 0) {
+        continue;
+      }
+
+      auto n = from[i].exchange(0, std::memory_order_relaxed);
+      if (to == nullptr) {
+        to = getOrCreateBucket(b);
+      }
+      to[i].fetch_add(n, std::memory_order_relaxed);
+    }
+  }
+
+  sum_.fetch_add(other->sum_.exchange(0, std::memory_order_relaxed),
+                 std::memory_order_relaxed);
+}
+
+void HdrHistogram::clear() {
+  for (uint32_t b = 0; b < bucket_count_; ++b) {
+    auto slots = buckets_[b].load(std::memory_order_acquire);
+    if (slots == nullptr) {
+      continue;
+    }
+
+    for (uint32_t i = 0; i < bucketSize(b); ++i) {
+      slots[i].store(0, std::memory_order_relaxed);
+    }
+  }
+
+  sum_.store(0, std::memory_order_relaxed);
+}
+
+uint64_t HdrHistogram::count() const {
+  uint64_t total = 0;
+  for (uint32_t b = 0; b < bucket_count_; ++b) {
+    auto slots = buckets_[b].load(std::memory_order_acquire);
+    if (slots == nullptr) {
+      continue;
+    }
+
+    for (uint32_t i = 0; i < bucketSize(b); ++i) {
+      total += slots[i].load(std::memory_order_relaxed);
+    }
+  }
+
+  return total;
+}
+
+int64_t HdrHistogram::percentile(double pct) const {
+  const auto total = count();
+  if (total == 0) {
+    return 0;
+  }
+
+  pct = std::min(std::max(pct, 0.0), 100.0);
+  const auto rank = std::min<uint64_t>(
+    std::max<uint64_t>(std::ceil(pct / 100 * total), 1), total);
+  uint64_t seen = 0;
+  for (uint32_t b = 0; b < bucket_count_; ++b) {
+    auto slots = buckets_[b].load(std::memory_order_acquire);
+    if (slots == nullptr) {
+      continue;
+    }
+
+    for (uint32_t i = 0; i < bucketSize(b); ++i) {
+      seen += slots[i].load(std::memory_order_relaxed);
+      if (seen >= rank) {
+        return highestValue(b, i);
+      }
+    }
+  }
+
+  // values recorded while we were counting
+  return max_value_;
+}
+
+int64_t HdrHistogram::highestValue(uint32_t bucket, uint32_t slot) const {
+  const uint64_t sub_bucket = bucket == 0 ? slot :
+    slot + sub_bucket_count_ / 2;
+  const uint64_t highest = ((sub_bucket + 1) << bucket) - 1;
+  return std::min<int64_t>(highest, max_value_);
+}
+
+HdrHistogram::Slot* HdrHistogram::getOrCreateBucket(uint32_t bucket) {
+  auto slots = buckets_[bucket].load(std::memory_order_acquire);
+  if (slots) {
+    return slots;
+  }
+
+  // value initialization zeroes the counts
+  auto new_slots = new Slot[bucketSize(bucket)]();
+  if (buckets_[bucket].compare_exchange_strong(slots, new_slots,
+                                               std::memory_order_acq_rel)) {
+    return new_slots;
+  }
+
+  // someone else got there first, slots is theirs
+  delete[] new_slots;
+  return slots;
+}
+
+}  // namespace common
@@ -0,0 +1,102 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+namespace common {
+
+/**
+ * A log-linear (HDR style) histogram. Values are bucketed by their power of
+ * two, and each power of two range is split into linear sub buckets fine
+ * enough to keep significant_digits decimal digits of every value. So the
+ * relative error of any percentile is below 10^-significant_digits, however
+ * large the value, while the memory used only grows with log(max_value).
+ *
+ * Bucket arrays are allocated on first use, so a histogram only recording
+ * values of similar magnitude stays small.
+ *
+ * record() is thread safe and lock free. The other functions may run
+ * concurrently with record(), but then don't see a consistent snapshot.
+ */
+class HdrHistogram {
+ public:
+  // Values larger than max_value are recorded as max_value. Negative values
+  // are recorded as 0.
+  HdrHistogram(int significant_digits, int64_t max_value);
+  ~HdrHistogram();
+
+  // no copy or move
+  HdrHistogram(const HdrHistogram&) = delete;
+  HdrHistogram& operator=(const HdrHistogram&) = delete;
+
+  void record(int64_t value, uint64_t count = 1);
+
+  // Add the values recorded in other, which must be constructed with the
+  // same parameters as *this.
+  void add(const HdrHistogram& other);
+
+  // Same as add(), but also take the values out of other. Values recorded in
+  // other concurrently are either moved or left in other, never lost.
+  void drainFrom(HdrHistogram* other);
+
+  void clear();
+
+  uint64_t count() const;
+
+  int64_t sum() const {
+    return sum_.load(std::memory_order_relaxed);
+  }
+
+  // The value pct percent of the values recorded are no larger than, up to
+  // the precision of *this. 0 if nothing has been recorded.
+  int64_t percentile(double pct) const;
+
+  int64_t min() const {
+    return percentile(0);
+  }
+
+  int64_t max() const {
+    return percentile(100);
+  }
+
+ private:
+  using Slot = std::atomic<uint64_t>;
+
+  // The # of slots in bucket
+  uint32_t bucketSize(uint32_t bucket) const {
+    return bucket == 0 ? sub_bucket_count_ : sub_bucket_count_ / 2;
+  }
+
+  // The largest value counted in slot of bucket
+  int64_t highestValue(uint32_t bucket, uint32_t slot) const;
+
+  // Allocate bucket unless it's allocated, and return it
+  Slot* getOrCreateBucket(uint32_t bucket);
+
+  const int64_t max_value_;
+  // the # of linear sub buckets per power of two, a power of two itself
+  uint32_t sub_bucket_count_;
+  uint32_t sub_bucket_count_magnitude_;
+  uint32_t bucket_count_;
+  // bucket_count_ lazily allocated slot arrays
+  std::unique_ptr<std::atomic<Slot*>[]> buckets_;
+  std::atomic<int64_t> sum_;
+};
+
+}  // namespace common
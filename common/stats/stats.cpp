@@ -19,9 +19,9 @@
 #include <folly/Memory.h>
 #include <folly/stats/BucketedTimeSeries-defs.h>
 #include <folly/stats/MultiLevelTimeSeries-defs.h>
-#include <folly/stats/Histogram-defs.h>
-#include <folly/stats/TimeseriesHistogram-defs.h>
 #include <folly/String.h>
+#include <gflags/gflags.h>
+#include <algorithm>
 #include <cstdlib>
 #include <sstream>
 #include <string>
@@ -29,7 +29,6 @@
 #include <utility>
 #include <vector>
 
-using folly::Histogram;
 using folly::MultiLevelTimeSeries;
 using std::chrono::duration_cast;
 using std::chrono::seconds;
@@ -43,27 +42,35 @@ using std::thread;
 using std::unique_ptr;
 using std::vector;
 
+DEFINE_int32(stats_histogram_significant_digits, 2,
+             "Decimal digits of precision kept for metric values");
+DEFINE_int64(stats_histogram_max_value, 4LL * 3600 * 1000 * 1000,
+             "Metric values larger than this are recorded as this. The "
+             "default covers 4 hours in microseconds");
+
 namespace common {
 
 namespace {
 
-const int64_t kMinMetricValue = 0;
-const int64_t kMaxMetricValue = 200;
 const int64_t kFlushIntervalMS = 250;
+// # of windows the last minute of a metric is kept in
+const uint32_t kMetricWindowsPerMin = 6;
 
 inline seconds GetTimeSinceEpochSeconds() {
   return duration_cast<seconds>(system_clock::now().time_since_epoch());
 }
 
+unique_ptr<HdrHistogram> NewHistogram() {
+  return folly::make_unique<HdrHistogram>(
+      FLAGS_stats_histogram_significant_digits,
+      FLAGS_stats_histogram_max_value);
+}
+
 unique_ptr<Stats::TimeseriesHistogramWrapper> GetTimeseriesHistogramWrapper(
     uint32_t nSecondsPerMin) {
-  std::vector<seconds> intervals { seconds(nSecondsPerMin), seconds(0) };
-
-  folly::TimeseriesHistogram<int64_t> ts_histogram(
-      1, kMinMetricValue, kMaxMetricValue,
-      MultiLevelTimeSeries<int64_t>(60, intervals.size(), intervals.data()));
-
-  return folly::make_unique<Stats::TimeseriesHistogramWrapper>(ts_histogram);
+  return folly::make_unique<Stats::TimeseriesHistogramWrapper>(
+      nSecondsPerMin, FLAGS_stats_histogram_significant_digits,
+      FLAGS_stats_histogram_max_value);
 }
 
 unique_ptr<Stats::MultiLevelTimeSeriesWrapper> GetMultiLevelTimeSeriesWrapper(
@@ -86,6 +93,8 @@ uint32_t GetArraySize(const std::vector<string>* array) {
 
 }  // namespace
 
+const uint32_t Stats::kInvalidId;
+
 std::atomic<uint32_t> Stats::nSecondsPerMin_ { 60 };
 
 std::atomic<const std::vector<string>*> Stats::counter_names_ { nullptr };
@@ -96,8 +105,7 @@ std::atomic<const std::vector<string>*> Stats::metric_names_ { nullptr };
 /** Thread local stats object. Periodically flushed to global stats. */
 class LocalStats {
  public:
-  LocalStats(uint32_t num_counters, uint32_t num_metrics,
-             int64_t min_metric_value, int64_t max_metric_value);
+  LocalStats();
 
   // Counter update methods.
   void Incr(const uint32_t counter, uint64_t value = 1);
@@ -113,20 +121,25 @@ class LocalStats {
   void FlushAll();
 
  private:
-  // Helper structs for storing last flushing time along with the histogram/
-  // counter.
-  struct HistogramWrapper {
-    unique_ptr<Histogram<int64_t>> histogram;
-    mutex m;
-
-    HistogramWrapper(int64_t min_value, int64_t max_value)
-        : histogram(new Histogram<int64_t>(1, min_value, max_value)) {}
-  };
-
-  struct Counter {
-    std::atomic<uint64_t> sum;
-
-    explicit Counter(uint64_t n) : sum(n) {}
+  // Counters are laid out in columns of cache line sized blocks, so that the
+  // hot counters of a thread share as few cache lines as possible and never
+  // share one with another thread.
+  static const uint32_t kCountersPerBlock = 8;
+
+  struct CounterBlock {
+#if __GNUC__ >= 8
+    alignas(folly::hardware_destructive_interference_size)
+      std::atomic<uint64_t> sums[kCountersPerBlock];
+#else
+    std::atomic<uint64_t> sums[kCountersPerBlock]
+      FOLLY_ALIGN_TO_AVOID_FALSE_SHARING;
+#endif
+
+    CounterBlock() {
+      for (auto& sum : sums) {
+        sum.store(0, std::memory_order_relaxed);
+      }
+    }
   };
 
   struct Gauge {
@@ -135,26 +148,41 @@ class LocalStats {
     explicit Gauge(uint64_t n) : value(n) {}
   };
 
+  // Only the owner thread writes sum, so no atomic read-modify-write is needed
+  static void Add(std::atomic<uint64_t>* sum, uint64_t value) {
+    sum->store(sum->load(std::memory_order_relaxed) + value,
+               std::memory_order_relaxed);
+  }
+
+  // Allocate the thread local sum of counter / histogram of metric on first
+  // use. Return nullptr if no stat has the id.
+  std::atomic<uint64_t>* NewCounterSum(const uint32_t counter);
+  HdrHistogram* NewLocalHistogram(const uint32_t metric);
+
   // Flush the thread local stats to global stats.
-  void FlushCounter(const uint32_t counter, seconds time_epoch_seconds);
-  void FlushCounter(std::pair<const string, unique_ptr<Counter>>* counter,
-                    seconds time_epoch_seconds);
-  void FlushMetric(const uint32_t metric, seconds time_epoch_seconds);
-  void FlushMetric(
-      std::pair<const string, unique_ptr<HistogramWrapper>>* metric,
-      seconds time_epoch_seconds);
+  void FlushCounters(seconds time_epoch_seconds);
+  void FlushMetrics(seconds time_epoch_seconds);
   void FlushGauge(std::pair<const string, unique_ptr<Gauge>>* gauge);
 
-  const int64_t min_metric_value_;
-  const int64_t max_metric_value_;
+  // counter i is counter_blocks_[i / kCountersPerBlock]
+  // ->sums[i % kCountersPerBlock]. Only the owner thread can modify the
+  // structure of counter_blocks_, with lock_counters_ held.
+  std::vector<unique_ptr<CounterBlock>> counter_blocks_;
+  mutex lock_counters_;
+  // what the flush thread has flushed of each counter. Only the flush thread
+  // touches it.
+  std::vector<uint64_t> flushed_counters_;
+
+  // metric i is histograms_[i]. Only the owner thread can modify the
+  // structure of histograms_, with lock_histograms_ held.
+  std::vector<unique_ptr<HdrHistogram>> histograms_;
+  mutex lock_histograms_;
+
+  // The ids of the dynamic stats this thread has used. Only the owner thread
+  // touches them.
+  std::unordered_map<string, uint32_t> counter_ids_;
+  std::unordered_map<string, uint32_t> metric_ids_;
 
-  std::vector<unique_ptr<HistogramWrapper>> histograms_;
-  std::vector<unique_ptr<Counter>> counters_;
-
-  std::unordered_map<string, unique_ptr<HistogramWrapper>> histogram_map_;
-  mutex lock_histogram_map_;
-  std::unordered_map<string, unique_ptr<Counter>> counter_map_;
-  mutex lock_counter_map_;
   std::unordered_map<string, unique_ptr<Gauge>> gauge_map_;
   mutex lock_gauge_map_;
 
@@ -162,73 +190,98 @@ class LocalStats {
   Stats* stats_;
 };
 
-LocalStats::LocalStats(uint32_t num_counters, uint32_t num_metrics,
-                       int64_t min_metric_value, int64_t max_metric_value)
-    : min_metric_value_(min_metric_value),
-      max_metric_value_(max_metric_value),
+LocalStats::LocalStats()
+    : counter_blocks_(),
+      lock_counters_(),
+      flushed_counters_(),
       histograms_(),
-      counters_(),
-      histogram_map_(),
-      lock_histogram_map_(),
-      counter_map_(),
-      lock_counter_map_(),
+      lock_histograms_(),
+      counter_ids_(),
+      metric_ids_(),
       gauge_map_(),
       lock_gauge_map_(),
-      stats_(Stats::get()) {
-  for (uint32_t i = 0; i < num_metrics; ++i) {
-    histograms_.emplace_back(folly::make_unique<HistogramWrapper>(
-        min_metric_value_, max_metric_value_));
-  }
-
-  for (uint32_t i = 0; i < num_counters; ++i) {
-    counters_.emplace_back(folly::make_unique<Counter>(0));
-  }
-}
+      stats_(Stats::get()) {}
 
 void LocalStats::Incr(const uint32_t counter, uint64_t value) {
-  if (LIKELY(counter < counters_.size())) {
-    counters_[counter]->sum.fetch_add(value);
+  const auto block = counter / kCountersPerBlock;
+  std::atomic<uint64_t>* sum;
+  if (LIKELY(block < counter_blocks_.size() && counter_blocks_[block])) {
+    sum = &counter_blocks_[block]->sums[counter % kCountersPerBlock];
+  } else {
+    sum = NewCounterSum(counter);
+    if (sum == nullptr) {
+      return;
+    }
   }
+
+  Add(sum, value);
 }
 
 void LocalStats::Incr(const string& counter, uint64_t value) {
-  // only the thread who is recording stats can modify the structure of
-  // counter_map_.
-  // Thus we don't need to do any synchronizations when reading it.
-  auto it = counter_map_.find(counter);
-  if (LIKELY(it != counter_map_.end())) {
-    it->second->sum.fetch_add(value);
-    return;
+  auto it = counter_ids_.find(counter);
+  if (UNLIKELY(it == counter_ids_.end())) {
+    it = counter_ids_.emplace(counter,
+                              stats_->counter_ids_.GetOrAdd(counter)).first;
   }
 
-  lock_guard<mutex> g(lock_counter_map_);
-  counter_map_.emplace(counter, folly::make_unique<Counter>(value));
+  Incr(it->second, value);
 }
 
 void LocalStats::AddMetric(const uint32_t metric, int64_t value) {
-  if (LIKELY(metric < histograms_.size())) {
-    lock_guard<mutex> g(histograms_[metric]->m);
-    histograms_[metric]->histogram->addValue(value);
+  HdrHistogram* histogram;
+  if (LIKELY(metric < histograms_.size() && histograms_[metric])) {
+    histogram = histograms_[metric].get();
+  } else {
+    histogram = NewLocalHistogram(metric);
+    if (histogram == nullptr) {
+      return;
+    }
   }
+
+  histogram->record(value);
 }
 
 void LocalStats::AddMetric(const string& metric, int64_t value) {
-  // only the thread who is recording stats can modify the structure of
-  // histogram_map_.
-  // Thus we don't need to do any synchronizations when reading it.
-  auto it = histogram_map_.find(metric);
-  if (LIKELY(it != histogram_map_.end())) {
-    lock_guard<mutex> g(it->second->m);
-    it->second->histogram->addValue(value);
-    return;
+  auto it = metric_ids_.find(metric);
+  if (UNLIKELY(it == metric_ids_.end())) {
+    it = metric_ids_.emplace(metric,
+                             stats_->metric_ids_.GetOrAdd(metric)).first;
   }
 
-  auto hw = folly::make_unique<HistogramWrapper>(min_metric_value_,
-                                                 max_metric_value_);
-  hw->histogram->addValue(value);
+  AddMetric(it->second, value);
+}
+
+std::atomic<uint64_t>* LocalStats::NewCounterSum(const uint32_t counter) {
+  if (counter >= stats_->counter_ids_.size()) {
+    return nullptr;
+  }
+
+  const auto block = counter / kCountersPerBlock;
+  lock_guard<mutex> g(lock_counters_);
+  if (block >= counter_blocks_.size()) {
+    counter_blocks_.resize(block + 1);
+  }
+  if (counter_blocks_[block] == nullptr) {
+    counter_blocks_[block] = folly::make_unique<CounterBlock>();
+  }
 
-  lock_guard<mutex> g(lock_histogram_map_);
-  histogram_map_.emplace(metric, std::move(hw));
+  return &counter_blocks_[block]->sums[counter % kCountersPerBlock];
+}
+
+HdrHistogram* LocalStats::NewLocalHistogram(const uint32_t metric) {
+  if (metric >= stats_->metric_ids_.size()) {
+    return nullptr;
+  }
+
+  auto histogram = NewHistogram();
+  auto ret = histogram.get();
+  lock_guard<mutex> g(lock_histograms_);
+  if (metric >= histograms_.size()) {
+    histograms_.resize(metric + 1);
+  }
+  histograms_[metric] = std::move(histogram);
+
+  return ret;
 }
 
 void LocalStats::SetGauge(const string& gauge, uint64_t value) {
@@ -248,27 +301,8 @@ void LocalStats::SetGauge(const string& gauge, uint64_t value) {
 
 void LocalStats::FlushAll() {
   auto now = GetTimeSinceEpochSeconds();
-  for (uint32_t counter = 0; counter < counters_.size(); ++counter) {
-    FlushCounter(counter, now);
-  }
-
-  {
-    lock_guard<mutex> g(lock_counter_map_);
-    for (auto& counter : counter_map_) {
-      FlushCounter(&counter, now);
-    }
-  }
-
-  for (uint32_t metric = 0; metric < histograms_.size(); ++metric) {
-    FlushMetric(metric, now);
-  }
-
-  {
-    lock_guard<mutex> g(lock_histogram_map_);
-    for (auto& histogram : histogram_map_) {
-      FlushMetric(&histogram, now);
-    }
-  }
+  FlushCounters(now);
+  FlushMetrics(now);
 
   {
     lock_guard<mutex> g(lock_gauge_map_);
@@ -278,53 +312,37 @@ void LocalStats::FlushAll() {
   }
 }
 
-void LocalStats::FlushCounter(const uint32_t counter,
-                              seconds time_epoch_seconds) {
-  auto sum = counters_[counter]->sum.exchange(0);
-
-  // Flush to global stats.
-  if (sum > 0) {
-    stats_->FlushCounter(counter, sum, time_epoch_seconds);
-  }
-}
-
-void LocalStats::FlushCounter(
-    std::pair<const string, unique_ptr<Counter>>* counter,
-    seconds time_epoch_seconds) {
-  auto sum = counter->second->sum.exchange(0);
-
-  if (sum > 0) {
-    stats_->FlushCounter(counter->first, sum, time_epoch_seconds);
-  }
-}
-
-void LocalStats::FlushMetric(const uint32_t metric,
-                             seconds time_epoch_seconds) {
-  auto histogram_ptr = folly::make_unique<Histogram<int64_t>>(
-      1, min_metric_value_, max_metric_value_);
+void LocalStats::FlushCounters(seconds time_epoch_seconds) {
+  lock_guard<mutex> g(lock_counters_);
+  flushed_counters_.resize(counter_blocks_.size() * kCountersPerBlock, 0);
+  for (uint32_t block = 0; block < counter_blocks_.size(); ++block) {
+    if (counter_blocks_[block] == nullptr) {
+      continue;
+    }
 
-  {
-    lock_guard<mutex> g(histograms_[metric]->m);
-    histograms_[metric]->histogram.swap(histogram_ptr);
+    for (uint32_t i = 0; i < kCountersPerBlock; ++i) {
+      const auto counter = block * kCountersPerBlock + i;
+      auto sum = counter_blocks_[block]->sums[i].load(
+          std::memory_order_relaxed);
+      auto& flushed = flushed_counters_[counter];
+      // Flush to global stats.
+      if (sum != flushed) {
+        stats_->FlushCounter(counter, sum - flushed, time_epoch_seconds);
+        flushed = sum;
+      }
+    }
   }
-
-  // Flush to global stats.
-  stats_->FlushMetric(metric, *histogram_ptr, time_epoch_seconds);
 }
 
-void LocalStats::FlushMetric(
-    std::pair<const string, unique_ptr<HistogramWrapper>>* metric,
-    seconds time_epoch_seconds) {
-  auto histogram_ptr = folly::make_unique<Histogram<int64_t>>(
-      1, min_metric_value_, max_metric_value_);
-
-  {
-    lock_guard<mutex> g(metric->second->m);
-    metric->second->histogram.swap(histogram_ptr);
+void LocalStats::FlushMetrics(seconds time_epoch_seconds) {
+  lock_guard<mutex> g(lock_histograms_);
+  for (uint32_t metric = 0; metric < histograms_.size(); ++metric) {
+    if (histograms_[metric]) {
+      // Flush to global stats.
+      stats_->FlushMetric(metric, histograms_[metric].get(),
+                          time_epoch_seconds);
+    }
   }
-
-  // Flush to global stats.
-  stats_->FlushMetric(metric->first, *histogram_ptr, time_epoch_seconds);
 }
 
 void LocalStats::FlushGauge(std::pair<const string, unique_ptr<Gauge>>* gauge) {
@@ -344,9 +362,11 @@ void Stats::init(const std::vector<string>* counter_names,
 
 Stats::Stats() : flush_interval_(kFlushIntervalMS)
                , should_stop_(false) {
+  // pre-defined stats take the first ids
   auto num_metrics = GetArraySize(metric_names_.load());
   if (num_metrics > 0) {
     for (uint32_t i = 0; i < num_metrics; ++i) {
+      metric_ids_.GetOrAdd((*metric_names_.load())[i]);
       histograms_.emplace_back(
           GetTimeseriesHistogramWrapper(nSecondsPerMin_.load()));
     }
@@ -355,6 +375,7 @@ Stats::Stats() : flush_interval_(kFlushIntervalMS)
   auto num_counters = GetArraySize(counter_names_.load());
   if (num_counters > 0) {
     for (uint32_t i = 0; i < num_counters; ++i) {
+      counter_ids_.GetOrAdd((*counter_names_.load())[i]);
       timeseries_.emplace_back(
           GetMultiLevelTimeSeriesWrapper(nSecondsPerMin_.load()));
     }
@@ -414,6 +435,56 @@ void Stats::AddMetric(const string& metric, int64_t value) {
   GetLocalStats()->AddMetric(metric, value);
 }
 
+void Stats::Incr(const Handle& counter, uint64_t value) {
+  GetLocalStats()->Incr(counter.id_, value);
+}
+
+void Stats::AddMetric(const Handle& metric, int64_t value) {
+  GetLocalStats()->AddMetric(metric.id_, value);
+}
+
+Stats::Handle Stats::GetCounterHandle(const string& name, const Tags& tags) {
+  return Handle(counter_ids_.GetOrAdd(TaggedName(name, tags)));
+}
+
+Stats::Handle Stats::GetMetricHandle(const string& name, const Tags& tags) {
+  return Handle(metric_ids_.GetOrAdd(TaggedName(name, tags)));
+}
+
+string Stats::TaggedName(const string& name, const Tags& tags) {
+  string tagged_name = name;
+  for (const auto& tag : tags) {
+    tagged_name += " " + tag.first + "=" + tag.second;
+  }
+
+  return tagged_name;
+}
+
+uint32_t Stats::StatIds::GetOrAdd(const string& name) {
+  lock_guard<mutex> g(m_);
+  auto it = ids_.find(name);
+  if (it != ids_.end()) {
+    return it->second;
+  }
+
+  const uint32_t id = names_.size();
+  ids_.emplace(name, id);
+  names_.push_back(name);
+  size_.store(names_.size());
+  return id;
+}
+
+uint32_t Stats::StatIds::Find(const string& name) {
+  lock_guard<mutex> g(m_);
+  auto it = ids_.find(name);
+  return it == ids_.end() ? kInvalidId : it->second;
+}
+
+const string& Stats::StatIds::name(uint32_t id) {
+  lock_guard<mutex> g(m_);
+  return names_[id];
+}
+
 void Stats::RegisterIncr(const std::string &counter,
                          std::function<uint64_t()> callback) {
   lock_guard<mutex> g(lock_counter_callbacks_);
@@ -436,9 +507,7 @@ void Stats::RegisterGauge(const std::string& gauge,
 LocalStats* Stats::GetLocalStats() {
   auto ptr = local_stats_.get();
   if (UNLIKELY(ptr == nullptr)) {
-    local_stats_.reset(new LocalStats(GetArraySize(counter_names_.load()),
-                                      GetArraySize(metric_names_.load()),
-                                      kMinMetricValue, kMaxMetricValue));
+    local_stats_.reset(new LocalStats());
     ptr = local_stats_.get();
   }
 
@@ -446,57 +515,38 @@ LocalStats* Stats::GetLocalStats() {
 }
 
 void Stats::FlushMetric(const uint32_t metric,
-                        const Histogram<int64_t>& histogram,
+                        HdrHistogram* histogram,
                         seconds time_epoch_seconds) {
-  if (LIKELY(metric < histograms_.size())) {
-    lock_guard<mutex> g(histograms_[metric]->m);
-    histograms_[metric]->ts_histogram.addValues(time_epoch_seconds, histogram);
-  }
-}
-
-void Stats::FlushMetric(const string& metric,
-                        const Histogram<int64_t>& histogram,
-                        seconds time_epoch_seconds) {
-  // only the flush thread can modify the structure of histogram_map_.
+  // only the flush thread can modify the structure of histograms_.
   // Thus we don't need to do any synchronizations when reading it.
-  auto it = histogram_map_.find(metric);
-  if (LIKELY(it != histogram_map_.end())) {
-    lock_guard<mutex> g(it->second->m);
-    it->second->ts_histogram.addValues(time_epoch_seconds, histogram);
-    return;
+  if (UNLIKELY(metric >= histograms_.size() || !histograms_[metric])) {
+    auto thw = GetTimeseriesHistogramWrapper(nSecondsPerMin_.load());
+    lock_guard<mutex> g(lock_histograms_);
+    if (metric >= histograms_.size()) {
+      histograms_.resize(metric + 1);
+    }
+    histograms_[metric] = std::move(thw);
   }
 
-  auto thw = GetTimeseriesHistogramWrapper(nSecondsPerMin_.load());
-  thw->ts_histogram.addValues(time_epoch_seconds, histogram);
-
-  lock_guard<mutex> g(lock_histogram_map_);
-  histogram_map_.emplace(metric, std::move(thw));
+  lock_guard<mutex> g(histograms_[metric]->m);
+  histograms_[metric]->AddValues(time_epoch_seconds, histogram);
 }
 
 void Stats::FlushCounter(const uint32_t counter, uint64_t sum,
                          seconds time_epoch_seconds) {
-  if (LIKELY(counter < timeseries_.size())) {
-    lock_guard<mutex> g(timeseries_[counter]->m);
-    timeseries_[counter]->timeseries.addValue(time_epoch_seconds, sum);
-  }
-}
-
-void Stats::FlushCounter(const string& counter, uint64_t sum,
-                         seconds time_epoch_seconds) {
-  // only the flush thread can modify the structure of counter_map_.
+  // only the flush thread can modify the structure of timeseries_.
   // Thus we don't need to do any synchronizations when reading it.
-  auto it = timeseries_map_.find(counter);
-  if (LIKELY(it != timeseries_map_.end())) {
-    lock_guard<mutex> g(it->second->m);
-    it->second->timeseries.addValue(time_epoch_seconds, sum);
-    return;
+  if (UNLIKELY(counter >= timeseries_.size() || !timeseries_[counter])) {
+    auto mtsw = GetMultiLevelTimeSeriesWrapper(nSecondsPerMin_.load());
+    lock_guard<mutex> g(lock_timeseries_);
+    if (counter >= timeseries_.size()) {
+      timeseries_.resize(counter + 1);
+    }
+    timeseries_[counter] = std::move(mtsw);
   }
 
-  auto mtsw = GetMultiLevelTimeSeriesWrapper(nSecondsPerMin_.load());
-  mtsw->timeseries.addValue(time_epoch_seconds, sum);
-
-  lock_guard<mutex> g(lock_timeseries_map_);
-  timeseries_map_.emplace(counter, std::move(mtsw));
+  lock_guard<mutex> g(timeseries_[counter]->m);
+  timeseries_[counter]->timeseries.addValue(time_epoch_seconds, sum);
 }
 
 void Stats::FlushGauge(const string& gauge, uint64_t value) {
@@ -508,7 +558,9 @@ void Stats::FlushGauge(const string& gauge, uint64_t value) {
     return;
   }
 
-  gauges_map_.emplace(gauge, folly::make_unique<std::atomic<uint64_t>>(value));
+  auto new_gauge = folly::make_unique<std::atomic<uint64_t>>(value);
+  lock_guard<mutex> g(lock_gauges_map_);
+  gauges_map_.emplace(gauge, std::move(new_gauge));
 }
 
 Stats::Counter::Counter(Stats::MultiLevelTimeSeriesWrapper* ts_wrapper_arg)
@@ -526,55 +578,104 @@ uint64_t Stats::Counter::GetLastMinute() {
   return ts_wrapper_->timeseries.sum(0);
 }
 
+Stats::TimeseriesHistogramWrapper::TimeseriesHistogramWrapper(
+    uint32_t seconds_per_min, int significant_digits, int64_t max_value)
+    : total(significant_digits, max_value),
+      scratch(significant_digits, max_value),
+      windows(),
+      window_ids(),
+      window_seconds(std::max<uint32_t>(seconds_per_min / kMetricWindowsPerMin,
+                                        1)),
+      m() {
+  const auto num_windows =
+      std::max<uint32_t>(seconds_per_min / window_seconds, 1);
+  window_ids.resize(num_windows, -1);
+  for (uint32_t i = 0; i < num_windows; ++i) {
+    windows.emplace_back(
+        folly::make_unique<HdrHistogram>(significant_digits, max_value));
+  }
+}
+
+void Stats::TimeseriesHistogramWrapper::AddValues(seconds time_epoch_seconds,
+                                                  HdrHistogram* histogram) {
+  const int64_t id = time_epoch_seconds.count() / window_seconds;
+  const auto i = id % windows.size();
+  if (window_ids[i] != id) {
+    // the window is reused for a new one
+    windows[i]->clear();
+    window_ids[i] = id;
+  }
+
+  // Drain once, so that the window and total get the same values even if
+  // more are being recorded into histogram.
+  scratch.drainFrom(histogram);
+  windows[i]->add(scratch);
+  total.add(scratch);
+  scratch.clear();
+}
+
+void Stats::TimeseriesHistogramWrapper::MergeLastMinute(
+    seconds time_epoch_seconds, HdrHistogram* histogram) {
+  const int64_t id = time_epoch_seconds.count() / window_seconds;
+  for (size_t i = 0; i < windows.size(); ++i) {
+    if (window_ids[i] >= 0 &&
+        window_ids[i] > id - static_cast<int64_t>(windows.size())) {
+      histogram->add(*windows[i]);
+    }
+  }
+}
+
 Stats::Metric::Metric(TimeseriesHistogramWrapper* hist_wrapper_arg)
     : hist_wrapper_(hist_wrapper_arg) {}
 
 int64_t Stats::Metric::GetPercentileTotal(double pct) {
   lock_guard<mutex> l(hist_wrapper_->m);
-  hist_wrapper_->ts_histogram.update(GetTimeSinceEpochSeconds());
-  return hist_wrapper_->ts_histogram.getPercentileEstimate(pct, 1);
+  return hist_wrapper_->total.percentile(pct);
 }
 
 int64_t Stats::Metric::GetPercentileLastMinute(double pct) {
+  auto histogram = NewHistogram();
   lock_guard<mutex> l(hist_wrapper_->m);
-  hist_wrapper_->ts_histogram.update(GetTimeSinceEpochSeconds());
-  return hist_wrapper_->ts_histogram.getPercentileEstimate(pct, 0);
+  hist_wrapper_->MergeLastMinute(GetTimeSinceEpochSeconds(), histogram.get());
+  return histogram->percentile(pct);
 }
 
 int64_t Stats::Metric::GetSumTotal() {
   lock_guard<mutex> l(hist_wrapper_->m);
-  hist_wrapper_->ts_histogram.update(GetTimeSinceEpochSeconds());
-  return hist_wrapper_->ts_histogram.sum(1);
+  return hist_wrapper_->total.sum();
 }
 
 int64_t Stats::Metric::GetSumLastMinute() {
+  auto histogram = NewHistogram();
   lock_guard<mutex> l(hist_wrapper_->m);
-  hist_wrapper_->ts_histogram.update(GetTimeSinceEpochSeconds());
-  return hist_wrapper_->ts_histogram.sum(0);
+  hist_wrapper_->MergeLastMinute(GetTimeSinceEpochSeconds(), histogram.get());
+  return histogram->sum();
 }
 
 int64_t Stats::Metric::GetAverageTotal() {
   lock_guard<mutex> l(hist_wrapper_->m);
-  hist_wrapper_->ts_histogram.update(GetTimeSinceEpochSeconds());
-  return hist_wrapper_->ts_histogram.avg(1);
+  auto count = hist_wrapper_->total.count();
+  return count == 0 ? 0 : hist_wrapper_->total.sum() / count;
 }
 
 int64_t Stats::Metric::GetAverageLastMinute() {
+  auto histogram = NewHistogram();
   lock_guard<mutex> l(hist_wrapper_->m);
-  hist_wrapper_->ts_histogram.update(GetTimeSinceEpochSeconds());
-  return hist_wrapper_->ts_histogram.avg(0);
+  hist_wrapper_->MergeLastMinute(GetTimeSinceEpochSeconds(), histogram.get());
+  auto count = histogram->count();
+  return count == 0 ? 0 : histogram->sum() / count;
 }
 
 int64_t Stats::Metric::GetCountTotal() {
   lock_guard<mutex> l(hist_wrapper_->m);
-  hist_wrapper_->ts_histogram.update(GetTimeSinceEpochSeconds());
-  return hist_wrapper_->ts_histogram.count(1);
+  return hist_wrapper_->total.count();
 }
 
 int64_t Stats::Metric::GetCountLastMinute() {
+  auto histogram = NewHistogram();
   lock_guard<mutex> l(hist_wrapper_->m);
-  hist_wrapper_->ts_histogram.update(GetTimeSinceEpochSeconds());
-  return hist_wrapper_->ts_histogram.count(0);
+  hist_wrapper_->MergeLastMinute(GetTimeSinceEpochSeconds(), histogram.get());
+  return histogram->count();
 }
 
 Stats::Gauge::Gauge(std::atomic<uint64_t>* value)
@@ -585,7 +686,8 @@ uint64_t Stats::Gauge::GetValue() {
 }
 
 unique_ptr<Stats::Metric> Stats::GetMetric(const uint32_t metric) {
-  if (UNLIKELY(metric >= histograms_.size())) {
+  lock_guard<mutex> g(lock_histograms_);
+  if (UNLIKELY(metric >= histograms_.size() || !histograms_[metric])) {
     return nullptr;
   }
 
@@ -593,17 +695,17 @@ unique_ptr<Stats::Metric> Stats::GetMetric(const uint32_t metric) {
 }
 
 unique_ptr<Stats::Metric> Stats::GetMetric(const string& metric) {
-  lock_guard<mutex> g(lock_histogram_map_);
-  auto it = histogram_map_.find(metric);
-  if (UNLIKELY(it == histogram_map_.end())) {
+  auto id = metric_ids_.Find(metric);
+  if (UNLIKELY(id == kInvalidId)) {
     return nullptr;
   }
 
-  return folly::make_unique<Stats::Metric>(it->second.get());
+  return GetMetric(id);
 }
 
 unique_ptr<Stats::Counter> Stats::GetCounter(const uint32_t counter) {
-  if (UNLIKELY(counter >= timeseries_.size())) {
+  lock_guard<mutex> g(lock_timeseries_);
+  if (UNLIKELY(counter >= timeseries_.size() || !timeseries_[counter])) {
     return nullptr;
   }
 
@@ -611,13 +713,69 @@ unique_ptr<Stats::Counter> Stats::GetCounter(const uint32_t counter) {
 }
 
 unique_ptr<Stats::Counter> Stats::GetCounter(const string& counter) {
-  lock_guard<mutex> g(lock_timeseries_map_);
-  auto it = timeseries_map_.find(counter);
-  if (UNLIKELY(it == timeseries_map_.end())) {
+  auto id = counter_ids_.Find(counter);
+  if (UNLIKELY(id == kInvalidId)) {
     return nullptr;
   }
 
-  return folly::make_unique<Stats::Counter>(it->second.get());
+  return GetCounter(id);
+}
+
+const string& Stats::CounterName(const uint32_t counter) {
+  return counter_ids_.name(counter);
+}
+
+const string& Stats::MetricName(const uint32_t metric) {
+  return metric_ids_.name(metric);
+}
+
+bool Stats::SnapshotCounter(const uint32_t counter,
+                            CounterSnapshot* snapshot) {
+  MultiLevelTimeSeriesWrapper* mltsw;
+  {
+    lock_guard<mutex> g(lock_timeseries_);
+    if (counter >= timeseries_.size() || !timeseries_[counter]) {
+      return false;
+    }
+    mltsw = timeseries_[counter].get();
+  }
+
+  lock_guard<mutex> l(mltsw->m);
+  mltsw->timeseries.update(GetTimeSinceEpochSeconds());
+  snapshot->last_minute = mltsw->timeseries.sum(0);
+  snapshot->total = mltsw->timeseries.sum(1);
+  return true;
+}
+
+bool Stats::SnapshotMetric(const uint32_t metric, HdrHistogram* last_minute,
+                           MetricSnapshot* snapshot) {
+  TimeseriesHistogramWrapper* thw;
+  {
+    lock_guard<mutex> g(lock_histograms_);
+    if (metric >= histograms_.size() || !histograms_[metric]) {
+      return false;
+    }
+    thw = histograms_[metric].get();
+  }
+
+  last_minute->clear();
+  lock_guard<mutex> l(thw->m);
+  thw->MergeLastMinute(GetTimeSinceEpochSeconds(), last_minute);
+  snapshot->count = thw->total.count();
+  snapshot->sum = thw->total.sum();
+  snapshot->p50 = last_minute->percentile(50);
+  snapshot->p90 = last_minute->percentile(90);
+  snapshot->p99 = last_minute->percentile(99);
+  snapshot->p999 = last_minute->percentile(99.9);
+  return true;
+}
+
+void Stats::SnapshotGauges(
+    std::vector<std::pair<string, uint64_t>>* gauges) {
+  lock_guard<mutex> g(lock_gauges_map_);
+  for (auto& gauge : gauges_map_) {
+    gauges->emplace_back(gauge.first, gauge.second->load());
+  }
 }
 
 unique_ptr<Stats::Gauge> Stats::GetGauge(const string& gauge) {
@@ -655,48 +813,45 @@ string GetTotalName(const string& raw_name) {
 string Stats::DumpStatsAsText() {
   stringstream output;
   output << "gauges:\n";
-  for (auto& gauge : gauges_map_) {
-    output << boost::format("  %1%: %2%\n") % gauge.first %
-                  gauge.second->load();
-  };
+  {
+    lock_guard<mutex> g(lock_gauges_map_);
+    for (auto& gauge : gauges_map_) {
+      output << boost::format("  %1%: %2%\n") % gauge.first %
+                    gauge.second->load();
+    }
+  }
 
   output << "labels:\n";
   output << "metrics:\n";
-  auto metric_logger =
-      [&output](TimeseriesHistogramWrapper * thw, const string & metric_name) {
-    Metric metric(thw);
+  auto histogram_logger = [&output](const HdrHistogram& histogram,
+                                    const string& name) {
+    auto count = histogram.count();
     output << boost::format("  %1%: (average=%2%, count=%3%, maximum=%4%, "
                             "minimum=%5%, p50=%6%, p90=%7%, p99=%8%, "
-                            "p999=%9%, p9999=%10%, sum=%11%)\n") % metric_name %
-                  metric.GetAverageLastMinute() % metric.GetCountLastMinute() %
-                  metric.GetPercentileLastMinute(100) %
-                  metric.GetPercentileLastMinute(0) %
-                  metric.GetPercentileLastMinute(50) %
-                  metric.GetPercentileLastMinute(90) %
-                  metric.GetPercentileLastMinute(99) %
-                  metric.GetPercentileLastMinute(99.9) %
-                  metric.GetPercentileLastMinute(99.99) %
-                  metric.GetSumLastMinute();
-    output
-        << boost::format("  %1%: (average=%2%, count=%3%, maximum=%4%, "
-                         "minimum=%5%, p50=%6%, p90=%7%, p99=%8%, "
-                         "p999=%9%, p9999=%10%, sum=%11%)\n") %
-               GetTotalName(metric_name) %
-               metric.GetAverageTotal() % metric.GetCountTotal() %
-               metric.GetPercentileTotal(100) % metric.GetPercentileTotal(0) %
-               metric.GetPercentileTotal(50) % metric.GetPercentileTotal(90) %
-               metric.GetPercentileTotal(99) % metric.GetPercentileTotal(99.9) %
-               metric.GetPercentileTotal(99.99) % metric.GetSumTotal();
+                            "p999=%9%, p9999=%10%, sum=%11%)\n") % name %
+                  (count == 0 ? 0 : histogram.sum() / count) % count %
+                  histogram.max() % histogram.min() %
+                  histogram.percentile(50) % histogram.percentile(90) %
+                  histogram.percentile(99) % histogram.percentile(99.9) %
+                  histogram.percentile(99.99) % histogram.sum();
+  };
+  const auto now = GetTimeSinceEpochSeconds();
+  auto metric_logger = [&histogram_logger, now](
+      TimeseriesHistogramWrapper* thw, const string& metric_name) {
+    // merge the last minute only once for all its percentiles
+    auto last_minute = NewHistogram();
+    lock_guard<mutex> l(thw->m);
+    thw->MergeLastMinute(now, last_minute.get());
+    histogram_logger(*last_minute, metric_name);
+    histogram_logger(thw->total, GetTotalName(metric_name));
   };
-
-  for (uint32_t i = 0; i < histograms_.size(); ++i) {
-    metric_logger(histograms_[i].get(), (*metric_names_.load())[i]);
-  }
 
   {
-    lock_guard<mutex> g(lock_histogram_map_);
-    for (auto& histogram : histogram_map_) {
-      metric_logger(histogram.second.get(), histogram.first);
+    lock_guard<mutex> g(lock_histograms_);
+    for (uint32_t i = 0; i < histograms_.size(); ++i) {
+      if (histograms_[i]) {
+        metric_logger(histograms_[i].get(), metric_ids_.name(i));
+      }
     }
   }
 
@@ -710,14 +865,12 @@ string Stats::DumpStatsAsText() {
                   counter.GetTotal();
   };
 
-  for (uint32_t i = 0; i < timeseries_.size(); ++i) {
-    counter_logger(timeseries_[i].get(), (*counter_names_.load())[i]);
-  }
-
   {
-    lock_guard<mutex> g(lock_timeseries_map_);
-    for (auto& timeseries : timeseries_map_) {
-      counter_logger(timeseries.second.get(), timeseries.first);
+    lock_guard<mutex> g(lock_timeseries_);
+    for (uint32_t i = 0; i < timeseries_.size(); ++i) {
+      if (timeseries_[i]) {
+        counter_logger(timeseries_[i].get(), counter_ids_.name(i));
+      }
     }
   }
 
@@ -19,10 +19,21 @@
  * become stale (upto 1 seconds old), they are flushed into a global stats
  * which involves some locking. While retrieving stats, the global stats
  * object is consulted. The stats (counters/metrics) are organized in 1 second
- * buckets holding upto 1 minute (60 buckets) worth of data. For metrics,
- * we are using a histogram with bucket size of 1 and a range from 1 to 200
- * to save space. Mostly we use metrics for latency tracking for which the above
- * buckets and range is good enough. The stats can be off by 1 bucket (1 in 60).
+ * buckets holding upto 1 minute (60 buckets) worth of data. The stats can be
+ * off by 1 bucket (1 in 60).
+ *
+ * Thread local counters are kept in cache line aligned arrays, and only ever
+ * written by their own thread, with plain (relaxed) stores. The flush thread
+ * takes the difference from what it has flushed before instead of resetting
+ * them.
+ *
+ * Metrics are log-linear (HDR style) histograms keeping
+ * stats_histogram_significant_digits digits of every value up to
+ * stats_histogram_max_value, which is enough for microsecond latencies of up
+ * to hours. Thread local histograms are recorded into without locking, and
+ * drained into the global ones on flush. The global ones keep the last minute
+ * in up to 6 windows, so the last minute of a metric can be off by 1 window
+ * (1 in 6).
  *
  * Usage:
  *
@@ -60,6 +71,14 @@
  * Dynamic stats and pre-defined stats can be used together. i.e., some stats
  * are pre-defined,
  * while others are dynamic.
+ *
+ * Every stat name, dynamic or pre-defined, gets a dense id the first time it
+ * is seen, and thread local and global stats are arrays indexed by it. A
+ * dynamic stat updated on a hot path can be resolved once into a Handle, so
+ * that updating it needs neither building nor hashing its name:
+ *
+ * auto handle = Stats::get()->GetCounterHandle(counter, {{"db", db_name}});
+ * Stats::get()->Incr(handle, 100);
  */
 
 #pragma once
@@ -71,30 +90,59 @@
 #endif
 
 #include <folly/ThreadLocal.h>
-#include <folly/stats/Histogram.h>
 #include <folly/stats/MultiLevelTimeSeries.h>
-#include <folly/stats/TimeseriesHistogram.h>
 #include <atomic>
 #include <chrono>
+#include <deque>
+#include <limits>
 #include <memory>
 #include <mutex>
 #include <string>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 
+#include "common/stats/hdr_histogram.h"
+
 namespace common {
 
 class LocalStats;
 
 class Stats {
  public:
+  // A counter or metric resolved to its id
+  class Handle {
+   public:
+    Handle() : id_(kInvalidId) {}
+
+    bool valid() const { return id_ != kInvalidId; }
+
+   private:
+    friend class Stats;
+
+    explicit Handle(uint32_t id) : id_(id) {}
+
+    uint32_t id_;
+  };
+
+  // (key, value) pairs appended to a stat name as " key=value"
+  using Tags = std::vector<std::pair<std::string, std::string>>;
+
   // Counter update functions.
   void Incr(const uint32_t counter, uint64_t value = 1);
   void Incr(const std::string& counter, uint64_t value = 1);
+  void Incr(const Handle& counter, uint64_t value = 1);
 
   // Metric update functions.
   void AddMetric(const uint32_t metric, int64_t value);
   void AddMetric(const std::string& metric, int64_t value);
+  void AddMetric(const Handle& metric, int64_t value);
+
+  // Resolve counter / metric name tagged with tags to a handle. The same
+  // (name, tags) always resolves to the same handle, and updating a stat
+  // through its handle or its tagged name is the same.
+  Handle GetCounterHandle(const std::string& name, const Tags& tags = Tags());
+  Handle GetMetricHandle(const std::string& name, const Tags& tags = Tags());
 
   // Register callback for Counter / Metric / Gauge so they will be reported
   // periodically by the Stats class.
@@ -120,12 +168,28 @@ class Stats {
   };
 
   struct TimeseriesHistogramWrapper {
-    folly::TimeseriesHistogram<int64_t> ts_histogram;
+    // all values flushed so far
+    HdrHistogram total;
+    // where AddValues() drains thread local values to
+    HdrHistogram scratch;
+    // windows[i] holds the values flushed in window # window_ids[i], i.e.
+    // during [window_ids[i] * window_seconds,
+    //         (window_ids[i] + 1) * window_seconds)
+    std::vector<std::unique_ptr<HdrHistogram>> windows;
+    std::vector<int64_t> window_ids;
+    const uint32_t window_seconds;
     std::mutex m;
 
-    TimeseriesHistogramWrapper(
-        const folly::TimeseriesHistogram<int64_t>& ts_histogram_arg)
-        : ts_histogram(ts_histogram_arg), m() {}
+    TimeseriesHistogramWrapper(uint32_t seconds_per_min,
+                               int significant_digits, int64_t max_value);
+
+    void AddValues(std::chrono::seconds time_epoch_seconds,
+                   HdrHistogram* histogram);
+
+    // Merge the windows of the minute up to time_epoch_seconds into
+    // histogram. Caller must hold m.
+    void MergeLastMinute(std::chrono::seconds time_epoch_seconds,
+                         HdrHistogram* histogram);
   };
 
   class Counter {
@@ -164,6 +228,39 @@ class Stats {
     std::atomic<uint64_t>* value_;
   };
 
+  // The values of a counter at some point
+  struct CounterSnapshot {
+    uint64_t last_minute;
+    uint64_t total;
+  };
+
+  // The values of a metric at some point
+  struct MetricSnapshot {
+    // of all values
+    uint64_t count;
+    int64_t sum;
+    // of the values of the last minute
+    int64_t p50;
+    int64_t p90;
+    int64_t p99;
+    int64_t p999;
+  };
+
+  // For walking through all stats one at a time, without copying their names
+  // or holding any lock in between. Stats ids are dense, from 0 to
+  // NumCounterIds() / NumMetricIds() - 1, and names stay valid forever.
+  uint32_t NumCounterIds() const { return counter_ids_.size(); }
+  uint32_t NumMetricIds() const { return metric_ids_.size(); }
+  const std::string& CounterName(const uint32_t counter);
+  const std::string& MetricName(const uint32_t metric);
+  // Return false if counter / metric has no values yet. last_minute is used
+  // for merging the last minute of metric, and cleared before that.
+  bool SnapshotCounter(const uint32_t counter, CounterSnapshot* snapshot);
+  bool SnapshotMetric(const uint32_t metric, HdrHistogram* last_minute,
+                      MetricSnapshot* snapshot);
+  // Append (name, value) of all gauges to gauges
+  void SnapshotGauges(std::vector<std::pair<std::string, uint64_t>>* gauges);
+
   // Returns the corresponding Stats::Metric object, if the metric is not found,
   // nullptr is returned.
   std::unique_ptr<Metric> GetMetric(const uint32_t metric);
@@ -187,20 +284,44 @@ class Stats {
  private:
   friend class LocalStats;
 
+  static const uint32_t kInvalidId = std::numeric_limits<uint32_t>::max();
+
+  // Assigns dense ids to stat names, in the order they are first seen
+  class StatIds {
+   public:
+    // The id of name, assigning it a new one if it has none
+    uint32_t GetOrAdd(const std::string& name);
+
+    // The id of name, or kInvalidId if it has none
+    uint32_t Find(const std::string& name);
+
+    // The name of id, which must have been assigned. The reference stays
+    // valid for the lifetime of *this.
+    const std::string& name(uint32_t id);
+
+    // The # of ids assigned so far
+    uint32_t size() const { return size_.load(); }
+
+   private:
+    std::unordered_map<std::string, uint32_t> ids_;
+    // a deque, so that names never move
+    std::deque<std::string> names_;
+    std::atomic<uint32_t> size_ { 0 };
+    std::mutex m_;
+  };
+
   // Used by the LocalStats class to flush thread local metrics to global stats.
   // Not meant for regular usage.
+  // The values in histogram are moved to global stats.
   void FlushMetric(const uint32_t metric,
-                   const folly::Histogram<int64_t>& histogram,
-                   std::chrono::seconds time_epoch_seconds);
-  void FlushMetric(const std::string& metric,
-                   const folly::Histogram<int64_t>& histogram,
+                   HdrHistogram* histogram,
                    std::chrono::seconds time_epoch_seconds);
   void FlushCounter(const uint32_t counter, uint64_t sum,
                     std::chrono::seconds time_epoch_seconds);
-  void FlushCounter(const std::string& counter, uint64_t sum,
-                    std::chrono::seconds time_epoch_seconds);
   void FlushGauge(const std::string& counter, uint64_t value);
 
+  static std::string TaggedName(const std::string& name, const Tags& tags);
+
   Stats();
   ~Stats();
 
@@ -212,15 +333,15 @@ class Stats {
   // Thread local stats.
   folly::ThreadLocalPtr<LocalStats, Stats> local_stats_;
 
+  StatIds counter_ids_;
+  StatIds metric_ids_;
+
+  // Indexed by id. A stat is allocated when it is first flushed. Only the
+  // flush thread can modify their structure, with the lock held.
   std::vector<std::unique_ptr<TimeseriesHistogramWrapper>> histograms_;
+  std::mutex lock_histograms_;
   std::vector<std::unique_ptr<MultiLevelTimeSeriesWrapper>> timeseries_;
-
-  std::unordered_map<std::string, std::unique_ptr<TimeseriesHistogramWrapper>>
-      histogram_map_;
-  std::mutex lock_histogram_map_;
-  std::unordered_map<std::string, std::unique_ptr<MultiLevelTimeSeriesWrapper>>
-      timeseries_map_;
-  std::mutex lock_timeseries_map_;
+  std::mutex lock_timeseries_;
   std::unordered_map<std::string, std::unique_ptr<std::atomic<uint64_t>>> gauges_map_;
   std::mutex lock_gauges_map_;
 
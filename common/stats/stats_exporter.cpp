@@ -0,0 +1,660 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+
+#include "common/stats/stats_exporter.h"
+
+#include <folly/Conv.h>
+#include <folly/Range.h>
+#include <folly/String.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <tuple>
+#include <unordered_map>
+#include <unordered_set>
+
+DECLARE_int32(stats_histogram_significant_digits);
+DECLARE_int64(stats_histogram_max_value);
+
+DEFINE_int32(stats_export_max_delta_clients, 16,
+             "Max # of clients whose delta stats export state is kept");
+
+namespace common {
+
+struct StatsExporter::DeltaState {
+  // indexed by id
+  std::vector<uint64_t> counter_totals;
+  std::vector<bool> counter_named;
+  std::vector<uint64_t> metric_counts;
+  std::vector<int64_t> metric_sums;
+  std::vector<bool> metric_named;
+};
+
+namespace {
+
+// Stop filling the buffer once it has this many bytes
+const size_t kChunkBytes = 16 * 1024;
+
+const char kDeltaMagic[] = "RSD2";
+// The # of exports kept per delta client
+const size_t kDeltaGensPerClient = 4;
+const char kCounterRecord = 0x01;
+const char kMetricRecord = 0x02;
+const char kGaugeRecord = 0x03;
+
+// A series of an OpenMetrics metric family
+struct Series {
+  uint32_t id;
+  std::string labels;
+};
+
+struct Family {
+  std::string name;
+  std::vector<Series> series;
+};
+
+// Stats grouped into OpenMetrics metric families, as the series of a family
+// must be exported together. Stat ids and names never change, so stats are
+// parsed only once, and families only grow.
+class Catalog {
+ public:
+  // suffix is stripped from family names
+  explicit Catalog(std::string suffix)
+    : suffix_(std::move(suffix)), families_(), index_(), num_ids_(0) {}
+
+  // Catalog the ids added since the last call
+  void Update(uint32_t num_ids,
+              const std::function<const std::string&(uint32_t)>& name_of) {
+    std::string family;
+    std::string labels;
+    for (; num_ids_ < num_ids; ++num_ids_) {
+      StatsExporter::ParseName(name_of(num_ids_), &family, &labels);
+      if (family.size() > suffix_.size() &&
+          family.compare(family.size() - suffix_.size(), suffix_.size(),
+                         suffix_) == 0) {
+        family.resize(family.size() - suffix_.size());
+      }
+
+      auto it = index_.find(family);
+      if (it == index_.end()) {
+        it = index_.emplace(family, families_.size()).first;
+        families_.push_back(Family{family, {}});
+      }
+      families_[it->second].series.push_back(Series{num_ids_, labels});
+    }
+  }
+
+  const std::vector<Family>& families() const {
+    return families_;
+  }
+
+  bool Has(const std::string& family) const {
+    return index_.count(family) > 0;
+  }
+
+ private:
+  const std::string suffix_;
+  std::vector<Family> families_;
+  // family name -> index in families_
+  std::unordered_map<std::string, size_t> index_;
+  // ids below are cataloged
+  uint32_t num_ids_;
+};
+
+struct Catalogs {
+  std::mutex m;
+  Catalog counters { "_total" };
+  Catalog metrics { "" };
+};
+
+Catalogs* GetCatalogs() {
+  static Catalogs catalogs;
+  return &catalogs;
+}
+
+struct DeltaClient {
+  // (gen, what the client has once it has received the export of gen),
+  // oldest first
+  std::deque<std::pair<uint64_t, std::unique_ptr<StatsExporter::DeltaState>>>
+    gens;
+  // when the client last finished an export
+  uint64_t last_used = 0;
+};
+
+struct DeltaStates {
+  std::mutex m;
+  std::unordered_map<std::string, DeltaClient> clients;
+  uint64_t clock = 0;
+  uint64_t last_gen = 0;
+};
+
+DeltaStates* GetDeltaStates() {
+  static DeltaStates states;
+  return &states;
+}
+
+// Identifies the stat ids of this process
+uint64_t GetEpoch() {
+  static const uint64_t epoch =
+    std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::system_clock::now().time_since_epoch()).count();
+  return epoch;
+}
+
+void AppendVarint(uint64_t value, std::string* out) {
+  while (value >= 0x80) {
+    out->push_back(static_cast<char>(value | 0x80));
+    value >>= 7;
+  }
+  out->push_back(static_cast<char>(value));
+}
+
+void AppendZigzag(int64_t value, std::string* out) {
+  AppendVarint((static_cast<uint64_t>(value) << 1) ^
+               static_cast<uint64_t>(value >> 63), out);
+}
+
+void AppendFixed64(uint64_t value, std::string* out) {
+  for (int i = 0; i < 8; ++i) {
+    out->push_back(static_cast<char>(value >> (8 * i)));
+  }
+}
+
+uint64_t DecodeFixed64(const char* buf) {
+  uint64_t value = 0;
+  for (int i = 0; i < 8; ++i) {
+    value |= static_cast<uint64_t>(static_cast<uint8_t>(buf[i])) << (8 * i);
+  }
+  return value;
+}
+
+// The gen since refers to, or 0 if it's empty, malformed or from another
+// epoch
+uint64_t ParseSince(const std::string& since) {
+  const auto pos = since.find(':');
+  if (pos == std::string::npos) {
+    return 0;
+  }
+
+  try {
+    if (folly::to<uint64_t>(since.substr(0, pos)) != GetEpoch()) {
+      return 0;
+    }
+    return folly::to<uint64_t>(since.substr(pos + 1));
+  } catch (const std::exception&) {
+    return 0;
+  }
+}
+
+// Append name with the characters OpenMetrics doesn't allow in metric
+// (or label) names replaced by '_'
+void AppendName(folly::StringPiece name, bool is_label, std::string* out) {
+  if (name.empty() || std::isdigit(static_cast<unsigned char>(name[0]))) {
+    out->push_back('_');
+  }
+
+  for (auto c : name) {
+    const bool valid = std::isalnum(static_cast<unsigned char>(c)) ||
+      c == '_' || (!is_label && c == ':');
+    out->push_back(valid ? c : '_');
+  }
+}
+
+void AppendEscaped(folly::StringPiece value, std::string* out) {
+  for (auto c : value) {
+    if (c == '\\') {
+      out->append("\\\\");
+    } else if (c == '"') {
+      out->append("\\\"");
+    } else if (c == '\n') {
+      out->append("\\n");
+    } else {
+      out->push_back(c);
+    }
+  }
+}
+
+// Append a sample line "<family><suffix>{<labels>,<label>} <value>"
+template <typename T>
+void AppendSample(const std::string& family, const char* suffix,
+                  const std::string& labels, const char* label, T value,
+                  std::string* out) {
+  out->append(family);
+  out->append(suffix);
+  if (!labels.empty() || label) {
+    out->push_back('{');
+    out->append(labels);
+    if (!labels.empty() && label) {
+      out->push_back(',');
+    }
+    if (label) {
+      out->append(label);
+    }
+    out->push_back('}');
+  }
+  out->push_back(' ');
+  folly::toAppend(value, out);
+  out->push_back('\n');
+}
+
+void AppendType(const std::string& family, const char* type,
+                std::string* out) {
+  out->append("# TYPE ");
+  out->append(family);
+  out->push_back(' ');
+  out->append(type);
+  out->push_back('\n');
+}
+
+// Append the name of a delta record, or 0 if the client has it already
+void AppendDeltaName(const std::string& name, bool named, std::string* out) {
+  if (named) {
+    AppendVarint(0, out);
+    return;
+  }
+
+  AppendVarint(name.size(), out);
+  out->append(name);
+}
+
+}  // namespace
+
+const size_t StatsExporter::kDeltaHeaderSize;
+
+StatsExporter::StatsExporter(Format format, const std::string& client,
+                             const std::string& since)
+    : format_(format)
+    , client_(client)
+    , stats_(Stats::get())
+    , phase_(Phase::kCounters)
+    , family_(0)
+    , series_(0)
+    , next_id_(0)
+    , num_counter_ids_(stats_->NumCounterIds())
+    , num_metric_ids_(stats_->NumMetricIds())
+    , last_minute_(FLAGS_stats_histogram_significant_digits,
+                   FLAGS_stats_histogram_max_value)
+    , buffer_()
+    , buffer_pos_(0)
+    , gen_(0)
+    , delta_() {
+  if (format_ == Format::kOpenMetrics) {
+    auto catalogs = GetCatalogs();
+    std::lock_guard<std::mutex> g(catalogs->m);
+    catalogs->counters.Update(num_counter_ids_, [this] (uint32_t id)
+        -> const std::string& { return stats_->CounterName(id); });
+    catalogs->metrics.Update(num_metric_ids_, [this] (uint32_t id)
+        -> const std::string& { return stats_->MetricName(id); });
+    return;
+  }
+
+  CHECK(!client_.empty()) << "kDelta exports require a client";
+  // start from a copy of what the client has by since, if it's still kept
+  delta_.reset(new DeltaState());
+  uint64_t base_gen = 0;
+  {
+    const auto since_gen = ParseSince(since);
+    auto states = GetDeltaStates();
+    std::lock_guard<std::mutex> g(states->m);
+    gen_ = ++states->last_gen;
+    auto it = states->clients.find(client_);
+    if (since_gen != 0 && it != states->clients.end()) {
+      for (const auto& p : it->second.gens) {
+        if (p.first == since_gen) {
+          *delta_ = *p.second;
+          base_gen = since_gen;
+          break;
+        }
+      }
+    }
+  }
+  delta_->counter_totals.resize(num_counter_ids_, 0);
+  delta_->counter_named.resize(num_counter_ids_, false);
+  delta_->metric_counts.resize(num_metric_ids_, 0);
+  delta_->metric_sums.resize(num_metric_ids_, 0);
+  delta_->metric_named.resize(num_metric_ids_, false);
+
+  buffer_.append(kDeltaMagic, sizeof(kDeltaMagic) - 1);
+  AppendFixed64(GetEpoch(), &buffer_);
+  AppendFixed64(gen_, &buffer_);
+  AppendFixed64(base_gen, &buffer_);
+}
+
+StatsExporter::~StatsExporter() {}
+
+size_t StatsExporter::Read(char* buf, size_t max) {
+  while (buffer_pos_ == buffer_.size() && phase_ != Phase::kDone) {
+    buffer_.clear();
+    buffer_pos_ = 0;
+    Fill();
+  }
+
+  if (buffer_pos_ == buffer_.size()) {
+    if (delta_) {
+      // Everything has been read. Keep what the client has once it receives
+      // it, in case it asks for the deltas since this export next.
+      auto states = GetDeltaStates();
+      std::lock_guard<std::mutex> g(states->m);
+      auto& client = states->clients[client_];
+      client.last_used = ++states->clock;
+      client.gens.emplace_back(gen_, std::move(delta_));
+      while (client.gens.size() > kDeltaGensPerClient) {
+        client.gens.pop_front();
+      }
+      while (states->clients.size() >
+             static_cast<size_t>(
+               std::max(FLAGS_stats_export_max_delta_clients, 1))) {
+        auto lru = states->clients.begin();
+        for (auto it = states->clients.begin(); it != states->clients.end();
+             ++it) {
+          if (it->second.last_used < lru->second.last_used) {
+            lru = it;
+          }
+        }
+        states->clients.erase(lru);
+      }
+    }
+
+    return 0;
+  }
+
+  const auto n = std::min(max, buffer_.size() - buffer_pos_);
+  memcpy(buf, buffer_.data() + buffer_pos_, n);
+  buffer_pos_ += n;
+  return n;
+}
+
+std::string StatsExporter::ReadAll() {
+  std::string ret;
+  char buf[4096];
+  while (auto n = Read(buf, sizeof(buf))) {
+    ret.append(buf, n);
+  }
+
+  return ret;
+}
+
+std::string StatsExporter::DeltaSince(const char* buf) {
+  const auto magic_size = sizeof(kDeltaMagic) - 1;
+  return folly::to<std::string>(DecodeFixed64(buf + magic_size), ":",
+                                DecodeFixed64(buf + magic_size + 8));
+}
+
+const char* StatsExporter::ContentType(Format format) {
+  if (format == Format::kDelta) {
+    return "application/octet-stream";
+  }
+
+  return "application/openmetrics-text; version=1.0.0; charset=utf-8";
+}
+
+void StatsExporter::ParseName(const std::string& stat_name,
+                              std::string* family, std::string* labels) {
+  family->clear();
+  labels->clear();
+  std::vector<folly::StringPiece> tokens;
+  folly::split(' ', stat_name, tokens, true /* ignoreEmpty */);
+  for (size_t i = 0; i < tokens.size(); ++i) {
+    const auto pos = tokens[i].find('=');
+    if (i == 0 || pos == folly::StringPiece::npos) {
+      // not a tag, make it a part of the name
+      if (!family->empty()) {
+        family->push_back('_');
+      }
+      AppendName(tokens[i], false, family);
+      continue;
+    }
+
+    if (!labels->empty()) {
+      labels->push_back(',');
+    }
+    AppendName(tokens[i].subpiece(0, pos), true, labels);
+    labels->append("=\"");
+    AppendEscaped(tokens[i].subpiece(pos + 1), labels);
+    labels->push_back('"');
+  }
+
+  if (family->empty()) {
+    AppendName("", false, family);
+  }
+}
+
+void StatsExporter::Fill() {
+  if (format_ == Format::kOpenMetrics) {
+    FillOpenMetrics();
+  } else {
+    FillDelta();
+  }
+}
+
+void StatsExporter::FillOpenMetrics() {
+  if (phase_ == Phase::kGauges) {
+    AppendGauges();
+    buffer_.append("# EOF\n");
+    phase_ = Phase::kDone;
+    return;
+  }
+
+  const bool counters = phase_ == Phase::kCounters;
+  auto catalogs = GetCatalogs();
+  std::lock_guard<std::mutex> g(catalogs->m);
+  const auto& families = counters ? catalogs->counters.families() :
+    catalogs->metrics.families();
+  if (family_ >= families.size()) {
+    phase_ = counters ? Phase::kMetrics : Phase::kGauges;
+    family_ = 0;
+    series_ = 0;
+    return;
+  }
+
+  const auto& family = families[family_];
+  const auto name = counters ? family.name : MetricFamilyName(family.name);
+  if (name.empty()) {
+    ++family_;
+    series_ = 0;
+    return;
+  }
+
+  if (series_ == 0) {
+    AppendType(name, counters ? "counter" : "summary", &buffer_);
+  }
+
+  while (series_ < family.series.size() && buffer_.size() < kChunkBytes) {
+    const auto& series = family.series[series_++];
+    if (counters) {
+      Stats::CounterSnapshot snapshot;
+      if (stats_->SnapshotCounter(series.id, &snapshot)) {
+        AppendCounter(name, series.labels, snapshot);
+      }
+    } else {
+      Stats::MetricSnapshot snapshot;
+      if (stats_->SnapshotMetric(series.id, &last_minute_, &snapshot)) {
+        AppendMetric(name, series.labels, snapshot);
+      }
+    }
+  }
+
+  if (series_ == family.series.size()) {
+    ++family_;
+    series_ = 0;
+  }
+}
+
+void StatsExporter::FillDelta() {
+  if (phase_ == Phase::kCounters) {
+    while (next_id_ < num_counter_ids_ && buffer_.size() < kChunkBytes) {
+      const auto id = next_id_++;
+      Stats::CounterSnapshot snapshot;
+      auto& total = delta_->counter_totals[id];
+      if (!stats_->SnapshotCounter(id, &snapshot) || snapshot.total == total) {
+        continue;
+      }
+
+      buffer_.push_back(kCounterRecord);
+      AppendVarint(id, &buffer_);
+      AppendDeltaName(stats_->CounterName(id), delta_->counter_named[id],
+                      &buffer_);
+      // totals never go down
+      AppendVarint(snapshot.total > total ? snapshot.total - total : 0,
+                   &buffer_);
+      total = snapshot.total;
+      delta_->counter_named[id] = true;
+    }
+
+    if (next_id_ == num_counter_ids_) {
+      phase_ = Phase::kMetrics;
+      next_id_ = 0;
+    }
+    return;
+  }
+
+  if (phase_ == Phase::kMetrics) {
+    while (next_id_ < num_metric_ids_ && buffer_.size() < kChunkBytes) {
+      const auto id = next_id_++;
+      Stats::MetricSnapshot snapshot;
+      auto& count = delta_->metric_counts[id];
+      auto& sum = delta_->metric_sums[id];
+      if (!stats_->SnapshotMetric(id, &last_minute_, &snapshot) ||
+          snapshot.count == count) {
+        continue;
+      }
+
+      buffer_.push_back(kMetricRecord);
+      AppendVarint(id, &buffer_);
+      AppendDeltaName(stats_->MetricName(id), delta_->metric_named[id],
+                      &buffer_);
+      AppendVarint(snapshot.count > count ? snapshot.count - count : 0,
+                   &buffer_);
+      AppendZigzag(snapshot.sum - sum, &buffer_);
+      AppendZigzag(snapshot.p50, &buffer_);
+      AppendZigzag(snapshot.p90, &buffer_);
+      AppendZigzag(snapshot.p99, &buffer_);
+      AppendZigzag(snapshot.p999, &buffer_);
+      count = snapshot.count;
+      sum = snapshot.sum;
+      delta_->metric_named[id] = true;
+    }
+
+    if (next_id_ == num_metric_ids_) {
+      phase_ = Phase::kGauges;
+      next_id_ = 0;
+    }
+    return;
+  }
+
+  // gauges are few, and always sent in full
+  std::vector<std::pair<std::string, uint64_t>> gauges;
+  stats_->SnapshotGauges(&gauges);
+  for (const auto& gauge : gauges) {
+    buffer_.push_back(kGaugeRecord);
+    AppendDeltaName(gauge.first, false, &buffer_);
+    AppendVarint(gauge.second, &buffer_);
+  }
+  phase_ = Phase::kDone;
+}
+
+void StatsExporter::AppendCounter(const std::string& family,
+                                  const std::string& labels,
+                                  const Stats::CounterSnapshot& snapshot) {
+  AppendSample(family, "_total", labels, nullptr, snapshot.total, &buffer_);
+}
+
+void StatsExporter::AppendMetric(const std::string& family,
+                                 const std::string& labels,
+                                 const Stats::MetricSnapshot& snapshot) {
+  AppendSample(family, "", labels, "quantile=\"0.5\"", snapshot.p50,
+               &buffer_);
+  AppendSample(family, "", labels, "quantile=\"0.9\"", snapshot.p90,
+               &buffer_);
+  AppendSample(family, "", labels, "quantile=\"0.99\"", snapshot.p99,
+               &buffer_);
+  AppendSample(family, "", labels, "quantile=\"0.999\"", snapshot.p999,
+               &buffer_);
+  AppendSample(family, "_sum", labels, nullptr, snapshot.sum, &buffer_);
+  AppendSample(family, "_count", labels, nullptr, snapshot.count, &buffer_);
+}
+
+void StatsExporter::AppendGauges() {
+  std::vector<std::pair<std::string, uint64_t>> gauges;
+  stats_->SnapshotGauges(&gauges);
+
+  // (family, labels, value), sorted so that families are together
+  std::vector<std::tuple<std::string, std::string, uint64_t>> samples;
+  samples.reserve(gauges.size());
+  for (const auto& gauge : gauges) {
+    std::string family;
+    std::string labels;
+    ParseName(gauge.first, &family, &labels);
+    samples.emplace_back(std::move(family), std::move(labels), gauge.second);
+  }
+  std::sort(samples.begin(), samples.end());
+
+  // the names of the counter and metric families, and the name each gauge
+  // family is exported with, empty to skip it
+  std::unordered_set<std::string> taken;
+  std::unordered_map<std::string, std::string> names;
+  {
+    auto catalogs = GetCatalogs();
+    std::lock_guard<std::mutex> g(catalogs->m);
+    for (const auto& family : catalogs->counters.families()) {
+      taken.insert(family.name);
+    }
+    for (const auto& family : catalogs->metrics.families()) {
+      taken.insert(MetricFamilyName(family.name));
+    }
+  }
+  for (const auto& sample : samples) {
+    const auto& family = std::get<0>(sample);
+    if (names.count(family)) {
+      continue;
+    }
+
+    auto name = taken.count(family) ? family + "_gauge" : family;
+    names[family] = taken.count(name) ? "" : name;
+  }
+
+  for (size_t i = 0; i < samples.size(); ++i) {
+    const auto& name = names[std::get<0>(samples[i])];
+    if (name.empty()) {
+      continue;
+    }
+    if (i == 0 || std::get<0>(samples[i]) != std::get<0>(samples[i - 1])) {
+      AppendType(name, "gauge", &buffer_);
+    }
+    AppendSample(name, "", std::get<1>(samples[i]), nullptr,
+                 std::get<2>(samples[i]), &buffer_);
+  }
+}
+
+std::string StatsExporter::MetricFamilyName(const std::string& family) {
+  auto catalogs = GetCatalogs();
+  if (!catalogs->counters.Has(family)) {
+    return family;
+  }
+
+  auto name = family + "_summary";
+  if (catalogs->counters.Has(name) || catalogs->metrics.Has(name)) {
+    return "";
+  }
+  return name;
+}
+
+}  // namespace common
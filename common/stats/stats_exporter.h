@@ -0,0 +1,166 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+
+/**
+ * StatsExporter exports the stats of Stats one stat at a time, so that the
+ * output can be streamed out as it is produced rather than built as a whole.
+ *
+ * kOpenMetrics is the OpenMetrics text format. The tags of a stat name become
+ * labels, i.e., "name k1=v1 k2=v2" is exported as name{k1="v1",k2="v2"}.
+ * Counters are exported with their totals, metrics as summaries with the
+ * p50, p90, p99 and p999 of the last minute and the count and sum of all
+ * values, and gauges as they are.
+ *
+ * Metric families named the same as a counter family get a "_summary"
+ * suffix, and gauge families named the same as either get a "_gauge" suffix,
+ * so that no family is typed twice. A family still colliding is skipped.
+ *
+ * kDelta is a compact binary format, which only has what has changed since
+ * an earlier kDelta export to the same client:
+ *
+ *   "RSD2" epoch:fixed64 gen:fixed64 base_gen:fixed64
+ *   (counter | metric | gauge)*
+ *
+ *   counter: 0x01 id:varint name delta_of_total:varint
+ *   metric:  0x02 id:varint name delta_of_count:varint
+ *            delta_of_sum:zigzag p50:zigzag p90:zigzag p99:zigzag p999:zigzag
+ *   gauge:   0x03 name_size:varint name value:varint
+ *   name:    name_size:varint name, or 0 if it has been sent to the client
+ *
+ * Every kDelta export is a new gen. A client passes "<epoch>:<gen>" of the
+ * last export it has received in full as since, and gets the deltas from
+ * that export, which base_gen is set to. base_gen is 0 if the export has
+ * everything instead, e.g. for a new client, or if the export since refers to
+ * is from another epoch or no longer kept. The client must then forget the
+ * ids, names and values it has. The last few exports to each client are kept,
+ * so a client which missed a response can ask for the deltas since the one
+ * before it.
+ *
+ * Ids are only meaningful within the same epoch. fixed64 is little endian.
+ *
+ * Usage:
+ *
+ * StatsExporter exporter(StatsExporter::Format::kOpenMetrics);
+ * while (auto n = exporter.Read(buf, sizeof(buf))) {
+ *   write(fd, buf, n);
+ * }
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "common/stats/hdr_histogram.h"
+#include "common/stats/stats.h"
+
+namespace common {
+
+class StatsExporter {
+ public:
+  enum class Format {
+    kOpenMetrics,
+    kDelta,
+  };
+
+  // client identifies the consumer of kDelta exports, and must not be empty
+  // for them. since is "<epoch>:<gen>" of the last kDelta export the client
+  // has received, or empty. Both are ignored by kOpenMetrics exports.
+  explicit StatsExporter(Format format, const std::string& client = "",
+                         const std::string& since = "");
+
+  ~StatsExporter();
+
+  // no copy or move
+  StatsExporter(const StatsExporter&) = delete;
+  StatsExporter& operator=(const StatsExporter&) = delete;
+
+  // Copy the next up to max bytes of the export into buf.
+  // @return the # of bytes copied, 0 once everything has been copied.
+  size_t Read(char* buf, size_t max);
+
+  // Read the rest of the export
+  std::string ReadAll();
+
+  // The HTTP content type of format
+  static const char* ContentType(Format format);
+
+  // Parse a stat name "name k1=v1 k2=v2" into an OpenMetrics metric family
+  // name and its label set 'k1="v1",k2="v2"'.
+  static void ParseName(const std::string& stat_name, std::string* family,
+                        std::string* labels);
+
+  // What a kDelta client has received
+  struct DeltaState;
+
+  // The since argument following an export with the header in buf, which
+  // must have at least kDeltaHeaderSize bytes
+  static std::string DeltaSince(const char* buf);
+
+  static const size_t kDeltaHeaderSize = 28;
+
+ private:
+  enum class Phase {
+    kCounters,
+    kMetrics,
+    kGauges,
+    kDone,
+  };
+
+  // Append at least one more stat to buffer_, unless phase_ is kDone
+  void Fill();
+  void FillOpenMetrics();
+  void FillDelta();
+
+  void AppendCounter(const std::string& family, const std::string& labels,
+                     const Stats::CounterSnapshot& snapshot);
+  void AppendMetric(const std::string& family, const std::string& labels,
+                    const Stats::MetricSnapshot& snapshot);
+  void AppendGauges();
+
+  // The name metric family is exported with, or empty to skip it. Caller
+  // must hold the catalogs lock.
+  static std::string MetricFamilyName(const std::string& family);
+
+  const Format format_;
+  const std::string client_;
+  Stats* const stats_;
+
+  Phase phase_;
+  // kOpenMetrics walks through stats by families, and kDelta by ids
+  size_t family_;
+  size_t series_;
+  uint32_t next_id_;
+  // # of ids in each phase when the export started
+  uint32_t num_counter_ids_;
+  uint32_t num_metric_ids_;
+
+  // for merging the last minute of metrics
+  HdrHistogram last_minute_;
+  // output not read yet starts at buffer_[buffer_pos_]
+  std::string buffer_;
+  size_t buffer_pos_;
+  // the gen of this kDelta export
+  uint64_t gen_;
+  // what the client had received by the export this one is based on, with
+  // what this export sends merged in. It's kept as what the client has by
+  // gen_ once everything has been read.
+  std::unique_ptr<DeltaState> delta_;
+};
+
+}  // namespace common
@@ -34,6 +34,7 @@
 #include <set>
 #include <string>
 #include "common/stats/stats.h"
+#include "common/stats/stats_exporter.h"
 
 DEFINE_int32(
     http_status_port, 9999,
@@ -43,6 +44,84 @@ namespace common {
 
 namespace {
 
+const char kMetricsEndPoint[] = "/metrics";
+// The max # of bytes microhttpd asks for at a time when streaming /metrics
+const size_t kMetricsBlockSize = 32 * 1024;
+
+// /metrics?format=delta&client=<client>[&since=<epoch>:<gen>] exports deltas
+// for client, /metrics exports OpenMetrics text. Return false if the
+// arguments are invalid.
+bool ParseMetricsArguments(const StatusServer::Arguments* args,
+                           StatsExporter::Format* format,
+                           std::string* client,
+                           std::string* since) {
+  *format = StatsExporter::Format::kOpenMetrics;
+  if (args == nullptr) {
+    return true;
+  }
+
+  for (const auto& arg : *args) {
+    if (arg.first == "format" && arg.second == "delta") {
+      *format = StatsExporter::Format::kDelta;
+    } else if (arg.first == "client") {
+      *client = arg.second;
+    } else if (arg.first == "since") {
+      *since = arg.second;
+    }
+  }
+
+  // clients without an id would share, and mess up, each other's deltas
+  return *format != StatsExporter::Format::kDelta || !client->empty();
+}
+
+const char kMissingClient[] = "format=delta requires a client argument\n";
+
+ssize_t ReadMetrics(void* cls, uint64_t pos, char* buf, size_t max) {
+  auto n = reinterpret_cast<StatsExporter*>(cls)->Read(buf, max);
+  if (n == 0) {
+    return MHD_CONTENT_READER_END_OF_STREAM;
+  }
+
+  return n;
+}
+
+void FreeMetrics(void* cls) {
+  delete reinterpret_cast<StatsExporter*>(cls);
+}
+
+// Stream the export of stats out as microhttpd asks for more, instead of
+// building it as a whole.
+int QueueMetricsResponse(struct MHD_Connection* connection,
+                         const StatusServer::Arguments& args) {
+  StatsExporter::Format format;
+  std::string client;
+  std::string since;
+  if (!ParseMetricsArguments(&args, &format, &client, &since)) {
+    auto response = MHD_create_response_from_data(
+      sizeof(kMissingClient) - 1, const_cast<char*>(kMissingClient), MHD_NO,
+      MHD_NO);
+    auto ret = MHD_queue_response(connection, MHD_HTTP_BAD_REQUEST, response);
+    MHD_destroy_response(response);
+    return ret;
+  }
+
+  auto exporter = new StatsExporter(format, client, since);
+  auto response = MHD_create_response_from_callback(MHD_SIZE_UNKNOWN,
+                                                    kMetricsBlockSize,
+                                                    &ReadMetrics, exporter,
+                                                    &FreeMetrics);
+  if (response == nullptr) {
+    delete exporter;
+    return MHD_NO;
+  }
+
+  MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_TYPE,
+                          StatsExporter::ContentType(format));
+  auto ret = MHD_queue_response(connection, MHD_HTTP_OK, response);
+  MHD_destroy_response(response);
+  return ret;
+}
+
 int ServeCallback(void* param, struct MHD_Connection* connection,
                   const char* url, const char* method, const char* version,
                   const char* upload_data, size_t* upload_data_size,
@@ -75,6 +154,10 @@ int ServeCallback(void* param, struct MHD_Connection* connection,
         return MHD_YES;
       },
       &args);
+  if (0 == strcmp(url, kMetricsEndPoint)) {
+    return QueueMetricsResponse(connection, args);
+  }
+
   auto str = server->GetPageContent(url, &args);
   response = MHD_create_response_from_data(str.size(),
                                            const_cast<char*>(str.c_str()),
@@ -121,6 +204,17 @@ StatusServer::StatusServer(uint16_t port, EndPointToOPMap op_map,
     return ret;
   });
 
+  // OpenMetrics. ServeCallback() streams it rather than calling this.
+  op_map_.emplace(kMetricsEndPoint, [] (const Arguments* args) {
+    StatsExporter::Format format;
+    std::string client;
+    std::string since;
+    if (!ParseMetricsArguments(args, &format, &client, &since)) {
+      return std::string(kMissingClient);
+    }
+    return StatsExporter(format, client, since).ReadAll();
+  });
+
   // dump_heap
   op_map_.emplace("/dump_heap",
                   [] (const Arguments*) {
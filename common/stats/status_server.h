@@ -18,6 +18,11 @@
  * http://www.gnu.org/software/libmicrohttpd/
  *
  * Used for exporting stats, deploy commit etc.
+ *
+ * /stats.txt exports stats in the text format of Stats::DumpStatsAsText(),
+ * and /metrics streams them out in OpenMetrics text, or in the binary delta
+ * format with /metrics?format=delta&client=<client>&since=<epoch>:<gen>.
+ * See stats_exporter.h.
  */
 
 #pragma once
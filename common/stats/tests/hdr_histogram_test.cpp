@@ -0,0 +1,129 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+
+/**
+ * Unit tests for hdr_histogram.h
+ */
+
+#include "common/stats/hdr_histogram.h"
+
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+using common::HdrHistogram;
+
+namespace {
+
+const int64_t kHourUs = 3600LL * 1000 * 1000;
+
+TEST(HdrHistogramTest, SmallValuesAreExact) {
+  HdrHistogram histogram(2, kHourUs);
+  EXPECT_EQ(0u, histogram.count());
+  EXPECT_EQ(0, histogram.percentile(50));
+
+  for (int64_t i = 1; i <= 200; ++i) {
+    histogram.record(i);
+  }
+
+  EXPECT_EQ(200u, histogram.count());
+  EXPECT_EQ(200 * 201 / 2, histogram.sum());
+  EXPECT_EQ(1, histogram.min());
+  EXPECT_EQ(100, histogram.percentile(50));
+  EXPECT_EQ(180, histogram.percentile(90));
+  EXPECT_EQ(198, histogram.percentile(99));
+  EXPECT_EQ(200, histogram.max());
+}
+
+TEST(HdrHistogramTest, LargeValuesKeepPrecision) {
+  HdrHistogram histogram(2, kHourUs);
+  // a microsecond latency tail going up to half an hour
+  for (int64_t i = 1; i <= 1000; ++i) {
+    histogram.record(i * 1800 * 1000);
+  }
+
+  for (double pct : {50.0, 90.0, 99.0, 99.9, 100.0}) {
+    const double expected = pct * 10 * 1800 * 1000;
+    EXPECT_NEAR(expected, histogram.percentile(pct), expected / 100) << pct;
+  }
+
+  // beyond the range
+  histogram.record(10 * kHourUs);
+  EXPECT_EQ(kHourUs, histogram.max());
+  // below it
+  histogram.record(-5);
+  EXPECT_EQ(0, histogram.min());
+}
+
+TEST(HdrHistogramTest, AddAndDrain) {
+  HdrHistogram a(2, kHourUs);
+  HdrHistogram b(2, kHourUs);
+  for (int64_t i = 0; i < 100; ++i) {
+    a.record(i);
+    b.record(1000 + i, 2);
+  }
+
+  HdrHistogram merged(2, kHourUs);
+  merged.add(a);
+  EXPECT_EQ(100u, merged.count());
+  EXPECT_EQ(100u, a.count());
+
+  merged.drainFrom(&b);
+  EXPECT_EQ(300u, merged.count());
+  EXPECT_EQ(0u, b.count());
+  EXPECT_EQ(0, b.sum());
+  EXPECT_EQ(a.sum() + 2 * (100 * 1000 + 99 * 100 / 2), merged.sum());
+  EXPECT_EQ(89, merged.percentile(30));
+  EXPECT_NEAR(1099, merged.max(), 10);
+
+  merged.clear();
+  EXPECT_EQ(0u, merged.count());
+  EXPECT_EQ(0, merged.max());
+}
+
+TEST(HdrHistogramTest, ConcurrentRecordAndDrain) {
+  HdrHistogram local(2, kHourUs);
+  HdrHistogram global(2, kHourUs);
+  const int kThreads = 4;
+  const int kValues = 100000;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kThreads; ++t) {
+    threads.emplace_back([&local] {
+      for (int i = 0; i < kValues; ++i) {
+        local.record(i % 5000);
+      }
+    });
+  }
+
+  for (int i = 0; i < 100; ++i) {
+    global.drainFrom(&local);
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  global.drainFrom(&local);
+
+  // nothing is lost
+  EXPECT_EQ(static_cast<uint64_t>(kThreads) * kValues, global.count());
+  EXPECT_EQ(0u, local.count());
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,160 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+
+/**
+ * Unit tests for stats_exporter.h
+ */
+
+#include "common/stats/stats_exporter.h"
+
+#include <chrono>
+#include <string>
+#include <thread>
+
+#include "gtest/gtest.h"
+
+using common::Stats;
+using common::StatsExporter;
+using std::chrono::seconds;
+using std::string;
+using std::this_thread::sleep_for;
+
+namespace {
+
+// The # of occurrences of what in s
+size_t Count(const string& s, const string& what) {
+  size_t n = 0;
+  for (auto pos = s.find(what); pos != string::npos;
+       pos = s.find(what, pos + what.size())) {
+    ++n;
+  }
+  return n;
+}
+
+TEST(StatsExporterTest, ParseName) {
+  string family;
+  string labels;
+  StatsExporter::ParseName("replicator_out_bytes", &family, &labels);
+  EXPECT_EQ("replicator_out_bytes", family);
+  EXPECT_EQ("", labels);
+
+  StatsExporter::ParseName("replicator_out_bytes db=seg00001 dataset=seg",
+                           &family, &labels);
+  EXPECT_EQ("replicator_out_bytes", family);
+  EXPECT_EQ("db=\"seg00001\",dataset=\"seg\"", labels);
+
+  StatsExporter::ParseName("2xx.latency-ms extra k.1=a\"b\\c", &family,
+                           &labels);
+  EXPECT_EQ("_2xx_latency_ms_extra", family);
+  EXPECT_EQ("k_1=\"a\\\"b\\\\c\"", labels);
+}
+
+TEST(StatsExporterTest, OpenMetrics) {
+  Stats::get()->Incr("exporter_counter db=a", 3);
+  Stats::get()->Incr("exporter_counter db=b", 4);
+  Stats::get()->Incr("exporter_counter_total");
+  Stats::get()->AddMetric("exporter_metric db=a", 10);
+  Stats::get()->AddMetric("exporter_metric db=a", 20);
+  sleep_for(seconds(1));
+
+  auto text = StatsExporter(StatsExporter::Format::kOpenMetrics).ReadAll();
+  EXPECT_EQ(1u, Count(text, "# TYPE exporter_counter counter\n"));
+  EXPECT_EQ(1u, Count(text, "exporter_counter_total{db=\"a\"} 3\n"));
+  EXPECT_EQ(1u, Count(text, "exporter_counter_total{db=\"b\"} 4\n"));
+  EXPECT_EQ(1u, Count(text, "exporter_counter_total 1\n"));
+  // the series of a family are together
+  EXPECT_EQ(text.find("# TYPE exporter_counter counter\n"),
+            text.rfind("# TYPE", text.rfind("exporter_counter_total")));
+
+  EXPECT_EQ(1u, Count(text, "# TYPE exporter_metric summary\n"));
+  EXPECT_EQ(1u, Count(text,
+                     "exporter_metric{db=\"a\",quantile=\"0.5\"} 10\n"));
+  EXPECT_EQ(1u, Count(text, "exporter_metric_sum{db=\"a\"} 30\n"));
+  EXPECT_EQ(1u, Count(text, "exporter_metric_count{db=\"a\"} 2\n"));
+  EXPECT_EQ(text.size() - 6, text.rfind("# EOF\n"));
+
+  // small reads get the same
+  StatsExporter exporter(StatsExporter::Format::kOpenMetrics);
+  string read;
+  char buf[7];
+  while (auto n = exporter.Read(buf, sizeof(buf))) {
+    read.append(buf, n);
+  }
+  EXPECT_EQ(Count(text, "\n"), Count(read, "\n"));
+}
+
+TEST(StatsExporterTest, OpenMetricsNameCollisions) {
+  Stats::get()->Incr("exporter_collision", 1);
+  Stats::get()->AddMetric("exporter_collision", 10);
+  Stats::get()->RegisterGauge("exporter_collision", [] { return 7; });
+  sleep_for(seconds(1));
+
+  // every family is typed once
+  auto text = StatsExporter(StatsExporter::Format::kOpenMetrics).ReadAll();
+  EXPECT_EQ(1u, Count(text, "# TYPE exporter_collision counter\n"));
+  EXPECT_EQ(1u, Count(text, "exporter_collision_total 1\n"));
+  EXPECT_EQ(0u, Count(text, "# TYPE exporter_collision summary\n"));
+  EXPECT_EQ(1u, Count(text, "# TYPE exporter_collision_summary summary\n"));
+  EXPECT_EQ(1u, Count(text, "exporter_collision_summary_count 1\n"));
+  EXPECT_EQ(0u, Count(text, "# TYPE exporter_collision gauge\n"));
+  EXPECT_EQ(1u, Count(text, "# TYPE exporter_collision_gauge gauge\n"));
+  EXPECT_EQ(1u, Count(text, "exporter_collision_gauge 7\n"));
+}
+
+TEST(StatsExporterTest, Delta) {
+  Stats::get()->Incr("exporter_delta_counter", 5);
+  sleep_for(seconds(1));
+
+  const auto kFormat = StatsExporter::Format::kDelta;
+  const auto kHeaderSize = StatsExporter::kDeltaHeaderSize;
+  const string kName = "exporter_delta_counter";
+  const string kNoBaseGen(8, '\0');
+  auto first = StatsExporter(kFormat, "c1").ReadAll();
+  ASSERT_GE(first.size(), kHeaderSize);
+  EXPECT_EQ("RSD2", first.substr(0, 4));
+  EXPECT_EQ(kNoBaseGen, first.substr(20, 8));
+  EXPECT_NE(string::npos, first.find(kName));
+  const auto since_first = StatsExporter::DeltaSince(first.data());
+
+  // nothing changed, nothing but the header, based on first
+  auto second = StatsExporter(kFormat, "c1", since_first).ReadAll();
+  EXPECT_EQ(kHeaderSize, second.size());
+  EXPECT_EQ(first.substr(12, 8), second.substr(20, 8));
+
+  // the client never got second, the deltas since first are sent again
+  Stats::get()->Incr("exporter_delta_counter", 2);
+  sleep_for(seconds(1));
+  auto third = StatsExporter(kFormat, "c1", since_first).ReadAll();
+  // the name is known to the client, the delta is 2
+  EXPECT_EQ(string::npos, third.find(kName));
+  EXPECT_LT(kHeaderSize, third.size());
+  auto again = StatsExporter(kFormat, "c1", since_first).ReadAll();
+  EXPECT_EQ(third.substr(kHeaderSize), again.substr(kHeaderSize));
+
+  // exports not based on what the client has get everything
+  auto unknown = StatsExporter(kFormat, "c1", "1:1").ReadAll();
+  EXPECT_EQ(kNoBaseGen, unknown.substr(20, 8));
+  EXPECT_NE(string::npos, unknown.find(kName));
+  auto other = StatsExporter(kFormat, "c2", since_first).ReadAll();
+  EXPECT_EQ(kNoBaseGen, other.substr(20, 8));
+  EXPECT_NE(string::npos, other.find(kName));
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
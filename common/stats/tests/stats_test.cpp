@@ -227,6 +227,34 @@ TEST_F(StatsTest, StatsHistogramTest) {
   EXPECT_NEAR(190, metric2->GetPercentileTotal(90), 5);
   EXPECT_NEAR(199, metric2->GetPercentileTotal(99), 5);
 }
+
+// Verifies that updating a stat through its handle is the same as updating it
+// through its tagged name.
+TEST_F(StatsTest, StatsHandleTest) {
+  auto counter = Stats::get()->GetCounterHandle("counter4", {{"db", "db1"}});
+  EXPECT_TRUE(counter.valid());
+  EXPECT_FALSE(Stats::Handle().valid());
+  auto metric = Stats::get()->GetMetricHandle("metric4",
+                                              {{"db", "db1"}, {"shard", "1"}});
+  for (int i = 0; i < 10; ++i) {
+    Stats::get()->Incr(counter);
+    Stats::get()->AddMetric(metric, 10);
+  }
+  Stats::get()->Incr("counter4 db=db1", 5);
+  Stats::get()->AddMetric("metric4 db=db1 shard=1", 20);
+  // a handle that resolves to nothing is ignored
+  Stats::get()->Incr(Stats::Handle());
+  sleep_for(seconds(1));
+
+  auto counter4 = Stats::get()->GetCounter("counter4 db=db1");
+  ASSERT_NE(nullptr, counter4);
+  EXPECT_EQ(15, counter4->GetTotal());
+  auto metric4 = Stats::get()->GetMetric("metric4 db=db1 shard=1");
+  ASSERT_NE(nullptr, metric4);
+  EXPECT_EQ(11, metric4->GetCountTotal());
+  EXPECT_EQ(120, metric4->GetSumTotal());
+  EXPECT_EQ(nullptr, Stats::get()->GetCounter("counter4"));
+}
 }  // namespace
 
 int main(int argc, char** argv) {
@@ -191,6 +191,53 @@ TEST_F(FutureUtilTest, BothFailedWithPrimaryBeforeSpeculativeCall) {
   EXPECT_TRUE(error);
   EXPECT_EQ(1, backup_fired_.load());
 }
+
+TEST_F(FutureUtilTest, CancelLoser) {
+  // The backup wins, and the primary gets interrupted.
+  atomic<bool> primary_interrupted(false);
+  folly::Promise<int> primary;
+  primary.setInterruptHandler(
+    [&primary, &primary_interrupted] (const folly::exception_wrapper& e) {
+      EXPECT_TRUE(e.is_compatible_with<folly::FutureCancellation>());
+      primary_interrupted = true;
+      primary.setException(e);
+    });
+  EXPECT_EQ(2, GetSpeculativeFuture(
+                   primary.getFuture(),
+                   getBackupFutureFuncSuccess(2, milliseconds(10)),
+                   milliseconds(10), true /* cancel_loser */).get());
+  EXPECT_EQ(1, backup_fired_.load());
+  EXPECT_TRUE(primary_interrupted.load());
+
+  // The primary wins, and the backup gets interrupted.
+  atomic<bool> backup_interrupted(false);
+  auto backup = std::make_shared<folly::Promise<int>>();
+  backup->setInterruptHandler(
+    [backup = backup.get(), &backup_interrupted] (
+        const folly::exception_wrapper& e) {
+      backup_interrupted = true;
+      backup->setException(e);
+    });
+  EXPECT_EQ(1, GetSpeculativeFuture(
+                   makeFuture(1).delayed(milliseconds(50)),
+                   [backup] { return backup->getFuture(); },
+                   milliseconds(10), true /* cancel_loser */).get());
+  EXPECT_TRUE(backup_interrupted.load());
+
+  // Nothing is interrupted unless asked to.
+  primary_interrupted = false;
+  folly::Promise<int> slow_primary;
+  slow_primary.setInterruptHandler(
+    [&primary_interrupted] (const folly::exception_wrapper&) {
+      primary_interrupted = true;
+    });
+  EXPECT_EQ(2, GetSpeculativeFuture(
+                   slow_primary.getFuture(),
+                   getBackupFutureFuncSuccess(2, milliseconds(10)),
+                   milliseconds(10)).get());
+  EXPECT_FALSE(primary_interrupted.load());
+  slow_primary.setValue(1);
+}
 }  // namespace
 
 int main(int argc, char** argv) {
@@ -0,0 +1,161 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#include <unistd.h>
+
+#include <chrono>
+
+#include "gtest/gtest.h"
+
+#include "common/thrift_router.h"
+
+static const char* g_config_one_host =
+  "{"
+  "  \"user_pins\": {"
+  "  \"num_leaf_segments\": 1,"
+  "  \"127.0.0.1:8090\": [\"00000\"]"
+  "   }"
+  "}";
+
+static const char* g_config_four_hosts =
+  "{"
+  "  \"user_pins\": {"
+  "  \"num_leaf_segments\": 1,"
+  "  \"127.0.0.1:8090:us-east-1a_0\": [\"00000:S\"],"
+  "  \"127.0.0.1:8091:us-east-1a_1\": [\"00000:S\"],"
+  "  \"127.0.0.1:8092:us-east-1b_0\": [\"00000:M\"],"
+  "  \"127.0.0.1:8093:us-east-1b_1\": [\"00000:S\"]"
+  "   }"
+  "}";
+
+TEST(RouterLoadTest, HostLoad) {
+  FLAGS_thrift_router_latency_ewma_tau_ms = 1000;
+  common::detail::HostLoad load;
+  EXPECT_EQ(load.latencyUs(), 0);
+  EXPECT_EQ(load.cost(), 1);
+
+  load.start();
+  load.start();
+  EXPECT_EQ(load.outstanding(), 2);
+  EXPECT_EQ(load.cost(), 3);
+
+  // the first sample is taken as is
+  load.finish(1000);
+  EXPECT_EQ(load.outstanding(), 1);
+  EXPECT_EQ(load.latencyUs(), 1000);
+  EXPECT_EQ(load.cost(), 1001 * 2);
+
+  // later ones move the average by how long it has been since the last one
+  usleep(100 * 1000);
+  load.finish(11000);
+  EXPECT_EQ(load.outstanding(), 0);
+  EXPECT_GT(load.latencyUs(), 1000);
+  EXPECT_LT(load.latencyUs(), 6000);
+
+  // samples older than 10 time constants are forgotten
+  FLAGS_thrift_router_latency_ewma_tau_ms = 1;
+  usleep(20 * 1000);
+  EXPECT_EQ(load.latencyUs(), 0);
+  load.start();
+  load.finish(500);
+  EXPECT_EQ(load.latencyUs(), 500);
+  FLAGS_thrift_router_latency_ewma_tau_ms = 1000;
+}
+
+TEST(RouterLoadTest, RoutingTableCarriesHostLoads) {
+  using common::detail::RoutingTable;
+  RoutingTable v1(common::parseConfig(g_config_one_host, ""));
+  RoutingTable v2(common::parseConfig(g_config_four_hosts, ""), &v1);
+  RoutingTable v3(common::parseConfig(g_config_four_hosts, ""), &v2);
+
+  // 127.0.0.1:8090 is the only host in v1, and the first one in v2
+  ASSERT_EQ(v1.numHosts(), 1);
+  ASSERT_EQ(v2.numHosts(), 4);
+  EXPECT_EQ(v1.hostLoad(0), v2.hostLoad(0));
+  for (uint32_t i = 1; i < v2.numHosts(); ++i) {
+    EXPECT_NE(v2.hostLoad(i), v1.hostLoad(0));
+  }
+
+  for (uint32_t i = 0; i < v2.numHosts(); ++i) {
+    EXPECT_EQ(v2.hostLoad(i), v3.hostLoad(i));
+  }
+}
+
+TEST(RouterLoadTest, SegmentHedgerBudget) {
+  FLAGS_thrift_router_hedge_budget_percent = 10;
+  common::detail::SegmentHedger hedger("user_pins");
+  EXPECT_FALSE(hedger.tryHedge());
+
+  // a hedge every 10 calls
+  for (int i = 0; i < 9; ++i) {
+    hedger.onCall();
+  }
+  EXPECT_FALSE(hedger.tryHedge());
+  hedger.onCall();
+  EXPECT_TRUE(hedger.tryHedge());
+  EXPECT_FALSE(hedger.tryHedge());
+
+  // saving up is capped at 10 hedges
+  for (int i = 0; i < 1000; ++i) {
+    hedger.onCall();
+  }
+  for (int i = 0; i < 10; ++i) {
+    EXPECT_TRUE(hedger.tryHedge());
+  }
+  EXPECT_FALSE(hedger.tryHedge());
+
+  FLAGS_thrift_router_hedge_budget_percent = 0;
+  for (int i = 0; i < 1000; ++i) {
+    hedger.onCall();
+  }
+  EXPECT_FALSE(hedger.tryHedge());
+  FLAGS_thrift_router_hedge_budget_percent = 5;
+}
+
+TEST(RouterLoadTest, SegmentHedgerDelay) {
+  FLAGS_thrift_router_hedge_default_delay_ms = 50;
+  FLAGS_thrift_router_hedge_window_ms = 1;
+  common::detail::SegmentHedger hedger("user_pins");
+  EXPECT_EQ(hedger.onCall(), std::chrono::milliseconds(50));
+
+  // too few samples to close the window
+  for (int i = 1; i <= 50; ++i) {
+    hedger.recordLatency(i * 100);
+  }
+  usleep(2000);
+  EXPECT_EQ(hedger.onCall(), std::chrono::milliseconds(50));
+
+  // p95 of 100us, 200us, ..., 10000us, rounded up to ms
+  for (int i = 51; i <= 100; ++i) {
+    hedger.recordLatency(i * 100);
+  }
+  EXPECT_EQ(hedger.onCall(), std::chrono::milliseconds(10));
+
+  // and the next window with enough samples replaces it
+  usleep(2000);
+  for (int i = 0; i < 100; ++i) {
+    hedger.recordLatency(900);
+  }
+  EXPECT_EQ(hedger.onCall(), std::chrono::milliseconds(1));
+  FLAGS_thrift_router_hedge_window_ms = 10 * 1000;
+}
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
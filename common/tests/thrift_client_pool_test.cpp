@@ -234,6 +234,53 @@ TEST(ThriftClientTest, Basics) {
   testBasics(&pool_100);
 }
 
+TEST(ThriftClientTest, ChannelsPerHost) {
+  shared_ptr<DummyServiceTestHandler> handler;
+  shared_ptr<ThriftServer> server;
+  unique_ptr<thread> thr;
+  tie(handler, server, thr) = makeServer(gPort, 0);
+  sleep(1);
+
+  {
+    // one channel per host per IO thread by default
+    ThriftClientPool<DummyServiceAsyncClient> pool(1);
+    auto a = pool.getClient(gLocalIp, gPort);
+    auto b = pool.getClient(gLocalIp, gPort);
+    EXPECT_EQ(a->getChannel(), b->getChannel());
+  }
+
+  FLAGS_channels_per_host = 2;
+  {
+    ThriftClientPool<DummyServiceAsyncClient> pool(1);
+    auto a = pool.getClient(gLocalIp, gPort);
+    // a's channel is in use, so b gets a new one
+    auto b = pool.getClient(gLocalIp, gPort);
+    EXPECT_NE(a->getChannel(), b->getChannel());
+    EXPECT_NO_THROW(a->future_ping().get());
+    EXPECT_NO_THROW(b->future_ping().get());
+
+    // no room for a third channel
+    auto c = pool.getClient(gLocalIp, gPort);
+    EXPECT_TRUE(c->getChannel() == a->getChannel() ||
+                c->getChannel() == b->getChannel());
+
+    // the channel with the fewest clients is picked
+    auto least_used = c->getChannel() == a->getChannel() ?
+      b->getChannel() : a->getChannel();
+    auto d = pool.getClient(gLocalIp, gPort);
+    EXPECT_EQ(d->getChannel(), least_used);
+    EXPECT_NO_THROW(d->future_ping().get());
+  }
+
+  server->stop();
+  thr->join();
+
+  // bad channels are evicted and replaced
+  ThriftClientPool<DummyServiceAsyncClient> pool_1(1);
+  testBasics(&pool_1);
+  FLAGS_channels_per_host = 1;
+}
+
 void stressTest(uint32_t nThreads, uint32_t nCalls, uint32_t nBatchSz,
                 ThriftClientPool<DummyServiceAsyncClient>* pool) {
   LOG(INFO) << nThreads << " nThreads; "
@@ -0,0 +1,203 @@
+/// Copyright 2019 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+#include <fstream>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "common/tests/thrift/gen-cpp2/DummyService.h"
+#include "common/thrift_router.h"
+#include "folly/Benchmark.h"
+#include "thrift/lib/cpp2/server/ThriftServer.h"
+
+DEFINE_int32(num_shards, 1024, "Number of shards in the benchmark layout");
+DEFINE_int32(base_port, 8090, "The first of the 3 ports to serve on");
+
+using common::ThriftRouter;
+using dummy_service::thrift::DummyServiceAsyncClient;
+using dummy_service::thrift::DummyServiceSvIf;
+
+using Role = ThriftRouter<DummyServiceAsyncClient>::Role;
+using Quantity = ThriftRouter<DummyServiceAsyncClient>::Quantity;
+using RoutingTable = common::detail::RoutingTable;
+
+static const char* g_config_path = "./thrift_router_benchmark_config_file";
+
+// 3 hosts in 3 AZs, each serving every shard. Masters are spread evenly.
+std::string generateConfig() {
+  const char* groups[] = { "us-east-1a_0", "us-east-1c_0", "us-east-1e_0" };
+  std::string config = "{ \"user_pins\": { \"num_leaf_segments\": " +
+    std::to_string(FLAGS_num_shards);
+  for (int h = 0; h < 3; ++h) {
+    config += ", \"127.0.0.1:" + std::to_string(FLAGS_base_port + h) + ":" +
+      groups[h] + "\": [";
+    for (int shard = 0; shard < FLAGS_num_shards; ++shard) {
+      config += (shard == 0 ? "\"" : ", \"") + std::to_string(shard) +
+        (shard % 3 == h ? ":M\"" : ":S\"");
+    }
+    config += "]";
+  }
+
+  return config + " } }";
+}
+
+BENCHMARK(RoutingTableBuild, n) {
+  std::shared_ptr<const common::detail::ClusterLayout> layout;
+  BENCHMARK_SUSPEND {
+    layout = common::parseConfig(generateConfig(), "us-east-1c_0");
+  }
+
+  while (n--) {
+    RoutingTable table(layout);
+    folly::doNotOptimizeAway(table.numHosts());
+  }
+}
+
+BENCHMARK(RoutingTableLookup, n) {
+  std::unique_ptr<RoutingTable> table;
+  BENCHMARK_SUSPEND {
+    table = std::make_unique<RoutingTable>(
+      common::parseConfig(generateConfig(), "us-east-1c_0"));
+  }
+
+  uint32_t shard = 0;
+  while (n--) {
+    auto segment = table->findSegment("user_pins");
+    uint32_t az_slot;
+    table->findAzSlot("", &az_slot);
+    auto range = table->candidatesFor(
+      *segment, shard, RoutingTable::orderFor(Role::ANY), az_slot);
+    folly::doNotOptimizeAway(range);
+    if (++shard == segment->num_shards) {
+      shard = 0;
+    }
+  }
+}
+
+struct DummyServiceHandler : public DummyServiceSvIf {
+  void async_tm_ping(
+      std::unique_ptr<apache::thrift::HandlerCallback<void>> callback) override {
+    callback->done();
+  }
+};
+
+// Serves the 3 hosts of generateConfig() and routes to them. It is shared by
+// all benchmarks and lives until exit, as folly runs each benchmark many times.
+class RouterFixture {
+ public:
+  RouterFixture() {
+    for (int h = 0; h < 3; ++h) {
+      auto server = std::make_shared<apache::thrift::ThriftServer>();
+      server->setPort(FLAGS_base_port + h);
+      server->setInterface(std::make_shared<DummyServiceHandler>());
+      threads_.emplace_back([server] { server->serve(); });
+      servers_.push_back(std::move(server));
+    }
+
+    std::ofstream(g_config_path) << generateConfig();
+    router_ = std::make_unique<ThriftRouter<DummyServiceAsyncClient>>(
+      "us-east-1c_0", g_config_path, common::parseConfig);
+    sleep(1);
+  }
+
+  ThriftRouter<DummyServiceAsyncClient>* router() {
+    return router_.get();
+  }
+
+ private:
+  std::vector<std::shared_ptr<apache::thrift::ThriftServer>> servers_;
+  std::vector<std::thread> threads_;
+  std::unique_ptr<ThriftRouter<DummyServiceAsyncClient>> router_;
+};
+
+ThriftRouter<DummyServiceAsyncClient>* getRouter() {
+  static auto fixture = new RouterFixture();
+  return fixture->router();
+}
+
+void getClientsFor(unsigned n, const Role role, const Quantity quantity,
+                   const std::string& az) {
+  ThriftRouter<DummyServiceAsyncClient>* router;
+  std::vector<std::shared_ptr<DummyServiceAsyncClient>> clients;
+  BENCHMARK_SUSPEND {
+    router = getRouter();
+    // connect to every host of this thread before measuring
+    router->getClientsFor("user_pins", Role::ANY, Quantity::ALL, 0, &clients);
+  }
+
+  uint32_t shard = 0;
+  while (n--) {
+    router->getClientsFor("user_pins", role, quantity, shard, &clients, az);
+    folly::doNotOptimizeAway(clients);
+    if (++shard == static_cast<uint32_t>(FLAGS_num_shards)) {
+      shard = 0;
+    }
+  }
+
+  BENCHMARK_SUSPEND {
+    clients.clear();
+  }
+}
+
+BENCHMARK(GetClientsForAnyOne, n) {
+  getClientsFor(n, Role::ANY, Quantity::ONE, "");
+}
+
+BENCHMARK(GetClientsForMasterOne, n) {
+  getClientsFor(n, Role::MASTER, Quantity::ONE, "");
+}
+
+BENCHMARK(GetClientsForAnyAll, n) {
+  getClientsFor(n, Role::ANY, Quantity::ALL, "");
+}
+
+BENCHMARK(GetClientsForSpecificAzOne, n) {
+  getClientsFor(n, Role::ANY, Quantity::ONE, "us-east-1a");
+}
+
+BENCHMARK(GetClientsForAnyOneLatencyAware, n) {
+  FLAGS_thrift_router_latency_aware = true;
+  getClientsFor(n, Role::ANY, Quantity::ONE, "");
+  FLAGS_thrift_router_latency_aware = false;
+}
+
+BENCHMARK(GetClientsForMultiShards, n) {
+  ThriftRouter<DummyServiceAsyncClient>* router;
+  std::map<uint32_t, std::vector<std::shared_ptr<DummyServiceAsyncClient>>>
+    shard_to_clients;
+  BENCHMARK_SUSPEND {
+    router = getRouter();
+    for (uint32_t shard = 0; shard < 16; ++shard) {
+      shard_to_clients[shard];
+    }
+  }
+
+  while (n--) {
+    router->getClientsFor("user_pins", Role::ANY, Quantity::ONE,
+                          &shard_to_clients);
+    folly::doNotOptimizeAway(shard_to_clients);
+  }
+
+  BENCHMARK_SUSPEND {
+    shard_to_clients.clear();
+  }
+}
+
+int main(int argc, char **argv) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  folly::runBenchmarks();
+}
@@ -28,6 +28,7 @@
 
 #include "common/tests/thrift/gen-cpp2/DummyService.h"
 #include "common/thrift_router.h"
+#include "folly/Optional.h"
 #include "thrift/lib/cpp2/server/ThriftServer.h"
 
 using apache::thrift::HandlerCallback;
@@ -1031,6 +1032,124 @@ TEST(ThriftRouterTest, LocalGroupLongerThanConfigGroupTest) {
   }
 }
 
+TEST(ThriftRouterTest, Call) {
+  updateConfigFile(g_config_v1);
+  ThriftRouter<DummyServiceAsyncClient> router(
+    "", g_config_path, common::parseConfig);
+
+  shared_ptr<DummyServiceTestHandler> handlers[3];
+  shared_ptr<ThriftServer> servers[3];
+  unique_ptr<thread> thrs[3];
+
+  tie(handlers[0], servers[0], thrs[0]) = makeServer(8090);
+  tie(handlers[1], servers[1], thrs[1]) = makeServer(8091);
+  tie(handlers[2], servers[2], thrs[2]) = makeServer(8092);
+  sleep(1);
+
+  auto ping = [] (shared_ptr<DummyServiceAsyncClient> client) {
+    return client->future_ping();
+  };
+
+  folly::Optional<folly::Future<folly::Unit>> future;
+  EXPECT_EQ(router.call("unknown_segment", Role::ANY, 0, ping, &future),
+            ReturnCode::UNKNOWN_SEGMENT);
+  EXPECT_FALSE(future.hasValue());
+
+  // shard 0 only lives on 8090
+  EXPECT_EQ(router.call("user_pins", Role::ANY, 0, ping, &future),
+            ReturnCode::OK);
+  ASSERT_TRUE(future.hasValue());
+  EXPECT_NO_THROW(std::move(*future).get());
+  EXPECT_EQ(handlers[0]->nPings_.load(), 1);
+
+  // stop all servers
+  for (auto& s : servers) {
+    s->stop();
+  }
+
+  for (auto& t : thrs) {
+    t->join();
+  }
+}
+
+TEST(ThriftRouterTest, HedgedCall) {
+  updateConfigFile(g_config_v1);
+  ThriftRouter<DummyServiceAsyncClient> router(
+    "", g_config_path, common::parseConfig);
+
+  shared_ptr<DummyServiceTestHandler> handlers[3];
+  shared_ptr<ThriftServer> servers[3];
+  unique_ptr<thread> thrs[3];
+
+  tie(handlers[0], servers[0], thrs[0]) = makeServer(8090);
+  tie(handlers[1], servers[1], thrs[1]) = makeServer(8091);
+  tie(handlers[2], servers[2], thrs[2]) = makeServer(8092);
+  sleep(1);
+
+  auto ping = [] (shared_ptr<DummyServiceAsyncClient> client) {
+    return client->future_ping();
+  };
+  auto nPings = [&handlers] {
+    return handlers[0]->nPings_.load() + handlers[1]->nPings_.load() +
+      handlers[2]->nPings_.load();
+  };
+
+  EXPECT_THROW(router.hedgedCall("unknown_segment", 0, ping).get(),
+               std::runtime_error);
+
+  EXPECT_NO_THROW(router.hedgedCall("user_pins", 2, ping).get());
+  EXPECT_EQ(nPings(), 1);
+
+  // A failed primary is hedged right away, as long as there is budget
+  FLAGS_thrift_router_hedge_budget_percent = 100;
+  atomic<int> calls(0);
+  auto fail_first = [&calls] (shared_ptr<DummyServiceAsyncClient> client) {
+    if (calls++ == 0) {
+      return folly::makeFuture<folly::Unit>(std::runtime_error("primary"));
+    }
+    return client->future_ping();
+  };
+  EXPECT_NO_THROW(router.hedgedCall("user_pins", 2, fail_first).get());
+  EXPECT_EQ(calls.load(), 2);
+  EXPECT_EQ(nPings(), 2);
+
+  // So is one throwing before returning a future
+  calls = 0;
+  auto throw_first = [&calls] (shared_ptr<DummyServiceAsyncClient> client) {
+    if (calls++ == 0) {
+      throw std::runtime_error("primary");
+    }
+    return client->future_ping();
+  };
+  EXPECT_NO_THROW(router.hedgedCall("user_pins", 2, throw_first).get());
+  EXPECT_EQ(calls.load(), 2);
+  EXPECT_EQ(nPings(), 3);
+
+  // Shard 0 has a single replica, so there is nothing to hedge on
+  calls = 0;
+  EXPECT_THROW(router.hedgedCall("user_pins", 0, fail_first).get(),
+               std::runtime_error);
+  EXPECT_EQ(calls.load(), 1);
+
+  // No budget, no hedge
+  FLAGS_thrift_router_hedge_budget_percent = 0;
+  calls = 0;
+  EXPECT_THROW(router.hedgedCall("user_pins", 2, fail_first).get(),
+               std::runtime_error);
+  EXPECT_EQ(calls.load(), 1);
+  EXPECT_EQ(nPings(), 3);
+  FLAGS_thrift_router_hedge_budget_percent = 5;
+
+  // stop all servers
+  for (auto& s : servers) {
+    s->stop();
+  }
+
+  for (auto& t : thrs) {
+    t->join();
+  }
+}
+
 TEST(ThriftRouterTest, UnreachableHost) {
   FLAGS_default_thrift_client_pool_threads = 1;
   FLAGS_client_connect_timeout_millis = 10;
@@ -1069,6 +1188,71 @@ TEST(ThriftRouterTest, UnreachableHost) {
     ReturnCode::BAD_HOST);
 }
 
+static const char* g_config_groups =
+  "{"
+  "  \"user_pins\": {"
+  "  \"num_leaf_segments\": 1,"
+  "  \"127.0.0.1:8090:us-east-1a_0\": [\"00000:S\"],"
+  "  \"127.0.0.1:8091:us-east-1a_1\": [\"00000:S\"],"
+  "  \"127.0.0.1:8092:us-east-1b_0\": [\"00000:M\"],"
+  "  \"127.0.0.1:8093:us-east-1b_1\": [\"00000:S\"]"
+  "   }"
+  "}";
+
+// "port[group_begin,group_end)" for each candidate
+std::string describeCandidates(const common::detail::RoutingTable& table,
+                               const common::detail::RoutingTable::Order order,
+                               const std::string& az) {
+  uint32_t az_slot;
+  if (!table.findAzSlot(az, &az_slot)) {
+    return "unknown az";
+  }
+  auto segment = table.findSegment("user_pins");
+  auto range = table.candidatesFor(*segment, 0, order, az_slot);
+  std::string result;
+  for (auto c = range.first; c != range.second; ++c) {
+    EXPECT_LT(c->index, table.numHosts());
+    result += std::to_string(c->host->addr.getPort()) + "[" +
+      std::to_string(c->group_begin) + "," + std::to_string(c->group_end) +
+      ") ";
+  }
+  return result;
+}
+
+TEST(ThriftRouterTest, RoutingTable) {
+  using common::detail::RoutingTable;
+  RoutingTable table(common::parseConfig(g_config_groups, "us-east-1a_0"));
+
+  EXPECT_EQ(table.numHosts(), 4);
+  EXPECT_TRUE(table.findSegment("unknown") == nullptr);
+  ASSERT_TRUE(table.findSegment("user_pins") != nullptr);
+  EXPECT_EQ(table.findSegment("user_pins")->num_shards, 1);
+
+  EXPECT_EQ(describeCandidates(table, RoutingTable::LOCAL_FIRST, ""),
+            "8090[0,1) 8091[1,2) 8092[2,4) 8093[2,4) ");
+  EXPECT_EQ(describeCandidates(table, RoutingTable::MASTER_FIRST, ""),
+            "8092[0,1) 8090[1,2) 8091[2,3) 8093[3,4) ");
+  EXPECT_EQ(describeCandidates(table, RoutingTable::MASTER_ONLY, ""),
+            "8092[0,1) ");
+  EXPECT_EQ(describeCandidates(table, RoutingTable::SLAVE_ONLY, ""),
+            "8090[0,1) 8091[1,2) 8093[2,3) ");
+  EXPECT_EQ(describeCandidates(table, RoutingTable::LOCAL_FIRST, "us-east-1b"),
+            "8092[0,2) 8093[0,2) ");
+  EXPECT_EQ(describeCandidates(table, RoutingTable::SLAVE_ONLY, "us-east-1b"),
+            "8093[0,1) ");
+  EXPECT_EQ(describeCandidates(table, RoutingTable::LOCAL_FIRST, "us-east-1f"),
+            "unknown az");
+
+  FLAGS_always_prefer_local_host = true;
+  EXPECT_EQ(RoutingTable::orderFor(common::detail::Role::ANY),
+            RoutingTable::LOCAL_FIRST);
+  FLAGS_always_prefer_local_host = false;
+  EXPECT_EQ(RoutingTable::orderFor(common::detail::Role::ANY),
+            RoutingTable::MASTER_FIRST);
+  EXPECT_EQ(RoutingTable::orderFor(common::detail::Role::SLAVE),
+            RoutingTable::SLAVE_ONLY);
+}
+
 int main(int argc, char** argv) {
   FLAGS_always_prefer_local_host = false;
   ::testing::InitGoogleTest(&argc, argv);
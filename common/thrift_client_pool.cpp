@@ -22,7 +22,14 @@ DEFINE_int32(channel_cleanup_min_interval_seconds, 10,
              "The minimum time between two channel cleanups");
 
 DEFINE_int32(channel_max_checking_size, 500,
-             "The maximum # of channels checked by one cleanup");
+             "Deprecated and unused. Cleanups now check every channel.");
+
+DEFINE_int32(channels_per_host, 1,
+             "The max # of channels to each host per IO thread. New clients "
+             "get the channel with the fewest live clients on it, which is "
+             "not the # of in-flight requests. Only helps callers that get a "
+             "client per request and release it on completion, not those "
+             "that reuse clients, e.g. ThriftRouter's cached ones.");
 
 DEFINE_int32(channel_send_timeout_ms, 0,
              "The send timeout for channels");
@@ -18,6 +18,7 @@
 
 #pragma once
 
+#include <algorithm>
 #include <atomic>
 #include <cstdint>
 #include <memory>
@@ -42,7 +43,7 @@
 
 DECLARE_int32(channel_cleanup_min_interval_seconds);
 
-DECLARE_int32(channel_max_checking_size);
+DECLARE_int32(channels_per_host);
 
 DECLARE_int32(channel_send_timeout_ms);
 
@@ -67,8 +68,13 @@ namespace common {
  * Users may get thrift client object from the pool, and use it to communicate
  * with remote services.
  * Internally each pool has (owns or shares with others) N IO threads and N
- * event bases. Each IO Thread drives one event base. A pool can have at most N
- * connections to a destination.
+ * event bases. Each IO Thread drives one event base. A pool can have at most
+ * N * FLAGS_channels_per_host good connections to a destination. New clients
+ * get the channel with the fewest live clients on it. The pool can't see the
+ * requests in flight on a channel, so this only spreads load for callers
+ * that get a client per request and release it once the request completes.
+ * Clients that are held and reused, such as the ones ThriftRouter caches per
+ * thread, stay on the channel they were created with.
  * IO threads will be used in a round-robin way for creating new client.
  *
  * If a shared_ptr to a folly::SSLContext is provided, the clientpool will make
@@ -151,11 +157,26 @@ class ThriftClientPool {
     // last time cleanup was done
     time_t last_cleanup_time_;
 
+    struct ChannelAndStatus {
+      std::weak_ptr<apache::thrift::HeaderClientChannel> channel;
+      // the close callback of channel, so it must outlive channel
+      std::unique_ptr<ClientStatusCallback> cb;
+    };
+
+    struct HostChannels {
+      HostChannels() : good(), retired(), last_create_time(0) {}
+
+      // up to FLAGS_channels_per_host channels, all good as of the last
+      // evictBadChannels()
+      std::vector<ChannelAndStatus> good;
+      // bad channels, closed and kept until released by all their clients
+      std::vector<ChannelAndStatus> retired;
+      // the last time a channel was created to the host
+      time_t last_create_time;
+    };
+
     // a map from destinations to channels
-    std::unordered_map<
-      folly::SocketAddress,
-      std::pair<std::weak_ptr<apache::thrift::HeaderClientChannel>,
-                std::unique_ptr<ClientStatusCallback>>> channels_;
+    std::unordered_map<folly::SocketAddress, HostChannels> channels_;
 
     static std::string ioThreadName() {
       const auto class_name = folly::demangle(typeid(T)).toStdString();
@@ -209,36 +230,84 @@ class ThriftClientPool {
       }
     }
 
+    // Move the bad channels of host out of host->good, and drop the ones no
+    // longer used by any client.
+    static void evictBadChannels(HostChannels* host) {
+      auto& good = host->good;
+      for (size_t i = 0; i < good.size();) {
+        auto channel = good[i].channel.lock();
+        if (channel && good[i].cb->is_good.load() &&
+            channel->getTransport()->good()) {
+          ++i;
+          continue;
+        }
+
+        if (channel) {
+          // close the connection to avoid accumulating CLOSE_WAIT
+          channel->closeNow();
+          host->retired.push_back(std::move(good[i]));
+        }
+
+        if (i + 1 != good.size()) {
+          good[i] = std::move(good.back());
+        }
+        good.pop_back();
+      }
+
+      auto& retired = host->retired;
+      retired.erase(
+        std::remove_if(retired.begin(), retired.end(),
+                       [] (const ChannelAndStatus& c) {
+                         return c.channel.expired();
+                       }),
+        retired.end());
+    }
+
+    // Up to FLAGS_channels_per_host channels are kept to each addr. A client
+    // is handed the good channel with the fewest live clients on it, and a
+    // new channel is added while all of them have clients and there is room
+    // for one more. Live clients stand in for in-flight requests, which
+    // fbthrift doesn't expose per channel.
+    //
     // If aggressively is set to true, a new channel will be created
     // immediately if there is no existing good channel for the addr
     //
-    // a nullptr or bad channel can be returned if it's too soon to create a new
-    // channel and aggressively is set to false
+    // a nullptr can be returned if it's too soon to create a new channel and
+    // aggressively is set to false
     std::shared_ptr<apache::thrift::HeaderClientChannel>
     getChannelFor(const folly::SocketAddress& addr,
                   const uint32_t connect_timeout_ms,
                   const std::atomic<bool>** is_good,
                   const bool aggressively,
                   const std::shared_ptr<folly::SSLContext>& ssl_ctx) {
+      auto& host = channels_[addr];
+      evictBadChannels(&host);
+
       std::shared_ptr<apache::thrift::HeaderClientChannel> channel;
-      auto itor = channels_.find(addr);
-      bool should_new_channel = false;
+      ChannelAndStatus* least_loaded = nullptr;
+      long least_load = 0;
+      for (auto& c : host.good) {
+        auto candidate = c.channel.lock();
+        // every client of candidate holds a reference, and so do we
+        const long load = candidate.use_count() - 1;
+        if (least_loaded == nullptr || load < least_load) {
+          channel = std::move(candidate);
+          least_loaded = &c;
+          least_load = load;
+        }
+      }
 
-      if (itor == channels_.end()) {
-        // no such channel yet
-        should_new_channel = true;
-      } else {
-        channel = itor->second.first.lock();
-        const bool channel_good = (channel && channel->getTransport()->good());
+      const size_t max_channels = std::max(FLAGS_channels_per_host, 1);
+      bool should_new_channel = false;
+      if (least_loaded == nullptr) {
+        // no good channel. we only want to create a new one if it's not too
+        // soon to create a new one or we want to be aggressive
         const bool too_soon =
-          (itor->second.second->create_time +
-           FLAGS_min_channel_create_interval_seconds > time(nullptr));
-        // we only want to create a new channel if the current channel is not
-        // good for use and it's not too soon to create a new one or we want to
-        // be aggressive
-        if (!channel_good && (!too_soon || aggressively)) {
-          should_new_channel = true;
-        }
+          (host.last_create_time + FLAGS_min_channel_create_interval_seconds >
+           time(nullptr));
+        should_new_channel = !too_soon || aggressively;
+      } else if (least_load > 0 && host.good.size() < max_channels) {
+        should_new_channel = true;
       }
 
       if (should_new_channel) {
@@ -293,44 +362,38 @@ class ThriftClientPool {
           *is_good = &cb->is_good;
         }
         channel->setCloseCallback(cb.get());
-        channels_[addr] =
-          std::pair<std::weak_ptr<apache::thrift::HeaderClientChannel>,
-                    std::unique_ptr<ClientStatusCallback>>(
-            channel, std::move(cb));
-      } else {
+        host.good.push_back(ChannelAndStatus{channel, std::move(cb)});
+        host.last_create_time = time(nullptr);
+      } else if (least_loaded != nullptr) {
         if (is_good) {
-          *is_good = &(itor->second.second->is_good);
+          *is_good = &least_loaded->cb->is_good;
         }
       }
 
       return channel;
     }
 
-    void cleanupStaleChannels(const folly::SocketAddress& addr) {
+    // Evict bad channels to all hosts, and forget hosts without channels.
+    // The channels to the requested host are taken care of by
+    // getChannelFor(), so this only needs to run once in a while.
+    void cleanupStaleChannels() {
       auto now = time(nullptr);
       // skip cleanup if it was done recently
       if (now < last_cleanup_time_ + FLAGS_channel_cleanup_min_interval_seconds) {
-	return;
+        return;
       }
 
       last_cleanup_time_ = now;
-      auto itor = channels_.find(addr);
-      int n = 0;
-      while (itor != channels_.end() &&
-	     n++ < FLAGS_channel_max_checking_size) {
-	auto c = itor->second.first.lock();
-	// the channel has been released
-	if (!c) {
-	  itor = channels_.erase(itor);
-	  continue;
-	}
-
-	// the channel is bad
-	if (!itor->second.second->is_good.load()) {
-	  c->closeNow(); // close the connection to avoid accumulating CLOSE_WAIT
-	}
-
-	++itor;
+      for (auto itor = channels_.begin(); itor != channels_.end();) {
+        auto& host = itor->second;
+        evictBadChannels(&host);
+        // keep last_create_time around while it still throttles creation
+        if (host.good.empty() && host.retired.empty() &&
+            host.last_create_time + FLAGS_min_channel_create_interval_seconds <= now) {
+          itor = channels_.erase(itor);
+        } else {
+          ++itor;
+        }
       }
     }
 
@@ -435,7 +498,7 @@ class ThriftClientPool {
           auto channel = event_loop.getChannelFor(addr, connect_timeout_ms,
                                                   is_good, aggressively, std::move(ssl_ctx));
 
-          event_loop.cleanupStaleChannels(addr);
+          event_loop.cleanupStaleChannels();
 
           // The underlying folly::AsyncSocket has to be created/released on the
           // same IO thread to avoid race condition on its internal states. So
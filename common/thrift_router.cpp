@@ -19,11 +19,26 @@
 #include "common/thrift_router.h"
 
 #include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <map>
+#include <memory>
 #include <string>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 #include "common/jsoncpp/include/json/json.h"
 
+namespace {
+
+const std::string kHedges = "thrift_router_hedges";
+const std::string kHedgesOverBudget = "thrift_router_hedges_over_budget";
+
+// Latencies above this are recorded as this
+const int64_t kMaxLatencyUs = 60 * 1000 * 1000;
+
+}  // namespace
+
 DEFINE_bool(always_prefer_local_host, true,
             "Always prefer local host when ordering hosts");
 DEFINE_int32(min_client_reconnect_interval_seconds, 5,
@@ -35,6 +50,23 @@ DEFINE_int32(thrift_router_max_num_hosts_to_consider, -1, "Maximum number of "
 
 DEFINE_int32(thrift_router_log_frequency, 100, "Log frequency");
 
+DEFINE_bool(thrift_router_latency_aware, false, "Route to the less loaded of "
+            "two of the most preferred hosts, judged by the latency and "
+            "outstanding requests observed on calls made through call() and "
+            "hedgedCall().");
+DEFINE_int32(thrift_router_latency_ewma_tau_ms, 1000,
+             "Time constant of the per host latency moving average.");
+
+DEFINE_int32(thrift_router_hedge_budget_percent, 5, "Max percentage of "
+             "hedgedCall() calls to a segment that may be hedged. 0 disables "
+             "hedging.");
+DEFINE_double(thrift_router_hedge_percentile, 95,
+              "The latency percentile of a segment to hedge calls after.");
+DEFINE_int32(thrift_router_hedge_default_delay_ms, 50, "The hedge delay of a "
+             "segment until enough of its latencies have been observed.");
+DEFINE_int32(thrift_router_hedge_window_ms, 10 * 1000,
+             "The window to compute the hedge delay percentile over.");
+
 namespace {
 
 bool parseHost(const std::string& str, common::detail::Host* host,
@@ -88,6 +120,219 @@ bool parseShard(const std::string& str, common::detail::Role* role,
 
 namespace common {
 
+namespace detail {
+
+void HostLoad::finish(const uint64_t latency_us) {
+  outstanding_.fetch_sub(1, std::memory_order_relaxed);
+
+  const auto now = nowUs();
+  const auto last = last_sample_us_.exchange(now, std::memory_order_relaxed);
+  const uint64_t tau_us =
+    static_cast<uint64_t>(std::max(FLAGS_thrift_router_latency_ewma_tau_ms, 1)) * 1000;
+  if (last == 0 || now - last > kStaleTaus * tau_us) {
+    ewma_latency_us_.store(latency_us, std::memory_order_relaxed);
+    return;
+  }
+
+  const double weight = 1 - std::exp(-static_cast<double>(now - last) / tau_us);
+  auto old_value = ewma_latency_us_.load(std::memory_order_relaxed);
+  uint64_t new_value;
+  do {
+    new_value = old_value + weight *
+      (static_cast<double>(latency_us) - static_cast<double>(old_value));
+  } while (!ewma_latency_us_.compare_exchange_weak(
+             old_value, new_value, std::memory_order_relaxed));
+}
+
+uint64_t HostLoad::latencyUs() const {
+  const auto last = last_sample_us_.load(std::memory_order_relaxed);
+  const uint64_t tau_us =
+    static_cast<uint64_t>(std::max(FLAGS_thrift_router_latency_ewma_tau_ms, 1)) * 1000;
+  if (last == 0 || nowUs() - last > kStaleTaus * tau_us) {
+    return 0;
+  }
+
+  return ewma_latency_us_.load(std::memory_order_relaxed);
+}
+
+uint64_t HostLoad::nowUs() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+const int64_t SegmentHedger::kUnitsPerHedge;
+const int64_t SegmentHedger::kMaxBurstHedges;
+const uint64_t SegmentHedger::kMinSamples;
+
+SegmentHedger::SegmentHedger(const std::string& segment)
+    : window_(2, kMaxLatencyUs)
+    , window_start_us_(HostLoad::nowUs())
+    , delay_us_(0)
+    , rotate_mutex_()
+    , last_window_(2, kMaxLatencyUs)
+    , budget_(0)
+    , hedges_(Stats::get()->GetCounterHandle(kHedges,
+                                             {{"segment", segment}}))
+    , hedges_over_budget_(Stats::get()->GetCounterHandle(
+        kHedgesOverBudget, {{"segment", segment}})) {}
+
+folly::Duration SegmentHedger::onCall() {
+  const auto percent = FLAGS_thrift_router_hedge_budget_percent;
+  const auto max_budget = kMaxBurstHedges * kUnitsPerHedge;
+  if (percent > 0 && budget_.load(std::memory_order_relaxed) < max_budget) {
+    // may overshoot max_budget a little under races, which is fine
+    budget_.fetch_add(std::min<int64_t>(percent, kUnitsPerHedge),
+                      std::memory_order_relaxed);
+  }
+
+  maybeRotateWindow(HostLoad::nowUs());
+
+  auto delay_us = delay_us_.load(std::memory_order_relaxed);
+  if (delay_us == 0) {
+    delay_us = std::max(FLAGS_thrift_router_hedge_default_delay_ms, 0) * 1000;
+  }
+
+  // round up to the resolution of folly::Duration
+  return folly::Duration((delay_us + 999) / 1000);
+}
+
+bool SegmentHedger::tryHedge() {
+  auto budget = budget_.load(std::memory_order_relaxed);
+  do {
+    if (budget < kUnitsPerHedge) {
+      Stats::get()->Incr(hedges_over_budget_);
+      return false;
+    }
+  } while (!budget_.compare_exchange_weak(budget, budget - kUnitsPerHedge,
+                                          std::memory_order_relaxed));
+
+  Stats::get()->Incr(hedges_);
+  return true;
+}
+
+void SegmentHedger::maybeRotateWindow(const uint64_t now_us) {
+  const uint64_t window_us =
+    static_cast<uint64_t>(std::max(FLAGS_thrift_router_hedge_window_ms, 1)) * 1000;
+  if (now_us < window_start_us_.load(std::memory_order_relaxed) + window_us) {
+    return;
+  }
+
+  std::unique_lock<std::mutex> lock(rotate_mutex_, std::try_to_lock);
+  if (!lock.owns_lock() ||
+      now_us < window_start_us_.load(std::memory_order_relaxed) + window_us) {
+    // somebody else is rotating, or has just rotated
+    return;
+  }
+
+  // a window too quiet to tell is extended until it has enough samples
+  if (window_.count() < kMinSamples) {
+    return;
+  }
+
+  last_window_.clear();
+  last_window_.drainFrom(&window_);
+  delay_us_.store(last_window_.percentile(FLAGS_thrift_router_hedge_percentile),
+                  std::memory_order_relaxed);
+  window_start_us_.store(now_us, std::memory_order_relaxed);
+}
+
+RoutingTable::RoutingTable(std::shared_ptr<const ClusterLayout> layout,
+                           const RoutingTable* previous)
+    : layout_(std::move(layout))
+    , host_loads_()
+    , az_slots_()
+    , num_az_slots_(1)
+    , segments_() {
+  std::map<folly::SocketAddress, std::shared_ptr<HostLoad>> previous_loads;
+  if (previous != nullptr) {
+    uint32_t index = 0;
+    for (const auto& host : previous->layout_->all_hosts) {
+      previous_loads.emplace(host.addr, previous->host_loads_[index++]);
+    }
+  }
+
+  std::unordered_map<const Host*, uint32_t> host_indexes;
+  std::vector<std::string> azs(1);
+  host_loads_.reserve(layout_->all_hosts.size());
+  for (const auto& host : layout_->all_hosts) {
+    host_indexes.emplace(&host, host_indexes.size());
+    auto itor = previous_loads.find(host.addr);
+    host_loads_.push_back(itor != previous_loads.end() ?
+                          itor->second : std::make_shared<HostLoad>());
+    if (!host.az.empty() && az_slots_.emplace(host.az, azs.size()).second) {
+      azs.push_back(host.az);
+    }
+  }
+  num_az_slots_ = azs.size();
+
+  // (role rank, negated group prefix length), smaller is preferred
+  using Key = std::pair<int, int>;
+  std::vector<std::pair<Key, Candidate>> sorted;
+  for (const auto& name_info : layout_->segments) {
+    const auto& segment_name = name_info.first;
+    const auto& shard_to_hosts = name_info.second.shard_to_hosts;
+    auto& segment = segments_[segment_name];
+    segment.num_shards = shard_to_hosts.size();
+    segment.offsets.reserve(
+      segment.num_shards * kNumOrders * num_az_slots_ + 1);
+    segment.offsets.push_back(0);
+
+    for (const auto& host_info : shard_to_hosts) {
+      for (int order = 0; order < kNumOrders; ++order) {
+        for (uint32_t az_slot = 0; az_slot < num_az_slots_; ++az_slot) {
+          sorted.clear();
+          for (const auto& hi : host_info) {
+            const auto host = hi.first;
+            const auto role = hi.second;
+            if (az_slot != 0 && host->az != azs[az_slot]) {
+              continue;
+            }
+            if ((order == MASTER_ONLY && role != Role::MASTER) ||
+                (order == SLAVE_ONLY && role != Role::SLAVE)) {
+              continue;
+            }
+
+            const int role_rank =
+              (order == MASTER_FIRST && role != Role::MASTER) ? 1 : 0;
+            const int prefix_length = host->groups_prefix_lengths.at(segment_name);
+            sorted.emplace_back(Key(role_rank, -prefix_length),
+                                Candidate{host, host_indexes.at(host), 0, 0});
+          }
+
+          std::stable_sort(sorted.begin(), sorted.end(),
+                           [] (const std::pair<Key, Candidate>& a,
+                               const std::pair<Key, Candidate>& b) {
+                             return a.first < b.first;
+                           });
+
+          const uint32_t base = segment.candidates.size();
+          uint32_t group_begin = 0;
+          for (uint32_t i = 0; i < sorted.size(); ++i) {
+            if (i > 0 && sorted[i].first != sorted[i - 1].first) {
+              group_begin = i;
+            }
+            segment.candidates.push_back(sorted[i].second);
+            segment.candidates.back().group_begin = group_begin;
+          }
+
+          // group_end is only known once the whole group has been seen
+          uint32_t group_end = sorted.size();
+          for (uint32_t i = sorted.size(); i-- > 0;) {
+            if (i + 1 < sorted.size() && sorted[i].first != sorted[i + 1].first) {
+              group_end = i + 1;
+            }
+            segment.candidates[base + i].group_end = group_end;
+          }
+
+          segment.offsets.push_back(segment.candidates.size());
+        }
+      }
+    }
+  }
+}
+
+}  // namespace detail
+
 std::unique_ptr<const detail::ClusterLayout> parseConfig(
     const std::string& content, const std::string& local_group) {
   auto cl = std::make_unique<detail::ClusterLayout>();
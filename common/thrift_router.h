@@ -19,19 +19,25 @@
 #pragma once
 
 #include <algorithm>
+#include <atomic>
 #include <functional>
+#include <limits>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <set>
+#include <stdexcept>
 #include <string>
 #include <vector>
 #include <unordered_map>
 #include <utility>
 
 #include "common/file_watcher.h"
+#include "common/future_util.h"
 #include "common/network_util.h"
+#include "common/stats/hdr_histogram.h"
+#include "common/stats/stats.h"
 #include "common/thrift_client_pool.h"
-#include "folly/Hash.h"
 #include "folly/SocketAddress.h"
 #include "folly/ThreadLocal.h"
 
@@ -40,6 +46,12 @@ DECLARE_int32(min_client_reconnect_interval_seconds);
 DECLARE_int64(client_connect_timeout_millis);
 DECLARE_int32(thrift_router_max_num_hosts_to_consider);
 DECLARE_int32(thrift_router_log_frequency);
+DECLARE_bool(thrift_router_latency_aware);
+DECLARE_int32(thrift_router_latency_ewma_tau_ms);
+DECLARE_int32(thrift_router_hedge_budget_percent);
+DECLARE_int32(thrift_router_hedge_default_delay_ms);
+DECLARE_double(thrift_router_hedge_percentile);
+DECLARE_int32(thrift_router_hedge_window_ms);
 
 namespace common {
 
@@ -75,6 +87,233 @@ struct ClusterLayout {
   std::set<Host> all_hosts;
 };
 
+/*
+ * HostLoad tracks the load of a host as observed on the RPCs ThriftRouter
+ * makes to it: the requests outstanding, and an exponentially weighted moving
+ * average of how long they took to complete. The average decays with time
+ * constant FLAGS_thrift_router_latency_ewma_tau_ms, and is forgotten when no
+ * sample arrives for kStaleTaus time constants, so that a host which was
+ * avoided for being slow gets probed again.
+ *
+ * All interfaces are thread safe. Concurrent samples may race on the average,
+ * which is fine for an estimate.
+ */
+class HostLoad {
+ public:
+  HostLoad()
+    : ewma_latency_us_(0)
+    , last_sample_us_(0)
+    , outstanding_(0) {}
+
+  // A request to the host started
+  void start() {
+    outstanding_.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  // A request started by start() finished after latency_us
+  void finish(const uint64_t latency_us);
+
+  // The latency estimate, 0 if there is no recent sample
+  uint64_t latencyUs() const;
+
+  uint32_t outstanding() const {
+    return outstanding_.load(std::memory_order_relaxed);
+  }
+
+  // Lower is better. Hosts without a latency estimate are ranked on
+  // outstanding requests only.
+  uint64_t cost() const {
+    return (latencyUs() + 1) * (outstanding() + 1);
+  }
+
+  static uint64_t nowUs();
+
+  // no copy or move
+  HostLoad(const HostLoad&) = delete;
+  HostLoad& operator=(const HostLoad&) = delete;
+
+ private:
+  static const int kStaleTaus = 10;
+
+  std::atomic<uint64_t> ewma_latency_us_;
+  std::atomic<uint64_t> last_sample_us_;
+  std::atomic<uint32_t> outstanding_;
+};
+
+/*
+ * SegmentHedger decides when and whether ThriftRouter::hedgedCall() hedges a
+ * call to its segment.
+ *
+ * The hedge delay is the FLAGS_thrift_router_hedge_percentile latency
+ * observed over the last window of FLAGS_thrift_router_hedge_window_ms. It is
+ * FLAGS_thrift_router_hedge_default_delay_ms until a window has collected
+ * enough samples.
+ *
+ * Hedges are paid for from a budget, which every call tops up by
+ * FLAGS_thrift_router_hedge_budget_percent of a hedge, so hedges never exceed
+ * that percentage of calls by more than a small burst.
+ *
+ * All interfaces are thread safe.
+ */
+class SegmentHedger {
+ public:
+  explicit SegmentHedger(const std::string& segment);
+
+  // Account for a new call, and return the delay before hedging it.
+  folly::Duration onCall();
+
+  // Take a hedge out of the budget. Return false if the budget is exhausted.
+  bool tryHedge();
+
+  // A request to the segment succeeded after latency_us
+  void recordLatency(const uint64_t latency_us) {
+    window_.record(latency_us);
+  }
+
+  // no copy or move
+  SegmentHedger(const SegmentHedger&) = delete;
+  SegmentHedger& operator=(const SegmentHedger&) = delete;
+
+ private:
+  // budget units per hedge, so that each call adds one unit per percent
+  static const int64_t kUnitsPerHedge = 100;
+  // how many hedges the budget can save up
+  static const int64_t kMaxBurstHedges = 10;
+  // samples needed before a window sets the delay
+  static const uint64_t kMinSamples = 100;
+
+  // Start a new window if the current one is over
+  void maybeRotateWindow(const uint64_t now_us);
+
+  HdrHistogram window_;
+  std::atomic<uint64_t> window_start_us_;
+  // 0 until the first window with enough samples
+  std::atomic<uint64_t> delay_us_;
+  // serializes window rotations, and protects last_window_
+  std::mutex rotate_mutex_;
+  HdrHistogram last_window_;
+
+  std::atomic<int64_t> budget_;
+  const Stats::Handle hedges_;
+  const Stats::Handle hedges_over_budget_;
+};
+
+/*
+ * RoutingTable is the lookup side of a ClusterLayout. It is built once per
+ * layout version, off the request path, and holds for every (segment, shard,
+ * order, az) a flat array of candidate hosts already sorted in preference
+ * order. Hosts which tie on the sorting criteria form a group, and lookups
+ * rotate each group to spread load among them.
+ *
+ * Hosts are numbered densely from 0 to numHosts() - 1, so that per thread
+ * client state can be kept in a vector indexed by Candidate::index. The
+ * HostLoad of each host is shared by all threads, and carried over from the
+ * previous table for hosts that are in both.
+ */
+class RoutingTable {
+ public:
+  // How the candidates of a shard are filtered and sorted.
+  enum Order {
+    // masters only, prefer local to non-local
+    MASTER_ONLY = 0,
+    // slaves only, prefer local to non-local
+    SLAVE_ONLY,
+    // all hosts, prefer local to non-local
+    LOCAL_FIRST,
+    // all hosts, prefer master to slave, then local to non-local
+    MASTER_FIRST,
+    kNumOrders
+  };
+
+  struct Candidate {
+    const Host* host;
+    // dense index of host among all hosts of the layout
+    uint32_t index;
+    // candidates [group_begin, group_end) of the same array tie with this one
+    uint32_t group_begin;
+    uint32_t group_end;
+  };
+
+  struct Segment {
+    uint32_t num_shards;
+    // candidates for slot i are [offsets[i], offsets[i + 1]) of candidates,
+    // where i = (shard * kNumOrders + order) * num az slots + az slot
+    std::vector<uint32_t> offsets;
+    std::vector<Candidate> candidates;
+  };
+
+  explicit RoutingTable(std::shared_ptr<const ClusterLayout> layout,
+                        const RoutingTable* previous = nullptr);
+
+  const std::shared_ptr<const ClusterLayout>& layout() const {
+    return layout_;
+  }
+
+  uint32_t numHosts() const {
+    return layout_->all_hosts.size();
+  }
+
+  const std::shared_ptr<HostLoad>& hostLoad(const uint32_t index) const {
+    return host_loads_[index];
+  }
+
+  // The routes for segment, or nullptr if it is not in the layout
+  const Segment* findSegment(const std::string& segment) const {
+    auto itor = segments_.find(segment);
+    return itor == segments_.end() ? nullptr : &itor->second;
+  }
+
+  // Slot 0 holds hosts of all AZs. Return false if no host is in az.
+  bool findAzSlot(const std::string& az, uint32_t* slot) const {
+    if (az.empty()) {
+      *slot = 0;
+      return true;
+    }
+
+    auto itor = az_slots_.find(az);
+    if (itor == az_slots_.end()) {
+      return false;
+    }
+
+    *slot = itor->second;
+    return true;
+  }
+
+  // The order to serve role with, honoring FLAGS_always_prefer_local_host
+  static Order orderFor(const Role role) {
+    switch (role) {
+    case Role::MASTER:
+      return MASTER_ONLY;
+    case Role::SLAVE:
+      return SLAVE_ONLY;
+    default:
+      return FLAGS_always_prefer_local_host ? LOCAL_FIRST : MASTER_FIRST;
+    }
+  }
+
+  // Sorted candidates of shard. shard must be less than segment.num_shards.
+  std::pair<const Candidate*, const Candidate*> candidatesFor(
+      const Segment& segment, const ShardID shard, const Order order,
+      const uint32_t az_slot) const {
+    const auto i = (shard * kNumOrders + order) * num_az_slots_ + az_slot;
+    const auto data = segment.candidates.data();
+    return std::make_pair(data + segment.offsets[i],
+                          data + segment.offsets[i + 1]);
+  }
+
+  // no copy or move
+  RoutingTable(const RoutingTable&) = delete;
+  RoutingTable& operator=(const RoutingTable&) = delete;
+
+ private:
+  const std::shared_ptr<const ClusterLayout> layout_;
+  // indexed by Candidate::index
+  std::vector<std::shared_ptr<HostLoad>> host_loads_;
+  std::unordered_map<std::string, uint32_t> az_slots_;
+  uint32_t num_az_slots_;
+  std::unordered_map<SegmentName, Segment> segments_;
+};
+
 }  // namespace detail
 
 /*
@@ -109,8 +348,12 @@ class ThriftRouter {
       std::shared_ptr<ThriftClientPool<ClientType, USE_BINARY_PROTOCOL>> client_pool = nullptr)
       : config_path_(config_path)
       , parser_(std::move(parser))
-      , cluster_layout_()
-      , local_client_map_(std::move(client_pool)) {
+      , routing_table_()
+      , routing_table_version_(0)
+      , local_client_map_(std::move(client_pool))
+      , hedgers_mutex_()
+      , hedgers_()
+      , local_hedgers_() {
     CHECK(common::FileWatcher::Instance()->AddFile(
       config_path_,
       [this, local_group] (std::string content) {
@@ -118,7 +361,11 @@ class ThriftRouter {
           parser_(content, local_group));
 
         if (new_layout) {
-          std::atomic_store_explicit(&cluster_layout_, new_layout, std::memory_order_release);
+          auto table = std::make_shared<const detail::RoutingTable>(
+            std::move(new_layout), getRoutingTable().get());
+          std::atomic_store_explicit(&routing_table_, std::move(table),
+                                     std::memory_order_release);
+          routing_table_version_.fetch_add(1, std::memory_order_release);
         } else {
           LOG(ERROR) << "Failed to parse the config: " << content;
         }
@@ -162,7 +409,12 @@ class ThriftRouter {
    *                    specific_az, only clients in that specific_az will be returned.
    *
    *                    If two hosts equal according to the sorting criteria, we
-   *                    randomly order them
+   *                    rotate their order from call to call.
+   *
+   *                    With FLAGS_thrift_router_latency_aware, the first two
+   *                    of the most preferred hosts are compared on their
+   *                    HostLoad and the less loaded goes first. Load is only
+   *                    measured on RPCs made through call() and hedgedCall().
    */
   ReturnCode getClientsFor(const std::string& segment,
                            const Role role,
@@ -170,12 +422,9 @@ class ThriftRouter {
                            const ShardID shard,
                            std::vector<std::shared_ptr<ClientType>>* clients,
                            const std::string& specific_az = "") {
-    std::map<ShardID, std::vector<std::shared_ptr<ClientType>>>
-      shard_to_clients;
-    shard_to_clients[shard];
-    auto ret = getClientsFor(segment, role, quantity, &shard_to_clients, specific_az);
-    *clients = std::move(shard_to_clients[shard]);
-    return ret;
+    updateRoutingTable();
+    return local_client_map_.getClientsFor(segment, role, quantity, shard,
+                                           clients, specific_az);
   }
 
   /*
@@ -197,11 +446,111 @@ class ThriftRouter {
       std::map<ShardID, std::vector<std::shared_ptr<ClientType>>>*
         shard_to_clients,
       const std::string& specific_az = "") {
-    updateClusterLayout();
+    updateRoutingTable();
     return local_client_map_.getClientsFor(segment, role, quantity,
                                            shard_to_clients, specific_az);
   }
 
+  /*
+   * Call rpc on the best replica of shard, and count it towards the load of
+   * the replica's host until it completes. Prefer it to getClientsFor() for
+   * single replica calls when FLAGS_thrift_router_latency_aware is on, as
+   * RPCs made on clients from getClientsFor() are not measured.
+   *
+   * @param rpc     Callable taking a std::shared_ptr<ClientType>, and
+   *                returning a folly::Future of the RPC. It is called at most
+   *                once, before call() returns.
+   * @param future  The out parameter for the future of the call, only set if
+   *                OK is returned.
+   *
+   * @return the same as getClientsFor() with Quantity::ONE
+   */
+  template <typename F, typename FutureType>
+  ReturnCode call(const std::string& segment,
+                  const Role role,
+                  const ShardID shard,
+                  F&& rpc,
+                  FutureType* future,
+                  const std::string& specific_az = "") {
+    updateRoutingTable();
+    std::vector<std::shared_ptr<ClientType>> clients;
+    std::vector<std::shared_ptr<detail::HostLoad>> loads;
+    const auto ret = local_client_map_.getClientsFor(
+      segment, role, Quantity::ONE, shard, &clients, specific_az, &loads);
+    if (ret != ReturnCode::OK) {
+      return ret;
+    }
+
+    *future = timedCall(rpc, std::move(clients[0]), std::move(loads[0]),
+                        nullptr);
+    return ReturnCode::OK;
+  }
+
+  /*
+   * Call rpc on the best replica of shard, and hedge it on the next best
+   * replica if it hasn't succeeded after the segment's observed p95 latency
+   * (see SegmentHedger), or as soon as it fails. The first success is
+   * returned and the other attempt is cancelled. If neither succeeds, the
+   * exception from the first attempt is returned.
+   *
+   * Cancelling only raises a folly interrupt on the losing future. The
+   * future_*() methods generated by fbthrift install no interrupt handler,
+   * so the losing RPC still runs to completion and occupies its server. Its
+   * result is dropped.
+   *
+   * Hedges are limited to FLAGS_thrift_router_hedge_budget_percent of the
+   * calls to each segment, and disabled if it is 0. Meant for idempotent
+   * calls such as reads.
+   *
+   * @param rpc  Callable taking a std::shared_ptr<ClientType>, and returning
+   *             a folly::Future of the RPC. It is called at most twice.
+   *
+   * @return a future failed with std::runtime_error if no good replica is
+   *         found, otherwise the future of the call.
+   */
+  template <typename F>
+  auto hedgedCall(const std::string& segment,
+                  const ShardID shard,
+                  F&& rpc,
+                  const Role role = Role::ANY,
+                  const std::string& specific_az = "")
+      -> decltype(rpc(std::shared_ptr<ClientType>())) {
+    using FutureType = decltype(rpc(std::shared_ptr<ClientType>()));
+    using T = typename FutureType::value_type;
+
+    updateRoutingTable();
+    std::vector<std::shared_ptr<ClientType>> clients;
+    std::vector<std::shared_ptr<detail::HostLoad>> loads;
+    const auto ret = local_client_map_.getClientsFor(
+      segment, role, Quantity::TWO, shard, &clients, specific_az, &loads);
+    if (ret != ReturnCode::OK) {
+      return folly::makeFuture<T>(std::runtime_error(
+        "No client for shard " + std::to_string(shard) + " of " + segment +
+        ", return code " + std::to_string(ret)));
+    }
+
+    auto hedger = getSegmentHedger(segment);
+    const auto delay = hedger->onCall();
+    auto primary = timedCall(rpc, std::move(clients[0]), std::move(loads[0]),
+                             hedger);
+    if (clients.size() < 2 || FLAGS_thrift_router_hedge_budget_percent <= 0) {
+      return primary;
+    }
+
+    return GetSpeculativeFuture(
+      std::move(primary),
+      [rpc = std::forward<F>(rpc), client = std::move(clients[1]),
+       load = std::move(loads[1]), hedger] () mutable -> FutureType {
+        if (!hedger->tryHedge()) {
+          return folly::makeFuture<T>(
+            std::runtime_error("Hedge budget exhausted"));
+        }
+        return timedCall(rpc, std::move(client), std::move(load), hedger);
+      },
+      delay,
+      true /* cancel_loser */);
+  }
+
   uint32_t getShardNumberFor(const std::string& segment) {
     const auto layout = getClusterLayout();
 
@@ -247,12 +596,71 @@ class ThriftRouter {
   ThriftRouter& operator=(const ThriftRouter&) = delete;
 
  private:
+  using RoutingTable = detail::RoutingTable;
+  using Candidate = RoutingTable::Candidate;
+
+  // Call rpc on client, count it towards load until it completes, and feed
+  // its latency to hedger, if any, if it succeeds. The client is held until
+  // the call completes. An exception thrown by rpc is returned as a failed
+  // future, so that load is still finished and hedgedCall() may hedge it.
+  template <typename F>
+  static auto timedCall(F& rpc,
+                        std::shared_ptr<ClientType> client,
+                        std::shared_ptr<detail::HostLoad> load,
+                        std::shared_ptr<detail::SegmentHedger> hedger)
+      -> decltype(rpc(client)) {
+    using T = typename decltype(rpc(client))::value_type;
+    const auto start_us = detail::HostLoad::nowUs();
+    load->start();
+    auto future = folly::makeFutureWith([&rpc, &client] {
+        return rpc(client);
+      });
+    return std::move(future).then(
+      [client = std::move(client), load = std::move(load),
+       hedger = std::move(hedger), start_us] (folly::Try<T>&& t) {
+        const auto latency_us = detail::HostLoad::nowUs() - start_us;
+        load->finish(latency_us);
+        if (hedger && t.hasValue()) {
+          hedger->recordLatency(latency_us);
+        }
+        return folly::makeFuture<T>(std::move(t));
+      });
+  }
+
+  std::shared_ptr<detail::SegmentHedger> getSegmentHedger(
+      const std::string& segment) {
+    auto& local_hedgers = *local_hedgers_;
+    auto itor = local_hedgers.find(segment);
+    if (itor != local_hedgers.end()) {
+      return itor->second;
+    }
+
+    std::lock_guard<std::mutex> g(hedgers_mutex_);
+    auto& hedger = hedgers_[segment];
+    if (hedger == nullptr) {
+      hedger = std::make_shared<detail::SegmentHedger>(segment);
+    }
+    local_hedgers.emplace(segment, hedger);
+    return hedger;
+  }
+
   std::shared_ptr<const ClusterLayout> getClusterLayout() {
-    return std::atomic_load_explicit(&cluster_layout_, std::memory_order_acquire);
+    const auto table = getRoutingTable();
+    return table ? table->layout() : nullptr;
+  }
+
+  std::shared_ptr<const RoutingTable> getRoutingTable() {
+    return std::atomic_load_explicit(&routing_table_, std::memory_order_acquire);
   }
 
-  void updateClusterLayout() {
-    local_client_map_.updateClusterLayout(getClusterLayout());
+  void updateRoutingTable() {
+    // Only touch the shared_ptr when the table has changed since this thread
+    // last looked. The version is read first, so a table published after it
+    // is at worst loaded once more on the next call.
+    const auto version = routing_table_version_.load(std::memory_order_acquire);
+    if (local_client_map_.routingTableVersion() != version) {
+      local_client_map_.updateRoutingTable(version, getRoutingTable());
+    }
   }
 
   class ThreadLocalClientMap {
@@ -265,7 +673,41 @@ class ThriftRouter {
         client_pool_ =
           std::make_shared<ThriftClientPool<ClientType, USE_BINARY_PROTOCOL>>();
       }
-      *local_cluster_layout_ = std::make_shared<const ClusterLayout>();
+    }
+
+    ReturnCode getClientsFor(
+        const std::string& segment,
+        const Role role,
+        const Quantity quantity,
+        const ShardID shard,
+        std::vector<std::shared_ptr<ClientType>>* clients,
+        const std::string& specific_az,
+        std::vector<std::shared_ptr<detail::HostLoad>>* loads = nullptr) {
+      auto& local = *local_;
+      const RoutingTable::Segment* routes;
+      uint32_t az_slot;
+      auto ret = findRoutes(local, segment, specific_az, &routes, &az_slot);
+      if (ret != ReturnCode::OK) {
+        clients->clear();
+        return ret;
+      }
+
+      if (shard >= routes->num_shards) {
+        LOG(ERROR) << "Unknown shard: " << shard;
+        clients->clear();
+        return ReturnCode::UNKNOWN_SHARD;
+      }
+
+      const auto rotation = local.rotation_counter++;
+      if (az_slot == kUnknownAzSlot) {
+        clients->clear();
+        LOG_EVERY_N(ERROR, FLAGS_thrift_router_log_frequency)
+          << "Could not find hosts for shard " << shard;
+        return ReturnCode::NOT_FOUND;
+      }
+
+      return fillClientsFor(&local, *routes, shard, RoutingTable::orderFor(role),
+                            az_slot, quantity, rotation, clients, loads);
     }
 
     ReturnCode getClientsFor(
@@ -274,195 +716,243 @@ class ThriftRouter {
         const Quantity quantity,
         std::map<ShardID, std::vector<std::shared_ptr<ClientType>>>*
           shard_to_clients,
-        const std::string& specific_az = "") {
-      auto& segments = (*local_cluster_layout_)->segments;
-      auto itor = segments.find(segment);
-      if (itor == segments.end()) {
-        LOG(ERROR) << "Unknown segment: " << segment;
-        return ReturnCode::UNKNOWN_SEGMENT;
+        const std::string& specific_az) {
+      auto& local = *local_;
+      const RoutingTable::Segment* routes;
+      uint32_t az_slot;
+      auto ret = findRoutes(local, segment, specific_az, &routes, &az_slot);
+      if (ret != ReturnCode::OK) {
+        return ret;
       }
-      thread_local unsigned rotation_counter = 0;
-      rotation_counter++;
-      auto& shard_to_hosts = itor->second.shard_to_hosts;
+
+      // All shards share one rotation, so that tied hosts are picked
+      // consistently across the shards of a single call.
+      const auto rotation = local.rotation_counter++;
+      const auto order = RoutingTable::orderFor(role);
       // Trying to fill clients for as many shards as possible.
       // If all shards are successfully fulfilled with the required clients,
       // OK is returned.
       // Otherwise, the error code for the last failure shard is returned.
-      auto ret = ReturnCode::OK;
       for (auto& s_c : *shard_to_clients) {
-        if (s_c.first >= shard_to_hosts.size()) {
+        if (s_c.first >= routes->num_shards) {
           LOG(ERROR) << "Unknown shard: " << s_c.first;
           return ReturnCode::UNKNOWN_SHARD;
         }
-        // find clients for shard
-        auto shard = s_c.first;
-        auto& clients = s_c.second;
-        clients.clear();
-        int shrink_target = shard_to_hosts[shard].size();
-        if (quantity != Quantity::ALL &&
-            FLAGS_thrift_router_max_num_hosts_to_consider > 0 &&
-            FLAGS_thrift_router_max_num_hosts_to_consider < shrink_target) {
-          shrink_target = FLAGS_thrift_router_max_num_hosts_to_consider;
-        }
-        auto hosts_for_shard = selectHosts(
-          shard_to_hosts[shard], role, rotation_counter, segment, shrink_target, specific_az);
-        if (hosts_for_shard.empty()) {
-          LOG_EVERY_N(ERROR, FLAGS_thrift_router_log_frequency)
-            << "Could not find hosts for shard " << shard;
-          ret = ReturnCode::NOT_FOUND;
-          continue;
-        }
-        createOrFixClientsFor(hosts_for_shard);
-        auto sz = hosts_for_shard.size();
-        filterBadHosts(&hosts_for_shard);
-        if (sz != hosts_for_shard.size() && quantity == Quantity::ALL) {
-          // exist some bad hosts, and we want all of them
-          LOG_EVERY_N(ERROR, FLAGS_thrift_router_log_frequency)
-            << "There is at least one bad host for shard " << shard;
-          ret = ReturnCode::BAD_HOST;
-          continue;
-        }
 
-        if (hosts_for_shard.empty()) {
+        if (az_slot == kUnknownAzSlot) {
+          s_c.second.clear();
           LOG_EVERY_N(ERROR, FLAGS_thrift_router_log_frequency)
-            << "We could not find any good host for shard " << shard;
-          ret = ReturnCode::BAD_HOST;
+            << "Could not find hosts for shard " << s_c.first;
+          ret = ReturnCode::NOT_FOUND;
           continue;
         }
 
-        for (const auto host : hosts_for_shard) {
-          clients.push_back((*clients_)[host->addr].client);
-          if (quantity == Quantity::ONE) {
-            break;
-          }
-
-          if (quantity == Quantity::TWO && clients.size() == 2) {
-            break;
-          }
+        auto shard_ret = fillClientsFor(&local, *routes, s_c.first, order,
+                                        az_slot, quantity, rotation,
+                                        &s_c.second);
+        if (shard_ret != ReturnCode::OK) {
+          ret = shard_ret;
         }
       }
 
       return ret;
     }
 
-    void updateClusterLayout(std::shared_ptr<const ClusterLayout> layout) {
-      if (layout == *local_cluster_layout_ || layout == nullptr) {
+    uint64_t routingTableVersion() {
+      return local_->version;
+    }
+
+    void updateRoutingTable(const uint64_t version,
+                            std::shared_ptr<const RoutingTable> table) {
+      auto& local = *local_;
+      local.version = version;
+      if (table == local.table || table == nullptr) {
         return;
       }
 
-      // store the new cluster layout
-      *local_cluster_layout_ = std::move(layout);
+      // store the new routing table
+      local.table = std::move(table);
 
       // remove clients for non-existing servers
-      const auto& hosts = (*local_cluster_layout_)->all_hosts;
+      const auto& hosts = local.table->layout()->all_hosts;
       Host host;
-      for (auto itor = clients_->begin(); itor != clients_->end();) {
+      for (auto itor = local.clients.begin(); itor != local.clients.end();) {
         host.addr = itor->first;
         if (hosts.find(host) != hosts.end()) {
           ++itor;
         } else {
-          itor = clients_->erase(itor);
+          itor = local.clients.erase(itor);
         }
       }
+
+      // host indexes are per table, resolve them again lazily
+      local.host_clients.assign(local.table->numHosts(), nullptr);
     }
 
    private:
+    static const uint32_t kUnknownAzSlot = std::numeric_limits<uint32_t>::max();
+
+    struct ClientAndStatus {
+      std::shared_ptr<ClientType> client;
+      const std::atomic<bool>* is_good = nullptr;
+      uint64_t create_time = 0;
+    };
+
+    struct LocalState {
+      std::shared_ptr<const RoutingTable> table;
+      // routing_table_version_ when table was last refreshed
+      uint64_t version = 0;
+      unsigned rotation_counter = 0;
+      std::unordered_map<folly::SocketAddress, ClientAndStatus> clients;
+      // entries of clients indexed by Candidate::index, nullptr until the
+      // host is first routed to with the current table. Pointers into an
+      // unordered_map stay valid until the entry is erased.
+      std::vector<ClientAndStatus*> host_clients;
+    };
+
+    // Set *az_slot to kUnknownAzSlot if specific_az has no host, which
+    // callers report as NOT_FOUND for every requested shard.
+    ReturnCode findRoutes(const LocalState& local,
+                          const std::string& segment,
+                          const std::string& specific_az,
+                          const RoutingTable::Segment** routes,
+                          uint32_t* az_slot) {
+      *routes = local.table ? local.table->findSegment(segment) : nullptr;
+      if (*routes == nullptr) {
+        LOG(ERROR) << "Unknown segment: " << segment;
+        return ReturnCode::UNKNOWN_SEGMENT;
+      }
+
+      if (!local.table->findAzSlot(specific_az, az_slot)) {
+        *az_slot = kUnknownAzSlot;
+      }
+
+      return ReturnCode::OK;
+    }
+
     /*
-     * selectHosts filters and sorts hosts based on the host properties.
+     * Fill clients for shard from its precomputed candidates.
      *
-     * In particular, it firstly filters the hosts by:
-     * - AZ (if input specific_az is not empty)
-     * - Role (if input role is not Role::ANY)
+     * Candidates are walked in preference order, with each group of tied
+     * candidates rotated by rotation. At most
+     * FLAGS_thrift_router_max_num_hosts_to_consider candidates are considered
+     * unless quantity is ALL. For ONE and TWO we stop once enough good hosts
+     * are found, for ALL every candidate must be good.
      *
-     * Then, sort hosts by:
-     * if role == ANY && !FLAGS_always_prefer_local_host
-     * - (1) prefer master to slave
-     * - (2) prefer local to non-local.
-     * for everything else, simply prefer local to non local.
-     * If two hosts equal according to the sorting criteria, we randomly order them.
+     * If loads is not nullptr, it is filled with the HostLoad of each client.
      */
-    auto selectHosts(
-        const std::vector<std::pair<const Host*, Role>>& host_info,
-        const Role role,
-        const unsigned rotation_counter,
-        const std::string& segment,
-        const int shrink_target,
-        const std::string& specific_az) {
-          std::vector<const Host*> v;
-          std::unordered_map<const Host*, Role> hostToRole;
-          v.reserve(host_info.size());
-          hostToRole.reserve(host_info.size());
-          for (const auto& hi : host_info) {
-            // filter by AZ
-            if (specific_az != "" && hi.first->az.compare(specific_az) != 0) {
-              continue;
-            }
-            // filter by role
-            if (role != Role::ANY && hi.second != role){
-              continue;
-            }
-            v.push_back(hi.first);
-            hostToRole[hi.first] = hi.second;
-          }
-          if (v.empty()) {
-            return v;
-          }
+    ReturnCode fillClientsFor(LocalState* local,
+                              const RoutingTable::Segment& routes,
+                              const ShardID shard,
+                              const RoutingTable::Order order,
+                              const uint32_t az_slot,
+                              const Quantity quantity,
+                              const unsigned rotation,
+                              std::vector<std::shared_ptr<ClientType>>* clients,
+                              std::vector<std::shared_ptr<detail::HostLoad>>*
+                                loads = nullptr) {
+      clients->clear();
+      if (loads) {
+        loads->clear();
+      }
+      const auto range = local->table->candidatesFor(routes, shard, order,
+                                                     az_slot);
+      const auto candidates = range.first;
+      uint32_t n = range.second - range.first;
+      if (n == 0) {
+        LOG_EVERY_N(ERROR, FLAGS_thrift_router_log_frequency)
+          << "Could not find hosts for shard " << shard;
+        return ReturnCode::NOT_FOUND;
+      }
 
-          sortAndShrinkHosts(&v, hostToRole, rotation_counter, role, segment, shrink_target);
-          return v;
-    }
+      if (quantity != Quantity::ALL &&
+          FLAGS_thrift_router_max_num_hosts_to_consider > 0 &&
+          static_cast<uint32_t>(FLAGS_thrift_router_max_num_hosts_to_consider) < n) {
+        n = FLAGS_thrift_router_max_num_hosts_to_consider;
+      }
 
-    void sortAndShrinkHosts(
-      std::vector<const Host*>* v,
-      const std::unordered_map<const Host*, Role>& hostToRole,
-      const unsigned rotation_counter,
-      const Role role,
-      const std::string& segment,
-      const int shrink_target) {
-        auto comparator = [this, &hostToRole, role, &segment, rotation_counter]
-        (const Host* h1, const Host* h2) -> bool {
-        // prefer master to slave
-        if (role == Role::ANY && !FLAGS_always_prefer_local_host) {
-          // "hostToRole" must contain all the hosts specified in "v"
-          // (see how hosts are filtered in selectHosts),
-          // therefore we don't check key existance here for simplicity.
-          if (hostToRole.at(h1) != hostToRole.at(h2)) {
-            return hostToRole.at(h1) == Role::MASTER;
+      // the i-th candidate after rotating each tie group
+      auto rotated = [candidates, rotation] (const uint32_t i) -> const Candidate& {
+        const auto& first = candidates[i];
+        const auto group_size = first.group_end - first.group_begin;
+        return group_size == 1 ? first :
+          candidates[first.group_begin +
+                     (i - first.group_begin + rotation) % group_size];
+      };
+
+      // power of two choices among the most preferred hosts
+      const bool latency_aware = FLAGS_thrift_router_latency_aware;
+      const auto& table = *local->table;
+      bool swap_first_two = false;
+      if (latency_aware && n >= 2 && candidates[0].group_end >= 2) {
+        swap_first_two = table.hostLoad(rotated(1).index)->cost() <
+          table.hostLoad(rotated(0).index)->cost();
+      }
+
+      const size_t wanted = quantity == Quantity::ONE ? 1 :
+        (quantity == Quantity::TWO ? 2 : n);
+      for (uint32_t i = 0; i < n && clients->size() < wanted; ++i) {
+        const auto& candidate = rotated(swap_first_two && i < 2 ? 1 - i : i);
+
+        auto& cs = clientFor(local, candidate);
+        createOrFixClientFor(candidate.host->addr, &cs);
+        if (is_client_good(cs)) {
+          clients->push_back(cs.client);
+          if (loads) {
+            loads->push_back(table.hostLoad(candidate.index));
           }
+          continue;
         }
 
-        // prefer local, in descending order of group prefix length
-        const auto s1 = h1->groups_prefix_lengths.at(segment);
-        const auto s2 = h2->groups_prefix_lengths.at(segment);
-        if (s1 == s2) {
-          const auto hash1 = folly::hash::twang_mix64(
-            reinterpret_cast<uint64_t>(h1) ^ rotation_counter);
-          const auto hash2 = folly::hash::twang_mix64(
-            reinterpret_cast<uint64_t>(h2) ^ rotation_counter);
-          return hash1 < hash2;
-        } else {
-          return s1 > s2;
+        if (quantity == Quantity::ALL) {
+          // exist some bad hosts, and we want all of them
+          LOG_EVERY_N(ERROR, FLAGS_thrift_router_log_frequency)
+            << "There is at least one bad host for shard " << shard;
+          clients->clear();
+          if (loads) {
+            loads->clear();
+          }
+          return ReturnCode::BAD_HOST;
         }
-      };
+      }
 
-      if (shrink_target < v->size()) {
-        std::partial_sort(v->begin(), v->begin() + shrink_target, v->end(),
-            comparator);
-        v->resize(shrink_target);
-      } else {
-        std::sort(v->begin(), v->end(), comparator);
+      if (clients->empty()) {
+        LOG_EVERY_N(ERROR, FLAGS_thrift_router_log_frequency)
+          << "We could not find any good host for shard " << shard;
+        return ReturnCode::BAD_HOST;
       }
+
+      return ReturnCode::OK;
     }
 
-    // TODO(bol) In theory, there is data race in this function. Because the IO
-    // thread writes the flag in socket, while we read it without any
-    // synchronization. We should remove this function once we are able to get
-    // a reliable atomic is_good flag.
-    static bool is_client_good(ClientType* client) {
-      if (client == nullptr) {
+    static ClientAndStatus& clientFor(LocalState* local,
+                                      const Candidate& candidate) {
+      auto& cs = local->host_clients[candidate.index];
+      if (cs == nullptr) {
+        cs = &local->clients[candidate.host->addr];
+      }
+
+      return *cs;
+    }
+
+    static bool is_client_good(const ClientAndStatus& cs) {
+      if (cs.client == nullptr) {
         return false;
       }
 
+      // The pool flips is_good from the IO thread once the channel breaks
+      if (cs.is_good != nullptr) {
+        return cs.is_good->load(std::memory_order_relaxed);
+      }
+
+      return is_socket_good(cs.client.get());
+    }
+
+    // TODO(bol) In theory, there is data race in this function. Because the IO
+    // thread writes the flag in socket, while we read it without any
+    // synchronization. It is only used for clients the pool didn't hand out
+    // an is_good flag for.
+    static bool is_socket_good(ClientType* client) {
       auto transport = dynamic_cast<apache::thrift::HeaderClientChannel*>
         (client->getChannel())->getTransport();
 
@@ -472,30 +962,25 @@ class ThriftRouter {
       return socket->good();
     }
 
-    void createOrFixClientsFor(const std::vector<const Host*>& hosts) {
-      for (auto host : hosts) {
-        auto itor = clients_->find(host->addr);
-        if (itor != clients_->end() &&
-            is_client_good(itor->second.client.get())) {
-            // has the client and it is good
-          continue;
-        }
-
-        if (itor != clients_->end() &&
-            itor->second.create_time +
-            FLAGS_min_client_reconnect_interval_seconds > now()) {
-          // has a bad client and it is too soon to reconnect
-          continue;
-        }
+    void createOrFixClientFor(const folly::SocketAddress& addr,
+                              ClientAndStatus* cs) {
+      if (is_client_good(*cs)) {
+        // has the client and it is good
+        return;
+      }
 
-        // either don't have the client or we need to fix the bad client
-        auto& cs = (*clients_)[host->addr];
-        cs.client = client_pool_->getClient(host->addr,
-                                            FLAGS_client_connect_timeout_millis,
-                                            &cs.is_good,
-                                            false /* aggressively */);
-        cs.create_time = now();
+      if (cs->create_time + FLAGS_min_client_reconnect_interval_seconds > now()) {
+        // has a bad client and it is too soon to reconnect
+        return;
       }
+
+      // either don't have the client or we need to fix the bad client
+      cs->is_good = nullptr;
+      cs->client = client_pool_->getClient(addr,
+                                           FLAGS_client_connect_timeout_millis,
+                                           &cs->is_good,
+                                           false /* aggressively */);
+      cs->create_time = now();
     }
 
     static uint64_t now() {
@@ -503,34 +988,25 @@ class ThriftRouter {
         std::chrono::system_clock::now().time_since_epoch()).count();
     }
 
-    void filterBadHosts(std::vector<const Host*>* hosts) {
-      auto itor = std::remove_if(
-        hosts->begin(), hosts->end(),
-        [this] (const Host* host) {
-          return !is_client_good((*clients_)[host->addr].client.get());
-        });
-      hosts->erase(itor, hosts->end());
-    }
-
-    struct ClientAndStatus {
-      std::shared_ptr<ClientType> client;
-      const std::atomic<bool>* is_good;
-      uint64_t create_time;
-    };
-
     std::shared_ptr<ThriftClientPool<ClientType, USE_BINARY_PROTOCOL>> client_pool_;
-    folly::ThreadLocal<std::shared_ptr<const ClusterLayout>>
-      local_cluster_layout_;
-    folly::ThreadLocal<std::unordered_map<folly::SocketAddress,
-                                          ClientAndStatus>> clients_;
+    folly::ThreadLocal<LocalState> local_;
   };
 
   const std::string config_path_;
   std::function<std::unique_ptr<const ClusterLayout>(
     std::string, const std::string&)> parser_;
 
-  std::shared_ptr<const ClusterLayout> cluster_layout_;
+  std::shared_ptr<const RoutingTable> routing_table_;
+  // bumped after every store to routing_table_
+  std::atomic<uint64_t> routing_table_version_;
   ThreadLocalClientMap local_client_map_;
+
+  // hedgers_mutex_ protects hedgers_, which local_hedgers_ caches per thread
+  std::mutex hedgers_mutex_;
+  std::unordered_map<SegmentName, std::shared_ptr<detail::SegmentHedger>>
+    hedgers_;
+  folly::ThreadLocal<std::unordered_map<
+    SegmentName, std::shared_ptr<detail::SegmentHedger>>> local_hedgers_;
 };
 
 /*
@@ -33,6 +33,7 @@
 #include "common/stats/status_server.h"
 #include "gflags/gflags.h"
 #include "common/helix_client.h"
+#include "rocksdb_replicator/rocksdb_replicator.h"
 #include "thrift/lib/cpp2/server/ThriftServer.h"
 
 
@@ -81,7 +82,10 @@ int main(int argc, char** argv) {
   server->setNPoolThreads(FLAGS_num_worker_threads);
   server->setNWorkerThreads(FLAGS_num_server_io_threads);
 
-  common::StatusServer::StartStatusServer();
+  common::StatusServer::StartStatusServer({
+      {"/replication.json", [] (const common::StatusServer::Arguments*) {
+          return replicator::RocksDBReplicator::instance()->introspectJson();
+        }}});
 
   if (helix_mode) {
       auto az = common::getAvailabilityZone();
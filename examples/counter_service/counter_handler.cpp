@@ -20,11 +20,59 @@
 #include "examples/counter_service/counter_handler.h"
 
 #include <string>
+#include <utility>
 
 #include "examples/counter_service/stats_enum.h"
+#include "common/global_cpu_executor.h"
 #include "common/stats/stats.h"
 #include "common/timer.h"
+#include "gflags/gflags.h"
 
+#if __GNUC__ >= 8
+#include "folly/executors/CPUThreadPoolExecutor.h"
+#else
+#include "wangle/concurrent/CPUThreadPoolExecutor.h"
+#endif
+
+DEFINE_int32(counter_read_your_writes_timeout_ms, 100,
+             "Max time a replica waits to apply updates up to "
+             "GetRequest.min_seq_no before failing with NOT_CAUGHT_UP");
+
+namespace {
+
+using GetCallback = std::unique_ptr<apache::thrift::HandlerCallback<
+  std::unique_ptr<::counter::GetResponse>>>;
+
+void replyGetCounter(GetCallback callback, const rocksdb::Status& status,
+                     const std::string& value) {
+  ::counter::CounterException ex;
+  if (status.IsTimedOut()) {
+    ex.code = ::counter::ErrorCode::NOT_CAUGHT_UP;
+    ex.msg = status.ToString();
+    callback.release()->exceptionInThread(std::move(ex));
+    return;
+  }
+
+  if (!status.ok()) {
+    ex.code = ::counter::ErrorCode::ROCKSDB_ERROR;
+    ex.msg = status.ToString();
+    callback.release()->exceptionInThread(std::move(ex));
+    return;
+  }
+
+  if (value.size() != sizeof(int64_t)) {
+    ex.code = ::counter::ErrorCode::CORRUPTED_DATA;
+    ex.msg = "Corrupted data found";
+    callback.release()->exceptionInThread(std::move(ex));
+    return;
+  }
+
+  ::counter::GetResponse res;
+  memcpy(&res.counter_value, value.c_str(), value.size());
+  callback.release()->resultInThread(res);
+}
+
+}  // anonymous namespace
 
 namespace counter {
 
@@ -51,26 +99,54 @@ void CounterHandler::async_tm_getCounter(
   CounterException ex;
   if (request->need_routing) {
     request->need_routing = false;
-    std::vector<std::shared_ptr<CounterAsyncClient>> clients;
-    router_->GetClientsFor(request->segment,
-                           request->counter_name,
-                           true /* for_read */,
-                           &clients);
-    if (clients.empty()) {
+    folly::Optional<folly::Future<::counter::GetResponse>> response;
+    if (!router_->GetCounter(*request, &response)) {
       ex.code = ErrorCode::SERVER_NOT_FOUND;
       ex.msg = "Server not found for getting: " + request->counter_name;
       callback.release()->exceptionInThread(std::move(ex));
       return;
     }
 
-    clients[0]->future_getCounter(*request).then(
-      [ callback = std::move(callback) ]
+    std::move(*response).then(
+      [ callback = std::move(callback), request = std::move(request),
+        router = router_.get() ]
       (folly::Try<::counter::GetResponse>&& t) mutable {
+        bool not_caught_up = false;
         if (t.hasException()) {
-          callback.release()->exceptionInThread(t.exception());
-        } else {
-          callback.release()->resultInThread(std::move(t.value()));
+          t.exception().with_exception(
+            [&not_caught_up] (const CounterException& e) {
+              not_caught_up = e.code == ErrorCode::NOT_CAUGHT_UP;
+            });
+        }
+
+        std::vector<std::shared_ptr<CounterAsyncClient>> leaders;
+        if (not_caught_up) {
+          // The replica we picked is still behind the write the caller wants
+          // to see, while the leader has it for sure.
+          router->GetClientsFor(request->segment,
+                                request->counter_name,
+                                false /* for_read */,
+                                &leaders);
+        }
+
+        if (leaders.empty()) {
+          if (t.hasException()) {
+            callback.release()->exceptionInThread(t.exception());
+          } else {
+            callback.release()->resultInThread(std::move(t.value()));
+          }
+          return;
         }
+
+        leaders[0]->future_getCounter(*request).then(
+          [ callback = std::move(callback) ]
+          (folly::Try<::counter::GetResponse>&& leader_t) mutable {
+            if (leader_t.hasException()) {
+              callback.release()->exceptionInThread(leader_t.exception());
+            } else {
+              callback.release()->resultInThread(std::move(leader_t.value()));
+            }
+          });
       });
 
     return;
@@ -84,26 +160,21 @@ void CounterHandler::async_tm_getCounter(
     return;
   }
 
-  std::string value;
-  auto status = db->Get(read_options_, request->counter_name, &value);
-  if (!status.ok()) {
-    ex.code = ErrorCode::ROCKSDB_ERROR;
-    ex.msg = status.ToString();
-    callback.release()->exceptionInThread(std::move(ex));
-    return;
-  }
-
-  if (value.size() != sizeof(int64_t)) {
-    ex.code = ErrorCode::CORRUPTED_DATA;
-    ex.msg = "Corrupted data found";
-    callback.release()->exceptionInThread(std::move(ex));
+  if (request->__isset.min_seq_no) {
+    // Don't hold this worker thread while waiting for the db to catch up.
+    db->GetAtLeast(request->min_seq_no, read_options_, request->counter_name,
+                   FLAGS_counter_read_your_writes_timeout_ms,
+                   common::getGlobalCPUExecutor()).then(
+      [ callback = std::move(callback) ]
+      (std::pair<rocksdb::Status, std::string>&& result) mutable {
+        replyGetCounter(std::move(callback), result.first, result.second);
+      });
     return;
   }
 
-
-  GetResponse res;
-  memcpy(&res.counter_value, value.c_str(), value.size());
-  callback.release()->resultInThread(res);
+  std::string value;
+  auto status = db->Get(read_options_, request->counter_name, &value);
+  replyGetCounter(std::move(callback), status, value);
 }
 
 void CounterHandler::async_tm_setCounter(
@@ -155,15 +226,23 @@ void CounterHandler::async_tm_setCounter(
     rocksdb::Slice(reinterpret_cast<const char*>(&request->counter_value),
                    sizeof(request->counter_value)));
 
-  auto status = db->Write(write_options_, &write_batch);
-  if (status.ok()) {
-    callback.release()->resultInThread(SetResponse());
-    return;
-  }
-
-  ex.code = ErrorCode::ROCKSDB_ERROR;
-  ex.msg = status.ToString();
-  callback.release()->exceptionInThread(std::move(ex));
+  // Don't hold this worker thread while waiting for follower ACK.
+  db->WriteAsync(write_options_, &write_batch).then(
+    [ callback = std::move(callback) ]
+    (std::pair<rocksdb::Status, rocksdb::SequenceNumber> result) mutable {
+      const auto& status = result.first;
+      if (status.ok()) {
+        SetResponse response;
+        response.set_seq_no(result.second);
+        callback.release()->resultInThread(std::move(response));
+        return;
+      }
+
+      CounterException ex;
+      ex.code = ErrorCode::ROCKSDB_ERROR;
+      ex.msg = status.ToString();
+      callback.release()->exceptionInThread(std::move(ex));
+    });
 }
 
 void CounterHandler::async_tm_bumpCounter(
@@ -215,15 +294,23 @@ void CounterHandler::async_tm_bumpCounter(
     rocksdb::Slice(reinterpret_cast<const char*>(&request->counter_delta),
                    sizeof(request->counter_delta)));
 
-  auto status = db->Write(write_options_, &write_batch);
-  if (status.ok()) {
-    callback.release()->resultInThread(BumpResponse());
-    return;
-  }
-
-  ex.code = ErrorCode::ROCKSDB_ERROR;
-  ex.msg = status.ToString();
-  callback.release()->exceptionInThread(std::move(ex));
+  // Don't hold this worker thread while waiting for follower ACK.
+  db->WriteAsync(write_options_, &write_batch).then(
+    [ callback = std::move(callback) ]
+    (std::pair<rocksdb::Status, rocksdb::SequenceNumber> result) mutable {
+      const auto& status = result.first;
+      if (status.ok()) {
+        BumpResponse response;
+        response.set_seq_no(result.second);
+        callback.release()->resultInThread(std::move(response));
+        return;
+      }
+
+      CounterException ex;
+      ex.code = ErrorCode::ROCKSDB_ERROR;
+      ex.msg = status.ToString();
+      callback.release()->exceptionInThread(std::move(ex));
+    });
 }
 
 }  // namespace counter
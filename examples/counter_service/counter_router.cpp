@@ -65,5 +65,24 @@ void CounterRouter::GetClientsFor(
     clients);
 }
 
+bool CounterRouter::GetCounter(
+    const GetRequest& request,
+    folly::Optional<folly::Future<GetResponse>>* response) {
+  auto num_shards = router_.getShardNumberFor(request.segment);
+  if (num_shards <= 0) {
+    return false;
+  }
+
+  using RouterType = common::ThriftRouter<CounterAsyncClient>;
+  return router_.call(
+    request.segment,
+    RouterType::Role::ANY,
+    ShardId(request.counter_name, num_shards),
+    [&request] (const std::shared_ptr<CounterAsyncClient>& client) {
+      return client->future_getCounter(request);
+    },
+    response) == RouterType::ReturnCode::OK;
+}
+
 }  // namespace counter
 
@@ -22,6 +22,8 @@
 
 #include "examples/counter_service/thrift/gen-cpp2/Counter.h"
 #include "common/thrift_router.h"
+#include "folly/Optional.h"
+#include "folly/futures/Future.h"
 
 namespace counter {
 
@@ -38,6 +40,12 @@ class CounterRouter {
                      const bool for_read,
                      std::vector<std::shared_ptr<CounterAsyncClient>>* clients);
 
+  // Send request to a replica able to serve reads of its counter, through
+  // the router so that the replica's load is measured. Return false if there
+  // is no such replica.
+  bool GetCounter(const GetRequest& request,
+                  folly::Optional<folly::Future<GetResponse>>* response);
+
  private:
   common::ThriftRouter<CounterAsyncClient> router_;
 };
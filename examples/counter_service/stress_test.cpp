@@ -17,6 +17,7 @@
 //
 
 #include <atomic>
+#include <chrono>
 #include <thread>
 #include <vector>
 
@@ -30,6 +31,52 @@ DEFINE_int32(thread_num, 8, "thread number");
 DEFINE_bool(verify_results, false, "verify results or not");
 DEFINE_int32(key_num_per_thread, 1024, "key num per thread");
 DEFINE_int32(allowed_flying_requests, 1024 * 1024, "allowed flying requests");
+DEFINE_int32(duration_seconds, 0, "Stop after this long, 0 runs forever");
+DEFINE_bool(client_per_request, false, "Get a client from the pool for every "
+            "request, and hold it until the response. This lets the pool "
+            "spread requests over --channels_per_host channels.");
+
+namespace {
+
+std::atomic<bool> g_stop(false);
+std::atomic<uint64_t> g_completed(0);
+std::atomic<uint64_t> g_latency_us(0);
+
+uint64_t nowUs() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Log the throughput and average latency every second, until
+// --duration_seconds has passed.
+void report() {
+  const auto start = nowUs();
+  uint64_t last_completed = 0;
+  uint64_t last_latency_us = 0;
+  for (int seconds = 1;
+       FLAGS_duration_seconds <= 0 || seconds <= FLAGS_duration_seconds;
+       ++seconds) {
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+    const auto completed = g_completed.load();
+    const auto latency_us = g_latency_us.load();
+    const auto n = completed - last_completed;
+    LOG(INFO) << n << " requests/s, "
+              << (n == 0 ? 0 : (latency_us - last_latency_us) / n)
+              << " us average latency";
+    last_completed = completed;
+    last_latency_us = latency_us;
+  }
+
+  const auto elapsed_us = nowUs() - start;
+  const auto completed = g_completed.load();
+  LOG(INFO) << "Completed " << completed << " requests in "
+            << elapsed_us / 1000 << " ms, "
+            << completed * 1000000 / elapsed_us << " requests/s, "
+            << (completed == 0 ? 0 : g_latency_us.load() / completed)
+            << " us average latency";
+}
+
+}  // namespace
 
 using ClientType = counter::CounterAsyncClient;
 
@@ -56,7 +103,7 @@ int main(int argc, char** argv) {
           get_request.counter_name = base_key_name;
           counter::GetResponse get_response;
           get_request.counter_name = base_key_name;
-          while (true) {
+          while (!g_stop.load()) {
             if (FLAGS_verify_results) {
               ++current_value;
               auto options = rpc_options;
@@ -76,7 +123,18 @@ int main(int argc, char** argv) {
                 folly::to<std::string>(current_value % FLAGS_key_num_per_thread);
               tokens.blockingWrite(true);
               auto options = rpc_options;
-              client->future_bumpCounter(options, bump_request).then([&tokens] () {
+              // getClient() returns a unique_ptr with a deleter local to it,
+              // which can only be had from an existing client.
+              decltype(client) c(nullptr, client.get_deleter());
+              if (FLAGS_client_per_request) {
+                c = client_pool.getClient(FLAGS_server_ip, FLAGS_server_port);
+              }
+              const auto start = nowUs();
+              auto future = (c ? c : client)->future_bumpCounter(options,
+                                                                 bump_request);
+              std::move(future).then([&tokens, c = std::move(c), start] () {
+                  g_latency_us.fetch_add(nowUs() - start);
+                  g_completed.fetch_add(1);
                   bool b;
                   tokens.read(b);
                 });
@@ -85,6 +143,9 @@ int main(int argc, char** argv) {
         }));
   }
 
+  report();
+  g_stop.store(true);
+
   for (auto& thread : threads) {
     thread.join();
   }
@@ -25,6 +25,8 @@ enum ErrorCode {
   ROCKSDB_ERROR = 2,
   CORRUPTED_DATA = 3,
   SERVER_NOT_FOUND = 4,
+  # The replica has not applied updates up to GetRequest.min_seq_no in time
+  NOT_CAUGHT_UP = 5,
 }
 
 exception CounterException {
@@ -36,6 +38,13 @@ struct GetRequest {
   1: required string counter_name,
   2: optional string segment = "default",
   3: optional bool need_routing = 1,
+
+  # Read-your-writes. If set, the counter is read from a replica only after
+  # it has applied updates up to min_seq_no, which is the seq_no returned by a
+  # previous setCounter() or bumpCounter() on the same counter. Replicas that
+  # don't catch up in time fail with NOT_CAUGHT_UP, and the request is retried
+  # on the leader if it was routed.
+  4: optional i64 min_seq_no,
 }
 
 struct GetResponse {
@@ -50,7 +59,8 @@ struct SetRequest {
 }
 
 struct SetResponse {
-  # for future use
+  # The sequence number of the write in the db of the counter
+  1: optional i64 seq_no,
 }
 
 struct BumpRequest {
@@ -61,7 +71,8 @@ struct BumpRequest {
 }
 
 struct BumpResponse {
-  # for future use
+  # The sequence number of the write in the db of the counter
+  1: optional i64 seq_no,
 }
 
 
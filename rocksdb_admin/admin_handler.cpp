@@ -181,6 +181,32 @@ const std::string kS3RestoreMs = "s3_restore_ms";
 const std::string kDeleteDBFailure = "delete_db_failure";
 const std::string kCompactDb = "compact_db";
 
+// The stats of the kafka ingestion into a segment, resolved once instead of
+// for every message
+struct KafkaIngestionStats {
+  explicit KafkaIngestionStats(const std::string& segment) {
+    auto stats = common::Stats::get();
+    const common::Stats::Tags tags = {{"segment", segment}};
+    consumer_latency = stats->GetMetricHandle(kKafkaConsumerLatency, tags);
+    put_messages = stats->GetCounterHandle(kKafkaDbPutMessage, tags);
+    del_messages = stats->GetCounterHandle(kKafkaDbDelMessage, tags);
+    merge_messages = stats->GetCounterHandle(kKafkaDbMergeMessage, tags);
+    put_errors = stats->GetCounterHandle(kKafkaDbPutErrors, tags);
+    delete_errors = stats->GetCounterHandle(kKafkaDbDeleteErrors, tags);
+    merge_errors = stats->GetCounterHandle(kKafkaDbMergeErrors, tags);
+    invalid_opcodes = stats->GetCounterHandle(kKafkaInvalidOpcode, tags);
+  }
+
+  common::Stats::Handle consumer_latency;
+  common::Stats::Handle put_messages;
+  common::Stats::Handle del_messages;
+  common::Stats::Handle merge_messages;
+  common::Stats::Handle put_errors;
+  common::Stats::Handle delete_errors;
+  common::Stats::Handle merge_errors;
+  common::Stats::Handle invalid_opcodes;
+};
+
 int64_t GetMessageTimestampSecs(const RdKafka::Message& message) {
   const auto ts = message.timestamp();
   if (ts.type == RdKafka::MessageTimestamp::MSG_TIMESTAMP_CREATE_TIME) {
@@ -409,6 +435,52 @@ CPUThreadPoolExecutor* S3UploadAndDownloadExecutor() {
   return &executor;
 }
 
+// Where checkpoints are staged before replacing the dbs they bootstrap, and
+// the replaced dbs are kept until the checkpoints are serving
+const std::string kBootstrapTmpDir = "bootstrap_tmp/";
+
+// Move dir from to to, or copy it if they are on different filesystems.
+// from is expected to be a flat directory, e.g. a rocksdb checkpoint.
+bool MoveOrCopyDir(const std::string& from, const std::string& to) {
+  boost::system::error_code err;
+  boost::filesystem::remove_all(to, err);
+  if (!err) {
+    boost::filesystem::create_directories(
+      boost::filesystem::path(to).parent_path(), err);
+  }
+  if (err) {
+    LOG(ERROR) << "Failed to prepare " << to << ": " << err.message();
+    return false;
+  }
+
+  boost::filesystem::rename(from, to, err);
+  if (!err) {
+    return true;
+  }
+
+  LOG(INFO) << "Copying " << from << " to " << to << " as it can't be moved: "
+            << err.message();
+  err.clear();
+  boost::filesystem::create_directory(to, err);
+  boost::filesystem::directory_iterator itr(from, err);
+  for (; !err && itr != boost::filesystem::directory_iterator();
+       itr.increment(err)) {
+    boost::filesystem::copy_file(
+      itr->path(), boost::filesystem::path(to) / itr->path().filename(), err);
+  }
+
+  boost::system::error_code ignored;
+  if (err) {
+    LOG(ERROR) << "Failed to copy " << from << " to " << to << ": "
+               << err.message();
+    boost::filesystem::remove_all(to, ignored);
+    return false;
+  }
+
+  boost::filesystem::remove_all(from, ignored);
+  return true;
+}
+
 // The dbs moved to db_tmp/ shouldnt be re-used or re-opened, so we can
 // delete them via boost filesystem operations rather than rocksdb::DestroyDB()
 void deleteTmpDBs() {
@@ -459,6 +531,16 @@ AdminHandler::AdminHandler(
   , allow_overlapping_keys_segments_()
   , num_current_s3_sst_downloadings_(0)
   , stop_db_deletion_thread_(false) {
+  // Before any db is added, as only dbs added afterwards can bootstrap
+  replicator::RocksDBReplicator::instance()->setBootstrapHandler(
+    [this] (const std::string& db_name,
+            const std::string& checkpoint_dir,
+            const replicator::ReplicaRole role,
+            const folly::SocketAddress& upstream_addr) {
+      return bootstrapDBFromCheckpoint(db_name, checkpoint_dir, role,
+                                       upstream_addr);
+    });
+
   if (db_manager_ == nullptr) {
     db_manager_ = CreateDBBasedOnConfig(rocksdb_options_);
   }
@@ -542,6 +624,108 @@ std::unique_ptr<rocksdb::DB> AdminHandler::removeDB(
   return db;
 }
 
+bool AdminHandler::bootstrapDBFromCheckpoint(
+    const std::string& db_name,
+    const std::string& checkpoint_dir,
+    const replicator::ReplicaRole role,
+    const folly::SocketAddress& upstream_addr) {
+  db_admin_lock_.Lock(db_name);
+  SCOPE_EXIT { db_admin_lock_.Unlock(db_name); };
+
+  {
+    auto db = getDB(db_name, nullptr);
+    if (db == nullptr || db->upstream_addr() == nullptr ||
+        *db->upstream_addr() != upstream_addr) {
+      // The db has been removed or moved on since it started bootstrapping
+      LOG(ERROR) << "Not bootstrapping " << db_name << " as it has changed";
+      return false;
+    }
+  }
+
+  // Stage the checkpoint next to the dbs, and make sure it opens, before
+  // touching the db. checkpoint_dir may well be on another filesystem.
+  const auto db_path = FLAGS_rocksdb_dir + db_name;
+  const auto staging_path = FLAGS_rocksdb_dir + kBootstrapTmpDir + db_name;
+  const auto backup_path = staging_path + ".old";
+  if (!MoveOrCopyDir(checkpoint_dir, staging_path)) {
+    return false;
+  }
+
+  auto options = rocksdb_options_(common::DbNameToSegment(db_name), db_name);
+  {
+    rocksdb::DB* staged_db;
+    auto s = rocksdb::DB::OpenForReadOnly(options, staging_path, &staged_db);
+    if (!s.ok()) {
+      LOG(ERROR) << "Not bootstrapping " << db_name << " as the checkpoint "
+                 << "fails to open: " << s.ToString();
+      boost::system::error_code ignored;
+      boost::filesystem::remove_all(staging_path, ignored);
+      return false;
+    }
+    delete staged_db;
+  }
+
+  LOG(INFO) << "Bootstrapping " << db_name << " from " << checkpoint_dir;
+  removeDB(db_name, nullptr);
+
+  // Keep the old db until the checkpoint is serving, and put it back if the
+  // checkpoint doesn't make it
+  boost::system::error_code fs_err;
+  boost::filesystem::remove_all(backup_path, fs_err);
+  if (!fs_err) {
+    boost::filesystem::rename(db_path, backup_path, fs_err);
+  }
+  if (fs_err) {
+    LOG(ERROR) << "Failed to move " << db_path << " to " << backup_path
+               << ": " << fs_err.message();
+    reopenDB(db_name, db_path, options, role, upstream_addr);
+    return false;
+  }
+
+  boost::filesystem::rename(staging_path, db_path, fs_err);
+  if (fs_err) {
+    LOG(ERROR) << "Failed to move " << staging_path << " to " << db_path
+               << ": " << fs_err.message();
+  } else if (reopenDB(db_name, db_path, options, role, upstream_addr)) {
+    boost::filesystem::remove_all(backup_path, fs_err);
+    LOG(INFO) << "Done bootstrapping " << db_name;
+    return true;
+  }
+
+  LOG(ERROR) << "Restoring " << db_name << " as it failed to bootstrap";
+  boost::filesystem::remove_all(db_path, fs_err);
+  boost::filesystem::rename(backup_path, db_path, fs_err);
+  if (fs_err) {
+    LOG(ERROR) << "Failed to move " << backup_path << " back to " << db_path
+               << ": " << fs_err.message();
+    return false;
+  }
+  reopenDB(db_name, db_path, options, role, upstream_addr);
+  return false;
+}
+
+bool AdminHandler::reopenDB(const std::string& db_name,
+                            const std::string& db_path,
+                            const rocksdb::Options& options,
+                            const replicator::ReplicaRole role,
+                            const folly::SocketAddress& upstream_addr) {
+  auto db = GetRocksdb(db_path, options);
+  if (db == nullptr) {
+    LOG(ERROR) << "Failed to open " << db_name << " at " << db_path;
+    return false;
+  }
+
+  std::string err_msg;
+  if (!db_manager_->addDB(db_name, std::move(db), role,
+                          std::make_unique<folly::SocketAddress>(upstream_addr),
+                          &err_msg)) {
+    LOG(ERROR) << "Failed to add " << db_name << ": " << err_msg;
+    return false;
+  }
+
+  return true;
+}
+
 DBMetaData AdminHandler::getMetaData(const std::string& db_name) {
   DBMetaData meta;
   meta.db_name = db_name;
@@ -1943,7 +2127,7 @@ void AdminHandler::async_tm_startMessageIngestion(
   kafka_watcher->StartWith(
       replay_timestamp_ms,
       [message_count, db_name, db, should_deserialize,
-       segment = std::move(segment), this](
+       stats = KafkaIngestionStats(segment), this](
           std::shared_ptr<const RdKafka::Message> message,
           const bool is_replay) mutable {
     if (message == nullptr) {
@@ -1977,8 +2161,7 @@ void AdminHandler::async_tm_startMessageIngestion(
       auto latency_ms = common::timeutil::GetCurrentTimestamp(
           common::timeutil::TimeUnit::kMillisecond)
                         - message->timestamp().timestamp;
-      common::Stats::get()->AddMetric(folly::stringPrintf("%s segment=%s",
-          kKafkaConsumerLatency.c_str(), segment.c_str()), latency_ms);
+      common::Stats::get()->AddMetric(stats.consumer_latency, latency_ms);
     }
 
     auto key = rocksdb::Slice(static_cast<const char *>(message->key_pointer()),
@@ -2009,43 +2192,36 @@ void AdminHandler::async_tm_startMessageIngestion(
 
     switch (op_code) {
       case KafkaOperationCode::PUT:
-        common::Stats::get()->Incr(folly::stringPrintf("%s segment=%s",
-            kKafkaDbPutMessage.c_str(), segment.c_str()));
+        common::Stats::get()->Incr(stats.put_messages);
 
         status = db->rocksdb()->Put(write_options, key, value);
         if (!status.ok()) {
           LOG(ERROR) << "Failure while writing to " << db_name << ": "
                      << status.ToString();
-          common::Stats::get()->Incr(folly::stringPrintf("%s segment=%s",
-              kKafkaDbPutErrors.c_str(), segment.c_str()));
+          common::Stats::get()->Incr(stats.put_errors);
         }
 
         break;
       case KafkaOperationCode::DELETE:
-        common::Stats::get()->Incr(folly::stringPrintf("%s segment=%s",
-            kKafkaDbDelMessage.c_str(), segment.c_str()));
+        common::Stats::get()->Incr(stats.del_messages);
         status = db->rocksdb()->Delete(write_options, key);
         if (!status.ok()) {
           LOG(ERROR) << "Failure while deleting from " << db_name << ": "
                      << status.ToString();
-          common::Stats::get()->Incr(folly::stringPrintf("%s segment=%s",
-              kKafkaDbDeleteErrors.c_str(), segment.c_str()));
+          common::Stats::get()->Incr(stats.delete_errors);
         }
         break;
       case KafkaOperationCode::MERGE:
-        common::Stats::get()->Incr(folly::stringPrintf("%s segment=%s",
-            kKafkaDbMergeMessage.c_str(), segment.c_str()));
+        common::Stats::get()->Incr(stats.merge_messages);
         status = db->rocksdb()->Merge(write_options, key, value);
         if (!status.ok()) {
           LOG(ERROR) << "Failure while merging to " << db_name << ": "
                      << status.ToString();
-          common::Stats::get()->Incr(folly::stringPrintf("%s segment=%s",
-              kKafkaDbMergeErrors.c_str(), segment.c_str()));
+          common::Stats::get()->Incr(stats.merge_errors);
         }
         break;
       default:
-        common::Stats::get()->Incr(folly::stringPrintf("%s segment=%s",
-            kKafkaInvalidOpcode.c_str(), segment.c_str()));
+        common::Stats::get()->Incr(stats.invalid_opcodes);
         LOG(ERROR) << "Invalid op_code in kafka payload";
     }
 
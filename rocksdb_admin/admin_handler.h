@@ -163,6 +163,24 @@ class AdminHandler : virtual public AdminSvIf {
   std::unique_ptr<rocksdb::DB> removeDB(const std::string& db_name,
                                         AdminException* ex);
 
+  // Replace db_name with the checkpoint of its upstream in checkpoint_dir,
+  // when it can no longer catch up from the upstream WAL. The checkpoint is
+  // staged under FLAGS_rocksdb_dir and verified first, and db_name is put
+  // back as it was if the checkpoint fails to take its place. Return true
+  // iff db_name has been replaced.
+  bool bootstrapDBFromCheckpoint(const std::string& db_name,
+                                 const std::string& checkpoint_dir,
+                                 const replicator::ReplicaRole role,
+                                 const folly::SocketAddress& upstream_addr);
+
+  // Open the db at db_path, and add it as db_name with role and
+  // upstream_addr. Return false if either fails.
+  bool reopenDB(const std::string& db_name,
+                const std::string& db_path,
+                const rocksdb::Options& options,
+                const replicator::ReplicaRole role,
+                const folly::SocketAddress& upstream_addr);
+
   DBMetaData getMetaData(const std::string& db_name);
   bool clearMetaData(const std::string& db_name);
   bool writeMetaData(const std::string& db_name,
@@ -14,6 +14,7 @@
 
 #include "rocksdb_admin/application_db.h"
 
+#include <memory>
 #include <string>
 
 #include "folly/Conv.h"
@@ -38,6 +39,9 @@ const std::string kRocksdbWriteMs = "rocksdb_write_ms";
 const std::string kRocksdbCompaction = "rocksdb_compact_range";
 const std::string kRocksdbCompactionMs = "rocksdb_compact_range_ms";
 
+const std::string kNotCaughtUp =
+  "db has not applied updates up to the requested sequence number";
+
 }  // anonymous namespace
 
 namespace admin {
@@ -119,6 +123,90 @@ std::vector<rocksdb::Status> ApplicationDB::MultiGet(
   return db_->MultiGet(options, slice, value);
 }
 
+folly::Future<bool> ApplicationDB::waitForSeqNo(
+    const rocksdb::SequenceNumber seq_no, const uint64_t timeout_ms) {
+  if (replicated_db_ == nullptr || db_->GetLatestSequenceNumber() >= seq_no) {
+    // A db without replication only has the updates written to it locally
+    return folly::makeFuture(true);
+  }
+
+  return replicated_db_->WaitForSeqNo(seq_no, timeout_ms);
+}
+
+// The continuations below hold db_ rather than this, so that they are safe
+// to run after *this is gone. They run on the caller's executor, since the
+// wait is fulfilled on the replicator's.
+folly::Future<std::unique_ptr<rocksdb::Iterator>>
+ApplicationDB::NewIteratorAtLeast(const rocksdb::SequenceNumber seq_no,
+                                  const rocksdb::ReadOptions& options,
+                                  const uint64_t timeout_ms,
+                                  folly::Executor* executor) {
+  return waitForSeqNo(seq_no, timeout_ms).via(executor).then(
+    [db = db_, options] (bool caught_up) {
+      if (!caught_up) {
+        return std::unique_ptr<rocksdb::Iterator>(rocksdb::NewErrorIterator(
+          rocksdb::Status::TimedOut(kNotCaughtUp)));
+      }
+
+      common::Stats::get()->Incr(kRocksdbNewIterator);
+      common::Timer timer(kRocksdbNewIteratorMs);
+      return std::unique_ptr<rocksdb::Iterator>(db->NewIterator(options));
+    });
+}
+
+folly::Future<std::pair<rocksdb::Status, std::string>>
+ApplicationDB::GetAtLeast(const rocksdb::SequenceNumber seq_no,
+                          const rocksdb::ReadOptions& options,
+                          const rocksdb::Slice& key,
+                          const uint64_t timeout_ms,
+                          folly::Executor* executor) {
+  return waitForSeqNo(seq_no, timeout_ms).via(executor).then(
+    [db = db_, options, key = key.ToString()] (bool caught_up) {
+      std::pair<rocksdb::Status, std::string> result;
+      if (!caught_up) {
+        result.first = rocksdb::Status::TimedOut(kNotCaughtUp);
+        return result;
+      }
+
+      common::Stats::get()->Incr(kRocksdbGet);
+      common::Timer timer(kRocksdbGetMs);
+      result.first = db->Get(options, key, &result.second);
+      return result;
+    });
+}
+
+folly::Future<std::pair<std::vector<rocksdb::Status>,
+                        std::vector<std::string>>>
+ApplicationDB::MultiGetAtLeast(const rocksdb::SequenceNumber seq_no,
+                               const rocksdb::ReadOptions& options,
+                               const std::vector<rocksdb::Slice>& keys,
+                               const uint64_t timeout_ms,
+                               folly::Executor* executor) {
+  std::vector<std::string> key_strs;
+  key_strs.reserve(keys.size());
+  for (const auto& key : keys) {
+    key_strs.push_back(key.ToString());
+  }
+
+  return waitForSeqNo(seq_no, timeout_ms).via(executor).then(
+    [db = db_, options, key_strs = std::move(key_strs)] (bool caught_up) {
+      std::pair<std::vector<rocksdb::Status>,
+                std::vector<std::string>> result;
+      if (!caught_up) {
+        result.first.assign(key_strs.size(),
+                            rocksdb::Status::TimedOut(kNotCaughtUp));
+        result.second.resize(key_strs.size());
+        return result;
+      }
+
+      std::vector<rocksdb::Slice> slices(key_strs.begin(), key_strs.end());
+      common::Stats::get()->Incr(kRocksdbMultiGet);
+      common::Timer timer(kRocksdbMultiGetMs);
+      result.first = db->MultiGet(options, slices, &result.second);
+      return result;
+    });
+}
+
 rocksdb::Status ApplicationDB::Write(const rocksdb::WriteOptions& options,
     rocksdb::WriteBatch* write_batch) {
   common::Stats::get()->Incr(kRocksdbWrite);
@@ -135,6 +223,34 @@ rocksdb::Status ApplicationDB::Write(const rocksdb::WriteOptions& options,
   }
 }
 
+folly::Future<std::pair<rocksdb::Status, rocksdb::SequenceNumber>>
+ApplicationDB::WriteAsync(const rocksdb::WriteOptions& options,
+                          rocksdb::WriteBatch* write_batch) {
+  common::Stats::get()->Incr(kRocksdbWrite);
+  common::Stats::get()->Incr(kRocksdbWriteBytes, write_batch->GetDataSize());
+  auto timer = std::make_unique<common::Timer>(kRocksdbWriteMs);
+  if (!replicated_db_) {
+    auto status = db_->Write(options, write_batch);
+    return folly::makeFuture(
+      std::make_pair(status, db_->GetLatestSequenceNumber()));
+  }
+
+  return replicated_db_->WriteAsync(options, write_batch)
+    .then([timer = std::move(timer)]
+          (folly::Try<rocksdb::SequenceNumber>&& t) {
+        if (t.hasException()) {
+          auto status =
+            rocksdb::Status::Aborted(t.exception().what().toStdString());
+          t.exception().with_exception(
+            [&status] (const replicator::WriteException& ex) {
+              status = ex.status();
+            });
+          return std::make_pair(status, rocksdb::SequenceNumber(0));
+        }
+        return std::make_pair(rocksdb::Status::OK(), t.value());
+      });
+}
+
 rocksdb::Status ApplicationDB::CompactRange(
         const rocksdb::CompactRangeOptions& options,
         const rocksdb::Slice* begin, const rocksdb::Slice* end) {
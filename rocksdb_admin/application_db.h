@@ -14,9 +14,14 @@
 
 #pragma once
 
+#include <memory>
 #include <string>
+#include <utility>
+#include <vector>
 
+#include "folly/Executor.h"
 #include "folly/SocketAddress.h"
+#include "folly/futures/Future.h"
 #include "rocksdb/db.h"
 #include "rocksdb/options.h"
 #include "rocksdb/write_batch.h"
@@ -81,6 +86,41 @@ class ApplicationDB {
                                         const std::vector<rocksdb::Slice>& keys,
                                         std::vector<std::string>* values);
 
+  // Read-your-writes versions of NewIterator(), Get() and MultiGet(). They
+  // are served only once this db has applied updates up to seq_no, which is
+  // what WriteAsync() reports on the leader, so followers can serve reads
+  // right after a write. The calling thread is not blocked while waiting.
+  // seq_no:     (IN) Sequence number the db must have applied
+  // options:    (IN) Read options. Pointers in it must stay valid until the
+  //                  returned future is fulfilled
+  // timeout_ms: (IN) Max time to wait for this db to catch up
+  // executor:   (IN) Where to do the read once caught up, so that it doesn't
+  //                  hold the replicator threads fulfilling the wait
+  //
+  // If this db doesn't catch up within timeout_ms, the returned status (or
+  // the status of the returned iterator) is TimedOut, and the caller may retry
+  // on the leader.
+  folly::Future<std::unique_ptr<rocksdb::Iterator>> NewIteratorAtLeast(
+      const rocksdb::SequenceNumber seq_no,
+      const rocksdb::ReadOptions& options,
+      const uint64_t timeout_ms,
+      folly::Executor* executor);
+
+  folly::Future<std::pair<rocksdb::Status, std::string>> GetAtLeast(
+      const rocksdb::SequenceNumber seq_no,
+      const rocksdb::ReadOptions& options,
+      const rocksdb::Slice& key,
+      const uint64_t timeout_ms,
+      folly::Executor* executor);
+
+  folly::Future<std::pair<std::vector<rocksdb::Status>,
+                          std::vector<std::string>>> MultiGetAtLeast(
+      const rocksdb::SequenceNumber seq_no,
+      const rocksdb::ReadOptions& options,
+      const std::vector<rocksdb::Slice>& keys,
+      const uint64_t timeout_ms,
+      folly::Executor* executor);
+
   // Batch write with the given options and data.
   // options:     (IN) Write options
   // write_batch: (IN) Batch operations
@@ -89,6 +129,18 @@ class ApplicationDB {
   rocksdb::Status Write(const rocksdb::WriteOptions& options,
                         rocksdb::WriteBatch* write_batch);
 
+  // Same as Write(), but don't block the calling thread while waiting for
+  // follower ACK. write_batch is no longer accessed once this returns.
+  // options:     (IN) Write options
+  // write_batch: (IN) Batch operations
+  //
+  // Return a future fulfilled with rocksdb::Status::ok on success, and the
+  // sequence number after applying write_batch. Pass it to the *AtLeast()
+  // read APIs for read-your-writes on any replica.
+  folly::Future<std::pair<rocksdb::Status, rocksdb::SequenceNumber>>
+  WriteAsync(const rocksdb::WriteOptions& options,
+             rocksdb::WriteBatch* write_batch);
+
   // Compact the db.
   // options:     (IN) CompactRange options
   // begin:       (IN) Start key of the compaction.
@@ -135,6 +187,11 @@ class ApplicationDB {
   // get the highest empty level of default column family
   uint32_t getHighestEmptyLevel();
 
+  // Return a future fulfilled with true once this db has applied updates up
+  // to seq_no, or false if it doesn't within timeout_ms
+  folly::Future<bool> waitForSeqNo(const rocksdb::SequenceNumber seq_no,
+                                   const uint64_t timeout_ms);
+
   const std::string db_name_;
   std::shared_ptr<rocksdb::DB> db_;
 
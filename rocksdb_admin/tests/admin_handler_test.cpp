@@ -802,6 +802,65 @@ TEST_F(AdminHandlerTestBase, CheckDB) {
   }
 }
 
+TEST_F(AdminHandlerTestBase, BootstrapDBFromCheckpoint) {
+  auto write_db = [] (const string& path, const string& val) {
+    rocksdb::DB* db;
+    Options options;
+    options.create_if_missing = true;
+    ASSERT_TRUE(rocksdb::DB::Open(options, path, &db).ok());
+    EXPECT_TRUE(db->Put(rocksdb::WriteOptions(), "key", val).ok());
+    delete db;
+  };
+
+  const string testdb = generateDBName();
+  write_db(FLAGS_rocksdb_dir + testdb, "old");
+  addDBWithRole(testdb, "FOLLOWER");
+  EXPECT_dbValForKey(testdb, "key", "old");
+  const auto upstream_addr =
+    *db_manager_->getDB(testdb, nullptr)->upstream_addr();
+
+  // checkpoints are downloaded outside of FLAGS_rocksdb_dir
+  const string checkpoint_root =
+    "/tmp/admin_handler_test_checkpoint/" + testSessionIdAsStr() + "/";
+  const string backup_path = FLAGS_rocksdb_dir + "bootstrap_tmp/" + testdb +
+    ".old";
+
+  // a checkpoint which doesn't open leaves the db as it is, so that the
+  // replicator can resume pulling into it
+  const auto old_db = db_manager_->getDB(testdb, nullptr);
+  const string bad_checkpoint = checkpoint_root + "bad";
+  clearAndCreateDir(bad_checkpoint);
+  EXPECT_FALSE(handler_->bootstrapDBFromCheckpoint(
+    testdb, bad_checkpoint, replicator::ReplicaRole::FOLLOWER, upstream_addr));
+  EXPECT_EQ(db_manager_->getDB(testdb, nullptr), old_db);
+  EXPECT_dbValForKey(testdb, "key", "old");
+  EXPECT_FALSE(fs::exists(backup_path));
+
+  // so does a checkpoint from an upstream the db no longer follows
+  const string other_checkpoint = checkpoint_root + "other";
+  clearAndCreateDir(other_checkpoint);
+  write_db(other_checkpoint, "other");
+  EXPECT_FALSE(handler_->bootstrapDBFromCheckpoint(
+    testdb, other_checkpoint, replicator::ReplicaRole::FOLLOWER,
+    folly::SocketAddress(upstream_addr.getAddressStr(),
+                         upstream_addr.getPort() + 1)));
+  EXPECT_EQ(db_manager_->getDB(testdb, nullptr), old_db);
+  EXPECT_dbValForKey(testdb, "key", "old");
+
+  // a good one replaces the db, and the old db is gone once it's serving
+  const string checkpoint = checkpoint_root + testdb;
+  clearAndCreateDir(checkpoint);
+  write_db(checkpoint, "new");
+  EXPECT_TRUE(handler_->bootstrapDBFromCheckpoint(
+    testdb, checkpoint, replicator::ReplicaRole::FOLLOWER, upstream_addr));
+  EXPECT_dbValForKey(testdb, "key", "new");
+  EXPECT_FALSE(fs::exists(checkpoint));
+  EXPECT_FALSE(fs::exists(backup_path));
+
+  boost::system::error_code remove_err;
+  fs::remove_all(checkpoint_root, remove_err);
+}
+
 TEST(AdminHandlerTest, MetaData) {
   FLAGS_rocksdb_dir = "/tmp/admin_handler_test/";
   clearAndCreateDir(FLAGS_rocksdb_dir);
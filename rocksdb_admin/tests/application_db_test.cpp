@@ -296,6 +296,47 @@ TEST_F(ApplicationDBTestBase, GetProperty) {
   EXPECT_TRUE(db_->DBLmaxEmpty());
 }
 
+TEST_F(ApplicationDBTestBase, ReadAtLeast) {
+  rocksdb::WriteBatch batch;
+  batch.Put("key1", "value1");
+  batch.Put("key2", "value2");
+  auto write_result = db_->WriteAsync(WriteOptions(), &batch).get();
+  EXPECT_TRUE(write_result.first.ok());
+  const auto seq_no = write_result.second;
+  EXPECT_EQ(seq_no, db_->rocksdb()->GetLatestSequenceNumber());
+
+  // Do the reads inline in the thread fulfilling the wait
+  class InlineExecutor : public folly::Executor {
+   public:
+    void add(folly::Func f) override {
+      f();
+    }
+  } executor;
+
+  // db_ has no replication, so it is always caught up
+  auto get_result = db_->GetAtLeast(seq_no, rocksdb::ReadOptions(),
+                                    "key1", 100, &executor).get();
+  EXPECT_TRUE(get_result.first.ok());
+  EXPECT_EQ(get_result.second, "value1");
+
+  auto multi_get_result = db_->MultiGetAtLeast(
+    seq_no, rocksdb::ReadOptions(), {"key1", "key2", "key3"}, 100,
+    &executor).get();
+  ASSERT_EQ(multi_get_result.first.size(), 3u);
+  EXPECT_TRUE(multi_get_result.first[0].ok());
+  EXPECT_EQ(multi_get_result.second[0], "value1");
+  EXPECT_TRUE(multi_get_result.first[1].ok());
+  EXPECT_EQ(multi_get_result.second[1], "value2");
+  EXPECT_TRUE(multi_get_result.first[2].IsNotFound());
+
+  auto itor = db_->NewIteratorAtLeast(seq_no, rocksdb::ReadOptions(),
+                                      100, &executor).get();
+  itor->SeekToFirst();
+  ASSERT_TRUE(itor->Valid());
+  EXPECT_EQ(itor->key().ToString(), "key1");
+  EXPECT_TRUE(itor->status().ok());
+}
+
 TEST_F(ApplicationDBTestBase, GetLSMLevelInfo) {
   // Verify: DB level=7 at new create
   EXPECT_EQ(db_->rocksdb()->NumberLevels(), 7);
@@ -0,0 +1,386 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#include "rocksdb_replicator/checkpoint_fetcher.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "glog/logging.h"
+#include "rocksdb/env.h"
+
+namespace {
+
+bool EndsWith(const std::string& str, const std::string& suffix) {
+  return str.size() >= suffix.size() &&
+    str.compare(str.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+}  // namespace
+
+namespace replicator { namespace detail {
+
+const char* const CheckpointFetcher::kProgressFile = "FETCH_PROGRESS";
+
+CheckpointFetcher::CheckpointFetcher(
+    std::shared_ptr<ReplicatorAsyncClient> client,
+    std::string db_name,
+    std::string dir,
+    folly::Executor* executor,
+    const apache::thrift::RpcOptions& rpc_options,
+    const uint32_t parallelism,
+    const uint32_t chunk_bytes)
+    : client_(std::move(client))
+    , db_name_(std::move(db_name))
+    , dir_(std::move(dir))
+    , executor_(executor)
+    , rpc_options_(rpc_options)
+    , parallelism_(std::max<uint32_t>(parallelism, 1))
+    , chunk_bytes_(std::max<uint32_t>(chunk_bytes, 1))
+    , promise_()
+    , checkpoint_id_()
+    , db_identity_()
+    , seq_no_(0)
+    , mtx_()
+    , chunks_()
+    , fds_()
+    , progress_(nullptr)
+    , in_flight_(0)
+    , error_()
+    , finished_(false) {}
+
+CheckpointFetcher::~CheckpointFetcher() {
+  for (const auto& p : fds_) {
+    close(p.second);
+  }
+  if (progress_) {
+    fclose(progress_);
+  }
+}
+
+folly::Future<uint64_t> CheckpointFetcher::fetch() {
+  auto future = promise_.getFuture();
+  // mkdir -p
+  auto env = rocksdb::Env::Default();
+  for (auto pos = dir_.find('/', 1); ; pos = dir_.find('/', pos + 1)) {
+    auto status = env->CreateDirIfMissing(dir_.substr(0, pos));
+    if (!status.ok()) {
+      promise_.setException(std::runtime_error(status.ToString()));
+      return future;
+    }
+    if (pos == std::string::npos) {
+      break;
+    }
+  }
+
+  CheckpointRequest req;
+  req.db_name = db_name_;
+  auto self = shared_from_this();
+  client_->future_createCheckpoint(rpc_options_, req).via(executor_)
+    .then([self] (folly::Try<CheckpointResponse>&& t) {
+        if (t.hasException()) {
+          std::lock_guard<std::mutex> g(self->mtx_);
+          self->error_ = "createCheckpoint() failed: " +
+            t.exception().what().toStdString();
+          self->maybeFinish();
+          return;
+        }
+
+        self->start(t.value());
+      });
+
+  return future;
+}
+
+void CheckpointFetcher::start(const CheckpointResponse& checkpoint) {
+  checkpoint_id_ = checkpoint.checkpoint_id;
+  seq_no_ = checkpoint.seq_no;
+  const auto progress_path = dir_ + "/" + kProgressFile;
+
+  // Written in place of a db identity the upstream doesn't tell, or which
+  // doesn't fit in the progress file
+  static const std::string kNoIdentity = "-";
+  db_identity_ = kNoIdentity;
+  if (checkpoint.__isset.db_identity && !checkpoint.db_identity.empty() &&
+      checkpoint.db_identity.size() < 256 &&
+      std::none_of(checkpoint.db_identity.begin(),
+                   checkpoint.db_identity.end(),
+                   [] (char c) { return isspace(c); })) {
+    db_identity_ = checkpoint.db_identity;
+  }
+
+  // (db identity, checkpoint id, file name, file size, offset, length) of
+  // the chunks downloaded by earlier fetches
+  struct Progress {
+    std::string identity;
+    std::string checkpoint_id;
+    std::string file_name;
+    uint64_t file_size;
+    uint64_t offset;
+    uint64_t len;
+  };
+  std::vector<Progress> done;
+  if (auto f = fopen(progress_path.c_str(), "r")) {
+    char line[1024], identity[256], id[256], name[256];
+    unsigned long long size, offset, len;
+    while (fgets(line, sizeof(line), f)) {
+      // lines without a length are from older versions, and not trusted
+      if (sscanf(line, "%255s %255s %255s %llu %llu %llu", identity, id, name,
+                 &size, &offset, &len) == 6) {
+        done.push_back(Progress{identity, id, name, size, offset, len});
+      }
+    }
+    fclose(f);
+  }
+
+  auto env = rocksdb::Env::Default();
+  std::set<std::string> names;
+  std::lock_guard<std::mutex> g(mtx_);
+  for (const auto& file : checkpoint.files) {
+    // file names come from the upstream, and are created in dir_ only
+    if (file.name.empty() || file.name.find('/') != std::string::npos ||
+        file.name == "." || file.name == ".." || file.name == kProgressFile) {
+      error_ = "Bad file name in checkpoint: " + file.name;
+      maybeFinish();
+      return;
+    }
+    names.insert(file.name);
+
+    const auto path = dir_ + "/" + file.name;
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT, 0644);
+    if (fd < 0 || ftruncate(fd, file.size) != 0) {
+      error_ = "Failed to open " + path + ": " + strerror(errno);
+      if (fd >= 0) {
+        close(fd);
+      }
+      maybeFinish();
+      return;
+    }
+    fds_[file.name] = fd;
+
+    // sst files are immutable, and their names are never reused within a db.
+    // So a chunk of one with the same name and size downloaded for another
+    // checkpoint of the same upstream db is as good. Other dbs, e.g. another
+    // replica taking over as upstream, have different files by those names.
+    const bool reusable = db_identity_ != kNoIdentity &&
+      EndsWith(file.name, ".sst");
+    const uint64_t size = file.size;
+    std::vector<std::pair<uint64_t, uint64_t>> have;
+    for (const auto& d : done) {
+      if (d.identity == db_identity_ && d.file_name == file.name &&
+          d.file_size == size && d.offset < size && d.len > 0 &&
+          (reusable || d.checkpoint_id == checkpoint_id_)) {
+        have.emplace_back(d.offset, std::min(size, d.offset + d.len));
+      }
+    }
+    std::sort(have.begin(), have.end());
+
+    // download the ranges not covered by what we have, in chunk_bytes_ at
+    // most, so that chunks of a different size earlier leave no hole
+    uint64_t offset = 0;
+    auto itor = have.begin();
+    while (offset < size) {
+      if (itor != have.end() && itor->first <= offset) {
+        offset = std::max(offset, itor->second);
+        ++itor;
+        continue;
+      }
+
+      const uint64_t end = itor == have.end() ? size : itor->first;
+      const auto len = std::min<uint64_t>(chunk_bytes_, end - offset);
+      chunks_.push_back(Chunk{file.name, size, offset,
+                              static_cast<uint32_t>(len)});
+      offset += len;
+    }
+  }
+
+  // drop whatever earlier fetches left behind that isn't in this checkpoint
+  std::vector<std::string> children;
+  if (env->GetChildren(dir_, &children).ok()) {
+    for (const auto& name : children) {
+      if (name != "." && name != ".." && name != kProgressFile &&
+          names.count(name) == 0) {
+        env->DeleteFile(dir_ + "/" + name);
+      }
+    }
+  }
+
+  progress_ = fopen(progress_path.c_str(), "a");
+  if (progress_ == nullptr) {
+    error_ = "Failed to open " + progress_path + ": " + strerror(errno);
+    maybeFinish();
+    return;
+  }
+
+  LOG(INFO) << "Fetching " << chunks_.size() << " chunks of checkpoint "
+            << checkpoint_id_ << " of " << db_name_ << " into " << dir_;
+  const auto n_workers = std::min<size_t>(parallelism_, chunks_.size());
+  if (n_workers == 0) {
+    maybeFinish();
+    return;
+  }
+
+  auto self = shared_from_this();
+  for (size_t i = 0; i < n_workers; ++i) {
+    executor_->add([self] { self->fetchNext(); });
+  }
+}
+
+void CheckpointFetcher::fetchNext() {
+  Chunk chunk;
+  {
+    std::lock_guard<std::mutex> g(mtx_);
+    if (!error_.empty() || chunks_.empty()) {
+      maybeFinish();
+      return;
+    }
+
+    chunk = std::move(chunks_.front());
+    chunks_.pop_front();
+    ++in_flight_;
+  }
+
+  CheckpointChunkRequest req;
+  req.db_name = db_name_;
+  req.checkpoint_id = checkpoint_id_;
+  req.file_name = chunk.file_name;
+  req.offset = chunk.offset;
+  req.max_bytes = chunk.len;
+  auto self = shared_from_this();
+  client_->future_getCheckpointChunk(rpc_options_, req).via(executor_)
+    .then([self, chunk = std::move(chunk)] (
+        folly::Try<CheckpointChunkResponse>&& t) {
+        if (t.hasException()) {
+          self->fail("getCheckpointChunk() failed for " + chunk.file_name +
+                     ": " + t.exception().what().toStdString());
+        } else {
+          self->writeChunk(chunk, t.value().data);
+        }
+
+        {
+          std::lock_guard<std::mutex> g(self->mtx_);
+          --self->in_flight_;
+        }
+        self->fetchNext();
+      });
+}
+
+void CheckpointFetcher::writeChunk(const Chunk& chunk,
+                                   const folly::IOBuf& data) {
+  // Upstream caps chunks at its own FLAGS_replicator_bootstrap_chunk_bytes,
+  // which may be less than ours. Anything short of the end of the file is
+  // fine as long as it makes progress.
+  const auto len = data.computeChainDataLength();
+  if (len == 0 || len > chunk.len) {
+    fail("Got " + std::to_string(len) + " bytes instead of up to " +
+         std::to_string(chunk.len) + " from " + chunk.file_name +
+         " at offset " + std::to_string(chunk.offset));
+    return;
+  }
+
+  int fd;
+  {
+    std::lock_guard<std::mutex> g(mtx_);
+    fd = fds_[chunk.file_name];
+  }
+
+  uint64_t offset = chunk.offset;
+  for (const auto& range : data) {
+    size_t written = 0;
+    while (written < range.size()) {
+      auto n = pwrite(fd, range.data() + written, range.size() - written,
+                      offset + written);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n < 0) {
+        fail("Failed to write " + chunk.file_name + ": " + strerror(errno));
+        return;
+      }
+      written += n;
+    }
+    offset += range.size();
+  }
+
+  // Don't record a chunk before it's on disk, or a fetch resumed after a
+  // crash would take a hole in the file for it.
+  if (fdatasync(fd) != 0) {
+    fail("Failed to sync " + chunk.file_name + ": " + strerror(errno));
+    return;
+  }
+
+  std::lock_guard<std::mutex> g(mtx_);
+  fprintf(progress_, "%s %s %s %llu %llu %llu\n", db_identity_.c_str(),
+          checkpoint_id_.c_str(), chunk.file_name.c_str(),
+          static_cast<unsigned long long>(chunk.file_size),
+          static_cast<unsigned long long>(chunk.offset),
+          static_cast<unsigned long long>(len));
+  fflush(progress_);
+
+  if (len < chunk.len) {
+    // the worker calling us fetches the rest next
+    chunks_.push_front(Chunk{chunk.file_name, chunk.file_size,
+                             chunk.offset + len,
+                             static_cast<uint32_t>(chunk.len - len)});
+  }
+}
+
+void CheckpointFetcher::fail(const std::string& msg) {
+  std::lock_guard<std::mutex> g(mtx_);
+  if (error_.empty()) {
+    error_ = msg;
+  }
+}
+
+void CheckpointFetcher::maybeFinish() {
+  if (finished_ || in_flight_ > 0 || (error_.empty() && !chunks_.empty())) {
+    return;
+  }
+
+  finished_ = true;
+  if (!error_.empty()) {
+    LOG(ERROR) << "Failed to fetch checkpoint of " << db_name_ << ": "
+               << error_;
+    promise_.setException(std::runtime_error(error_));
+    return;
+  }
+
+  if (progress_) {
+    fclose(progress_);
+    progress_ = nullptr;
+  }
+  unlink((dir_ + "/" + kProgressFile).c_str());
+  LOG(INFO) << "Fetched checkpoint " << checkpoint_id_ << " of " << db_name_
+            << " at sequence # " << seq_no_;
+  promise_.setValue(seq_no_);
+}
+
+}  // namespace detail
+}  // namespace replicator
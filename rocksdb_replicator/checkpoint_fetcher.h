@@ -0,0 +1,121 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#pragma once
+
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "folly/Executor.h"
+#include "folly/futures/Future.h"
+#include "rocksdb_replicator/thrift/gen-cpp2/Replicator.h"
+
+namespace replicator { namespace detail {
+
+/*
+ * CheckpointFetcher asks an upstream to create a checkpoint of db_name, and
+ * downloads it into dir with up to parallelism getCheckpointChunk() requests
+ * of chunk_bytes in flight. Upstream may return less than asked for, in which
+ * case the rest is asked for next.
+ *
+ * Downloaded byte ranges are recorded in dir/FETCH_PROGRESS, so a fetch into
+ * the same dir after a failure or a restart only downloads what's missing,
+ * whatever the chunk sizes used before. Since
+ * sst files are never modified, those downloaded for an older checkpoint of
+ * the same upstream db, as told by its db identity, are reused if the new
+ * checkpoint has the same ones.
+ *
+ * fetch() is called at most once. The returned future is fulfilled with the
+ * latest sequence # in the checkpoint once all of it is in dir, or fails with
+ * the first error encountered.
+ */
+class CheckpointFetcher
+    : public std::enable_shared_from_this<CheckpointFetcher> {
+ public:
+  CheckpointFetcher(std::shared_ptr<ReplicatorAsyncClient> client,
+                    std::string db_name,
+                    std::string dir,
+                    folly::Executor* executor,
+                    const apache::thrift::RpcOptions& rpc_options,
+                    const uint32_t parallelism,
+                    const uint32_t chunk_bytes);
+
+  ~CheckpointFetcher();
+
+  // no copy or move
+  CheckpointFetcher(const CheckpointFetcher&) = delete;
+  CheckpointFetcher& operator=(const CheckpointFetcher&) = delete;
+
+  folly::Future<uint64_t> fetch();
+
+  static const char* const kProgressFile;
+
+ private:
+  struct Chunk {
+    std::string file_name;
+    uint64_t file_size;
+    uint64_t offset;
+    uint32_t len;
+  };
+
+  // Work out the chunks still to download and start the workers
+  void start(const CheckpointResponse& checkpoint);
+
+  // Download the next chunk in chunks_, or finish if there is none left
+  void fetchNext();
+
+  // Write a downloaded chunk to its file and record it in the progress file.
+  // Queue the rest of the chunk first if data is short of it.
+  void writeChunk(const Chunk& chunk, const folly::IOBuf& data);
+
+  // Fail the fetch with msg unless it has failed already
+  void fail(const std::string& msg);
+
+  // Fulfill promise_ once no request is in flight. Caller must hold mtx_.
+  void maybeFinish();
+
+  const std::shared_ptr<ReplicatorAsyncClient> client_;
+  const std::string db_name_;
+  const std::string dir_;
+  folly::Executor* const executor_;
+  const apache::thrift::RpcOptions rpc_options_;
+  const uint32_t parallelism_;
+  const uint32_t chunk_bytes_;
+
+  folly::Promise<uint64_t> promise_;
+  std::string checkpoint_id_;
+  // the upstream db identity recorded in the progress file
+  std::string db_identity_;
+  uint64_t seq_no_;
+
+  // mtx_ protects all members below
+  std::mutex mtx_;
+  std::deque<Chunk> chunks_;
+  // file name => fd of the files being downloaded
+  std::unordered_map<std::string, int> fds_;
+  FILE* progress_;
+  uint32_t in_flight_;
+  std::string error_;
+  bool finished_;
+};
+
+}  // namespace detail
+}  // namespace replicator
@@ -0,0 +1,284 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#include "rocksdb_replicator/checkpoint_store.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <vector>
+
+#include "folly/Random.h"
+#include "folly/ScopeGuard.h"
+#include "glog/logging.h"
+#include "rocksdb/env.h"
+
+namespace {
+
+uint64_t NowMs() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// mkdir -p
+rocksdb::Status CreateDirs(rocksdb::Env* env, const std::string& dir) {
+  for (auto pos = dir.find('/', 1); ; pos = dir.find('/', pos + 1)) {
+    auto status = env->CreateDirIfMissing(dir.substr(0, pos));
+    if (!status.ok() || pos == std::string::npos) {
+      return status;
+    }
+  }
+}
+
+}  // namespace
+
+namespace replicator { namespace detail {
+
+CheckpointStore::CheckpointStore(std::string dir,
+                                 folly::Executor* executor,
+                                 const uint64_t ttl_ms,
+                                 const uint64_t reuse_ms,
+                                 TimerWheel* timer_wheel)
+    : dir_(std::move(dir))
+    , executor_(executor)
+    , ttl_ms_(ttl_ms)
+    , reuse_ms_(reuse_ms)
+    , timer_wheel_(timer_wheel)
+    , create_mtx_()
+    , mtx_()
+    , checkpoints_()
+    , expiry_scheduled_(false) {}
+
+CheckpointStore::~CheckpointStore() {
+  for (const auto& p : checkpoints_) {
+    deleteCheckpoint(p.first);
+  }
+}
+
+rocksdb::Status CheckpointStore::create(DbWrapper* db_wrapper,
+                                        CheckpointResponse* response) {
+  // Creating a checkpoint flushes the memtables. Let concurrent callers
+  // reuse the one created by the first of them.
+  std::lock_guard<std::mutex> create_g(create_mtx_);
+  const auto now = NowMs();
+  {
+    std::lock_guard<std::mutex> g(mtx_);
+    Checkpoint* newest = nullptr;
+    for (auto& p : checkpoints_) {
+      if (p.second.created_ms + reuse_ms_ > now &&
+          (newest == nullptr || p.second.created_ms > newest->created_ms)) {
+        newest = &p.second;
+      }
+    }
+
+    if (newest) {
+      newest->last_used_ms = now;
+      *response = newest->response;
+      return rocksdb::Status::OK();
+    }
+  }
+
+  auto env = rocksdb::Env::Default();
+  auto status = CreateDirs(env, dir_);
+  if (!status.ok()) {
+    return status;
+  }
+
+  const auto id = std::to_string(now) + "_" +
+    std::to_string(folly::Random::rand32());
+  const auto path = dir_ + "/" + id;
+  uint64_t seq_no = 0;
+  status = db_wrapper->CreateCheckpoint(path, &seq_no);
+
+  CheckpointResponse new_response;
+  new_response.checkpoint_id = id;
+  new_response.seq_no = seq_no;
+  std::string identity;
+  if (status.ok() && db_wrapper->GetDbIdentity(&identity).ok()) {
+    new_response.set_db_identity(identity);
+  }
+  std::vector<std::string> children;
+  if (status.ok()) {
+    status = env->GetChildren(path, &children);
+  }
+  for (const auto& name : children) {
+    if (!status.ok()) {
+      break;
+    }
+    if (name == "." || name == "..") {
+      continue;
+    }
+
+    CheckpointFile file;
+    file.name = name;
+    uint64_t size = 0;
+    status = env->GetFileSize(path + "/" + name, &size);
+    file.size = size;
+    new_response.files.push_back(std::move(file));
+  }
+
+  if (!status.ok()) {
+    deleteCheckpoint(id);
+    return status;
+  }
+
+  LOG(INFO) << "Created checkpoint " << path << " at sequence # " << seq_no
+            << " with " << new_response.files.size() << " files";
+  *response = new_response;
+  std::lock_guard<std::mutex> g(mtx_);
+  checkpoints_.emplace(id, Checkpoint{std::move(new_response), now, now});
+  scheduleExpiry();
+  return rocksdb::Status::OK();
+}
+
+rocksdb::Status CheckpointStore::read(const std::string& checkpoint_id,
+                                      const std::string& file_name,
+                                      const uint64_t offset,
+                                      const uint32_t max_bytes,
+                                      folly::IOBuf* data) {
+  std::string path;
+  uint64_t file_size;
+  {
+    std::lock_guard<std::mutex> g(mtx_);
+    auto itor = checkpoints_.find(checkpoint_id);
+    if (itor == checkpoints_.end()) {
+      return rocksdb::Status::NotFound("no checkpoint " + checkpoint_id);
+    }
+
+    // only ever read files listed in the checkpoint
+    const auto& files = itor->second.response.files;
+    auto file = std::find_if(files.begin(), files.end(),
+                             [&file_name] (const CheckpointFile& f) {
+                               return f.name == file_name;
+                             });
+    if (file == files.end()) {
+      return rocksdb::Status::NotFound("no file " + file_name + " in " +
+                                       checkpoint_id);
+    }
+
+    file_size = std::max<int64_t>(file->size, 0);
+
+    itor->second.last_used_ms = NowMs();
+    path = dir_ + "/" + checkpoint_id + "/" + file_name;
+  }
+
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return rocksdb::Status::IOError(path, strerror(errno));
+  }
+  SCOPE_EXIT { close(fd); };
+
+  // don't allocate more than what's left of the file
+  const uint64_t n_bytes = std::min<uint64_t>(
+    max_bytes, file_size > offset ? file_size - offset : 0);
+  auto buf = folly::IOBuf::create(n_bytes);
+  while (buf->length() < n_bytes) {
+    auto n = pread(fd, buf->writableTail(), n_bytes - buf->length(),
+                   offset + buf->length());
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      return rocksdb::Status::IOError(path, strerror(errno));
+    }
+    if (n == 0) {
+      break;
+    }
+    buf->append(n);
+  }
+
+  *data = std::move(*buf);
+  return rocksdb::Status::OK();
+}
+
+size_t CheckpointStore::size() {
+  std::lock_guard<std::mutex> g(mtx_);
+  return checkpoints_.size();
+}
+
+void CheckpointStore::scheduleExpiry() {
+  if (expiry_scheduled_) {
+    return;
+  }
+
+  expiry_scheduled_ = true;
+  std::weak_ptr<CheckpointStore> weak_self = shared_from_this();
+  timer_wheel_->schedule(
+    [weak_self = std::move(weak_self), executor = executor_] {
+      if (weak_self.lock() == nullptr) {
+        return;
+      }
+
+      executor->add([weak_self] {
+          auto self = weak_self.lock();
+          if (self) {
+            self->expire();
+          }
+        });
+    },
+    ttl_ms_);
+}
+
+void CheckpointStore::expire() {
+  const auto now = NowMs();
+  std::vector<std::string> expired;
+  {
+    std::lock_guard<std::mutex> g(mtx_);
+    auto itor = checkpoints_.begin();
+    while (itor != checkpoints_.end()) {
+      if (itor->second.last_used_ms + ttl_ms_ <= now) {
+        expired.push_back(itor->first);
+        itor = checkpoints_.erase(itor);
+        continue;
+      }
+
+      ++itor;
+    }
+
+    expiry_scheduled_ = false;
+    if (!checkpoints_.empty()) {
+      scheduleExpiry();
+    }
+  }
+
+  for (const auto& id : expired) {
+    LOG(INFO) << "Deleting idle checkpoint " << dir_ << "/" << id;
+    deleteCheckpoint(id);
+  }
+}
+
+void CheckpointStore::deleteCheckpoint(const std::string& id) {
+  auto env = rocksdb::Env::Default();
+  const auto path = dir_ + "/" + id;
+  std::vector<std::string> children;
+  if (env->GetChildren(path, &children).ok()) {
+    for (const auto& name : children) {
+      if (name != "." && name != "..") {
+        env->DeleteFile(path + "/" + name);
+      }
+    }
+  }
+  env->DeleteDir(path);
+}
+
+}  // namespace detail
+}  // namespace replicator
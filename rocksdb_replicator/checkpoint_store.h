@@ -0,0 +1,112 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#pragma once
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "folly/Executor.h"
+#include "folly/io/IOBuf.h"
+#include "rocksdb/status.h"
+#include "rocksdb_replicator/db_wrapper.h"
+#include "rocksdb_replicator/thrift/gen-cpp2/replicator_types.h"
+#include "rocksdb_replicator/timer_wheel.h"
+
+namespace replicator { namespace detail {
+
+/*
+ * CheckpointStore keeps the checkpoints of a db which downstreams are
+ * bootstrapping from, each in a sub directory of dir.
+ *
+ * A checkpoint not read for ttl_ms is deleted on executor. A checkpoint
+ * created in the last reuse_ms is handed out again instead of creating a new
+ * one, so that downstreams bootstrapping at about the same time share it.
+ *
+ * @note All public interface of CheckpointStore are thread safe.
+ */
+class CheckpointStore : public std::enable_shared_from_this<CheckpointStore> {
+ public:
+  CheckpointStore(std::string dir,
+                  folly::Executor* executor,
+                  const uint64_t ttl_ms,
+                  const uint64_t reuse_ms,
+                  TimerWheel* timer_wheel = TimerWheel::shared());
+
+  // Delete all checkpoints
+  ~CheckpointStore();
+
+  // no copy or move
+  CheckpointStore(const CheckpointStore&) = delete;
+  CheckpointStore& operator=(const CheckpointStore&) = delete;
+
+  /*
+   * Create a checkpoint of db_wrapper, or reuse a recent one, and describe it
+   * in response.
+   */
+  rocksdb::Status create(DbWrapper* db_wrapper, CheckpointResponse* response);
+
+  /*
+   * Read up to max_bytes of file_name in checkpoint_id from offset into data.
+   * At most the rest of the file, as listed in the checkpoint, is allocated.
+   * Return NotFound if there is no such checkpoint or file.
+   */
+  rocksdb::Status read(const std::string& checkpoint_id,
+                       const std::string& file_name,
+                       const uint64_t offset,
+                       const uint32_t max_bytes,
+                       folly::IOBuf* data);
+
+  // The # of checkpoints kept
+  size_t size();
+
+ private:
+  struct Checkpoint {
+    CheckpointResponse response;
+    uint64_t created_ms;
+    uint64_t last_used_ms;
+  };
+
+  // Arm the expiry timer unless it's armed. Caller must hold mtx_.
+  void scheduleExpiry();
+
+  // Delete the checkpoints not read for ttl_ms_
+  void expire();
+
+  // Delete the checkpoint directory id
+  void deleteCheckpoint(const std::string& id);
+
+  const std::string dir_;
+  folly::Executor* const executor_;
+  const uint64_t ttl_ms_;
+  const uint64_t reuse_ms_;
+  TimerWheel* const timer_wheel_;
+
+  // serializes create()
+  std::mutex create_mtx_;
+
+  // mtx_ protects checkpoints_ and expiry_scheduled_
+  std::mutex mtx_;
+  std::map<std::string, Checkpoint> checkpoints_;
+  bool expiry_scheduled_;
+};
+
+}  // namespace detail
+}  // namespace replicator
@@ -0,0 +1,209 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#pragma once
+
+#include <functional>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#if __GNUC__ >= 8
+#include "folly/concurrency/ConcurrentHashMap.h"
+#include "folly/synchronization/Rcu.h"
+#else
+#include "rocksdb_replicator/fast_read_map.h"
+#endif
+
+namespace replicator { namespace detail {
+
+/*
+ * A thread safe concurrent map optimized for reads, with the same interface
+ * as FastReadMap.
+ *
+ * Values are indexed by a folly::ConcurrentHashMap, so add() and remove() are
+ * O(1) instead of copying the whole map. Readers look values up inside an RCU
+ * read section, which only touches thread local state. remove() waits for the
+ * readers that may still see the removed value before destroying it, so once
+ * it returns the map holds no reference to the value. visit() gives access to
+ * a value without copying it, which saves a shared refcount bump when V is a
+ * std::shared_ptr.
+ *
+ * @note f passed to visit() and forEach() must not modify the map, and
+ * should be short, as it runs inside the RCU read section, which remove()
+ * and clear() wait for. Copy the value out with get() to do more with it.
+ *
+ * With older folly (gcc < 8 builds), it falls back to FastReadMap.
+ */
+template <typename K, typename V, typename H = std::hash<K>>
+class ConcurrentReadMap {
+ public:
+  ConcurrentReadMap()
+      : map_()
+      , write_lock_() {
+  }
+
+  ~ConcurrentReadMap() {
+#if __GNUC__ >= 8
+    for (auto itor = map_.cbegin(); itor != map_.cend(); ++itor) {
+      delete itor->second;
+    }
+#endif
+  }
+
+  // no copy or move
+  ConcurrentReadMap(const ConcurrentReadMap&) = delete;
+  ConcurrentReadMap& operator=(const ConcurrentReadMap&) = delete;
+
+  /*
+   * Get the value associated with the key.
+   * If key is found in the map, value is filled with the found value.
+   * Otherwise, value is untouched, and false is returned.
+   */
+  bool get(const K& key, V* value) {
+    return visit(key, [value] (const V& v) { *value = v; });
+  }
+
+  /*
+   * Call f(value) with the value associated with the key, without copying it.
+   * The value stays valid during the call even if it is removed concurrently.
+   * Return false if key is not found in the map, in which case f is not called.
+   */
+  template <typename F>
+  bool visit(const K& key, F&& f) {
+#if __GNUC__ >= 8
+    folly::rcu_reader guard;
+    auto itor = map_.find(key);
+    if (itor == map_.cend()) {
+      return false;
+    }
+
+    f(*itor->second);
+    return true;
+#else
+    V value;
+    if (!map_.get(key, &value)) {
+      return false;
+    }
+
+    f(value);
+    return true;
+#endif
+  }
+
+  /*
+   * Add the (key, value) pair to the map.
+   * If key is already in the map, it is a non-op, and false is returned.
+   */
+  bool add(const K& key, const V& value) {
+#if __GNUC__ >= 8
+    std::lock_guard<std::mutex> g(write_lock_);
+    auto new_value = new V(value);
+    if (!map_.insert(key, new_value).second) {
+      // the key is already in the map
+      delete new_value;
+      return false;
+    }
+
+    return true;
+#else
+    return map_.add(key, value);
+#endif
+  }
+
+  /*
+   * Remove key from the map.
+   * Return false if key is not found in the map.
+   */
+  bool remove(const K& key, V* value = nullptr) {
+#if __GNUC__ >= 8
+    std::lock_guard<std::mutex> g(write_lock_);
+    V* old_value;
+    {
+      auto itor = map_.find(key);
+      if (itor == map_.cend()) {
+        // the key is not in the map
+        return false;
+      }
+      old_value = itor->second;
+    }
+
+    map_.erase(key);
+    folly::synchronize_rcu();
+    if (value) {
+      *value = std::move(*old_value);
+    }
+    delete old_value;
+    return true;
+#else
+    return map_.remove(key, value);
+#endif
+  }
+
+  /*
+   * Clear the whole map
+   */
+  void clear() {
+#if __GNUC__ >= 8
+    std::lock_guard<std::mutex> g(write_lock_);
+    std::vector<V*> old_values;
+    for (auto itor = map_.cbegin(); itor != map_.cend(); ++itor) {
+      old_values.push_back(itor->second);
+    }
+
+    map_.clear();
+    folly::synchronize_rcu();
+    for (auto old_value : old_values) {
+      delete old_value;
+    }
+#else
+    map_.clear();
+#endif
+  }
+
+  /*
+   * Call f(key, value) for every pair in the map. Pairs added or removed
+   * while iterating may or may not be visited.
+   */
+  template <typename F>
+  void forEach(F&& f) {
+#if __GNUC__ >= 8
+    folly::rcu_reader guard;
+    for (auto itor = map_.cbegin(); itor != map_.cend(); ++itor) {
+      f(itor->first, *itor->second);
+    }
+#else
+    map_.forEach(std::forward<F>(f));
+#endif
+  }
+
+ private:
+#if __GNUC__ >= 8
+  // values are owned by *this, and destroyed by remove() and clear() once no
+  // reader can see them
+  folly::ConcurrentHashMap<K, V*, H> map_;
+#else
+  FastReadMap<K, V, H> map_;
+#endif
+
+  // lock for synchronizing write ops
+  std::mutex write_lock_;
+};
+
+}  // namespace detail
+}  // namespace replicator
@@ -1,4 +1,7 @@
 #pragma once
+#include <string>
+#include <vector>
+
 #include "rocksdb/db.h"
 #include "rocksdb_replicator/thrift/gen-cpp2/Replicator.h"
 
@@ -11,6 +14,34 @@ public:
       rocksdb::SequenceNumber seq_number,
       std::unique_ptr<rocksdb::TransactionLogIterator>* iter) = 0;
   virtual uint64_t LatestSequenceNumber() = 0;
+  // Hint that the WAL following seq_no is about to be read, so that up to
+  // max_bytes of it may be brought into the page cache ahead of time.
+  virtual void PrefetchWal(rocksdb::SequenceNumber /* seq_no */,
+                           uint64_t /* max_bytes */) {}
+  // Create a checkpoint of the db in dir, which must not exist, for a
+  // downstream to bootstrap from. seq_no is set to its latest sequence #.
+  virtual rocksdb::Status CreateCheckpoint(const std::string& /* dir */,
+                                           uint64_t* /* seq_no */) {
+    return rocksdb::Status::NotSupported("checkpoints are not supported");
+  }
+  // Same as rocksdb::DB::GetDbIdentity()
+  virtual rocksdb::Status GetDbIdentity(std::string* /* identity */) {
+    return rocksdb::Status::NotSupported("db identity is not supported");
+  }
   virtual bool HandleReplicateResponse(Update* update) = 0;
+  // Apply the updates in [begin, end) in order, and return how many of them
+  // have been applied before the first failure. Overrides must still apply
+  // each update as its own write, so that downstreams of this db see the same
+  // WAL records as upstream.
+  virtual size_t HandleReplicateResponses(std::vector<Update>::iterator begin,
+                                          std::vector<Update>::iterator end) {
+    size_t n = 0;
+    for (auto itor = begin; itor != end; ++itor, ++n) {
+      if (!HandleReplicateResponse(&*itor)) {
+        break;
+      }
+    }
+    return n;
+  }
 };
 }  // namespace replicator
\ No newline at end of file
@@ -116,6 +116,24 @@ class FastReadMap {
     return true;
   }
 
+  /*
+   * Call f(key, value) for every pair in the map, as of the call.
+   * Modifications made while iterating are not visible to f.
+   */
+  template <typename F>
+  void forEach(F&& f) {
+    std::shared_ptr<std::unordered_map<K, V>> local_map;
+
+    {
+      folly::RWSpinLock::ReadHolder read_guard(map_rwlock_);
+      local_map = map_;
+    }
+
+    for (const auto& kv : *local_map) {
+      f(kv.first, kv.second);
+    }
+  }
+
   /*
    * Clear the whole map
    */
@@ -0,0 +1,139 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#include "rocksdb_replicator/follower_ack_tracker.h"
+
+#include <algorithm>
+#include <functional>
+
+namespace replicator { namespace detail {
+
+constexpr double FollowerAckTracker::kAlpha;
+
+uint64_t FollowerAckTracker::ack(const std::string& id,
+                                 const uint64_t applied_seq_no,
+                                 const uint64_t now_ms,
+                                 int64_t* ack_ms,
+                                 bool* became_unhealthy) {
+  *ack_ms = -1;
+  *became_unhealthy = false;
+
+  std::lock_guard<std::mutex> g(mtx_);
+  auto& f = followers_.emplace(id, Follower{0, 0, 0, 0, 0.0, true})
+    .first->second;
+  f.acked_seq_no = std::max(f.acked_seq_no, applied_seq_no);
+  f.last_seen_ms = now_ms;
+  if (f.sent_seq_no != 0 && f.acked_seq_no >= f.sent_seq_no) {
+    const uint64_t ms = now_ms > f.sent_ms ? now_ms - f.sent_ms : 0;
+    f.expected_ack_ms = f.expected_ack_ms == 0 ?
+      ms : kAlpha * ms + (1 - kAlpha) * f.expected_ack_ms;
+    f.sent_seq_no = 0;
+    *ack_ms = ms;
+  }
+
+  return quorumAckedSeqNo(now_ms, became_unhealthy);
+}
+
+uint64_t FollowerAckTracker::refresh(const uint64_t now_ms,
+                                     bool* became_unhealthy) {
+  *became_unhealthy = false;
+  std::lock_guard<std::mutex> g(mtx_);
+  return quorumAckedSeqNo(now_ms, became_unhealthy);
+}
+
+void FollowerAckTracker::sent(const std::string& id,
+                              const uint64_t seq_no,
+                              const uint64_t now_ms) {
+  std::lock_guard<std::mutex> g(mtx_);
+  auto itor = followers_.find(id);
+  // only followers which have acked something are tracked
+  if (itor == followers_.end()) {
+    return;
+  }
+
+  auto& f = itor->second;
+  // time the earliest unacked send only
+  if (f.sent_seq_no == 0 && seq_no > f.acked_seq_no) {
+    f.sent_seq_no = seq_no;
+    f.sent_ms = now_ms;
+  }
+}
+
+std::vector<FollowerAckTracker::FollowerInfo>
+FollowerAckTracker::getFollowers(const uint64_t now_ms) {
+  std::vector<FollowerInfo> infos;
+  std::lock_guard<std::mutex> g(mtx_);
+  for (const auto& p : followers_) {
+    infos.push_back(FollowerInfo{p.first,
+                                 p.second.acked_seq_no,
+                                 p.second.last_seen_ms,
+                                 p.second.expected_ack_ms,
+                                 isHealthy(p.second, now_ms)});
+  }
+  return infos;
+}
+
+bool FollowerAckTracker::isHealthy(const Follower& f,
+                                   const uint64_t now_ms) const {
+  if (f.last_seen_ms + stale_ms_ < now_ms) {
+    return false;
+  }
+
+  if (f.expected_ack_ms > max_expected_ack_ms_) {
+    return false;
+  }
+
+  return f.sent_seq_no == 0 || f.sent_ms + max_expected_ack_ms_ >= now_ms;
+}
+
+uint64_t FollowerAckTracker::quorumAckedSeqNo(const uint64_t now_ms,
+                                              bool* became_unhealthy) {
+  std::vector<uint64_t> acked_seq_nos;
+  size_t n_healthy = 0;
+  auto itor = followers_.begin();
+  while (itor != followers_.end()) {
+    auto& follower = itor->second;
+    if (follower.last_seen_ms + 10 * stale_ms_ < now_ms) {
+      itor = followers_.erase(itor);
+      continue;
+    }
+
+    const bool healthy = isHealthy(follower, now_ms);
+    if (follower.healthy && !healthy) {
+      *became_unhealthy = true;
+    }
+    follower.healthy = healthy;
+    n_healthy += healthy ? 1 : 0;
+    acked_seq_nos.push_back(follower.acked_seq_no);
+    ++itor;
+  }
+
+  if (acked_seq_nos.empty()) {
+    return 0;
+  }
+
+  const size_t k = std::min(
+    acked_seq_nos.size(),
+    std::max<size_t>(1, std::min(quorum_, n_healthy)));
+  std::nth_element(acked_seq_nos.begin(), acked_seq_nos.begin() + k - 1,
+                   acked_seq_nos.end(), std::greater<uint64_t>());
+  return acked_seq_nos[k - 1];
+}
+
+}  // namespace detail
+}  // namespace replicator
@@ -0,0 +1,135 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#pragma once
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace replicator { namespace detail {
+
+/*
+ * FollowerAckTracker keeps the ack state of every follower of a leader db,
+ * and tells the sequence # acked by a quorum of them.
+ *
+ * Each follower's expected ack latency is an EWMA of how long it took to ack
+ * the updates sent to it recently, i.e. from sending a response (or a push)
+ * until its next request (or push response) shows they have been applied.
+ *
+ * A follower is healthy if it has been seen in the last stale_ms, its
+ * expected ack latency is no more than max_expected_ack_ms, and it hasn't
+ * left a send unacked for longer than that either. The quorum is
+ * min(quorum, # of healthy followers), but at least 1. So a slow or gone
+ * follower drops out of the quorum, and writes are acked by the healthy ones
+ * instead of timing out. Acks from unhealthy followers still count towards
+ * the quorum. Health is re-evaluated on every ack, and by refresh(), which
+ * the leader calls while writes are waiting, so a follower which stopped
+ * acking drops out without waiting for the others to ack.
+ *
+ * Followers not seen for 10 * stale_ms are forgotten.
+ *
+ * @note All public interface of FollowerAckTracker are thread safe.
+ */
+class FollowerAckTracker {
+ public:
+  struct FollowerInfo {
+    std::string id;
+    uint64_t acked_seq_no;
+    uint64_t last_seen_ms;
+    // 0 if no ack latency has been measured yet
+    double expected_ack_ms;
+    bool healthy;
+  };
+
+  FollowerAckTracker(const size_t quorum,
+                     const uint64_t max_expected_ack_ms,
+                     const uint64_t stale_ms)
+    : quorum_(quorum)
+    , max_expected_ack_ms_(max_expected_ack_ms)
+    , stale_ms_(stale_ms)
+    , mtx_()
+    , followers_() {}
+
+  // no copy or move
+  FollowerAckTracker(const FollowerAckTracker&) = delete;
+  FollowerAckTracker& operator=(const FollowerAckTracker&) = delete;
+
+  /*
+   * Follower id has applied updates up to applied_seq_no, as of now_ms.
+   * ack_ms is set to the ack latency measured from this ack, or -1 if there
+   * is none. became_unhealthy is set to true if a follower (this one or
+   * another one) has just turned unhealthy.
+   *
+   * @return the sequence # acked by the quorum
+   */
+  uint64_t ack(const std::string& id,
+               const uint64_t applied_seq_no,
+               const uint64_t now_ms,
+               int64_t* ack_ms,
+               bool* became_unhealthy);
+
+  /*
+   * Re-evaluate the health of the followers as of now_ms, without an ack.
+   * became_unhealthy is set the same way as ack() does.
+   *
+   * @return the sequence # acked by the quorum, 0 if no follower is tracked
+   */
+  uint64_t refresh(const uint64_t now_ms, bool* became_unhealthy);
+
+  /*
+   * Updates up to seq_no have been sent to follower id at now_ms
+   */
+  void sent(const std::string& id,
+            const uint64_t seq_no,
+            const uint64_t now_ms);
+
+  std::vector<FollowerInfo> getFollowers(const uint64_t now_ms);
+
+ private:
+  // weight of a new ack latency sample in the EWMA
+  static constexpr double kAlpha = 0.2;
+
+  struct Follower {
+    uint64_t acked_seq_no;
+    uint64_t last_seen_ms;
+    // the last update of the earliest send not acked yet, 0 if there is none
+    uint64_t sent_seq_no;
+    uint64_t sent_ms;
+    double expected_ack_ms;
+    bool healthy;
+  };
+
+  bool isHealthy(const Follower& f, const uint64_t now_ms) const;
+
+  // Forget the followers gone for long, refresh the health of the others,
+  // and return the sequence # acked by the quorum. Caller must hold mtx_.
+  uint64_t quorumAckedSeqNo(const uint64_t now_ms, bool* became_unhealthy);
+
+  const size_t quorum_;
+  const uint64_t max_expected_ack_ms_;
+  const uint64_t stale_ms_;
+
+  // mtx_ protects followers_
+  std::mutex mtx_;
+  std::map<std::string, Follower> followers_;
+};
+
+}  // namespace detail
+}  // namespace replicator
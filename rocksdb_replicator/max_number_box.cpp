@@ -21,86 +21,170 @@
 #include <algorithm>
 
 #include "folly/Likely.h"
+#include "rocksdb_replicator/timer_wheel.h"
 
 namespace replicator { namespace detail {
 
-void MaxNumberBox::post(const uint64_t num) {
-  std::vector<Waiter*> waiters_to_notify;
-  std::vector<Waiter*> waiters_to_wait;
+const uint64_t MaxNumberBox::kNoWaiter;
 
+MaxNumberBox::~MaxNumberBox() {
+  // it's client's responsibility to ensure there is no pending wait() when
+  // the destructor is called. Pending waitAsync() callers simply get false.
+  std::vector<std::shared_ptr<Waiter>> heap;
   {
-    std::unique_lock<std::mutex> lk(mtx_);
-    if (num <= max_number_) {
+    std::lock_guard<std::mutex> g(waiters_->mtx);
+    heap.swap(waiters_->heap);
+    waiters_->num_timed_out = 0;
+  }
+  for (auto& w : heap) {
+    if (w->should_i_fulfill()) {
+      w->promise.setValue(false);
+    }
+  }
+}
+
+void MaxNumberBox::post(const uint64_t num) {
+  auto cur = max_number_.load();
+  do {
+    if (num <= cur) {
       return;
     }
+  } while (!max_number_.compare_exchange_weak(cur, num));
 
-    max_number_ = num;
+  // Paired with waitAsync(), which publishes min_num_to_wait before
+  // re-checking max_number_. Either we see its waiter here, or it sees num.
+  if (LIKELY(num < waiters_->min_num_to_wait.load())) {
+    return;
+  }
 
-    if (waiters_.empty()) {
-      return;
+  std::vector<std::shared_ptr<Waiter>> waiters_to_notify;
+  {
+    std::lock_guard<std::mutex> g(waiters_->mtx);
+    waiters_->popSatisfied(max_number_.load(), &waiters_to_notify);
+  }
+
+  // We don't want to hold mtx_ when fulfilling promises, which may run
+  // callbacks inline.
+  for (auto& w : waiters_to_notify) {
+    w->promise.setValue(true);
+  }
+}
+
+folly::Future<bool> MaxNumberBox::waitAsync(const uint64_t num,
+                                            const uint64_t timeout_ms) {
+  if (UNLIKELY(num <= max_number_.load())) {
+    return folly::makeFuture(true);
+  }
+
+  auto w = std::make_shared<Waiter>(num);
+  auto future = w->promise.getFuture();
+  std::vector<std::shared_ptr<Waiter>> waiters_to_notify;
+
+  {
+    std::lock_guard<std::mutex> g(waiters_->mtx);
+    waiters_->heap.push_back(w);
+    std::push_heap(waiters_->heap.begin(), waiters_->heap.end(),
+                   waiterGreater);
+    waiters_->refreshMin();
+
+    // A post() may have raised max_number_ before seeing min_num_to_wait.
+    if (num <= max_number_.load()) {
+      waiters_->popSatisfied(max_number_.load(), &waiters_to_notify);
     }
+  }
 
-    std::partition_copy(waiters_.begin(), waiters_.end(),
-                        std::back_inserter(waiters_to_notify),
-                        std::back_inserter(waiters_to_wait),
-                        [this] (Waiter* w) {
-                          return w->num_to_wait <= this->max_number_;
-                        });
+  for (auto& satisfied : waiters_to_notify) {
+    satisfied->promise.setValue(true);
+  }
 
-    waiters_.swap(waiters_to_wait);
+  if (timeout_ms > 0 && !w->done.load()) {
+    // Put weak_ptrs in the timeout lambda, so that waiters fulfilled by
+    // post() don't stay around until the timeout, and neither does the
+    // waiter heap once *this is gone.
+    std::weak_ptr<Waiter> weak_w(w);
+    std::weak_ptr<Waiters> weak_waiters(waiters_);
+    TimerWheel::shared()->schedule(
+      [weak_w = std::move(weak_w),
+       weak_waiters = std::move(weak_waiters)] {
+        auto w = weak_w.lock();
+        if (w == nullptr) {
+          return;
+        }
+
+        auto waiters = weak_waiters.lock();
+        if (waiters) {
+          // w is still in heap if it's not done, as popSatisfied() flips
+          // done with mtx held too.
+          std::lock_guard<std::mutex> g(waiters->mtx);
+          if (!w->should_i_fulfill()) {
+            return;
+          }
+          waiters->timedOut();
+        } else if (!w->should_i_fulfill()) {
+          return;
+        }
+        w->promise.setValue(false);
+      },
+      timeout_ms);
   }
 
-  // We don't want to hold mtx_ when calling notify_one(). Because that could
-  // make pending threads wake up and go to sleep immediately due to we are
-  // still holding mtx_.
-  // This could make a pending thread return true from wait() or wait_for() due
-  // to spurious wakeup or timeout. This is benign. Because we use the pred versions
-  // of wait() and wait_for(). Also concurrent calling notify_one() is safe.
-  std::for_each(waiters_to_notify.begin(), waiters_to_notify.end(),
-                [] (Waiter* w) { w->cv.notify_one(); });
+  return future;
 }
 
 bool MaxNumberBox::wait(const uint64_t num, const uint64_t timeout_ms) {
-  // We use thread local waiter because 1) avoid constructor and destructor
-  // overhead of Waiter::cv; 2) It is possible that the thread calling wait()
-  // returns from wait() before the thread calling post() calls notify_one()
-  // on Waiter::cv.
-  thread_local Waiter me;
-
-  std::unique_lock<std::mutex> lk(mtx_);
-  if (UNLIKELY(num <= max_number_)) {
+  if (LIKELY(num <= max_number_.load())) {
     return true;
   }
 
-  me.num_to_wait = num;
-  waiters_.push_back(&me);
+  return waitAsync(num, timeout_ms).get();
+}
 
-  if (timeout_ms == 0) {
-    me.cv.wait(lk, [this, num] { return num <= this->max_number_; });
-    return true;
+size_t MaxNumberBox::numWaiters() const {
+  std::lock_guard<std::mutex> g(waiters_->mtx);
+  return waiters_->heap.size() - waiters_->num_timed_out;
+}
+
+void MaxNumberBox::Waiters::popSatisfied(
+    const uint64_t max_number,
+    std::vector<std::shared_ptr<Waiter>>* satisfied) {
+  while (!heap.empty() && heap.front()->num_to_wait <= max_number) {
+    std::pop_heap(heap.begin(), heap.end(), waiterGreater);
+    auto w = std::move(heap.back());
+    heap.pop_back();
+    if (w->should_i_fulfill()) {
+      satisfied->push_back(std::move(w));
+    } else {
+      --num_timed_out;
+    }
   }
 
+  refreshMin();
+}
 
-  if (me.cv.wait_for(lk,
-                     std::chrono::milliseconds(timeout_ms),
-                     [this, num] { return num <= this->max_number_; })) {
-    return true;
+void MaxNumberBox::Waiters::timedOut() {
+  ++num_timed_out;
+  if (num_timed_out * 2 >= heap.size()) {
+    heap.erase(std::remove_if(heap.begin(), heap.end(),
+                              [] (const std::shared_ptr<Waiter>& w) {
+                                return w->done.load();
+                              }),
+               heap.end());
+    std::make_heap(heap.begin(), heap.end(), waiterGreater);
+    num_timed_out = 0;
+  }
+
+  refreshMin();
+}
+
+void MaxNumberBox::Waiters::refreshMin() {
+  while (!heap.empty() && heap.front()->done.load()) {
+    std::pop_heap(heap.begin(), heap.end(), waiterGreater);
+    heap.pop_back();
+    --num_timed_out;
   }
 
-  // We are timeouted if we are here.
-  // If it is timeout. wait_for() will acquire the lock and recheck pred. So
-  // it is safe to assert that we must still be in waiters_, and that
-  // num > max_number_.
-  // waiters_ usually has a few to at most a few hundreds elements. So we use
-  // std::vector instead of list to make code simpler and achieve better cache
-  // locality. Also timeout shouldn't be on the performance critical path.
-  auto new_end = std::remove(waiters_.begin(), waiters_.end(), &me);
-  // TODO (bol) change it to DCHECK/assert() once it's stable.
-  CHECK(num > max_number_ && std::distance(new_end, waiters_.end()) == 1);
-  waiters_.erase(new_end, waiters_.end());
-  return false;
+  min_num_to_wait.store(heap.empty() ? kNoWaiter : heap.front()->num_to_wait);
 }
 
 }  // namespace detail
 }  // namespace replicator
-
@@ -18,10 +18,13 @@
 
 #pragma once
 
-#include <condition_variable>
+#include <atomic>
+#include <limits>
+#include <memory>
 #include <mutex>
 #include <vector>
 
+#include "folly/futures/Future.h"
 #include "glog/logging.h"
 
 namespace replicator { namespace detail {
@@ -30,8 +33,15 @@ namespace replicator { namespace detail {
  * MaxNumberBox is a data structure for maintaining the max number it receives
  * through its post() API.
  *
- * It also provides a wait() API, which will block caller until the max number
- * is no less than the number parameter, or timeout_ms has passed.
+ * It also provides a waitAsync() API, which returns a future fulfilled with
+ * true once the max number is no less than the number parameter, or with false
+ * once timeout_ms has passed. wait() is the blocking version of waitAsync().
+ *
+ * post() is a single CAS on max_number_ unless it satisfies a pending waiter,
+ * and wait() on a satisfied number never takes the lock either. Timeouts run
+ * on the shared TimerWheel, and timed out waiters are only marked so. They
+ * are dropped once they reach the top of the heap, or all at once when they
+ * make up half of it, so that a timeout costs O(log n) amortized.
  *
  * @note All public interface of MaxNumberBox are thread safe.
  */
@@ -41,15 +51,10 @@ class MaxNumberBox {
    * init_num is the initial number in the box.
    */
   MaxNumberBox(const uint64_t init_num = 0)
-    : mtx_()
-    , max_number_(init_num)
-    , waiters_() {}
-
-  ~MaxNumberBox() {
-    // it's client's responsibility to ensure there is no pending calls when the
-    // destructor is called.
-    CHECK(waiters_.empty());
-  }
+    : max_number_(init_num)
+    , waiters_(std::make_shared<Waiters>()) {}
+
+  ~MaxNumberBox();
 
   // no copy or move
   MaxNumberBox(const MaxNumberBox&) = delete;
@@ -64,22 +69,88 @@ class MaxNumberBox {
    * Wait until (num <= the max number *this received) or timeout_ms
    * timeout_ms == 0 means no timeout
    *
-   * @return true if (num <= the max number *this received), false if timeout.
+   * @return a future fulfilled with true if (num <= the max number *this
+   * received), false if timeout or *this is destroyed before that.
+   */
+  folly::Future<bool> waitAsync(const uint64_t num, const uint64_t timeout_ms);
+
+  /*
+   * Blocking version of waitAsync()
    */
   bool wait(const uint64_t num, const uint64_t timeout_ms);
 
+  /*
+   * The max number *this has received so far
+   */
+  uint64_t get() const {
+    return max_number_.load();
+  }
+
+  /*
+   * The number of wait() and waitAsync() calls pending
+   */
+  size_t numWaiters() const;
+
  private:
+  static const uint64_t kNoWaiter = std::numeric_limits<uint64_t>::max();
+
   struct Waiter {
-    uint64_t num_to_wait;
-    std::condition_variable cv;
+    explicit Waiter(const uint64_t num)
+      : num_to_wait(num)
+      , promise()
+      , done(false) {}
+
+    // whoever flips done first fulfills promise
+    bool should_i_fulfill() {
+      return !done.exchange(true);
+    }
+
+    const uint64_t num_to_wait;
+    folly::Promise<bool> promise;
+    std::atomic<bool> done;
+  };
+
+  // Order heap as a min-heap on num_to_wait
+  static bool waiterGreater(const std::shared_ptr<Waiter>& a,
+                            const std::shared_ptr<Waiter>& b) {
+    return a->num_to_wait > b->num_to_wait;
+  }
+
+  // Pending waiters. Shared with their timeouts, which may fire after *this
+  // is destroyed.
+  struct Waiters {
+    Waiters() : min_num_to_wait(kNoWaiter), mtx(), heap(), num_timed_out(0) {}
+
+    // Move the waiters satisfied by max_number into satisfied, smallest
+    // first, marking them done, and refresh min_num_to_wait. The ones
+    // already timed out are dropped instead. Caller must hold mtx.
+    void popSatisfied(const uint64_t max_number,
+                      std::vector<std::shared_ptr<Waiter>>* satisfied);
+
+    // Account for a waiter in heap that has just timed out, and sweep the
+    // timed out ones if they make up half of heap. Caller must hold mtx.
+    void timedOut();
+
+    // Drop the timed out waiters at the top of heap, and refresh
+    // min_num_to_wait. Caller must hold mtx.
+    void refreshMin();
+
+    // The smallest num_to_wait in heap, or kNoWaiter if there is none.
+    // Written with mtx held, read without it by post() to decide whether it
+    // needs to take mtx at all.
+    std::atomic<uint64_t> min_num_to_wait;
+    // mtx protects heap and num_timed_out
+    std::mutex mtx;
+    std::vector<std::shared_ptr<Waiter>> heap;
+    // Waiters in heap that have timed out, i.e. are done. Waiters in heap
+    // only get done by timing out, and done is only flipped for them with
+    // mtx held.
+    size_t num_timed_out;
   };
 
-  // mtx_ protects max_number_ and waiters_
-  // We didn't investigate using other mutex types. Our gut feeling is that the
-  // mutex type itself won't be the bottleneck.
-  std::mutex mtx_;
-  uint64_t max_number_;
-  std::vector<Waiter*> waiters_;
+  // The max number posted so far. Only ever increases.
+  std::atomic<uint64_t> max_number_;
+  const std::shared_ptr<Waiters> waiters_;
 };
 
 }  // namespace detail
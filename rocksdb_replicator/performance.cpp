@@ -17,7 +17,10 @@
 //
 
 #include <folly/ScopeGuard.h>
+#include <time.h>
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
 #include <memory>
 #include <string>
@@ -33,6 +36,7 @@
 #include "rocksdb/rate_limiter.h"
 #include "rocksdb/table.h"
 #include "rocksdb_replicator/thrift/gen-cpp2/Replicator.h"
+#include "thrift/lib/cpp2/protocol/Serializer.h"
 
 
 using folly::SocketAddress;
@@ -63,8 +67,33 @@ DEFINE_int32(num_keys_per_shard_thread, 10 * 1024,
 DEFINE_string(db_path, "/tmp/", "The path to dbs");
 DEFINE_string(upstream_ip, "127.0.0.1", "upstream ip address");
 DEFINE_int32(value_size, 1024, "value size");
+DEFINE_bool(benchmark_serving, false,
+            "Benchmark the leader side cost of serving updates to followers, "
+            "instead of running a replication session");
+DEFINE_int32(num_serving_followers, 3,
+             "Number of followers each update is served to when "
+             "benchmark_serving is set");
+
+DEFINE_bool(benchmark_catch_up, false,
+            "Benchmark how long a follower takes to catch up. The master "
+            "writes catch_up_seq_nos updates before serving, and the slave "
+            "measures the time to converge");
+DEFINE_int64(catch_up_seq_nos, 10 * 1000 * 1000,
+             "Number of sequence numbers the follower is behind when "
+             "benchmark_catch_up is set");
+DEFINE_int32(catch_up_records_per_batch, 10,
+             "Number of records in each WriteBatch when benchmark_catch_up "
+             "is set");
+
+DEFINE_bool(benchmark_group_commit, false,
+            "Benchmark writes/s to a single leader shard at 1, 8 and 64 "
+            "concurrent writers, with and without group commit");
+DEFINE_bool(sync_writes, true,
+            "Sync the WAL on every write when benchmark_group_commit is set");
 
 DECLARE_int32(rocksdb_replicator_port);
+DECLARE_bool(replicator_adaptive_response_bytes);
+DECLARE_bool(replicator_group_commit);
 
 bool notFinished(const vector<RocksDBReplicator::ReplicatedDB*>& dbs) {
   for (auto& db : dbs) {
@@ -90,6 +119,178 @@ uint64_t GetCurrentTime() {
     std::chrono::system_clock::now().time_since_epoch()).count();
 }
 
+uint64_t GetThreadCpuTimeUs() {
+  timespec ts;
+  CHECK_EQ(clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts), 0);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Serve all updates in db to FLAGS_num_serving_followers followers the same
+// way handleReplicateRequest() does, including thrift serialization.
+// Return the number of bytes served per CPU second.
+double ServeAllUpdates(DB* db, bool zero_copy) {
+  uint64_t bytes = 0;
+  const auto cpu_begin = GetThreadCpuTimeUs();
+  for (int i = 0; i < FLAGS_num_serving_followers; ++i) {
+    std::unique_ptr<rocksdb::TransactionLogIterator> iter;
+    CHECK(db->GetUpdatesSince(1, &iter).ok());
+    for (; iter->Valid(); iter->Next()) {
+      auto result = iter->GetBatch();
+      replicator::Update update;
+      if (zero_copy) {
+        bytes += RocksDBReplicator::ReplicatedDB::fillUpdate(&result, &update);
+      } else {
+        // The serving path before zero copy
+        update.set_seq_no(result.sequence);
+        const auto& str = result.writeBatchPtr->Data();
+        bytes += str.size();
+        update.raw_data = std::move(*folly::IOBuf::copyBuffer(str.data(),
+                                                              str.size()));
+        replicator::LogExtractor extractor;
+        if (result.writeBatchPtr->Iterate(&extractor).ok()) {
+          update.timestamp = extractor.ms;
+        }
+      }
+
+      folly::IOBufQueue queue;
+      apache::thrift::CompactSerializer::serialize(update, &queue);
+    }
+  }
+
+  const auto cpu_end = GetThreadCpuTimeUs();
+  return static_cast<double>(bytes) * 1000000 /
+    std::max<uint64_t>(cpu_end - cpu_begin, 1);
+}
+
+void BenchmarkServing(Options& options) {
+  auto db_name = string("serving_shard");
+  auto raw_db = cleanAndOpenDB(FLAGS_db_path + db_name, options);
+  RocksDBReplicator::ReplicatedDB* db;
+  CHECK(RocksDBReplicator::instance()->addDB(db_name, raw_db,
+                                             ReplicaRole::LEADER,
+                                             SocketAddress(), &db) ==
+        ReturnCode::OK);
+
+  string dummy_data;
+  dummy_data.resize(FLAGS_value_size);
+  const rocksdb::WriteOptions write_options;
+  for (int n = 0; n < FLAGS_num_keys_per_shard_thread; ++n) {
+    WriteBatch update;
+    update.Put("key_" + to_string(n), dummy_data);
+    CHECK(db->Write(write_options, &update).ok());
+  }
+
+  // warm up the page cache for WAL files
+  ServeAllUpdates(raw_db.get(), true);
+
+  LOG(INFO) << "Serving " << FLAGS_num_keys_per_shard_thread << " updates to "
+            << FLAGS_num_serving_followers << " followers";
+  LOG(INFO) << "copy:      " << ServeAllUpdates(raw_db.get(), false)
+            << " bytes/s per core";
+  LOG(INFO) << "zero copy: " << ServeAllUpdates(raw_db.get(), true)
+            << " bytes/s per core";
+
+  RocksDBReplicator::instance()->removeDB(db_name);
+}
+
+void BenchmarkCatchUp(Options& options) {
+  auto db_name = string("catch_up_shard");
+  RocksDBReplicator::ReplicatedDB* db;
+  SocketAddress addr(FLAGS_upstream_ip, FLAGS_rocksdb_replicator_port);
+
+  if (FLAGS_is_master) {
+    auto raw_db = cleanAndOpenDB(FLAGS_db_path + db_name, options);
+    string dummy_data;
+    dummy_data.resize(FLAGS_value_size);
+    const rocksdb::WriteOptions write_options;
+    int64_t n = 0;
+    LOG(INFO) << "Writing " << FLAGS_catch_up_seq_nos << " updates...";
+    while (n < FLAGS_catch_up_seq_nos) {
+      WriteBatch update;
+      for (int i = 0;
+           i < FLAGS_catch_up_records_per_batch && n < FLAGS_catch_up_seq_nos;
+           ++i, ++n) {
+        update.Put("key_" + to_string(n), dummy_data);
+      }
+      CHECK(raw_db->Write(write_options, &update).ok());
+    }
+
+    CHECK(RocksDBReplicator::instance()->addDB(db_name, raw_db,
+                                               ReplicaRole::LEADER,
+                                               SocketAddress(), &db) ==
+          ReturnCode::OK);
+    LOG(INFO) << "Ready to serve the follower";
+    while (true) {
+      sleep_for(seconds(10));
+      LOG(INFO) << common::Stats::get()->DumpStatsAsText();
+    }
+  }
+
+  const auto start = std::chrono::steady_clock::now();
+  CHECK(RocksDBReplicator::instance()->addDB(
+          db_name, cleanAndOpenDB(FLAGS_db_path + db_name, options),
+          ReplicaRole::FOLLOWER, addr, &db) == ReturnCode::OK);
+  while (static_cast<int64_t>(db->db_wrapper_->LatestSequenceNumber()) <
+         FLAGS_catch_up_seq_nos) {
+    sleep_for(std::chrono::milliseconds(10));
+  }
+  const auto end = std::chrono::steady_clock::now();
+
+  LOG(INFO) << "Caught up " << FLAGS_catch_up_seq_nos << " sequence numbers in "
+            << std::chrono::duration_cast<std::chrono::milliseconds>(
+                 end - start).count()
+            << " ms with adaptive response bytes "
+            << (FLAGS_replicator_adaptive_response_bytes ? "on" : "off");
+  LOG(INFO) << common::Stats::get()->DumpStatsAsText();
+  RocksDBReplicator::instance()->removeDB(db_name);
+}
+
+void BenchmarkGroupCommit(Options& options) {
+  auto db_name = string("group_commit_shard");
+  RocksDBReplicator::ReplicatedDB* db;
+  CHECK(RocksDBReplicator::instance()->addDB(
+          db_name, cleanAndOpenDB(FLAGS_db_path + db_name, options),
+          ReplicaRole::LEADER, SocketAddress(), &db) == ReturnCode::OK);
+
+  string dummy_data;
+  dummy_data.resize(FLAGS_value_size);
+  WriteOptions write_options;
+  write_options.sync = FLAGS_sync_writes;
+
+  for (bool group_commit : {false, true}) {
+    FLAGS_replicator_group_commit = group_commit;
+    for (int num_writers : {1, 8, 64}) {
+      std::atomic<int64_t> num_writes(0);
+      std::atomic<bool> stop(false);
+      vector<thread> threads(num_writers);
+      for (int i = 0; i < num_writers; ++i) {
+        threads[i] = thread([&, thread_id = i] {
+            int64_t n = 0;
+            while (!stop.load()) {
+              WriteBatch update;
+              update.Put("thread_" + to_string(thread_id) + "_key_" +
+                         to_string(n++), dummy_data);
+              CHECK(db->Write(write_options, &update).ok());
+              ++num_writes;
+            }
+          });
+      }
+
+      sleep_for(seconds(10));
+      stop.store(true);
+      for (auto& thread : threads) {
+        thread.join();
+      }
+
+      LOG(INFO) << "group commit " << (group_commit ? "on " : "off")
+                << ", " << num_writers << " writers: "
+                << num_writes.load() / 10 << " writes/s";
+    }
+  }
+
+  RocksDBReplicator::instance()->removeDB(db_name);
+}
+
 int main(int argc, char** argv) {
   google::ParseCommandLineFlags(&argc, &argv, true);
   LOG(INFO) << common::Stats::get()->DumpStatsAsText();
@@ -111,6 +312,21 @@ int main(int argc, char** argv) {
     rocksdb::NewBlockBasedTableFactory(table_options));
   options.create_if_missing = true;
 
+  if (FLAGS_benchmark_serving) {
+    BenchmarkServing(options);
+    return 0;
+  }
+
+  if (FLAGS_benchmark_group_commit) {
+    BenchmarkGroupCommit(options);
+    return 0;
+  }
+
+  if (FLAGS_benchmark_catch_up) {
+    BenchmarkCatchUp(options);
+    return 0;
+  }
+
   vector<RocksDBReplicator::ReplicatedDB*> dbs;
   RocksDBReplicator::ReplicatedDB* db;
   auto replicator = RocksDBReplicator::instance();
@@ -158,12 +374,25 @@ int main(int argc, char** argv) {
       LOG(INFO) << common::Stats::get()->DumpStatsAsText();
     }
   } else {
+    // Start the clock once the master starts writing
+    while (std::all_of(dbs.begin(), dbs.end(),
+                       [] (RocksDBReplicator::ReplicatedDB* db) {
+                         return db->db_wrapper_->LatestSequenceNumber() == 0;
+                       })) {
+      sleep_for(std::chrono::milliseconds(10));
+    }
+
+    const auto start = GetCurrentTime();
     while (notFinished(dbs)) {
       sleep_for(seconds(1));
       LOG(INFO) << common::Stats::get()->DumpStatsAsText();
     }
+    const auto end = GetCurrentTime();
 
     LOG(INFO) << "Done";
+    LOG(INFO) << "Applied " << FLAGS_num_write_threads *
+      FLAGS_num_keys_per_shard_thread * FLAGS_num_shards << " updates in "
+              << end - start << " seconds";
     LOG(INFO) << common::Stats::get()->DumpStatsAsText();
 
     if (FLAGS_verify_data) {
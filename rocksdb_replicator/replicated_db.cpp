@@ -18,6 +18,7 @@
 
 #include <gflags/gflags.h>
 
+#include <algorithm>
 #include <chrono>
 #include <string>
 #include <vector>
@@ -29,9 +30,12 @@
 #include "common/timer.h"
 #include "folly/MoveWrapper.h"
 #include "folly/Random.h"
+#include "folly/futures/Future.h"
 #include "rocksdb_replicator/replicator_stats.h"
 #include "rocksdb_replicator/rocksdb_replicator.h"
+#include "rocksdb_replicator/timer_wheel.h"
 #include "rocksdb_replicator/utils.h"
+#include "rocksdb_replicator/write_batch_util.h"
 
 DEFINE_int32(replicator_max_server_wait_time_ms, 10 * 1000,
              "Max wait time before an empty response is returned");
@@ -42,6 +46,91 @@ DEFINE_int32(replicator_client_server_timeout_difference_ms, 10 * 1000,
 DEFINE_int32(replicator_max_updates_per_response, 50,
              "Max number of RocksDB updates a response can contain");
 
+DEFINE_bool(replicator_adaptive_response_bytes, false,
+            "Ask upstream for a byte budget per response instead of a fixed "
+            "# of updates, and adapt the budget to replication lag and RTT");
+
+DEFINE_int32(replicator_max_updates_per_adaptive_response, 10000,
+             "Max number of RocksDB updates a response can contain when "
+             "replicator_adaptive_response_bytes is enabled");
+
+DEFINE_uint64(replicator_min_bytes_per_response, 64 * 1024,
+              "The smallest byte budget a follower asks for in a response");
+
+DEFINE_uint64(replicator_max_bytes_per_response, 16 * 1024 * 1024,
+              "The largest byte budget a follower asks for in a response");
+
+DEFINE_uint64(replicator_max_pull_rtt_ms, 500,
+              "The byte budget stops growing and shrinks if a pull from "
+              "upstream takes longer than this while catching up");
+
+DEFINE_int32(replicator_pull_pipeline_depth, 1,
+             "Max number of pull requests in flight per db while a follower "
+             "is catching up. 1 disables pipelining");
+
+DEFINE_int32(replicator_pull_window_seq_nos, 1000,
+             "Number of sequence numbers covered by each pipelined pull "
+             "request");
+
+DEFINE_bool(replicator_group_commit, false,
+            "Merge concurrent writes to a db into a single RocksDB write, "
+            "and wait for follower ACK once for the whole group");
+
+DEFINE_uint64(replicator_group_commit_max_bytes, 1024 * 1024,
+              "Max total size of the WriteBatches merged into a group commit");
+
+DEFINE_bool(replicator_push_replication, false,
+            "Followers subscribe to their upstream, which pushes updates as "
+            "they are committed, instead of pulling updates");
+
+DEFINE_int32(replicator_push_idle_timeout_ms, 30 * 1000,
+             "A subscribed follower subscribes again if upstream has not "
+             "pushed anything for this long. A follower which has fallen back "
+             "to pulling tries to subscribe again at the same interval");
+
+DEFINE_int32(replicator_push_max_retries, 3,
+             "Number of times a failed push is retried before the subscriber "
+             "is dropped");
+
+DEFINE_int32(replicator_push_retry_delay_ms, 200,
+             "Delay before retrying a failed push, doubled on each retry");
+
+DEFINE_int32(replicator_wal_tail_cache_max_updates, 1024,
+             "Max number of recently served updates cached per db for other "
+             "followers to reuse. 0 disables the cache");
+
+DEFINE_int32(replicator_wal_tail_cache_max_bytes, 4 * 1024 * 1024,
+             "Max total size of updates cached per db in the WAL tail cache");
+
+DEFINE_bool(replicator_tagged_timestamps, false,
+            "Write the timestamp of each update as a tagged 16-byte LogData, "
+            "which readers find without iterating the batch, rather than the "
+            "bare 8-byte one. Hosts reading a tagged timestamp must run a "
+            "version which understands it, so only enable it once every host "
+            "replicating the db, followers included, has been upgraded to "
+            "such a version. Followers write what they apply the same way, "
+            "so enable it on all hosts alike.");
+
+DEFINE_bool(replicator_compress_updates, false,
+            "Compress updates served to downstreams with a zstd dictionary "
+            "trained from the db's recent WAL records, and ask upstream to do "
+            "the same. Either side without it falls back to no compression");
+
+DEFINE_int32(replicator_compression_level, 3,
+             "zstd level used to compress updates served to downstreams");
+
+DEFINE_int32(replicator_compression_dict_bytes, 16 * 1024,
+             "Max size of the zstd dictionary trained per db");
+
+DEFINE_int32(replicator_compression_sample_bytes, 1024 * 1024,
+             "Bytes of served WAL records sampled to train a dictionary");
+
+DEFINE_int32(replicator_compression_dict_refresh_ms, 10 * 60 * 1000,
+             "How often the dictionary of a db is trained again");
+
+DEFINE_int32(replicator_compression_min_bytes, 64,
+             "Updates smaller than this are served uncompressed");
+
 DEFINE_int32(replicator_pull_delay_on_error_ms, 5 * 1000,
              "How long to wait before sending the next pull request on error");
 
@@ -77,7 +166,56 @@ DEFINE_uint64(replicator_consecutive_ack_timeout_before_degradation, 100,
              "The max number of consecutive replication timeout, before a DB enters degradation mode "
              "and use the above replicator_timeout_degraded_ms");
 
-DECLARE_int32(replicator_idle_iter_timeout_ms);
+DEFINE_int32(replicator_idle_iter_timeout_ms, 60 * 1000,
+             "Timeout value after which idle cached iters are removed");
+DEFINE_int32(replicator_max_cached_iters_per_db, 64,
+             "Max # of WAL iterators kept warm for the downstreams of a db");
+DEFINE_uint64(replicator_iter_fork_max_seq_nos, 10000,
+              "A downstream missing a warm WAL iterator at its sequence # may "
+              "take over one at most this many sequence #s behind, instead "
+              "of creating one from scratch. 0 disables it");
+DEFINE_uint64(replicator_iter_fork_min_idle_ms, 15 * 1000,
+              "Only take over WAL iterators unused for this long, which are "
+              "likely left by downstreams that went away. Keep it above how "
+              "long a live downstream may take between reads, including "
+              "replicator_max_server_wait_time_ms");
+DEFINE_uint64(replicator_wal_prefetch_bytes, 4 * 1024 * 1024,
+              "How many bytes of WAL to prefetch from about where a WAL "
+              "iterator created from scratch is, at most once a second per "
+              "db. Keep it small, every db of the host may prefetch at once "
+              "when downstreams reconnect. 0 disables it");
+DEFINE_int32(replicator_ack_quorum, 1,
+             "In replication mode 2, the # of followers which must ack a write. "
+             "Followers excluded for being slow or gone don't count, so fewer "
+             "acks are required if there are not enough healthy followers");
+DEFINE_uint64(replicator_follower_max_expected_ack_ms, 500,
+              "A follower expected to take longer than this to ack, based on "
+              "its recent acks, is excluded from the ack quorum");
+DEFINE_uint64(replicator_follower_stale_ms, 30 * 1000,
+              "A follower not heard from for this long is excluded from the "
+              "ack quorum");
+DEFINE_string(replicator_checkpoint_dir, "/tmp/replicator_checkpoints/",
+              "Where checkpoints for downstreams to bootstrap from are "
+              "created. On the same filesystem as the dbs, sst files are hard "
+              "linked instead of copied");
+DEFINE_uint64(replicator_checkpoint_ttl_ms, 10 * 60 * 1000,
+              "A checkpoint not read by any downstream for this long is "
+              "deleted");
+DEFINE_uint64(replicator_checkpoint_reuse_ms, 60 * 1000,
+              "A checkpoint created less than this long ago is handed out to "
+              "downstreams again instead of creating a new one");
+DEFINE_bool(replicator_bootstrap_from_checkpoint, false,
+            "Bootstrap a follower from a checkpoint of its upstream when the "
+            "updates it needs have been purged from the upstream WAL. Requires "
+            "a bootstrap handler set on RocksDBReplicator");
+DEFINE_string(replicator_bootstrap_dir, "/tmp/replicator_bootstrap/",
+              "Where checkpoints are downloaded to. The bootstrap handler "
+              "moves them next to the dbs, which is a copy if this is on "
+              "another filesystem");
+DEFINE_int32(replicator_bootstrap_parallelism, 8,
+             "Max # of checkpoint chunks downloaded at the same time per db");
+DEFINE_int32(replicator_bootstrap_chunk_bytes, 4 * 1024 * 1024,
+             "Size of the checkpoint chunks downloaded");
 DEFINE_string(replicator_zk_cluster, "", "Zookeeper cluster");
 DEFINE_string(replicator_helix_cluster, "", "Helix cluster");
 DEFINE_int32(replication_error_reset_upstream_percentage, 10,
@@ -108,42 +246,23 @@ rocksdb::Status RocksDBReplicator::ReplicatedDB::Write(
     throw ReturnCode::WRITE_TO_SLAVE;
   }
 
-  auto write_begin = GetCurrentTimeMs();
-
-  incCounter(kReplicatorWriteBytes, updates->GetDataSize(), db_name_);
+  if (FLAGS_replicator_group_commit) {
+    return writeGroupCommit(options, updates, seq_no);
+  }
 
-  auto ms = GetCurrentTimeMs();
-  updates->PutLogData(rocksdb::Slice(reinterpret_cast<const char*>(&ms),
-                                     sizeof(ms)));
-  auto write_leader_begin = GetCurrentTimeMs();
-  auto status = db_wrapper_->WriteToLeader(options, updates);
-  auto write_leader_end = GetCurrentTimeMs();
-  auto write_leader_time = write_leader_begin < write_leader_end ? write_leader_end - write_leader_begin : 0;
-  logMetric(kReplicatorWriteToLeaderMs, write_leader_time, db_name_);
+  auto write_begin = GetCurrentTimeMs();
 
+  rocksdb::SequenceNumber cur_seq_no;
+  auto status = writeToLeader(options, updates, write_begin, &cur_seq_no);
   if (!status.ok()) {
-    incCounter(kReplicatorWriteLeaderFailure, 1, db_name_);
-    auto write_failure_end = GetCurrentTimeMs();
-    logMetric(kReplicatorWriteFailureResponseTime, write_begin < write_failure_end? write_failure_end - write_begin : 0, db_name_);
     return status;
   }
 
-  auto replication_mode =  common::DBConfigManager::get()->getReplicationMode(db_name_);
-  // TODO(prem) : remove support for gflags soon
-  // for now we have to support both till all clusters are migrated
-  if (FLAGS_replicator_replication_mode > replication_mode) {
-    replication_mode = FLAGS_replicator_replication_mode;
-  }
-
-  cond_var_.notifyAll();
-
-  // TODO(bol): change it once RocksDB guarantees the sequence number is in
-  // the write batch.
-  auto cur_seq_no = db_wrapper_->LatestSequenceNumber();
   if (seq_no) {
     *seq_no = cur_seq_no;
   }
 
+  auto replication_mode = replicationMode();
   switch (replication_mode) {
   case 1:
   case 2:
@@ -159,17 +278,251 @@ rocksdb::Status RocksDBReplicator::ReplicatedDB::Write(
       << "Invalid replicaton mode " << replication_mode;
   }
   auto write_success_end = GetCurrentTimeMs();
-  logMetric(kReplicatorWriteSuccessResponseTime, write_begin < write_success_end? write_success_end - write_begin : 0, db_name_);
-  incCounter(kReplicatorWriteSuccess, 1, db_name_);
+  stats_.logMetric(kReplicatorWriteSuccessResponseTime, write_begin < write_success_end? write_success_end - write_begin : 0);
+  stats_.incCounter(kReplicatorWriteSuccess, 1);
+
+  return status;
+}
+
+folly::Future<rocksdb::SequenceNumber>
+RocksDBReplicator::ReplicatedDB::WriteAsync(
+    const rocksdb::WriteOptions& options,
+    rocksdb::WriteBatch* updates) {
+  if (role_ == ReplicaRole::FOLLOWER || role_ == ReplicaRole::OBSERVER) {
+    throw ReturnCode::WRITE_TO_SLAVE;
+  }
+
+  auto write_begin = GetCurrentTimeMs();
+
+  rocksdb::SequenceNumber cur_seq_no;
+  auto status = writeToLeader(options, updates, write_begin, &cur_seq_no);
+  if (!status.ok()) {
+    return folly::makeFuture<rocksdb::SequenceNumber>(WriteException(status));
+  }
+
+  auto replication_mode = replicationMode();
+  if (replication_mode == 0) {
+    auto write_success_end = GetCurrentTimeMs();
+    stats_.logMetric(kReplicatorWriteSuccessResponseTime, write_begin < write_success_end? write_success_end - write_begin : 0);
+    stats_.incCounter(kReplicatorWriteSuccess, 1);
+    return folly::makeFuture(cur_seq_no);
+  }
+
+  CHECK(replication_mode == 1 || replication_mode == 2)
+    << "Invalid replicaton mode " << replication_mode;
+
+  // The continuation runs in the thread calling post(), or in the thread
+  // destroying max_seq_no_acked_ when this db is being removed. Use a weak
+  // pointer so that we don't touch a destroyed db in the latter case.
+  scheduleAckQuorumCheck();
+  std::weak_ptr<ReplicatedDB> weak_db = shared_from_this();
+  return max_seq_no_acked_.waitAsync(cur_seq_no,
+                                     current_replicator_timeout_ms_.load())
+    .then([weak_db = std::move(weak_db), cur_seq_no, write_begin] (bool acked) {
+        auto db = weak_db.lock();
+        if (db == nullptr) {
+          throw WriteException(
+            rocksdb::Status::Aborted("db removed while waiting for ack"));
+        }
+
+        auto status = db->checkFollowerACK(acked);
+        if (!status.ok()) {
+          throw WriteException(status);
+        }
+
+        auto write_success_end = GetCurrentTimeMs();
+        db->stats_.logMetric(kReplicatorWriteSuccessResponseTime, write_begin < write_success_end? write_success_end - write_begin : 0);
+        db->stats_.incCounter(kReplicatorWriteSuccess, 1);
+        return cur_seq_no;
+      });
+}
+
+rocksdb::Status RocksDBReplicator::ReplicatedDB::writeToLeader(
+    const rocksdb::WriteOptions& options,
+    rocksdb::WriteBatch* updates,
+    const uint64_t write_begin,
+    rocksdb::SequenceNumber* cur_seq_no) {
+  stats_.incCounter(kReplicatorWriteBytes, updates->GetDataSize());
+
+  AppendTimestamp(updates, GetCurrentTimeMs(),
+                  FLAGS_replicator_tagged_timestamps);
+  auto write_leader_begin = GetCurrentTimeMs();
+  auto status = db_wrapper_->WriteToLeader(options, updates);
+  auto write_leader_end = GetCurrentTimeMs();
+  auto write_leader_time = write_leader_begin < write_leader_end ? write_leader_end - write_leader_begin : 0;
+  stats_.logMetric(kReplicatorWriteToLeaderMs, write_leader_time);
+
+  if (!status.ok()) {
+    stats_.incCounter(kReplicatorWriteLeaderFailure, 1);
+    auto write_failure_end = GetCurrentTimeMs();
+    stats_.logMetric(kReplicatorWriteFailureResponseTime, write_begin < write_failure_end? write_failure_end - write_begin : 0);
+    return status;
+  }
+
+  cond_var_.notify();
+  pushToSubscribers();
+
+  // TODO(bol): change it once RocksDB guarantees the sequence number is in
+  // the write batch.
+  *cur_seq_no = db_wrapper_->LatestSequenceNumber();
+  return status;
+}
+
+int RocksDBReplicator::ReplicatedDB::replicationMode() const {
+  auto replication_mode =  common::DBConfigManager::get()->getReplicationMode(db_name_);
+  // TODO(prem) : remove support for gflags soon
+  // for now we have to support both till all clusters are migrated
+  if (FLAGS_replicator_replication_mode > replication_mode) {
+    replication_mode = FLAGS_replicator_replication_mode;
+  }
+  return replication_mode;
+}
+
+rocksdb::Status RocksDBReplicator::ReplicatedDB::writeGroupCommit(
+    const rocksdb::WriteOptions& options,
+    rocksdb::WriteBatch* updates,
+    rocksdb::SequenceNumber* seq_no) {
+  auto write_begin = GetCurrentTimeMs();
+
+  stats_.incCounter(kReplicatorWriteBytes, updates->GetDataSize());
+
+  GroupCommitWriter w(options, updates);
+  std::unique_lock<std::mutex> lk(writers_mutex_);
+  writers_.push_back(&w);
+  w.cv.wait(lk, [this, &w] {
+      return w.done || (!writers_.empty() && writers_.front() == &w);
+    });
+
+  if (!w.done) {
+    // We are at the front of the queue, commit a group of writes on behalf of
+    // everyone queued behind us with compatible options.
+    std::vector<GroupCommitWriter*> group;
+    std::vector<const rocksdb::WriteBatch*> batches;
+    uint64_t group_bytes = 0;
+    for (auto writer : writers_) {
+      if (writer->options.sync != options.sync ||
+          writer->options.disableWAL != options.disableWAL) {
+        break;
+      }
+      const auto size = writer->batch->GetDataSize();
+      if (!group.empty() &&
+          group_bytes + size > FLAGS_replicator_group_commit_max_bytes) {
+        break;
+      }
+      group.push_back(writer);
+      batches.push_back(writer->batch);
+      group_bytes += size;
+    }
+    lk.unlock();
+
+    stats_.logMetric(kReplicatorGroupCommitSize, group.size());
+    auto merged = MergeWriteBatches(batches.begin(), batches.end());
+    AppendTimestamp(&merged, GetCurrentTimeMs(),
+                    FLAGS_replicator_tagged_timestamps);
+    auto write_leader_begin = GetCurrentTimeMs();
+    auto status = db_wrapper_->WriteToLeader(options, &merged);
+    auto write_leader_end = GetCurrentTimeMs();
+    auto write_leader_time = write_leader_begin < write_leader_end ? write_leader_end - write_leader_begin : 0;
+    stats_.logMetric(kReplicatorWriteToLeaderMs, write_leader_time);
+
+    if (status.ok()) {
+      // RocksDB stamps the sequence # into the batch it writes. Other writes
+      // to the db, e.g. from a replication thread, may land right after ours,
+      // so the latest sequence # is no substitute.
+      const auto first_seq_no = GetWriteBatchSequence(merged);
+      CHECK(first_seq_no != 0)
+        << "No sequence # in the write batch of " << db_name_;
+
+      // Each writer gets the sequence # of the last record in its own batch
+      uint64_t num_records = 0;
+      for (auto writer : group) {
+        num_records += writer->batch->Count();
+        writer->seq_no = first_seq_no + num_records - 1;
+        writer->written = true;
+      }
+
+      cond_var_.notify();
+      pushToSubscribers();
+    } else {
+      stats_.incCounter(kReplicatorWriteLeaderFailure, 1);
+    }
+
+    // Let the next group go ahead while we wait for follower ACK
+    lk.lock();
+    for (size_t i = 0; i < group.size(); ++i) {
+      writers_.pop_front();
+    }
+    if (!writers_.empty()) {
+      writers_.front()->cv.notify_one();
+    }
+    lk.unlock();
+
+    if (status.ok()) {
+      auto replication_mode = replicationMode();
+
+      switch (replication_mode) {
+      case 1:
+      case 2:
+        status = writeWaitFollowerACK(group.back()->seq_no);
+        break;
+      default:
+        CHECK(replication_mode == 0)
+          << "Invalid replicaton mode " << replication_mode;
+      }
+    }
+
+    lk.lock();
+    for (auto writer : group) {
+      writer->status = status;
+      writer->done = true;
+      if (writer != &w) {
+        writer->cv.notify_one();
+      }
+    }
+  }
+
+  auto status = w.status;
+  if (seq_no && w.written) {
+    *seq_no = w.seq_no;
+  }
+  lk.unlock();
+
+  auto write_end = GetCurrentTimeMs();
+  if (status.ok()) {
+    stats_.logMetric(kReplicatorWriteSuccessResponseTime, write_begin < write_end ? write_end - write_begin : 0);
+    stats_.incCounter(kReplicatorWriteSuccess, 1);
+  } else {
+    stats_.logMetric(kReplicatorWriteFailureResponseTime, write_begin < write_end ? write_end - write_begin : 0);
+  }
 
   return status;
 }
 
+folly::Future<bool> RocksDBReplicator::ReplicatedDB::WaitForSeqNo(
+    const rocksdb::SequenceNumber seq_no, const uint64_t timeout_ms) {
+  if (db_wrapper_->LatestSequenceNumber() >= seq_no) {
+    return folly::makeFuture(true);
+  }
+
+  // Followers notify cond_var_ whenever they apply updates from upstream
+  auto promise = std::make_shared<folly::Promise<bool>>();
+  auto future = promise->getFuture();
+  std::weak_ptr<ReplicatedDB> weak_db = shared_from_this();
+  cond_var_.runIfGreaterOrWaitForNotify(
+    [promise = std::move(promise), weak_db = std::move(weak_db), seq_no] {
+      auto db = weak_db.lock();
+      promise->setValue(db != nullptr &&
+                        db->db_wrapper_->LatestSequenceNumber() >= seq_no);
+    },
+    seq_no - 1,
+    timeout_ms);
+  return future;
+}
+
 std::string RocksDBReplicator::ReplicatedDB::Introspect() {
   auto upstream_addr_str = common::getNetworkAddressStr(upstream_addr_);
   auto cur_seq_no = db_wrapper_->LatestSequenceNumber();
 
-  // TODO(jz): consider json output
   std::stringstream ss;
   ss << "ReplicatedDB:" << std::endl;
   ss << "  name: " << db_name_ << std::endl;
@@ -177,10 +530,79 @@ std::string RocksDBReplicator::ReplicatedDB::Introspect() {
   ss << "  upstream_addr: " << upstream_addr_str << std::endl;
   ss << "  cur_seq_no: " << cur_seq_no << std::endl;
   ss << "  current_replicator_timeout_ms_: " << current_replicator_timeout_ms_.load() << std::endl;
-  // TODO(jz): add max_seq_no_acked_
+  ss << "  max_seq_no_acked_: " << max_seq_no_acked_.get() << std::endl;
   return ss.str();
 }
 
+Json::Value RocksDBReplicator::ReplicatedDB::IntrospectJson() {
+  // Everything below is either an atomic load or a short critical section,
+  // so that scraping all dbs on a host every few seconds is cheap.
+  const auto now = GetCurrentTimeMs();
+  const uint64_t cur_seq_no = db_wrapper_->LatestSequenceNumber();
+  const auto timeout_ms = current_replicator_timeout_ms_.load();
+
+  Json::Value root(Json::objectValue);
+  root["name"] = db_name_;
+  root["role"] = role_str_;
+  root["upstream_addr"] = common::getNetworkAddressStr(upstream_addr_);
+  root["cur_seq_no"] = Json::UInt64(cur_seq_no);
+  root["current_replicator_timeout_ms"] = Json::UInt(timeout_ms);
+  root["degraded"] = timeout_ms != FLAGS_replicator_timeout_ms &&
+    timeout_ms == FLAGS_replicator_timeout_degraded_ms;
+  root["consecutive_ack_timeouts"] = Json::UInt(numConsecutiveReplTimeout_.load());
+
+  if (role_ == ReplicaRole::LEADER) {
+    const auto acked = max_seq_no_acked_.get();
+    root["max_seq_no_acked"] = Json::UInt64(acked);
+    root["ack_lag_seq_nos"] =
+      Json::UInt64(cur_seq_no > acked ? cur_seq_no - acked : 0);
+    Json::Value followers(Json::objectValue);
+    for (const auto& info : ack_tracker_.getFollowers(now)) {
+      Json::Value follower(Json::objectValue);
+      follower["acked_seq_no"] = Json::UInt64(info.acked_seq_no);
+      follower["last_seen_ms"] = Json::UInt64(info.last_seen_ms);
+      follower["expected_ack_ms"] = info.expected_ack_ms;
+      follower["healthy"] = info.healthy;
+      followers[info.id] = follower;
+    }
+    root["followers"] = followers;
+  } else {
+    const uint64_t upstream_seq_no = upstream_latest_seq_no_.load();
+    const uint64_t applied_ms = last_applied_timestamp_ms_.load();
+    const bool behind = upstream_seq_no > cur_seq_no;
+    root["upstream_latest_seq_no"] = Json::UInt64(upstream_seq_no);
+    root["lag_seq_nos"] =
+      Json::UInt64(behind ? upstream_seq_no - cur_seq_no : 0);
+    // Updates newer than the last applied one may not exist yet when we are
+    // not behind, in which case there is no lag.
+    root["lag_ms"] =
+      Json::UInt64(behind && applied_ms != 0 && applied_ms < now ?
+                   now - applied_ms : 0);
+    root["last_applied_timestamp_ms"] = Json::UInt64(applied_ms);
+  }
+
+  double in_per_sec;
+  double out_per_sec;
+  meter_.getRates(now, &in_per_sec, &out_per_sec);
+  root["bytes_in"] = Json::UInt64(meter_.bytesIn());
+  root["bytes_out"] = Json::UInt64(meter_.bytesOut());
+  root["bytes_in_per_sec"] = in_per_sec;
+  root["bytes_out_per_sec"] = out_per_sec;
+
+  static const std::vector<double> kPcts = {50, 90, 99};
+  const auto rtts = meter_.getRttPercentiles(kPcts);
+  Json::Value pull_rtt_ms(Json::objectValue);
+  for (size_t i = 0; i < rtts.size(); ++i) {
+    pull_rtt_ms["p" + std::to_string(static_cast<int>(kPcts[i]))] =
+      Json::UInt64(rtts[i]);
+  }
+  root["pull_rtt_ms"] = pull_rtt_ms;
+
+  root["cached_iters"] = Json::UInt64(wal_iters_->size());
+  root["num_subscribers"] = Json::UInt(num_subscribers_.load());
+  return root;
+}
+
 
 RocksDBReplicator::ReplicatedDB::ReplicatedDB(
     const std::string& db_name,
@@ -192,24 +614,62 @@ RocksDBReplicator::ReplicatedDB::ReplicatedDB(
     const std::string& replicator_zk_cluster,
     const std::string& replicator_helix_cluster)
     : db_name_(db_name)
+    , stats_(db_name)
     , db_wrapper_(std::move(db_wrapper))
     , executor_(executor)
     , role_(role)
     , role_str_(ReplicaRoleString(role))
     , upstream_addr_(upstream_addr)
+    , follower_id_(common::getLocalIPAddress() + "/" + db_name)
     , client_pool_(client_pool)
     , replicator_zk_cluster_(replicator_zk_cluster)
     , replicator_helix_cluster_(replicator_helix_cluster)
     , client_()
-    , cond_var_(executor)
+    , cond_var_(executor,
+                [this] { return db_wrapper_->LatestSequenceNumber(); })
     , rpc_options_()
     , write_options_()
-    , cached_iters_()
-    , cached_iters_mutex_() {
+    , wal_iters_(std::make_shared<detail::WalIteratorManager>(
+        db_wrapper_,
+        executor,
+        FLAGS_replicator_max_cached_iters_per_db,
+        FLAGS_replicator_iter_fork_max_seq_nos,
+        FLAGS_replicator_iter_fork_min_idle_ms,
+        FLAGS_replicator_wal_prefetch_bytes,
+        FLAGS_replicator_idle_iter_timeout_ms))
+    , wal_tail_cache_()
+    , compressor_()
+    , decompressor_(FLAGS_replicator_max_bytes_per_response)
+    , response_budget_(FLAGS_replicator_min_bytes_per_response,
+                       FLAGS_replicator_max_bytes_per_response,
+                       FLAGS_replicator_max_pull_rtt_ms)
+    , ack_tracker_(std::max(FLAGS_replicator_ack_quorum, 1),
+                   FLAGS_replicator_follower_max_expected_ack_ms,
+                   FLAGS_replicator_follower_stale_ms)
+    , checkpoints_(std::make_shared<detail::CheckpointStore>(
+        FLAGS_replicator_checkpoint_dir + db_name,
+        executor,
+        FLAGS_replicator_checkpoint_ttl_ms,
+        FLAGS_replicator_checkpoint_reuse_ms))
+    , bootstrap_handler_() {
   if (role == ReplicaRole::FOLLOWER || role == ReplicaRole::OBSERVER) {
     client_ = client_pool_->getClient(upstream_addr);
   }
 
+  if (FLAGS_replicator_compress_updates) {
+    compressor_ = std::make_unique<detail::UpdateCompressor>(
+      FLAGS_replicator_compression_level,
+      FLAGS_replicator_compression_dict_bytes,
+      FLAGS_replicator_compression_sample_bytes,
+      FLAGS_replicator_compression_dict_refresh_ms);
+  }
+
+  if (FLAGS_replicator_wal_tail_cache_max_updates > 0) {
+    wal_tail_cache_ = std::make_unique<detail::WalTailCache>(
+      FLAGS_replicator_wal_tail_cache_max_updates,
+      FLAGS_replicator_wal_tail_cache_max_bytes);
+  }
+
   if (replicator_zk_cluster_.empty()) {
     replicator_zk_cluster_ = FLAGS_replicator_zk_cluster;
   }
@@ -234,16 +694,23 @@ RocksDBReplicator::ReplicatedDB::ReplicatedDB(
  * by ensuring the max ACKed sequence number is at least cur_seq_no.
  */
 rocksdb::Status RocksDBReplicator::ReplicatedDB::writeWaitFollowerACK(const uint64_t cur_seq_no) {
-  // TODO(bol): This potentially could block all worker threads. We may
-  // consider having a dedicated set of worker threads for admin requests,
-  // and/or provide async write API when this turns out to be a problem.
-  if (!max_seq_no_acked_.wait(cur_seq_no, current_replicator_timeout_ms_.load())) {
-    incCounter(kReplicatorWriteWaitTimedOut, 1, db_name_);
+  // This blocks the calling thread. Use WriteAsync() when worker threads
+  // shouldn't be tied up waiting for followers.
+  scheduleAckQuorumCheck();
+  return checkFollowerACK(
+    max_seq_no_acked_.wait(cur_seq_no, current_replicator_timeout_ms_.load()));
+}
+
+rocksdb::Status RocksDBReplicator::ReplicatedDB::checkFollowerACK(const bool acked) {
+  if (!acked) {
+    stats_.incCounter(kReplicatorWriteWaitTimedOut, 1);
     LOG(ERROR) << "Failed to receive ack from follower, timing out for " << db_name_;
     numConsecutiveReplTimeout_++;
 
     // enter degradation mode if there has been consecutive timeouts waiting for the follower ACK.
     // This allows us to use a smaller wait timeout to fail fast, instead of blocking for long.
+    // Slow followers are excluded from the ack quorum before it comes to this, so this only
+    // happens when no healthy follower is left.
     // Note that we don't have a mutex lock for the below conditions check for perf reasons,
     // so it's possible multiple thread calling this at the same time and decide to update
     // current_replicator_timeout_ms_ multiple times, that is idempotent and it is okay.
@@ -255,7 +722,7 @@ rocksdb::Status RocksDBReplicator::ReplicatedDB::writeWaitFollowerACK(const uint
       LOG(ERROR) << "Enter degradation mode for db " << db_name_
                 << " after " << numConsecutiveReplTimeout_.load() << " write timeouts,"
                 << " use new timeout to fail fast: " << current_replicator_timeout_ms_.load() << "ms";
-      incCounter(kReplicatorWriteTwoAckDegraded, 1, db_name_);
+      stats_.incCounter(kReplicatorWriteTwoAckDegraded, 1);
     }
     return rocksdb::Status::TimedOut("Failed to receive ack from follower");
   }
@@ -266,12 +733,75 @@ rocksdb::Status RocksDBReplicator::ReplicatedDB::writeWaitFollowerACK(const uint
     current_replicator_timeout_ms_.store(FLAGS_replicator_timeout_ms);
     LOG(ERROR) << "2-ACK Write succeeded, exit degradation mode and switch to use normal replicator timeout: "
               << current_replicator_timeout_ms_.load() << "ms";
-    incCounter(kReplicatorWriteTwoAckRecovered, 1, db_name_);
+    stats_.incCounter(kReplicatorWriteTwoAckRecovered, 1);
   }
 
   return rocksdb::Status::OK();
 }
 
+void RocksDBReplicator::ReplicatedDB::ackFromFollower(
+    const std::string& follower_id,
+    const uint64_t applied_seq_no) {
+  int64_t ack_ms;
+  bool became_unhealthy;
+  max_seq_no_acked_.post(ack_tracker_.ack(follower_id, applied_seq_no,
+                                          GetCurrentTimeMs(), &ack_ms,
+                                          &became_unhealthy));
+  if (ack_ms >= 0) {
+    stats_.logFollowerAckMs(follower_id, ack_ms);
+  }
+
+  if (became_unhealthy) {
+    reportFollowerExcluded();
+  }
+}
+
+void RocksDBReplicator::ReplicatedDB::scheduleAckQuorumCheck() {
+  // With a quorum of 1, the first ack completes the write anyway
+  if (FLAGS_replicator_ack_quorum <= 1 || ack_check_scheduled_.exchange(true)) {
+    return;
+  }
+
+  std::weak_ptr<ReplicatedDB> weak_db = shared_from_this();
+  detail::TimerWheel::shared()->schedule(
+    [weak_db = std::move(weak_db)] {
+      auto db = weak_db.lock();
+      if (db == nullptr) {
+        return;
+      }
+
+      // posting may complete writes waiting for acks, keep it off the wheel
+      // thread
+      db->executor_->add([weak_db] {
+          auto db = weak_db.lock();
+          if (db) {
+            db->checkAckQuorum();
+          }
+        });
+    },
+    FLAGS_replicator_follower_max_expected_ack_ms + 1);
+}
+
+void RocksDBReplicator::ReplicatedDB::checkAckQuorum() {
+  bool became_unhealthy;
+  max_seq_no_acked_.post(ack_tracker_.refresh(GetCurrentTimeMs(),
+                                              &became_unhealthy));
+  if (became_unhealthy) {
+    reportFollowerExcluded();
+  }
+
+  ack_check_scheduled_.store(false);
+  if (max_seq_no_acked_.numWaiters() > 0) {
+    scheduleAckQuorumCheck();
+  }
+}
+
+void RocksDBReplicator::ReplicatedDB::reportFollowerExcluded() {
+  LOG(WARNING) << "A follower of " << db_name_
+               << " is excluded from the ack quorum for being slow or gone";
+  stats_.incCounter(kReplicatorFollowerExcluded, 1);
+}
+
 /*
  * Helper function to reset the upstream IP after querying for latest leader from helix.
  */
@@ -302,7 +832,7 @@ void RocksDBReplicator::ReplicatedDB::resetUpstream() {
     std::vector<std::string> tokens;
     folly::split("_", leader_id, tokens);
     if (tokens.size() == 2 && tokens[0] != upstream_addr_.getAddressStr()) {
-      incCounter(kReplicatorLeaderReset, 1, db_name_);
+      stats_.incCounter(kReplicatorLeaderReset, 1);
       LOG(ERROR) << "[resetUpstream] Resetting upstream for " << db_name_ << " to " << tokens[0];
       upstream_addr_.setFromIpPort(tokens[0], FLAGS_rocksdb_replicator_port);
       // Update client with new upstream address.
@@ -313,84 +843,98 @@ void RocksDBReplicator::ReplicatedDB::resetUpstream() {
 
 void RocksDBReplicator::ReplicatedDB::pullFromUpstream() {
   CHECK(role_ == ReplicaRole::FOLLOWER || role_ == ReplicaRole::OBSERVER);
+  const uint64_t local_seq_no = db_wrapper_->LatestSequenceNumber();
+  if (FLAGS_replicator_pull_pipeline_depth > 1 &&
+      upstream_latest_seq_no_ >
+      local_seq_no + FLAGS_replicator_pull_window_seq_nos) {
+    pullFromUpstreamPipelined(local_seq_no);
+    return;
+  }
+
   ReplicateRequest req;
-  req.seq_no = db_wrapper_->LatestSequenceNumber();
+  req.seq_no = local_seq_no;
   req.db_name = db_name_;
   req.max_wait_ms = FLAGS_replicator_max_server_wait_time_ms;
   req.max_updates = FLAGS_replicator_max_updates_per_response;
   req.set_role(role_);
+  req.set_follower_id(follower_id_);
+  req.set_can_bootstrap(canBootstrap());
+  if (FLAGS_replicator_compress_updates) {
+    req.set_compression_dict_id(decompressor_.dictId());
+  }
+  if (FLAGS_replicator_adaptive_response_bytes) {
+    req.max_updates = FLAGS_replicator_max_updates_per_adaptive_response;
+    req.set_max_bytes(response_budget_.get());
+  }
 
-  incCounter(kReplicatorPullRequests, 1, db_name_);
+  stats_.incCounter(kReplicatorPullRequests, 1);
 
   std::weak_ptr<ReplicatedDB> weak_db = shared_from_this();
   auto options = rpc_options_;
   common::Timer timer(kReplicatorPullLatency);
+  const auto pull_start_ms = GetCurrentTimeMs();
   client_->future_replicate(options, req).via(executor_)
-    .then([weak_db = std::move(weak_db), timer = std::move(timer)] (folly::Try<ReplicateResponse>&& t) {
+    .then([weak_db = std::move(weak_db), timer = std::move(timer), pull_start_ms] (folly::Try<ReplicateResponse>&& t) {
         auto db = weak_db.lock();
         if (db == nullptr) {
           return;
         }
         bool delay_next_pull = false;
         if (t.hasException()) {
-          incCounter(kReplicatorPullRequestsFailure, 1, db->db_name_);
+          db->stats_.incCounter(kReplicatorPullRequestsFailure, 1);
           delay_next_pull = true;
-          try {
-#if __GNUC__ >= 8
-            t.exception().throw_exception();
-#else
-            t.exception().throwException();
-#endif
-          } catch (const ReplicateException& ex) {
-            LOG(ERROR) << "ReplicateException: upstream = " << common::getNetworkAddressStr(db->upstream_addr_) << ", code = " << static_cast<int>(ex.code)
-                       << ", message = " << ex.msg;
-            incCounter(kReplicatorRemoteApplicationExceptions, 1, db->db_name_);
-            
-            if (ex.code == ErrorCode::SOURCE_NOT_FOUND) {
-              // This could happen if this db missed a request about the latest upstream.
-              // So try to reset it.
-              incCounter(kReplicatorRemoteApplicationExceptionsNotFound, 1, db->db_name_);
-              db->resetUpstream();
-            }
-          } catch (const std::exception& ex) {
-            LOG(ERROR) << "std::exception when replicating from upstream " << common::getNetworkAddressStr(db->upstream_addr_)
-                       << " for db " << db->db_name_ << ": " << ex.what();
-            incCounter(kReplicatorConnectionErrors, 1, db->db_name_);
-            if (FLAGS_reset_upstream_on_std_exception) {
-              db->resetUpstream();
-            }
-            db->client_ = db->client_pool_->getClient(db->upstream_addr_);
-          }
+          db->handlePullException(t);
         } else {
-          incCounter(kReplicatorPullRequestsSuccess, 1, db->db_name_);
+          db->stats_.incCounter(kReplicatorPullRequestsSuccess, 1);
           auto& response = t.value();
+          if (!db->decompressUpdates(&response)) {
+            db->stats_.incCounter(kReplicatorDecompressionFailure, 1);
+            response.updates.clear();
+            delay_next_pull = true;
+          }
           uint64_t write_bytes = 0;
           const auto now = GetCurrentTimeMs();
           for (auto& update : response.updates) {
             if (update.timestamp != 0) {
               uint64_t then = update.timestamp;
-              logMetric(kReplicatorLatency, then < now ? now - then : 0,
-                        db->db_name_);
+              db->stats_.logMetric(kReplicatorLatency, then < now ? now - then : 0);
             }
 
-            auto byteRange = update.raw_data.coalesce();
-            write_bytes += byteRange.size();
-            if (!db->db_wrapper_->HandleReplicateResponse(&update)) {
-              incCounter(kReplicatorHandleResponseFailure, 1, db->db_name_);
-              delay_next_pull = true;
-              break;
-            }
+            write_bytes += update.raw_data.computeChainDataLength();
+          }
+
+          const auto n_applied = db->db_wrapper_->HandleReplicateResponses(
+            response.updates.begin(), response.updates.end());
+          db->recordApplied(response.updates.begin(), n_applied);
+          if (n_applied < response.updates.size()) {
+            db->stats_.incCounter(kReplicatorHandleResponseFailure, 1);
+            delay_next_pull = true;
           }
 
           if (response.__isset.role && response.role != ReplicaRole::LEADER) {
-            incCounter(kReplicatorPullFromNonLeader, 1, db->db_name_);
+            db->stats_.incCounter(kReplicatorPullFromNonLeader, 1);
+          }
+
+          if (response.__isset.latest_seq_no) {
+            db->upstream_latest_seq_no_ = response.latest_seq_no;
+          }
+
+          const auto rtt_ms = pull_start_ms < now ? now - pull_start_ms : 0;
+          db->meter_.addRtt(rtt_ms);
+          if (FLAGS_replicator_adaptive_response_bytes &&
+              response.__isset.latest_seq_no && !delay_next_pull) {
+            const uint64_t upstream_seq_no = response.latest_seq_no;
+            const uint64_t local_seq_no = db->db_wrapper_->LatestSequenceNumber();
+            const auto lag = upstream_seq_no > local_seq_no ? upstream_seq_no - local_seq_no : 0;
+            db->response_budget_.update(lag, rtt_ms, write_bytes);
           }
 
           if (!response.updates.empty()) {
             db->pullFromUpstreamNoUpdates_ = 0;
-            db->cond_var_.notifyAll();
+            db->cond_var_.notify();
+            db->pushToSubscribers();
           } else {
-            incCounter(kReplicatorPullRequestsNoUpdates, 1, db->db_name_);
+            db->stats_.incCounter(kReplicatorPullRequestsNoUpdates, 1);
             // no updates consecutively, and the upstream says it's NOT a leader.
             // Therefore we reset upstream.
             db->pullFromUpstreamNoUpdates_++;
@@ -401,37 +945,373 @@ void RocksDBReplicator::ReplicatedDB::pullFromUpstream() {
                            + ") upstream " + common::getNetworkAddressStr(db->upstream_addr_)
                          << " for " << FLAGS_replicator_max_consecutive_no_updates_before_upstream_reset
                          << " consecutive times, resetting upstream for " + db->db_name_;
-              incCounter(kReplicatorResetUpstreamOnNoUpdates, 1, db->db_name_);
+              db->stats_.incCounter(kReplicatorResetUpstreamOnNoUpdates, 1);
               db->resetUpstream();
               db->pullFromUpstreamNoUpdates_ = 0;
             }
           }
-          incCounter(kReplicatorInBytes, write_bytes, db->db_name_);
+          db->stats_.incCounter(kReplicatorInBytes, write_bytes);
+          db->meter_.addBytesIn(write_bytes, now);
         }
 
-        if (delay_next_pull) {
-          auto eb = db->client_->getChannel()->getEventBase();
-          // It is very bad if we fail to rescheudle a pull request, we'd prefer
-          // crashing.
-          eb->runInEventBaseThread([eb, weak_db = std::move(weak_db)] {
-              auto delay = FLAGS_replicator_pull_delay_on_error_ms;
-              // Randomize the delay so that helix (zk) is not overloaded from ext view requests.
-              auto randomized_delay = folly::Random::rand32(delay, delay * 2);
-              eb->runAfterDelay([weak_db = std::move(weak_db)] {
-                  auto db = weak_db.lock();
-                  if (db == nullptr) {
-                    return;
-                  }
-                  db->pullFromUpstream();
-                },
-                randomized_delay);
-            });
-        } else {
+        db->schedulePull(delay_next_pull);
+      });
+}
+
+void RocksDBReplicator::ReplicatedDB::pullFromUpstreamPipelined(
+    const uint64_t local_seq_no) {
+  // Split the range we know upstream has into windows, and request all of
+  // them at once. Upstream returns updates starting in each window, so the
+  // responses can be applied back to back as long as none of them is cut
+  // short.
+  const uint64_t window = FLAGS_replicator_pull_window_seq_nos;
+  const uint64_t lag = upstream_latest_seq_no_.load() - local_seq_no;
+  const auto num_windows = std::min<uint64_t>(
+    FLAGS_replicator_pull_pipeline_depth, (lag + window - 1) / window);
+
+  std::vector<folly::Future<ReplicateResponse>> futures;
+  futures.reserve(num_windows);
+  for (uint64_t i = 0; i < num_windows; ++i) {
+    ReplicateRequest req;
+    req.seq_no = local_seq_no + i * window;
+    req.db_name = db_name_;
+    req.max_wait_ms = FLAGS_replicator_max_server_wait_time_ms;
+    // a window can't hold more updates than sequence numbers
+    req.max_updates = window;
+    req.set_role(role_);
+    req.set_follower_id(follower_id_);
+    req.set_can_bootstrap(canBootstrap());
+    req.set_max_seq_no(local_seq_no + (i + 1) * window);
+    req.set_applied_seq_no(local_seq_no);
+    if (FLAGS_replicator_compress_updates) {
+      req.set_compression_dict_id(decompressor_.dictId());
+    }
+    if (FLAGS_replicator_adaptive_response_bytes) {
+      // A window cut short by the budget leaves a gap before the next one,
+      // which is then requested again from where we stop.
+      req.set_max_bytes(response_budget_.get());
+    }
+
+    stats_.incCounter(kReplicatorPullRequests, 1);
+    futures.push_back(client_->future_replicate(rpc_options_, req));
+  }
+  stats_.logMetric(kReplicatorPipelinedPulls, num_windows);
+
+  std::weak_ptr<ReplicatedDB> weak_db = shared_from_this();
+  const auto pull_start_ms = GetCurrentTimeMs();
+  folly::collectAll(futures).via(executor_)
+    .then([weak_db = std::move(weak_db), pull_start_ms] (
+        std::vector<folly::Try<ReplicateResponse>>&& results) {
+        auto db = weak_db.lock();
+        if (db == nullptr) {
+          return;
+        }
+
+        bool delay_next_pull = false;
+        bool applied = false;
+        uint64_t write_bytes = 0;
+        uint64_t max_response_bytes = 0;
+        const auto now = GetCurrentTimeMs();
+        // the RTT of the slowest window
+        const auto rtt_ms = pull_start_ms < now ? now - pull_start_ms : 0;
+        db->meter_.addRtt(rtt_ms);
+        // Apply responses strictly in order, and stop at the first failure or
+        // gap. Later windows will be requested again from where we stop.
+        for (auto& t : results) {
+          if (t.hasException()) {
+            db->stats_.incCounter(kReplicatorPullRequestsFailure, 1);
+            delay_next_pull = true;
+            db->handlePullException(t);
+            break;
+          }
+
+          db->stats_.incCounter(kReplicatorPullRequestsSuccess, 1);
+          auto& response = t.value();
+          if (response.__isset.latest_seq_no) {
+            db->upstream_latest_seq_no_ = response.latest_seq_no;
+          }
+
+          if (!db->decompressUpdates(&response)) {
+            db->stats_.incCounter(kReplicatorDecompressionFailure, 1);
+            delay_next_pull = true;
+            break;
+          }
+
+          // Updates within a response are consecutive in upstream's WAL. So
+          // the response applies cleanly iff its first update follows ours.
+          auto& updates = response.updates;
+          const bool continuous = updates.empty() ||
+            !updates.front().__isset.seq_no ||
+            static_cast<uint64_t>(updates.front().seq_no) ==
+            db->db_wrapper_->LatestSequenceNumber() + 1;
+
+          if (continuous && !updates.empty()) {
+            uint64_t response_bytes = 0;
+            for (auto& update : updates) {
+              if (update.timestamp != 0) {
+                uint64_t then = update.timestamp;
+                db->stats_.logMetric(kReplicatorLatency, then < now ? now - then : 0);
+              }
+
+              response_bytes += update.raw_data.computeChainDataLength();
+            }
+            write_bytes += response_bytes;
+            max_response_bytes = std::max(max_response_bytes, response_bytes);
+
+            auto n_applied = db->db_wrapper_->HandleReplicateResponses(
+              updates.begin(), updates.end());
+            db->recordApplied(updates.begin(), n_applied);
+            if (n_applied > 0) {
+              applied = true;
+            }
+            if (n_applied < updates.size()) {
+              db->stats_.incCounter(kReplicatorHandleResponseFailure, 1);
+              delay_next_pull = true;
+            }
+          }
+
+          if (delay_next_pull) {
+            break;
+          }
+
+          if (!continuous) {
+            db->stats_.incCounter(kReplicatorPipelinedPullGaps, 1);
+            break;
+          }
+        }
+
+        if (applied) {
+          db->pullFromUpstreamNoUpdates_ = 0;
+          db->cond_var_.notify();
+          db->pushToSubscribers();
+        }
+        if (FLAGS_replicator_adaptive_response_bytes && !delay_next_pull) {
+          // Each window was budgeted separately, so judge the budget by the
+          // fullest of them.
+          const uint64_t upstream_seq_no = db->upstream_latest_seq_no_.load();
+          const uint64_t local_seq_no = db->db_wrapper_->LatestSequenceNumber();
+          const auto lag = upstream_seq_no > local_seq_no ? upstream_seq_no - local_seq_no : 0;
+          db->response_budget_.update(lag, rtt_ms, max_response_bytes);
+        }
+        db->stats_.incCounter(kReplicatorInBytes, write_bytes);
+        db->meter_.addBytesIn(write_bytes, now);
+
+        db->schedulePull(delay_next_pull);
+      });
+}
+
+void RocksDBReplicator::ReplicatedDB::handlePullException(
+    folly::Try<ReplicateResponse>& t) {
+  try {
+#if __GNUC__ >= 8
+    t.exception().throw_exception();
+#else
+    t.exception().throwException();
+#endif
+  } catch (const ReplicateException& ex) {
+    LOG(ERROR) << "ReplicateException: upstream = " << common::getNetworkAddressStr(upstream_addr_) << ", code = " << static_cast<int>(ex.code)
+               << ", message = " << ex.msg;
+    stats_.incCounter(kReplicatorRemoteApplicationExceptions, 1);
+
+    if (ex.code == ErrorCode::SOURCE_NOT_FOUND) {
+      // This could happen if this db missed a request about the latest upstream.
+      // So try to reset it.
+      stats_.incCounter(kReplicatorRemoteApplicationExceptionsNotFound, 1);
+      resetUpstream();
+    } else if (ex.code == ErrorCode::SOURCE_SEQ_NO_PURGED) {
+      bootstrapFromUpstream();
+    }
+  } catch (const std::exception& ex) {
+    LOG(ERROR) << "std::exception when replicating from upstream " << common::getNetworkAddressStr(upstream_addr_)
+               << " for db " << db_name_ << ": " << ex.what();
+    stats_.incCounter(kReplicatorConnectionErrors, 1);
+    if (FLAGS_reset_upstream_on_std_exception) {
+      resetUpstream();
+    }
+    client_ = client_pool_->getClient(upstream_addr_);
+  }
+}
+
+void RocksDBReplicator::ReplicatedDB::schedulePull(bool delay_next_pull) {
+  if (bootstrapping_.load()) {
+    // pulling resumes once the db is replaced, or the bootstrap fails
+    return;
+  }
+
+  if (FLAGS_replicator_push_replication && !delay_next_pull &&
+      last_subscribe_ms_.load() + FLAGS_replicator_push_idle_timeout_ms <
+      GetCurrentTimeMs()) {
+    // We have fallen back to pulling. Subscribe again, which falls back to
+    // pulling again if it fails.
+    subscribeToUpstream();
+    return;
+  }
+
+  if (!delay_next_pull) {
+    pullFromUpstream();
+    return;
+  }
+
+  std::weak_ptr<ReplicatedDB> weak_db = shared_from_this();
+  auto eb = client_->getChannel()->getEventBase();
+  // It is very bad if we fail to rescheudle a pull request, we'd prefer
+  // crashing.
+  eb->runInEventBaseThread([eb, weak_db = std::move(weak_db)] {
+      auto delay = FLAGS_replicator_pull_delay_on_error_ms;
+      // Randomize the delay so that helix (zk) is not overloaded from ext view requests.
+      auto randomized_delay = folly::Random::rand32(delay, delay * 2);
+      eb->runAfterDelay([weak_db = std::move(weak_db)] {
+          auto db = weak_db.lock();
+          if (db == nullptr) {
+            return;
+          }
           db->pullFromUpstream();
+        },
+        randomized_delay);
+    });
+}
+
+bool RocksDBReplicator::ReplicatedDB::canBootstrap() const {
+  return FLAGS_replicator_bootstrap_from_checkpoint && bootstrap_handler_ &&
+    *bootstrap_handler_;
+}
+
+void RocksDBReplicator::ReplicatedDB::bootstrapFromUpstream() {
+  if (!canBootstrap() || bootstrapping_.exchange(true)) {
+    return;
+  }
+
+  const auto dir = FLAGS_replicator_bootstrap_dir + db_name_;
+  LOG(WARNING) << "Updates needed by " << db_name_ << " have been purged by "
+               << common::getNetworkAddressStr(upstream_addr_)
+               << ", bootstrapping from its checkpoint into " << dir;
+  stats_.incCounter(kReplicatorBootstraps, 1);
+
+  auto fetcher = std::make_shared<detail::CheckpointFetcher>(
+    client_, db_name_, dir, executor_, rpc_options_,
+    FLAGS_replicator_bootstrap_parallelism,
+    FLAGS_replicator_bootstrap_chunk_bytes);
+  std::weak_ptr<ReplicatedDB> weak_db = shared_from_this();
+  fetcher->fetch().via(executor_)
+    .then([weak_db = std::move(weak_db), dir] (folly::Try<uint64_t>&& t) {
+        auto db = weak_db.lock();
+        if (db == nullptr) {
+          return;
+        }
+
+        if (t.hasException()) {
+          LOG(ERROR) << "Failed to bootstrap " << db->db_name_ << ": "
+                     << t.exception().what();
+          db->stats_.incCounter(kReplicatorBootstrapFailure, 1);
+          db->bootstrapping_ = false;
+          db->schedulePull(true);
+          return;
+        }
+
+        LOG(INFO) << "Replacing " << db->db_name_ << " with the checkpoint "
+                  << "at sequence # " << t.value();
+        auto handler = db->bootstrap_handler_;
+        const auto db_name = db->db_name_;
+        const auto role = db->role_;
+        const auto upstream_addr = db->upstream_addr_;
+        // The handler removes this db, which waits for all references to it
+        // to go away.
+        db.reset();
+        if ((*handler)(db_name, dir, role, upstream_addr)) {
+          return;
         }
+
+        // The db is still here if the handler gave up before removing it
+        db = weak_db.lock();
+        if (db == nullptr) {
+          return;
+        }
+        LOG(ERROR) << "Failed to replace " << db_name << " with the checkpoint";
+        db->stats_.incCounter(kReplicatorBootstrapFailure, 1);
+        db->bootstrapping_ = false;
+        db->schedulePull(true);
       });
 }
 
+void RocksDBReplicator::ReplicatedDB::handleCreateCheckpointRequest(
+    std::unique_ptr<CreateCheckpointCallbackType> callback,
+    std::unique_ptr<CheckpointRequest> request) {
+  CHECK(request->db_name == db_name_);
+
+  std::weak_ptr<ReplicatedDB> weak_db = shared_from_this();
+  // Creating a checkpoint flushes the memtables, get it off the io thread
+  executor_->add(
+    [weak_db = std::move(weak_db),
+     request = folly::makeMoveWrapper(std::move(request)),
+     callback = folly::makeMoveWrapper(std::move(callback))] () mutable {
+      auto db = weak_db.lock();
+      if (db == nullptr) {
+        ReplicateException e;
+        e.msg = (*request)->db_name + " has been removed";
+        e.code = ErrorCode::SOURCE_NOT_FOUND;
+        (*callback).release()->exceptionInThread(std::move(e));
+        return;
+      }
+
+      CheckpointResponse response;
+      auto status = db->checkpoints_->create(db->db_wrapper_.get(),
+                                             &response);
+      if (!status.ok()) {
+        LOG(ERROR) << "Failed to create a checkpoint of " << db->db_name_
+                   << " with error: " << status.ToString();
+        ReplicateException e;
+        e.msg = status.ToString();
+        e.code = ErrorCode::SOURCE_READ_ERROR;
+        (*callback).release()->exceptionInThread(std::move(e));
+        return;
+      }
+
+      (*callback).release()->resultInThread(std::move(response));
+    });
+}
+
+void RocksDBReplicator::ReplicatedDB::handleGetCheckpointChunkRequest(
+    std::unique_ptr<GetCheckpointChunkCallbackType> callback,
+    std::unique_ptr<CheckpointChunkRequest> request) {
+  CHECK(request->db_name == db_name_);
+
+  std::weak_ptr<ReplicatedDB> weak_db = shared_from_this();
+  executor_->add(
+    [weak_db = std::move(weak_db),
+     request = folly::makeMoveWrapper(std::move(request)),
+     callback = folly::makeMoveWrapper(std::move(callback))] () mutable {
+      auto db = weak_db.lock();
+      if (db == nullptr) {
+        ReplicateException e;
+        e.msg = (*request)->db_name + " has been removed";
+        e.code = ErrorCode::SOURCE_NOT_FOUND;
+        (*callback).release()->exceptionInThread(std::move(e));
+        return;
+      }
+
+      // max_bytes is allocated upfront, don't let a downstream pick it
+      const auto max_bytes = std::min((*request)->max_bytes,
+                                      FLAGS_replicator_bootstrap_chunk_bytes);
+      CheckpointChunkResponse response;
+      auto status = db->checkpoints_->read(
+        (*request)->checkpoint_id, (*request)->file_name,
+        std::max<int64_t>((*request)->offset, 0),
+        std::max<int32_t>(max_bytes, 0), &response.data);
+      if (!status.ok()) {
+        ReplicateException e;
+        e.msg = status.ToString();
+        e.code = status.IsNotFound() ? ErrorCode::CHECKPOINT_NOT_FOUND :
+          ErrorCode::SOURCE_READ_ERROR;
+        (*callback).release()->exceptionInThread(std::move(e));
+        return;
+      }
+
+      db->stats_.incCounter(kReplicatorCheckpointOutBytes,
+                            response.data.computeChainDataLength());
+      (*callback).release()->resultInThread(std::move(response));
+    });
+}
+
 void RocksDBReplicator::ReplicatedDB::handleReplicateRequest(
     std::unique_ptr<CallbackType> callback,
     std::unique_ptr<ReplicateRequest> request) {
@@ -444,29 +1324,31 @@ void RocksDBReplicator::ReplicatedDB::handleReplicateRequest(
   // Inverse of predicate below: if requested sequence number is HIGHER than latest sequence number on leader, emit a stat)
   auto leaderSeqNum = db->db_wrapper_->LatestSequenceNumber();
   if (leaderSeqNum < seq_no) {
-    logMetric(kReplicatorLeaderSequenceNumbersBehind, seq_no - leaderSeqNum, db ->db_name_);
+    db->stats_.logMetric(kReplicatorLeaderSequenceNumbersBehind, seq_no - leaderSeqNum);
   }
 
   // Post the largest sequence number the Slave has committed.
   // If the request comes from an Observer, ignore the sequence number update.
-  if (request->__isset.role && request->role == ReplicaRole::OBSERVER) {
-    incCounter(kReplicatorHandleObserverRequests, 1, db->db_name_);
+  const bool is_observer =
+    request->__isset.role && request->role == ReplicaRole::OBSERVER;
+  if (is_observer) {
+    db->stats_.incCounter(kReplicatorHandleObserverRequests, 1);
   } else {
-    max_seq_no_acked_.post(seq_no);
+    // A pipelined request may start beyond what the follower has applied.
+    ackFromFollower(request->__isset.follower_id ? request->follower_id : "",
+                    request->__isset.applied_seq_no ?
+                    request->applied_seq_no : seq_no);
   }
 
-  auto replication_mode =  common::DBConfigManager::get()->getReplicationMode(db_name_);
-  // for now we have to support both till all clusters are migrated
-  if (FLAGS_replicator_replication_mode > replication_mode) {
-    replication_mode = FLAGS_replicator_replication_mode;
-  }
+  auto replication_mode = replicationMode();
 
   auto timeout = request->max_wait_ms;
 
-  cond_var_.runIfConditionOrWaitForNotify(
+  cond_var_.runIfGreaterOrWaitForNotify(
       // Operation
       [weak_db = std::move(weak_db),
       replication_mode,
+      is_observer,
        // TODO(bol) remove folly::makeMoveWrapper() when move to gcc 5.1
        request = folly::makeMoveWrapper(std::move(request)),
        callback = folly::makeMoveWrapper(std::move(callback))] () mutable {
@@ -481,133 +1363,746 @@ void RocksDBReplicator::ReplicatedDB::handleReplicateRequest(
 
         auto start_ts = GetCurrentTimeMs();
 
-        const auto expected_seq_no = (*request)->seq_no + 1;
-        rocksdb::SequenceNumber next_seq_no = expected_seq_no;
-        auto iter = db->getCachedIter(expected_seq_no);
-        if (iter && !iter->Valid()) {
-          iter->Next();
-          if (!iter->Valid()) {
-            // this can only happen when cond_var_ timeout, or a new log file
-            // got created. Either way, it is ok (required) to create a new
-            // iterator.
-            iter.reset(nullptr);
+        ReplicateResponse response;
+        response.set_role(db->role_);
+        rocksdb::SequenceNumber next_seq_no;
+        uint64_t read_bytes = 0;
+        auto status = db->readUpdates(**request, &response.updates,
+                                      &next_seq_no, &read_bytes);
+        if (status.ok()) {
+          const auto num_updates = response.updates.size();
+          response.set_latest_seq_no(db->db_wrapper_->LatestSequenceNumber());
+          if (db->compressor_ && (*request)->__isset.compression_dict_id) {
+            db->compressUpdates((*request)->compression_dict_id, &response);
           }
-        }
-
-        rocksdb::Status status;
-        bool use_cached_iter = (iter != nullptr);
-        if (!use_cached_iter) {
-          auto start = GetCurrentTimeMs();
-          status = db->db_wrapper_->GetUpdatesFromLeader(expected_seq_no, &iter);
-          auto end = GetCurrentTimeMs();
-          logMetric(kReplicatorGetUpdatesSinceMs, start < end ? end - start : 0,
-                    db->db_name_);
-        }
-        if (use_cached_iter || status.ok() || status.IsNotFound()) {
-          ReplicateResponse response;
-          response.set_role(db->role_);
-          uint64_t read_bytes = 0;
-          for (int32_t i = 0;
-               i < (*request)->max_updates && iter && iter->Valid();
-               ++i, iter->Next()) {
-            auto result = iter->GetBatch();
-
-            // emit a metrics on missing sequence number, possibly due to WAL deletion after TTL expires.
-            // ref: https://github.com/facebook/rocksdb/blob/7ae4da924ad4df9ffc04ba4b3577d1aa7025f4aa/include/rocksdb/db.h#L1417
-            // "If the sequence number is non existent, it returns an iterator at the first available seq_no after the requested seq_no"
-            if (i == 0 && result.sequence > expected_seq_no) {
-              LOG_EVERY_N(ERROR, FLAGS_replicator_log_frequency) << "[" << db->db_name_ << "]" << " received follower request for updates since sequence number: "
-                         << expected_seq_no << ", got: " << result.sequence;
-              incCounter(kReplicatorGetUpdatesMissingSequence, 1, db->db_name_);
-            }
-
-            Update update;
-            update.set_seq_no(result.sequence);
-            next_seq_no += result.writeBatchPtr->Count();
-            const auto& str = result.writeBatchPtr->Data();
-            read_bytes += str.size();
-            update.raw_data = std::move(*folly::IOBuf::copyBuffer(str.data(),
-                                                                  str.size()));
-            LogExtractor extractor;
-            auto ret = result.writeBatchPtr->Iterate(&extractor);
-            if (ret.ok()) {
-              update.timestamp = extractor.ms;
-            } else {
-              update.timestamp = 0;
-              LOG(WARNING) << "Failed to extract timestamp for " << db->db_name_;
-            }
-            response.updates.emplace_back(std::move(update));
+          if (num_updates > 0 && !is_observer) {
+            // time the ack before the follower can possibly send it
+            db->ack_tracker_.sent((*request)->__isset.follower_id ?
+                                  (*request)->follower_id : "",
+                                  next_seq_no - 1, GetCurrentTimeMs());
           }
-
+          // A pipelined window beyond what the follower has applied may be
+          // discarded by it on a gap. It only counts once the follower acks
+          // it with a later request.
+          const bool speculative = (*request)->__isset.applied_seq_no &&
+            (*request)->seq_no > (*request)->applied_seq_no;
           (*callback).release()->resultInThread(std::move(response));
-          if (replication_mode == 1) {
+          if (replication_mode == 1 && !speculative) {
             // post the largest sequence number we have written to the Slave.
             db->max_seq_no_acked_.post(next_seq_no - 1);
           }
-          logMetric(kReplicatorOutNumUpdates, response.updates.size(), db->db_name_);
-          incCounter(kReplicatorOutBytes, read_bytes, db->db_name_);
+          db->stats_.logMetric(kReplicatorOutNumUpdates, num_updates);
+          db->stats_.incCounter(kReplicatorOutBytes, read_bytes);
+          db->meter_.addBytesOut(read_bytes, GetCurrentTimeMs());
 
           auto end_success_ts = GetCurrentTimeMs();
-          logMetric(kReplicatorReplyUpdatesSuccessLatency, start_ts < end_success_ts ? end_success_ts - start_ts : 0, db->db_name_);
+          db->stats_.logMetric(kReplicatorReplyUpdatesSuccessLatency, start_ts < end_success_ts ? end_success_ts - start_ts : 0);
         } else {
           LOG(ERROR) << "Failed to pull updates from " << db->db_name_
                      << " with error: " << status.ToString();
-          incCounter(kReplicatorGetUpdatesSinceErrors, 1, db->db_name_);
+          db->stats_.incCounter(kReplicatorGetUpdatesSinceErrors, 1);
           ReplicateException e;
           e.msg = status.ToString();
-          e.code = ErrorCode::SOURCE_READ_ERROR;
+          e.code = status.IsIncomplete() ? ErrorCode::SOURCE_SEQ_NO_PURGED :
+            ErrorCode::SOURCE_READ_ERROR;
           (*callback).release()->exceptionInThread(std::move(e));
 
           auto end_failure_ts = GetCurrentTimeMs();
-          logMetric(kReplicatorReplyUpdatesFailureLatency, start_ts < end_failure_ts ? end_failure_ts - start_ts : 0, db->db_name_);
-        }
-
-        if (iter) {
-          db->putCachedIter(next_seq_no, std::move(iter));
+          db->stats_.logMetric(kReplicatorReplyUpdatesFailureLatency, start_ts < end_failure_ts ? end_failure_ts - start_ts : 0);
         }
       },
-      // Predicate
-      [db = std::move(db), seq_no] {
-        return db->db_wrapper_->LatestSequenceNumber() > seq_no;
-      },
+      // run once the db has updates newer than seq_no
+      seq_no,
       // timeout
       timeout);
 }
 
-std::unique_ptr<rocksdb::TransactionLogIterator>
-RocksDBReplicator::ReplicatedDB::getCachedIter(
-    rocksdb::SequenceNumber seq_no) {
-  std::lock_guard<std::mutex> g(cached_iters_mutex_);
-  auto iter = cached_iters_.find(seq_no);
-  if (iter == cached_iters_.end()) {
-    return nullptr;
+void RocksDBReplicator::ReplicatedDB::compressUpdates(
+    const int32_t downstream_dict_id,
+    ReplicateResponse* response) {
+  for (const auto& update : response->updates) {
+    compressor_->addSample(update.raw_data);
   }
 
-  auto ret = std::move(iter->second.first);
-  cached_iters_.erase(iter);
-  return ret;
-}
+  if (compressor_->shouldTrain()) {
+    // Training takes a while. Don't hold the response for it.
+    std::weak_ptr<ReplicatedDB> weak_db = shared_from_this();
+    executor_->add([weak_db = std::move(weak_db)] {
+        auto db = weak_db.lock();
+        if (db) {
+          db->compressor_->train();
+        }
+      });
+  }
+
+  auto dict = compressor_->dict();
+  if (dict == nullptr) {
+    return;
+  }
+
+  uint64_t saved_bytes = 0;
+  for (auto& update : response->updates) {
+    const auto size = update.raw_data.computeChainDataLength();
+    // Downstreams refuse to decompress updates larger than a whole response
+    if (size < static_cast<uint64_t>(FLAGS_replicator_compression_min_bytes) ||
+        size > FLAGS_replicator_max_bytes_per_response) {
+      continue;
+    }
+
+    auto compressed = detail::UpdateCompressor::compress(*dict,
+                                                         update.raw_data);
+    if (compressed == nullptr) {
+      continue;
+    }
+
+    saved_bytes += size - compressed->computeChainDataLength();
+    update.raw_data = std::move(*compressed);
+    update.set_uncompressed_size(size);
+  }
+
+  if (saved_bytes == 0) {
+    return;
+  }
 
-void RocksDBReplicator::ReplicatedDB::putCachedIter(
-    rocksdb::SequenceNumber seq_no,
-    std::unique_ptr<rocksdb::TransactionLogIterator> iter) {
-  std::lock_guard<std::mutex> g(cached_iters_mutex_);
-  cached_iters_.emplace(seq_no,
-                        std::make_pair(std::move(iter), GetCurrentTimeMs()));
+  response->set_compression_dict_id(static_cast<int32_t>(dict->id));
+  if (static_cast<uint32_t>(downstream_dict_id) != dict->id) {
+    response->set_compression_dict(dict->bytes);
+  }
+  stats_.incCounter(kReplicatorCompressionSavedBytes, saved_bytes);
 }
 
-void RocksDBReplicator::ReplicatedDB::cleanIdleCachedIters() {
-  auto now = GetCurrentTimeMs();
-  std::lock_guard<std::mutex> g(cached_iters_mutex_);
-  auto itor = cached_iters_.begin();
-  while (itor != cached_iters_.end()) {
-    if (itor->second.second + FLAGS_replicator_idle_iter_timeout_ms < now) {
-      itor = cached_iters_.erase(itor);
+bool RocksDBReplicator::ReplicatedDB::decompressUpdates(
+    ReplicateResponse* response) {
+  if (response->__isset.compression_dict &&
+      !decompressor_.setDict(response->compression_dict)) {
+    LOG(ERROR) << "Invalid compression dictionary from upstream for "
+               << db_name_;
+    return false;
+  }
+
+  for (auto& update : response->updates) {
+    if (!update.__isset.uncompressed_size) {
       continue;
     }
 
-    ++itor;
+    std::unique_ptr<folly::IOBuf> data;
+    if (response->__isset.compression_dict_id &&
+        static_cast<uint32_t>(response->compression_dict_id) ==
+        decompressor_.dictId()) {
+      data = decompressor_.decompress(update.raw_data,
+                                      update.uncompressed_size);
+    }
+
+    if (data == nullptr) {
+      LOG(ERROR) << "Failed to decompress updates from upstream for "
+                 << db_name_;
+      // ask upstream for its dictionary again
+      decompressor_.clear();
+      return false;
+    }
+
+    update.raw_data = std::move(*data);
+    update.__isset.uncompressed_size = false;
+  }
+
+  return true;
+}
+
+rocksdb::Status RocksDBReplicator::ReplicatedDB::readUpdates(
+    const ReplicateRequest& request,
+    std::vector<Update>* updates,
+    rocksdb::SequenceNumber* next_seq_no,
+    uint64_t* read_bytes) {
+  const auto expected_seq_no = request.seq_no + 1;
+  const int64_t max_bytes = request.__isset.max_bytes ? request.max_bytes : 0;
+  const bool windowed = request.__isset.max_seq_no;
+  *next_seq_no = expected_seq_no;
+
+  // Followers close to the tail of the WAL are likely asking for updates
+  // another follower has just got. Serve them from the cache without decoding
+  // the WAL again.
+  if (wal_tail_cache_ && request.max_updates > 0 && !windowed) {
+    if (wal_tail_cache_->get(expected_seq_no,
+                             request.max_updates,
+                             std::max<int64_t>(max_bytes, 0),
+                             updates,
+                             next_seq_no,
+                             read_bytes) > 0) {
+      stats_.incCounter(kReplicatorWalTailCacheHits, 1);
+      return rocksdb::Status::OK();
+    }
+    stats_.incCounter(kReplicatorWalTailCacheMisses, 1);
+  }
+
+  // Anything up to it must be in the WAL, unless it has been purged
+  const uint64_t latest_seq_no = db_wrapper_->LatestSequenceNumber();
+  std::unique_ptr<detail::WalIterator> iter;
+  auto source = detail::WalIteratorManager::Source::kExact;
+  auto start = GetCurrentTimeMs();
+  auto status = wal_iters_->get(expected_seq_no, &iter, &source);
+  if (source == detail::WalIteratorManager::Source::kNew) {
+    auto end = GetCurrentTimeMs();
+    stats_.logMetric(kReplicatorGetUpdatesSinceMs, start < end ? end - start : 0);
+  } else if (source == detail::WalIteratorManager::Source::kForked) {
+    stats_.incCounter(kReplicatorWalIterForks, 1);
+  }
+  if (status.ok() || status.IsNotFound()) {
+    status = rocksdb::Status::OK();
+    // Only updates emitted count against max_updates, not the ones skipped
+    // for starting before the window
+    for (;
+         static_cast<int64_t>(updates->size()) < request.max_updates &&
+         iter && iter->Valid() &&
+         (max_bytes <= 0 || *read_bytes < static_cast<uint64_t>(max_bytes));
+         iter->Next()) {
+      auto result = iter->GetBatch();
+      if (updates->empty() && result.sequence > expected_seq_no &&
+          request.__isset.can_bootstrap && request.can_bootstrap) {
+        status = rocksdb::Status::Incomplete(
+          "updates since " + std::to_string(expected_seq_no) +
+          " have been purged, the WAL starts at " +
+          std::to_string(result.sequence));
+        break;
+      }
+      if (windowed) {
+        // Updates starting before the window belong to the previous
+        // window, and updates starting after it to the next one.
+        if (static_cast<int64_t>(result.sequence) > request.max_seq_no) {
+          break;
+        }
+        if (result.sequence < expected_seq_no) {
+          continue;
+        }
+      }
+
+      // emit a metrics on missing sequence number, possibly due to WAL deletion after TTL expires.
+      // ref: https://github.com/facebook/rocksdb/blob/7ae4da924ad4df9ffc04ba4b3577d1aa7025f4aa/include/rocksdb/db.h#L1417
+      // "If the sequence number is non existent, it returns an iterator at the first available seq_no after the requested seq_no"
+      if (updates->empty() && result.sequence > expected_seq_no) {
+        LOG_EVERY_N(ERROR, FLAGS_replicator_log_frequency) << "[" << db_name_ << "]" << " received follower request for updates since sequence number: "
+                   << expected_seq_no << ", got: " << result.sequence;
+        stats_.incCounter(kReplicatorGetUpdatesMissingSequence, 1);
+      }
+
+      Update update;
+      const auto num_records = result.writeBatchPtr->Count();
+      *next_seq_no += num_records;
+      *read_bytes += fillUpdate(&result, &update);
+      if (wal_tail_cache_) {
+        wal_tail_cache_->add(update, num_records);
+      }
+      updates->emplace_back(std::move(update));
+    }
+
+    if (status.ok() && updates->empty() && (!iter || !iter->Valid()) &&
+        latest_seq_no >= expected_seq_no &&
+        request.__isset.can_bootstrap && request.can_bootstrap) {
+      status = rocksdb::Status::Incomplete(
+        "updates since " + std::to_string(expected_seq_no) +
+        " have been purged, the WAL is empty");
+    }
+  }
+
+  if (iter) {
+    wal_iters_->put(*next_seq_no, std::move(iter));
+  }
+
+  return status;
+}
+
+void RocksDBReplicator::ReplicatedDB::handleSubscribeRequest(
+    std::unique_ptr<SubscribeCallbackType> callback,
+    std::unique_ptr<SubscribeRequest> request,
+    const folly::SocketAddress& downstream_addr) {
+  CHECK(request->db_name == db_name_);
+
+  std::weak_ptr<ReplicatedDB> weak_db = shared_from_this();
+  executor_->add(
+    [weak_db = std::move(weak_db),
+     request = folly::makeMoveWrapper(std::move(request)),
+     callback = folly::makeMoveWrapper(std::move(callback)),
+     downstream_addr] () mutable {
+      auto db = weak_db.lock();
+      if (db == nullptr) {
+        ReplicateException e;
+        e.msg = (*request)->db_name + " has been removed";
+        e.code = ErrorCode::SOURCE_NOT_FOUND;
+        (*callback).release()->exceptionInThread(std::move(e));
+        return;
+      }
+
+      db->addSubscriber(std::move(*callback), std::move(*request),
+                        downstream_addr);
+    });
+}
+
+void RocksDBReplicator::ReplicatedDB::addSubscriber(
+    std::unique_ptr<SubscribeCallbackType> callback,
+    std::unique_ptr<SubscribeRequest> request,
+    const folly::SocketAddress& downstream_addr) {
+  auto subscriber = std::make_shared<Subscriber>();
+  subscriber->addr = downstream_addr;
+  subscriber->follower_id = request->__isset.follower_id ?
+    request->follower_id : common::getNetworkAddressStr(downstream_addr);
+  subscriber->client = client_pool_->getClient(downstream_addr);
+  subscriber->is_observer =
+    request->__isset.role && request->role == ReplicaRole::OBSERVER;
+  subscriber->next_seq_no = request->seq_no + 1;
+  subscriber->pushing = false;
+  subscriber->failures = 0;
+  subscriber->can_bootstrap =
+    request->__isset.can_bootstrap && request->can_bootstrap;
+
+  if (subscriber->can_bootstrap) {
+    // Turn the downstream away if it can't catch up from our WAL. It then
+    // pulls, finds out why, and bootstraps from a checkpoint.
+    ReplicateRequest probe;
+    probe.seq_no = request->seq_no;
+    probe.db_name = db_name_;
+    probe.max_wait_ms = 0;
+    probe.max_updates = 1;
+    probe.set_can_bootstrap(true);
+    std::vector<Update> updates;
+    rocksdb::SequenceNumber next_seq_no;
+    uint64_t read_bytes = 0;
+    auto status = readUpdates(probe, &updates, &next_seq_no, &read_bytes);
+    if (status.IsIncomplete()) {
+      ReplicateException e;
+      e.msg = status.ToString();
+      e.code = ErrorCode::SOURCE_SEQ_NO_PURGED;
+      callback.release()->exceptionInThread(std::move(e));
+      return;
+    }
+  }
+
+  if (!subscriber->is_observer) {
+    ackFromFollower(subscriber->follower_id, request->seq_no);
+  }
+
+  {
+    std::lock_guard<std::mutex> g(subscribers_mutex_);
+    // A downstream subscribes again when it hasn't heard from us for a while.
+    // Replace its old subscription. A push still in flight for the old one is
+    // harmless, as downstreams skip updates they already have.
+    subscribers_.erase(
+      std::remove_if(subscribers_.begin(), subscribers_.end(),
+                     [&downstream_addr] (const std::shared_ptr<Subscriber>& s) {
+                       return s->addr == downstream_addr;
+                     }),
+      subscribers_.end());
+    subscribers_.push_back(subscriber);
+    num_subscribers_.store(subscribers_.size());
+  }
+
+  LOG(INFO) << common::getNetworkAddressStr(downstream_addr)
+            << " subscribed to " << db_name_ << " from "
+            << subscriber->next_seq_no;
+  stats_.incCounter(kReplicatorHandleSubscribeRequests, 1);
+
+  SubscribeResponse response;
+  response.set_role(role_);
+  callback.release()->resultInThread(std::move(response));
+
+  pushToSubscribers();
+}
+
+void RocksDBReplicator::ReplicatedDB::pushToSubscribers() {
+  if (num_subscribers_.load() == 0) {
+    return;
+  }
+
+  std::vector<std::shared_ptr<Subscriber>> subscribers_to_push;
+  {
+    std::lock_guard<std::mutex> g(subscribers_mutex_);
+    const auto latest_seq_no = db_wrapper_->LatestSequenceNumber();
+    for (auto& subscriber : subscribers_) {
+      if (!subscriber->pushing && subscriber->next_seq_no <= latest_seq_no) {
+        subscriber->pushing = true;
+        subscribers_to_push.push_back(subscriber);
+      }
+    }
+  }
+
+  std::weak_ptr<ReplicatedDB> weak_db = shared_from_this();
+  for (auto& subscriber : subscribers_to_push) {
+    executor_->add([weak_db, subscriber] {
+        auto db = weak_db.lock();
+        if (db == nullptr) {
+          return;
+        }
+        db->pushUpdates(subscriber);
+      });
+  }
+}
+
+void RocksDBReplicator::ReplicatedDB::pushUpdates(
+    std::shared_ptr<Subscriber> subscriber) {
+  ReplicateRequest request;
+  {
+    std::lock_guard<std::mutex> g(subscribers_mutex_);
+    request.seq_no = subscriber->next_seq_no - 1;
+  }
+  request.db_name = db_name_;
+  request.max_wait_ms = 0;
+  request.max_updates = FLAGS_replicator_max_updates_per_response;
+  request.set_max_bytes(FLAGS_replicator_max_bytes_per_response);
+  request.set_can_bootstrap(subscriber->can_bootstrap);
+
+  PushRequest push_request;
+  push_request.db_name = db_name_;
+  push_request.set_role(role_);
+  const auto latest_seq_no = db_wrapper_->LatestSequenceNumber();
+  rocksdb::SequenceNumber next_seq_no;
+  uint64_t read_bytes = 0;
+  auto status = readUpdates(request, &push_request.updates, &next_seq_no,
+                            &read_bytes);
+  if (!status.ok()) {
+    LOG(ERROR) << "Failed to read updates to push for " << db_name_
+               << " with error: " << status.ToString();
+    stats_.incCounter(kReplicatorGetUpdatesSinceErrors, 1);
+    // The downstream will subscribe again or fall back to pulling
+    removeSubscriber(subscriber);
+    return;
+  }
+
+  if (push_request.updates.empty()) {
+    {
+      std::lock_guard<std::mutex> g(subscribers_mutex_);
+      // A write committed while we were reading skipped this subscriber
+      // because it saw us pushing. Don't miss it.
+      if (db_wrapper_->LatestSequenceNumber() == latest_seq_no) {
+        subscriber->pushing = false;
+        return;
+      }
+    }
+
+    std::weak_ptr<ReplicatedDB> weak_db = shared_from_this();
+    executor_->add([weak_db = std::move(weak_db), subscriber] {
+        auto db = weak_db.lock();
+        if (db == nullptr) {
+          return;
+        }
+        db->pushUpdates(subscriber);
+      });
+    return;
+  }
+
+  push_request.set_latest_seq_no(latest_seq_no);
+  const auto num_updates = push_request.updates.size();
+  stats_.incCounter(kReplicatorPushRequests, 1);
+  if (!subscriber->is_observer) {
+    ack_tracker_.sent(subscriber->follower_id, next_seq_no - 1,
+                      GetCurrentTimeMs());
+  }
+
+  std::weak_ptr<ReplicatedDB> weak_db = shared_from_this();
+  subscriber->client->future_push(rpc_options_, push_request).via(executor_)
+    .then([weak_db = std::move(weak_db), subscriber] (
+        folly::Try<PushResponse>&& t) {
+        auto db = weak_db.lock();
+        if (db == nullptr) {
+          return;
+        }
+
+        if (t.hasException()) {
+          LOG(ERROR) << "Failed to push updates of " << db->db_name_ << " to "
+                     << common::getNetworkAddressStr(subscriber->addr) << ": "
+                     << t.exception().what();
+          db->stats_.incCounter(kReplicatorPushRequestsFailure, 1);
+          db->retryPush(subscriber);
+          return;
+        }
+
+        const auto applied_seq_no = t.value().applied_seq_no;
+        if (!subscriber->is_observer) {
+          db->ackFromFollower(subscriber->follower_id, applied_seq_no);
+        }
+
+        {
+          std::lock_guard<std::mutex> g(db->subscribers_mutex_);
+          subscriber->next_seq_no = applied_seq_no + 1;
+          subscriber->pushing = false;
+          subscriber->failures = 0;
+        }
+        db->pushToSubscribers();
+      });
+
+  auto replication_mode = replicationMode();
+  if (replication_mode == 1 && !subscriber->is_observer) {
+    // post the largest sequence number we have written to the Slave.
+    max_seq_no_acked_.post(next_seq_no - 1);
+  }
+  stats_.logMetric(kReplicatorOutNumUpdates, num_updates);
+  stats_.incCounter(kReplicatorOutBytes, read_bytes);
+  meter_.addBytesOut(read_bytes, GetCurrentTimeMs());
+}
+
+void RocksDBReplicator::ReplicatedDB::retryPush(
+    std::shared_ptr<Subscriber> subscriber) {
+  uint32_t failures;
+  {
+    std::lock_guard<std::mutex> g(subscribers_mutex_);
+    failures = ++subscriber->failures;
+  }
+
+  if (failures > static_cast<uint32_t>(FLAGS_replicator_push_max_retries)) {
+    // The downstream subscribes again once it notices, or falls back to
+    // pulling.
+    removeSubscriber(subscriber);
+    return;
+  }
+
+  // Keep the subscriber marked as pushing, so that nothing else pushes to it
+  // before the retry.
+  const auto delay =
+    FLAGS_replicator_push_retry_delay_ms << std::min<uint32_t>(failures - 1, 10);
+  std::weak_ptr<ReplicatedDB> weak_db = shared_from_this();
+  auto eb = subscriber->client->getChannel()->getEventBase();
+  eb->runInEventBaseThread([eb, delay, weak_db = std::move(weak_db),
+                            subscriber = std::move(subscriber)] {
+      eb->runAfterDelay([weak_db = std::move(weak_db),
+                         subscriber = std::move(subscriber)] {
+          auto db = weak_db.lock();
+          if (db == nullptr) {
+            return;
+          }
+
+          {
+            std::lock_guard<std::mutex> g(db->subscribers_mutex_);
+            subscriber->pushing = false;
+          }
+          db->pushToSubscribers();
+        },
+        delay);
+    });
+}
+
+void RocksDBReplicator::ReplicatedDB::removeSubscriber(
+    const std::shared_ptr<Subscriber>& subscriber) {
+  std::lock_guard<std::mutex> g(subscribers_mutex_);
+  subscribers_.erase(
+    std::remove(subscribers_.begin(), subscribers_.end(), subscriber),
+    subscribers_.end());
+  num_subscribers_.store(subscribers_.size());
+}
+
+void RocksDBReplicator::ReplicatedDB::handlePushRequest(
+    std::unique_ptr<PushCallbackType> callback,
+    std::unique_ptr<PushRequest> request) {
+  CHECK(request->db_name == db_name_);
+
+  std::weak_ptr<ReplicatedDB> weak_db = shared_from_this();
+  // Applying updates may block on disk, get it off the io thread
+  executor_->add(
+    [weak_db = std::move(weak_db),
+     request = folly::makeMoveWrapper(std::move(request)),
+     callback = folly::makeMoveWrapper(std::move(callback))] () mutable {
+      auto db = weak_db.lock();
+      if (db == nullptr) {
+        ReplicateException e;
+        e.msg = (*request)->db_name + " has been removed";
+        e.code = ErrorCode::SOURCE_NOT_FOUND;
+        (*callback).release()->exceptionInThread(std::move(e));
+        return;
+      }
+
+      if (db->role_ != ReplicaRole::FOLLOWER &&
+          db->role_ != ReplicaRole::OBSERVER) {
+        ReplicateException e;
+        e.msg = db->db_name_ + " is not replicating from upstream";
+        e.code = ErrorCode::OTHER;
+        (*callback).release()->exceptionInThread(std::move(e));
+        return;
+      }
+
+      db->stats_.incCounter(kReplicatorHandlePushRequests, 1);
+      std::lock_guard<std::mutex> g(db->push_mutex_);
+      if (!db->subscribed_) {
+        // We are pulling, don't apply updates from two sources
+        ReplicateException e;
+        e.msg = db->db_name_ + " is not subscribed";
+        e.code = ErrorCode::OTHER;
+        (*callback).release()->exceptionInThread(std::move(e));
+        return;
+      }
+
+      db->last_push_ms_.store(GetCurrentTimeMs());
+      if ((*request)->__isset.latest_seq_no) {
+        db->upstream_latest_seq_no_ = (*request)->latest_seq_no;
+      }
+      bool applied = false;
+      uint64_t write_bytes = 0;
+      const auto now = GetCurrentTimeMs();
+      // Skip the updates we already have. The rest apply iff the first of
+      // them follows ours, since they are consecutive in upstream's WAL.
+      auto& updates = (*request)->updates;
+      const uint64_t local_seq_no = db->db_wrapper_->LatestSequenceNumber();
+      auto first = std::find_if(updates.begin(), updates.end(),
+                                [local_seq_no] (const Update& update) {
+          return !update.__isset.seq_no ||
+            static_cast<uint64_t>(update.seq_no) > local_seq_no;
+        });
+      if (first != updates.end() &&
+          (!first->__isset.seq_no ||
+           static_cast<uint64_t>(first->seq_no) == local_seq_no + 1)) {
+        for (auto itor = first; itor != updates.end(); ++itor) {
+          if (itor->timestamp != 0) {
+            uint64_t then = itor->timestamp;
+            db->stats_.logMetric(kReplicatorLatency, then < now ? now - then : 0);
+          }
+
+          write_bytes += itor->raw_data.computeChainDataLength();
+        }
+
+        auto n_applied = db->db_wrapper_->HandleReplicateResponses(
+          first, updates.end());
+        db->recordApplied(first, n_applied);
+        if (n_applied > 0) {
+          applied = true;
+        }
+        if (n_applied < static_cast<size_t>(updates.end() - first)) {
+          db->stats_.incCounter(kReplicatorHandleResponseFailure, 1);
+        }
+      }
+
+      if (applied) {
+        db->cond_var_.notify();
+        // downstreams chained behind us
+        db->pushToSubscribers();
+      }
+      db->stats_.incCounter(kReplicatorInBytes, write_bytes);
+      db->meter_.addBytesIn(write_bytes, now);
+
+      PushResponse response;
+      response.applied_seq_no = db->db_wrapper_->LatestSequenceNumber();
+      (*callback).release()->resultInThread(std::move(response));
+    });
+}
+
+void RocksDBReplicator::ReplicatedDB::subscribeToUpstream() {
+  CHECK(role_ == ReplicaRole::FOLLOWER || role_ == ReplicaRole::OBSERVER);
+  SubscribeRequest req;
+  req.db_name = db_name_;
+  req.seq_no = db_wrapper_->LatestSequenceNumber();
+  req.port = FLAGS_rocksdb_replicator_port;
+  req.set_role(role_);
+  req.set_follower_id(follower_id_);
+  req.set_can_bootstrap(canBootstrap());
+
+  last_subscribe_ms_.store(GetCurrentTimeMs());
+  std::weak_ptr<ReplicatedDB> weak_db = shared_from_this();
+  client_->future_subscribe(rpc_options_, req).via(executor_)
+    .then([weak_db = std::move(weak_db)] (
+        folly::Try<SubscribeResponse>&& t) {
+        auto db = weak_db.lock();
+        if (db == nullptr) {
+          return;
+        }
+
+        if (t.hasException()) {
+          LOG(ERROR) << "Failed to subscribe to "
+                     << common::getNetworkAddressStr(db->upstream_addr_)
+                     << " for " << db->db_name_ << ": " << t.exception().what()
+                     << ", falling back to pulling";
+          db->stats_.incCounter(kReplicatorSubscribeFailure, 1);
+          {
+            // wait for the push being applied, if any
+            std::lock_guard<std::mutex> g(db->push_mutex_);
+            db->subscribed_ = false;
+          }
+          db->pullFromUpstream();
+          return;
+        }
+
+        {
+          std::lock_guard<std::mutex> g(db->push_mutex_);
+          db->subscribed_ = true;
+        }
+        db->last_push_ms_.store(GetCurrentTimeMs());
+        db->scheduleSubscriptionCheck();
+      });
+}
+
+void RocksDBReplicator::ReplicatedDB::scheduleSubscriptionCheck() {
+  // Check right when the subscription would go idle, so that a lost one is
+  // noticed within replicator_push_idle_timeout_ms of the last push.
+  const auto now = GetCurrentTimeMs();
+  const auto deadline_ms =
+    last_push_ms_.load() + FLAGS_replicator_push_idle_timeout_ms + 1;
+  const uint32_t delay = deadline_ms > now ?
+    std::min<uint64_t>(deadline_ms - now, FLAGS_replicator_push_idle_timeout_ms) :
+    1;
+  std::weak_ptr<ReplicatedDB> weak_db = shared_from_this();
+  auto eb = client_->getChannel()->getEventBase();
+  eb->runInEventBaseThread([eb, delay, weak_db = std::move(weak_db)] {
+      eb->runAfterDelay([weak_db = std::move(weak_db)] {
+          auto db = weak_db.lock();
+          if (db == nullptr) {
+            return;
+          }
+
+          const auto now = GetCurrentTimeMs();
+          const auto last_push_ms = db->last_push_ms_.load();
+          if (last_push_ms + FLAGS_replicator_push_idle_timeout_ms < now) {
+            // Either upstream has nothing new, or it has lost our
+            // subscription. Subscribing again is cheap and covers both.
+            db->subscribeToUpstream();
+          } else {
+            db->scheduleSubscriptionCheck();
+          }
+        },
+        delay);
+    });
+}
+
+void RocksDBReplicator::ReplicatedDB::recordApplied(
+    std::vector<Update>::const_iterator begin, const size_t n_applied) {
+  // Some updates may have no timestamp. Use the latest one that has.
+  for (auto itor = begin + n_applied; itor != begin; ) {
+    --itor;
+    if (itor->timestamp != 0) {
+      last_applied_timestamp_ms_.store(itor->timestamp);
+      return;
+    }
+  }
+}
+
+uint64_t RocksDBReplicator::ReplicatedDB::fillUpdate(
+    rocksdb::BatchResult* result, Update* update) {
+  update->set_seq_no(result->sequence);
+
+  // The leader appends the timestamp as the last record of every batch, so
+  // we only need a full Iterate() for batches not written by Write().
+  uint64_t ms;
+  if (ExtractTrailingTimestamp(*result->writeBatchPtr, &ms)) {
+    update->timestamp = ms;
+  } else {
+    LogExtractor extractor;
+    extractor.ms = 0;
+    auto ret = result->writeBatchPtr->Iterate(&extractor);
+    if (ret.ok()) {
+      update->timestamp = extractor.ms;
+    } else {
+      update->timestamp = 0;
+      LOG(WARNING) << "Failed to extract timestamp for update "
+                   << result->sequence;
+    }
   }
+
+  // Hand the batch buffer over to the IOBuf, which deletes the WriteBatch
+  // once the last reference to raw_data goes away.
+  auto batch = result->writeBatchPtr.release();
+  const auto& rep = batch->Data();
+  update->raw_data = folly::IOBuf(
+    folly::IOBuf::TAKE_OWNERSHIP,
+    const_cast<char*>(rep.data()),
+    rep.size(),
+    [] (void* /* buf */, void* user_data) {
+      delete static_cast<rocksdb::WriteBatch*>(user_data);
+    },
+    batch);
+
+  return rep.size();
 }
 
 }  // namespace replicator
@@ -0,0 +1,323 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+//
+// A self-contained replication benchmark. It runs a leader host and
+// num_followers + num_observers downstream hosts in one process, each with
+// its own RocksDBReplicator listening on its own loopback port, and sweeps
+// shard count, value size, writer threads and replication mode. The results
+// are written out as JSON, so that they can be compared between releases.
+//
+
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "common/jsoncpp/include/json/json.h"
+#include "folly/Conv.h"
+#include "folly/String.h"
+#define private public
+#include "rocksdb_replicator/rocksdb_replicator.h"
+#include "rocksdb/db.h"
+
+using folly::SocketAddress;
+using replicator::ReplicaRole;
+using replicator::ReturnCode;
+using replicator::RocksDBReplicator;
+using rocksdb::DB;
+using rocksdb::Options;
+using rocksdb::WriteBatch;
+using rocksdb::WriteOptions;
+
+using std::atomic;
+using std::shared_ptr;
+using std::string;
+using std::thread;
+using std::to_string;
+using std::unique_ptr;
+using std::vector;
+
+DEFINE_string(shard_counts, "1,16", "Comma separated shard counts to sweep");
+DEFINE_string(value_sizes, "100,4096", "Comma separated value sizes to sweep");
+DEFINE_string(writer_threads, "1,8",
+              "Comma separated # of writer threads to sweep");
+DEFINE_string(replication_modes, "0,2",
+              "Comma separated replication modes to sweep");
+DEFINE_int32(num_followers, 2, "# of follower hosts");
+DEFINE_int32(num_observers, 0, "# of observer hosts");
+DEFINE_int32(base_port, 9190,
+             "The leader host listens on base_port, and the downstream hosts "
+             "on the ports following it");
+DEFINE_int32(duration_s, 10, "How long to write for each configuration");
+DEFINE_int32(catch_up_timeout_s, 60,
+             "How long to wait for downstreams to catch up after writing");
+DEFINE_string(bench_db_path, "/tmp/replication_benchmark_",
+              "The path prefix of the dbs");
+DEFINE_string(output, "", "The file to write the JSON results to. Written "
+              "to stdout if empty");
+
+DECLARE_int32(rocksdb_replicator_port);
+DECLARE_int32(replicator_replication_mode);
+
+namespace {
+
+// A host with its own replicator listening on port
+struct Host {
+  explicit Host(int32_t port) {
+    FLAGS_rocksdb_replicator_port = port;
+    replicator_.reset(new RocksDBReplicator);
+  }
+
+  unique_ptr<RocksDBReplicator> replicator_;
+};
+
+vector<int> ParseInts(const string& str) {
+  vector<folly::StringPiece> tokens;
+  folly::split(",", str, tokens);
+  vector<int> ints;
+  for (const auto& token : tokens) {
+    ints.push_back(folly::to<int>(token));
+  }
+  return ints;
+}
+
+shared_ptr<DB> CleanAndOpenDB(const string& path) {
+  CHECK_EQ(system(("rm -rf " + path).c_str()), 0);
+  Options options;
+  options.create_if_missing = true;
+  options.WAL_ttl_seconds = 3600;
+  DB* db;
+  CHECK(DB::Open(options, path, &db).ok());
+  return shared_ptr<DB>(db);
+}
+
+uint64_t NowMs() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+    std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// user + system CPU time of the process
+uint64_t GetProcessCpuTimeUs() {
+  rusage usage;
+  CHECK_EQ(getrusage(RUSAGE_SELF, &usage), 0);
+  return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000ull +
+    usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+uint64_t Percentile(const vector<uint64_t>& sorted, const double pct) {
+  if (sorted.empty()) {
+    return 0;
+  }
+  const auto idx = static_cast<size_t>(pct / 100 * (sorted.size() - 1));
+  return sorted[idx];
+}
+
+Json::Value RunConfig(const vector<unique_ptr<Host>>& hosts,
+                      const int num_shards,
+                      const int value_size,
+                      const int num_writers,
+                      const int replication_mode) {
+  LOG(INFO) << "Running " << num_shards << " shards, " << value_size
+            << " byte values, " << num_writers << " writers, mode "
+            << replication_mode;
+  FLAGS_replicator_replication_mode = replication_mode;
+
+  // leaders[s] is the leader of shard s, and downstreams[s] are its
+  // followers and observers
+  const SocketAddress leader_addr("127.0.0.1", FLAGS_base_port);
+  vector<RocksDBReplicator::ReplicatedDB*> leaders(num_shards);
+  vector<vector<RocksDBReplicator::ReplicatedDB*>> downstreams(num_shards);
+  for (int s = 0; s < num_shards; ++s) {
+    const auto db_name = "shard" + to_string(s);
+    for (size_t h = 0; h < hosts.size(); ++h) {
+      auto role = ReplicaRole::LEADER;
+      if (h > 0) {
+        role = static_cast<int>(h) <= FLAGS_num_followers ?
+          ReplicaRole::FOLLOWER : ReplicaRole::OBSERVER;
+      }
+
+      RocksDBReplicator::ReplicatedDB* db;
+      CHECK(hosts[h]->replicator_->addDB(
+              db_name,
+              CleanAndOpenDB(FLAGS_bench_db_path + "host" + to_string(h) +
+                             "_" + db_name),
+              role,
+              h == 0 ? SocketAddress() : leader_addr,
+              &db) == ReturnCode::OK);
+      if (h == 0) {
+        leaders[s] = db;
+      } else {
+        downstreams[s].push_back(db);
+      }
+    }
+  }
+
+  atomic<bool> stop(false);
+  atomic<uint64_t> num_writes(0);
+  atomic<uint64_t> num_failures(0);
+  uint64_t bytes_out_begin = 0;
+  for (auto leader : leaders) {
+    bytes_out_begin += leader->meter_.bytesOut();
+  }
+  const auto cpu_begin = GetProcessCpuTimeUs();
+
+  const string value(value_size, 'v');
+  vector<thread> writers;
+  for (int t = 0; t < num_writers; ++t) {
+    writers.emplace_back([&, t] {
+        const WriteOptions write_options;
+        for (uint64_t n = 0; !stop.load(); ++n) {
+          WriteBatch batch;
+          batch.Put("writer" + to_string(t) + "_key" + to_string(n), value);
+          auto db = leaders[(t + n) % leaders.size()];
+          if (db->Write(write_options, &batch).ok()) {
+            ++num_writes;
+          } else {
+            ++num_failures;
+          }
+        }
+      });
+  }
+
+  // Sample the replication lag of every downstream every ms, the same way
+  // replication.json reports lag_ms
+  vector<uint64_t> lags;
+  thread sampler([&] {
+      while (!stop.load()) {
+        const auto now = NowMs();
+        for (int s = 0; s < num_shards; ++s) {
+          const auto leader_seq_no =
+            leaders[s]->db_wrapper_->LatestSequenceNumber();
+          for (auto db : downstreams[s]) {
+            const auto applied_ms = db->last_applied_timestamp_ms_.load();
+            const bool behind =
+              db->db_wrapper_->LatestSequenceNumber() < leader_seq_no;
+            lags.push_back(behind && applied_ms != 0 && applied_ms < now ?
+                           now - applied_ms : 0);
+          }
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      }
+    });
+
+  std::this_thread::sleep_for(std::chrono::seconds(FLAGS_duration_s));
+  stop.store(true);
+  for (auto& writer : writers) {
+    writer.join();
+  }
+  sampler.join();
+
+  const auto cpu_us = GetProcessCpuTimeUs() - cpu_begin;
+  uint64_t bytes_out = 0;
+  for (auto leader : leaders) {
+    bytes_out += leader->meter_.bytesOut();
+  }
+  bytes_out -= bytes_out_begin;
+
+  // let downstreams catch up before tearing the shards down
+  const auto deadline = NowMs() + FLAGS_catch_up_timeout_s * 1000;
+  for (int s = 0; s < num_shards; ++s) {
+    const auto leader_seq_no = leaders[s]->db_wrapper_->LatestSequenceNumber();
+    for (auto db : downstreams[s]) {
+      while (db->db_wrapper_->LatestSequenceNumber() < leader_seq_no &&
+             NowMs() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      }
+    }
+  }
+  if (NowMs() >= deadline) {
+    LOG(ERROR) << "Downstreams didn't catch up in " << FLAGS_catch_up_timeout_s
+               << " seconds";
+  }
+
+  for (int s = 0; s < num_shards; ++s) {
+    for (size_t h = hosts.size(); h-- > 0;) {
+      hosts[h]->replicator_->removeDB("shard" + to_string(s));
+    }
+  }
+
+  std::sort(lags.begin(), lags.end());
+  Json::Value lag_ms(Json::objectValue);
+  lag_ms["p50"] = Json::UInt64(Percentile(lags, 50));
+  lag_ms["p99"] = Json::UInt64(Percentile(lags, 99));
+  lag_ms["p999"] = Json::UInt64(Percentile(lags, 99.9));
+
+  Json::Value result(Json::objectValue);
+  result["num_shards"] = num_shards;
+  result["value_size"] = value_size;
+  result["writer_threads"] = num_writers;
+  result["replication_mode"] = replication_mode;
+  result["writes_per_sec"] =
+    static_cast<double>(num_writes.load()) / FLAGS_duration_s;
+  result["write_failures"] = Json::UInt64(num_failures.load());
+  result["lag_ms"] = lag_ms;
+  result["replicated_bytes_per_sec"] =
+    static_cast<double>(bytes_out) / FLAGS_duration_s;
+  result["cpu_ns_per_replicated_byte"] = bytes_out == 0 ?
+    0.0 : static_cast<double>(cpu_us) * 1000 / bytes_out;
+  return result;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+
+  vector<unique_ptr<Host>> hosts;
+  for (int h = 0; h <= FLAGS_num_followers + FLAGS_num_observers; ++h) {
+    hosts.emplace_back(new Host(FLAGS_base_port + h));
+  }
+
+  Json::Value results(Json::arrayValue);
+  for (auto num_shards : ParseInts(FLAGS_shard_counts)) {
+    for (auto value_size : ParseInts(FLAGS_value_sizes)) {
+      for (auto num_writers : ParseInts(FLAGS_writer_threads)) {
+        for (auto mode : ParseInts(FLAGS_replication_modes)) {
+          results.append(RunConfig(hosts, num_shards, value_size, num_writers,
+                                   mode));
+        }
+      }
+    }
+  }
+
+  Json::Value root(Json::objectValue);
+  root["num_followers"] = FLAGS_num_followers;
+  root["num_observers"] = FLAGS_num_observers;
+  root["duration_s"] = FLAGS_duration_s;
+  root["results"] = results;
+
+  Json::StreamWriterBuilder builder;
+  const auto json = Json::writeString(builder, root);
+  if (FLAGS_output.empty()) {
+    std::cout << json << std::endl;
+  } else {
+    std::ofstream out(FLAGS_output);
+    out << json << std::endl;
+    CHECK(out.good()) << "Failed to write " << FLAGS_output;
+  }
+
+  return 0;
+}
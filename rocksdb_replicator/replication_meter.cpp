@@ -0,0 +1,111 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+#include "rocksdb_replicator/replication_meter.h"
+
+#include <algorithm>
+
+namespace replicator { namespace detail {
+
+const size_t ReplicationMeter::kNumRttSamples;
+
+ReplicationMeter::ReplicationMeter(const uint64_t window_ms)
+    : window_ms_(window_ms)
+    , bytes_in_(0)
+    , bytes_out_(0)
+    , cur_ms_(0)
+    , rates_mutex_()
+    , prev_{0, 0, 0}
+    , cur_{0, 0, 0}
+    , rtts_mutex_()
+    , rtts_()
+    , num_rtts_(0) {}
+
+void ReplicationMeter::addRtt(const uint64_t rtt_ms) {
+  std::lock_guard<std::mutex> g(rtts_mutex_);
+  rtts_[num_rtts_++ % kNumRttSamples] = rtt_ms;
+}
+
+void ReplicationMeter::roll(const uint64_t now_ms) {
+  std::lock_guard<std::mutex> g(rates_mutex_);
+  if (cur_.ms != 0 && now_ms < cur_.ms + window_ms_) {
+    // someone else has rolled
+    return;
+  }
+
+  const Snapshot now{now_ms, bytesIn(), bytesOut()};
+  // The first recording starts the first window
+  prev_ = cur_.ms == 0 ? now : cur_;
+  cur_ = now;
+  cur_ms_.store(now_ms, std::memory_order_relaxed);
+}
+
+void ReplicationMeter::getRates(const uint64_t now_ms, double* in_per_sec,
+                                double* out_per_sec) const {
+  *in_per_sec = 0;
+  *out_per_sec = 0;
+
+  Snapshot start;
+  Snapshot now;
+  {
+    std::lock_guard<std::mutex> g(rates_mutex_);
+    if (cur_.ms == 0) {
+      return;
+    }
+
+    // Nothing has been recorded since cur_ became a window old, or recording
+    // would have rolled. Rates then cover [cur_.ms, now], as if it had.
+    start = now_ms >= cur_.ms + window_ms_ ? cur_ : prev_;
+    // read under the lock, so that they are no less than start's
+    now = Snapshot{now_ms, bytesIn(), bytesOut()};
+  }
+
+  if (now.ms <= start.ms) {
+    return;
+  }
+
+  const double elapsed_sec = (now.ms - start.ms) / 1000.0;
+  *in_per_sec = (now.bytes_in - start.bytes_in) / elapsed_sec;
+  *out_per_sec = (now.bytes_out - start.bytes_out) / elapsed_sec;
+}
+
+std::vector<uint64_t> ReplicationMeter::getRttPercentiles(
+    const std::vector<double>& pcts) const {
+  std::vector<uint64_t> samples;
+  {
+    std::lock_guard<std::mutex> g(rtts_mutex_);
+    const auto n = std::min<uint64_t>(num_rtts_, kNumRttSamples);
+    samples.assign(rtts_.begin(), rtts_.begin() + n);
+  }
+
+  std::vector<uint64_t> result;
+  if (samples.empty()) {
+    return result;
+  }
+
+  std::sort(samples.begin(), samples.end());
+  result.reserve(pcts.size());
+  for (const auto pct : pcts) {
+    const auto clamped = std::min(std::max(pct, 0.0), 100.0);
+    const auto idx = static_cast<size_t>(clamped / 100 * (samples.size() - 1));
+    result.push_back(samples[idx]);
+  }
+  return result;
+}
+
+}  // namespace detail
+}  // namespace replicator
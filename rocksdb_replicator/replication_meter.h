@@ -0,0 +1,121 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+namespace replicator { namespace detail {
+
+/*
+ * ReplicationMeter keeps the traffic of a replicated db for introspection.
+ *
+ * Recording is meant for the replication paths, so byte counts are relaxed
+ * atomics, and RTTs go to a small ring of recent samples. The derived values
+ * (rates and percentiles) are only computed when someone asks for them, which
+ * keeps a periodic scrape of every db on a host cheap. Asking has no side
+ * effect, so any number of scrapers see the same rates.
+ */
+class ReplicationMeter {
+ public:
+  // # of recent RTT samples percentiles are computed from
+  static const size_t kNumRttSamples = 128;
+
+  /*
+   * Rates are averaged over at least window_ms and at most 2 * window_ms.
+   */
+  explicit ReplicationMeter(const uint64_t window_ms = 10000);
+
+  /*
+   * Record bytes replicated in or out at now_ms.
+   */
+  void addBytesIn(const uint64_t bytes, const uint64_t now_ms) {
+    maybeRoll(now_ms);
+    bytes_in_.fetch_add(bytes, std::memory_order_relaxed);
+  }
+
+  void addBytesOut(const uint64_t bytes, const uint64_t now_ms) {
+    maybeRoll(now_ms);
+    bytes_out_.fetch_add(bytes, std::memory_order_relaxed);
+  }
+
+  void addRtt(const uint64_t rtt_ms);
+
+  uint64_t bytesIn() const {
+    return bytes_in_.load(std::memory_order_relaxed);
+  }
+
+  uint64_t bytesOut() const {
+    return bytes_out_.load(std::memory_order_relaxed);
+  }
+
+  /*
+   * Fill the bytes/s in and out as of now_ms. Both are 0 until something has
+   * been recorded.
+   */
+  void getRates(const uint64_t now_ms, double* in_per_sec,
+                double* out_per_sec) const;
+
+  /*
+   * The RTT percentiles for pcts (each in [0, 100]) over the recent samples.
+   * Return an empty vector if no RTT has been recorded.
+   */
+  std::vector<uint64_t> getRttPercentiles(
+    const std::vector<double>& pcts) const;
+
+ private:
+  struct Snapshot {
+    uint64_t ms;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+  };
+
+  // Start a new window at now_ms if the current one is window_ms_ old
+  void maybeRoll(const uint64_t now_ms) {
+    if (now_ms >= cur_ms_.load(std::memory_order_relaxed) + window_ms_) {
+      roll(now_ms);
+    }
+  }
+
+  void roll(const uint64_t now_ms);
+
+  const uint64_t window_ms_;
+  std::atomic<uint64_t> bytes_in_;
+  std::atomic<uint64_t> bytes_out_;
+  // cur_.ms, readable without rates_mutex_
+  std::atomic<uint64_t> cur_ms_;
+
+  // protects prev_ and cur_, which only recording moves forward. Rates are
+  // computed over [prev_.ms, now], or [cur_.ms, now] once cur_ is a window
+  // old.
+  mutable std::mutex rates_mutex_;
+  Snapshot prev_;
+  Snapshot cur_;
+
+  // protects rtts_ and num_rtts_
+  mutable std::mutex rtts_mutex_;
+  std::array<uint64_t, kNumRttSamples> rtts_;
+  uint64_t num_rtts_;
+};
+
+}  // namespace detail
+}  // namespace replicator
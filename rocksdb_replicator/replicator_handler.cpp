@@ -40,4 +40,87 @@ void ReplicatorHandler::async_eb_replicate(
   db->handleReplicateRequest(std::move(callback), std::move(request));
 }
 
+#if __GNUC__ >= 8
+void ReplicatorHandler::async_tm_subscribe(
+#else
+void ReplicatorHandler::async_eb_subscribe(
+#endif
+    std::unique_ptr<apache::thrift::HandlerCallback<
+      std::unique_ptr<SubscribeResponse>>> callback,
+    std::unique_ptr<SubscribeRequest> request) {
+  std::shared_ptr<RocksDBReplicator::ReplicatedDB> db;
+  if (!db_map_->get(request->db_name, &db)) {
+    ReplicateException e;
+    e.code = ErrorCode::SOURCE_NOT_FOUND;
+    e.msg = "could not find " + request->db_name;
+    callback->exception(e);
+    return;
+  }
+
+  auto downstream_addr = *callback->getConnectionContext()->getPeerAddress();
+  downstream_addr.setPort(request->port);
+  db->handleSubscribeRequest(std::move(callback), std::move(request),
+                             downstream_addr);
+}
+
+#if __GNUC__ >= 8
+void ReplicatorHandler::async_tm_push(
+#else
+void ReplicatorHandler::async_eb_push(
+#endif
+    std::unique_ptr<apache::thrift::HandlerCallback<
+      std::unique_ptr<PushResponse>>> callback,
+    std::unique_ptr<PushRequest> request) {
+  std::shared_ptr<RocksDBReplicator::ReplicatedDB> db;
+  if (!db_map_->get(request->db_name, &db)) {
+    ReplicateException e;
+    e.code = ErrorCode::SOURCE_NOT_FOUND;
+    e.msg = "could not find " + request->db_name;
+    callback->exception(e);
+    return;
+  }
+
+  db->handlePushRequest(std::move(callback), std::move(request));
+}
+
+#if __GNUC__ >= 8
+void ReplicatorHandler::async_tm_createCheckpoint(
+#else
+void ReplicatorHandler::async_eb_createCheckpoint(
+#endif
+    std::unique_ptr<apache::thrift::HandlerCallback<
+      std::unique_ptr<CheckpointResponse>>> callback,
+    std::unique_ptr<CheckpointRequest> request) {
+  std::shared_ptr<RocksDBReplicator::ReplicatedDB> db;
+  if (!db_map_->get(request->db_name, &db)) {
+    ReplicateException e;
+    e.code = ErrorCode::SOURCE_NOT_FOUND;
+    e.msg = "could not find " + request->db_name;
+    callback->exception(e);
+    return;
+  }
+
+  db->handleCreateCheckpointRequest(std::move(callback), std::move(request));
+}
+
+#if __GNUC__ >= 8
+void ReplicatorHandler::async_tm_getCheckpointChunk(
+#else
+void ReplicatorHandler::async_eb_getCheckpointChunk(
+#endif
+    std::unique_ptr<apache::thrift::HandlerCallback<
+      std::unique_ptr<CheckpointChunkResponse>>> callback,
+    std::unique_ptr<CheckpointChunkRequest> request) {
+  std::shared_ptr<RocksDBReplicator::ReplicatedDB> db;
+  if (!db_map_->get(request->db_name, &db)) {
+    ReplicateException e;
+    e.code = ErrorCode::SOURCE_NOT_FOUND;
+    e.msg = "could not find " + request->db_name;
+    callback->exception(e);
+    return;
+  }
+
+  db->handleGetCheckpointChunkRequest(std::move(callback), std::move(request));
+}
+
 }  // namespace replicator
@@ -20,7 +20,7 @@
 
 #include <string>
 
-#include "rocksdb_replicator/fast_read_map.h"
+#include "rocksdb_replicator/concurrent_read_map.h"
 #include "rocksdb_replicator/rocksdb_replicator.h"
 #include "rocksdb_replicator/thrift/gen-cpp2/Replicator.h"
 
@@ -28,8 +28,8 @@ namespace replicator {
 
 class ReplicatorHandler : public ReplicatorSvIf {
  public:
-  using DBMapType = detail::FastReadMap<std::string,
-    std::shared_ptr<RocksDBReplicator::ReplicatedDB>>;
+  using DBPtr = std::shared_ptr<RocksDBReplicator::ReplicatedDB>;
+  using DBMapType = detail::ConcurrentReadMap<std::string, DBPtr>;
 
   explicit ReplicatorHandler(DBMapType* db_map) : db_map_(db_map) {}
 
@@ -42,6 +42,42 @@ class ReplicatorHandler : public ReplicatorSvIf {
         std::unique_ptr<ReplicateResponse>>> callback,
       std::unique_ptr<ReplicateRequest> request) override;
 
+#if __GNUC__ >= 8
+  void async_tm_subscribe(
+#else
+  void async_eb_subscribe(
+#endif
+      std::unique_ptr<apache::thrift::HandlerCallback<
+        std::unique_ptr<SubscribeResponse>>> callback,
+      std::unique_ptr<SubscribeRequest> request) override;
+
+#if __GNUC__ >= 8
+  void async_tm_push(
+#else
+  void async_eb_push(
+#endif
+      std::unique_ptr<apache::thrift::HandlerCallback<
+        std::unique_ptr<PushResponse>>> callback,
+      std::unique_ptr<PushRequest> request) override;
+
+#if __GNUC__ >= 8
+  void async_tm_createCheckpoint(
+#else
+  void async_eb_createCheckpoint(
+#endif
+      std::unique_ptr<apache::thrift::HandlerCallback<
+        std::unique_ptr<CheckpointResponse>>> callback,
+      std::unique_ptr<CheckpointRequest> request) override;
+
+#if __GNUC__ >= 8
+  void async_tm_getCheckpointChunk(
+#else
+  void async_eb_getCheckpointChunk(
+#endif
+      std::unique_ptr<apache::thrift::HandlerCallback<
+        std::unique_ptr<CheckpointChunkResponse>>> callback,
+      std::unique_ptr<CheckpointChunkRequest> request) override;
+
  private:
   DBMapType* db_map_;
 };
@@ -18,6 +18,7 @@
 
 #include "rocksdb_replicator/replicator_stats.h"
 
+#include <cctype>
 #include <string>
 
 #include "common/stats/stats.h"
@@ -55,6 +56,13 @@ const std::string kReplicatorReplyUpdatesSuccessLatency =
 const std::string kReplicatorReplyUpdatesFailureLatency =
   "replicator_reply_updates_failure_latency";
 
+const std::string kReplicatorWalTailCacheHits =
+  "replicator_wal_tail_cache_hits";
+const std::string kReplicatorWalTailCacheMisses =
+  "replicator_wal_tail_cache_misses";
+const std::string kReplicatorWalIterForks =
+  "replicator_wal_iter_forks";
+
 const std::string kReplicatorWriteSuccess =
   "replicator_write_success";
 const std::string kReplicatorWriteLeaderFailure =
@@ -66,6 +74,12 @@ const std::string kReplicatorWriteSuccessResponseTime = "replicator_write_succes
 const std::string kReplicatorWriteFailureResponseTime = "replicator_write_failure_response_time";
 const std::string kReplicatorWriteTwoAckDegraded = "replicator_write_two_ack_degraded";
 const std::string kReplicatorWriteTwoAckRecovered = "replicator_write_two_ack_recovered";
+const std::string kReplicatorFollowerAckMs = "replicator_follower_ack_ms";
+const std::string kReplicatorFollowerExcluded = "replicator_follower_excluded";
+const std::string kReplicatorGroupCommitSize = "replicator_group_commit_size";
+const std::string kReplicatorFollowerApplyBatchSize = "replicator_follower_apply_batch_size";
+const std::string kReplicatorCompressionSavedBytes = "replicator_compression_saved_bytes";
+const std::string kReplicatorDecompressionFailure = "replicator_decompression_failure";
 
 const std::string kReplicatorLeaderSequenceNumbersBehind = "replicator_leader_sequence_numbers_behind";
 const std::string kReplicatorPullRequests = "replicator_pull_requests";
@@ -77,6 +91,16 @@ const std::string kReplicatorPullLatency = "replicator_pull_latency";
 const std::string kReplicatorHandleResponseFailure = "replicator_handle_response_failure";
 const std::string kReplicatorResetUpstreamOnNoUpdates = "replicator_reset_upstream_on_no_updates_attempted";
 const std::string kReplicatorHandleObserverRequests = "replicator_handle_observer_requests";
+const std::string kReplicatorPipelinedPulls = "replicator_pipelined_pulls";
+const std::string kReplicatorPipelinedPullGaps = "replicator_pipelined_pull_gaps";
+const std::string kReplicatorSubscribeFailure = "replicator_subscribe_failure";
+const std::string kReplicatorHandleSubscribeRequests = "replicator_handle_subscribe_requests";
+const std::string kReplicatorPushRequests = "replicator_push_requests";
+const std::string kReplicatorPushRequestsFailure = "replicator_push_requests_failure";
+const std::string kReplicatorHandlePushRequests = "replicator_handle_push_requests";
+const std::string kReplicatorBootstraps = "replicator_bootstraps";
+const std::string kReplicatorBootstrapFailure = "replicator_bootstrap_failure";
+const std::string kReplicatorCheckpointOutBytes = "replicator_checkpoint_out_bytes";
 
 
 void logMetric(const std::string& metric_name, int64_t value,
@@ -99,4 +123,181 @@ void incCounter(const std::string& counter_name, uint64_t value,
   }
 }
 
+namespace {
+
+common::Stats::Tags DbTags(const std::string& db_name) {
+  if (FLAGS_replicator_enable_per_db_stats) {
+    return {{"db", db_name}};
+  } else if (FLAGS_replicator_enable_per_dataset_stats) {
+    return {{"dataset", common::DbNameToSegment(db_name)}};
+  }
+
+  return {};
+}
+
+// Keep the characters safe in a stat name, and cap the length, as follower
+// ids come from downstreams.
+std::string SanitizeFollowerId(const std::string& id) {
+  const size_t kMaxLength = 64;
+  std::string sanitized = id.substr(0, kMaxLength);
+  for (auto& c : sanitized) {
+    if (!isalnum(static_cast<unsigned char>(c)) &&
+        c != '.' && c != ':' && c != '/' && c != '-' && c != '_') {
+      c = '_';
+    }
+  }
+
+  return sanitized.empty() ? "unknown" : sanitized;
+}
+
+}  // namespace
+
+const size_t DbStats::kMaxTrackedFollowers;
+
+DbStats::DbStats(const std::string& db_name)
+    : db_name_(db_name)
+    , metrics_()
+    , counters_()
+    , follower_mtx_()
+    , follower_ack_ms_() {
+  const std::string* metric_names[] = {
+    &kReplicatorLatency,
+    &kReplicatorOutNumUpdates,
+    &kReplicatorGetUpdatesSinceMs,
+    &kReplicatorReplyUpdatesSuccessLatency,
+    &kReplicatorReplyUpdatesFailureLatency,
+    &kReplicatorWriteToLeaderMs,
+    &kReplicatorWriteSuccessResponseTime,
+    &kReplicatorWriteFailureResponseTime,
+    &kReplicatorFollowerAckMs,
+    &kReplicatorGroupCommitSize,
+    &kReplicatorFollowerApplyBatchSize,
+    &kReplicatorLeaderSequenceNumbersBehind,
+    &kReplicatorPipelinedPulls,
+  };
+
+  const std::string* counter_names[] = {
+    &kReplicatorOutBytes,
+    &kReplicatorInBytes,
+    &kReplicatorWriteBytes,
+    &kReplicatorConnectionErrors,
+    &kReplicatorRemoteApplicationExceptions,
+    &kReplicatorRemoteApplicationExceptionsNotFound,
+    &kReplicatorLeaderReset,
+    &kReplicatorGetUpdatesSinceErrors,
+    &kReplicatorGetUpdatesMissingSequence,
+    &kReplicatorWalTailCacheHits,
+    &kReplicatorWalTailCacheMisses,
+    &kReplicatorWalIterForks,
+    &kReplicatorWriteSuccess,
+    &kReplicatorWriteLeaderFailure,
+    &kReplicatorWriteWaitTimedOut,
+    &kReplicatorWriteTwoAckDegraded,
+    &kReplicatorWriteTwoAckRecovered,
+    &kReplicatorFollowerExcluded,
+    &kReplicatorCompressionSavedBytes,
+    &kReplicatorDecompressionFailure,
+    &kReplicatorPullRequests,
+    &kReplicatorPullRequestsSuccess,
+    &kReplicatorPullRequestsFailure,
+    &kReplicatorPullRequestsNoUpdates,
+    &kReplicatorPullFromNonLeader,
+    &kReplicatorHandleResponseFailure,
+    &kReplicatorResetUpstreamOnNoUpdates,
+    &kReplicatorHandleObserverRequests,
+    &kReplicatorPipelinedPullGaps,
+    &kReplicatorSubscribeFailure,
+    &kReplicatorHandleSubscribeRequests,
+    &kReplicatorPushRequests,
+    &kReplicatorPushRequestsFailure,
+    &kReplicatorHandlePushRequests,
+    &kReplicatorBootstraps,
+    &kReplicatorBootstrapFailure,
+    &kReplicatorCheckpointOutBytes,
+  };
+
+  auto stats = common::Stats::get();
+  const auto tags = DbTags(db_name);
+  for (auto name : metric_names) {
+    auto& handles = metrics_[name];
+    handles.all = stats->GetMetricHandle(*name);
+    if (!tags.empty()) {
+      handles.tagged = stats->GetMetricHandle(*name, tags);
+    }
+  }
+
+  for (auto name : counter_names) {
+    auto& handles = counters_[name];
+    handles.all = stats->GetCounterHandle(*name);
+    if (!tags.empty()) {
+      handles.tagged = stats->GetCounterHandle(*name, tags);
+    }
+  }
+}
+
+void DbStats::logMetric(const std::string& metric_name, int64_t value) const {
+  auto it = metrics_.find(&metric_name);
+  if (it == metrics_.end()) {
+    replicator::logMetric(metric_name, value, db_name_);
+    return;
+  }
+
+  common::Stats::get()->AddMetric(it->second.all, value);
+  if (it->second.tagged.valid()) {
+    common::Stats::get()->AddMetric(it->second.tagged, value);
+  }
+}
+
+void DbStats::incCounter(const std::string& counter_name,
+                         uint64_t value) const {
+  auto it = counters_.find(&counter_name);
+  if (it == counters_.end()) {
+    replicator::incCounter(counter_name, value, db_name_);
+    return;
+  }
+
+  common::Stats::get()->Incr(it->second.all, value);
+  if (it->second.tagged.valid()) {
+    common::Stats::get()->Incr(it->second.tagged, value);
+  }
+}
+
+void DbStats::logFollowerAckMs(const std::string& follower_id,
+                               int64_t ack_ms) const {
+  logMetric(kReplicatorFollowerAckMs, ack_ms);
+
+  Handles handles;
+  {
+    std::lock_guard<std::mutex> g(follower_mtx_);
+    auto it = follower_ack_ms_.find(follower_id);
+    if (it == follower_ack_ms_.end()) {
+      if (follower_ack_ms_.size() >= kMaxTrackedFollowers) {
+        return;
+      }
+
+      const common::Stats::Tags follower_tag = {
+        {"follower", SanitizeFollowerId(follower_id)}};
+      auto tags = follower_tag;
+      for (const auto& tag : DbTags(db_name_)) {
+        tags.push_back(tag);
+      }
+
+      auto stats = common::Stats::get();
+      Handles h;
+      h.all = stats->GetMetricHandle(kReplicatorFollowerAckMs, follower_tag);
+      if (tags.size() > follower_tag.size()) {
+        h.tagged = stats->GetMetricHandle(kReplicatorFollowerAckMs, tags);
+      }
+      it = follower_ack_ms_.emplace(follower_id, h).first;
+    }
+
+    handles = it->second;
+  }
+
+  common::Stats::get()->AddMetric(handles.all, ack_ms);
+  if (handles.tagged.valid()) {
+    common::Stats::get()->AddMetric(handles.tagged, ack_ms);
+  }
+}
+
 }  // namespace replicator
@@ -18,7 +18,11 @@
 
 #pragma once
 
+#include <mutex>
 #include <string>
+#include <unordered_map>
+
+#include "common/stats/stats.h"
 
 namespace replicator {
 
@@ -37,6 +41,9 @@ extern const std::string kReplicatorGetUpdatesMissingSequence;
 extern const std::string kReplicatorGetUpdatesSinceMs;
 extern const std::string kReplicatorReplyUpdatesSuccessLatency;
 extern const std::string kReplicatorReplyUpdatesFailureLatency;
+extern const std::string kReplicatorWalTailCacheHits;
+extern const std::string kReplicatorWalTailCacheMisses;
+extern const std::string kReplicatorWalIterForks;
 
 extern const std::string kReplicatorLeaderSequenceNumbersBehind;
 extern const std::string kReplicatorLeaderReset;
@@ -49,6 +56,12 @@ extern const std::string kReplicatorWriteSuccessResponseTime;
 extern const std::string kReplicatorWriteFailureResponseTime;
 extern const std::string kReplicatorWriteTwoAckDegraded;
 extern const std::string kReplicatorWriteTwoAckRecovered;
+extern const std::string kReplicatorFollowerAckMs;
+extern const std::string kReplicatorFollowerExcluded;
+extern const std::string kReplicatorGroupCommitSize;
+extern const std::string kReplicatorFollowerApplyBatchSize;
+extern const std::string kReplicatorCompressionSavedBytes;
+extern const std::string kReplicatorDecompressionFailure;
 
 
 extern const std::string kReplicatorPullRequests;
@@ -60,6 +73,16 @@ extern const std::string kReplicatorPullLatency;
 extern const std::string kReplicatorHandleResponseFailure;
 extern const std::string kReplicatorResetUpstreamOnNoUpdates;
 extern const std::string kReplicatorHandleObserverRequests;
+extern const std::string kReplicatorPipelinedPulls;
+extern const std::string kReplicatorPipelinedPullGaps;
+extern const std::string kReplicatorSubscribeFailure;
+extern const std::string kReplicatorHandleSubscribeRequests;
+extern const std::string kReplicatorPushRequests;
+extern const std::string kReplicatorPushRequestsFailure;
+extern const std::string kReplicatorHandlePushRequests;
+extern const std::string kReplicatorBootstraps;
+extern const std::string kReplicatorBootstrapFailure;
+extern const std::string kReplicatorCheckpointOutBytes;
 
 // add value to metric_name. If db_name is not empty, add value to the per db
 // metric also
@@ -71,4 +94,41 @@ void logMetric(const std::string& metric_name, int64_t value,
 void incCounter(const std::string& counter_name, uint64_t value,
                 const std::string& db_name = std::string());
 
+// The stats of a db, resolved to stats handles once so that updating them
+// neither builds nor hashes the per db names.
+class DbStats {
+ public:
+  explicit DbStats(const std::string& db_name);
+
+  // Same as logMetric() and incCounter() above with db_name. metric_name and
+  // counter_name are expected to be the names declared above, any other name
+  // takes the slow path.
+  void logMetric(const std::string& metric_name, int64_t value) const;
+  void incCounter(const std::string& counter_name, uint64_t value) const;
+
+  // Log ack_ms to kReplicatorFollowerAckMs, and to the same metric tagged
+  // with follower_id. follower_id comes off the wire, so it's sanitized, and
+  // only the first kMaxTrackedFollowers distinct ids get their own metric.
+  void logFollowerAckMs(const std::string& follower_id, int64_t ack_ms) const;
+
+  static const size_t kMaxTrackedFollowers = 32;
+
+ private:
+  struct Handles {
+    common::Stats::Handle all;
+    // invalid if neither per db nor per dataset stats are enabled
+    common::Stats::Handle tagged;
+  };
+
+  const std::string db_name_;
+  // Keyed by the address of the names declared above. Not modified after
+  // construction, thus safe to read from any thread.
+  std::unordered_map<const std::string*, Handles> metrics_;
+  std::unordered_map<const std::string*, Handles> counters_;
+
+  // follower_mtx_ protects follower_ack_ms_, keyed by follower id
+  mutable std::mutex follower_mtx_;
+  mutable std::unordered_map<std::string, Handles> follower_ack_ms_;
+};
+
 }  // namespace replicator
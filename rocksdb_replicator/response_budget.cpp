@@ -0,0 +1,47 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+#include "rocksdb_replicator/response_budget.h"
+
+#include <algorithm>
+
+namespace replicator { namespace detail {
+
+ResponseBudget::ResponseBudget(const uint64_t min_bytes,
+                               const uint64_t max_bytes,
+                               const uint64_t max_rtt_ms)
+    : min_bytes_(std::max<uint64_t>(min_bytes, 1))
+    , max_bytes_(std::max(max_bytes, min_bytes_))
+    , max_rtt_ms_(max_rtt_ms)
+    , budget_(min_bytes_) {}
+
+void ResponseBudget::update(const uint64_t lag, const uint64_t rtt_ms,
+                            const uint64_t response_bytes) {
+  if (lag == 0 || rtt_ms > max_rtt_ms_) {
+    budget_ = std::max(budget_ / 2, min_bytes_);
+    return;
+  }
+
+  // Only grow when the budget is what limited the response. Otherwise the
+  // upstream simply didn't have more to send, or max_updates was hit.
+  if (response_bytes >= budget_) {
+    budget_ = std::min(budget_ * 2, max_bytes_);
+  }
+}
+
+}  // namespace detail
+}  // namespace replicator
@@ -0,0 +1,67 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+#pragma once
+
+#include <cstdint>
+
+namespace replicator { namespace detail {
+
+/*
+ * ResponseBudget decides the max # of bytes a downstream asks for in each
+ * replicate request.
+ *
+ * The budget doubles while the downstream is behind and the upstream fills the
+ * whole budget within max_rtt_ms, so a follower catching up after a restart
+ * quickly moves to few large responses instead of many small ones. It halves,
+ * down to min_bytes, once the downstream has caught up or a pull takes longer
+ * than max_rtt_ms, which keeps responses small and replication latency low in
+ * the steady state.
+ *
+ * @note ResponseBudget is not thread safe. It is meant to be used by the pull
+ * loop of a single db.
+ */
+class ResponseBudget {
+ public:
+  ResponseBudget(const uint64_t min_bytes, const uint64_t max_bytes,
+                 const uint64_t max_rtt_ms);
+
+  /*
+   * The budget for the next request.
+   */
+  uint64_t get() const {
+    return budget_;
+  }
+
+  /*
+   * Adjust the budget with the outcome of the last request.
+   * lag is how many sequence #s the downstream is still behind after applying
+   * the response, rtt_ms is how long the request took, and response_bytes is
+   * the total size of updates in the response.
+   */
+  void update(const uint64_t lag, const uint64_t rtt_ms,
+              const uint64_t response_bytes);
+
+ private:
+  const uint64_t min_bytes_;
+  const uint64_t max_bytes_;
+  const uint64_t max_rtt_ms_;
+  uint64_t budget_;
+};
+
+}  // namespace detail
+}  // namespace replicator
@@ -41,19 +41,21 @@ DEFINE_int32(num_replicator_io_threads, 8,
 DEFINE_int32(rocksdb_replicator_executor_threads, 32,
              "The number of rocksplicator executor threads.");
 
+DECLARE_bool(replicator_push_replication);
+
 namespace replicator {
 
 RocksDBReplicator::RocksDBReplicator()
     : executor_()
     , client_pool_(FLAGS_num_replicator_io_threads)
+    , bootstrap_handler_()
     , db_map_()
 #if __GNUC__ >= 8
     , server_()
 #else
     , server_("disabled", false)
 #endif
-    , thread_()
-    , cleaner_() {
+    , thread_() {
 #if __GNUC__ >= 8
   executor_ = std::make_unique<folly::CPUThreadPoolExecutor>(
 #else
@@ -88,7 +90,6 @@ RocksDBReplicator::RocksDBReplicator()
 
 RocksDBReplicator::~RocksDBReplicator() {
   db_map_.clear();
-  cleaner_.stopAndWait();
   server_.stop();
   thread_.join();
 }
@@ -115,6 +116,7 @@ ReturnCode RocksDBReplicator::addDB(const std::string& db_name,
     new ReplicatedDB(db_name, std::move(db_wrapper), executor_.get(),
                      role, upstream_addr, &client_pool_, replicator_zk_cluster, replicator_helix_cluster));
 
+  new_db->bootstrap_handler_ = bootstrap_handler_;
   if (!db_map_.add(db_name, new_db)) {
     return ReturnCode::DB_PRE_EXIST;
   }
@@ -124,11 +126,13 @@ ReturnCode RocksDBReplicator::addDB(const std::string& db_name,
   }
 
   if (role == ReplicaRole::FOLLOWER || role == ReplicaRole::OBSERVER) {
-    new_db->pullFromUpstream();
+    if (FLAGS_replicator_push_replication) {
+      new_db->subscribeToUpstream();
+    } else {
+      new_db->pullFromUpstream();
+    }
   }
 
-  cleaner_.addDB(new_db);
-
   return ReturnCode::OK;
 }
 
@@ -170,4 +174,20 @@ ReturnCode RocksDBReplicator::write(const std::string& db_name,
   }
 }
 
+std::string RocksDBReplicator::introspectJson() {
+  Json::Value root(Json::objectValue);
+  db_map_.forEach([&root] (const std::string& db_name,
+                           const std::shared_ptr<ReplicatedDB>& db) {
+      root[db_name] = db->IntrospectJson();
+    });
+
+  Json::StreamWriterBuilder builder;
+  builder["indentation"] = "";
+  return Json::writeString(builder, root);
+}
+
+void RocksDBReplicator::setBootstrapHandler(BootstrapHandler handler) {
+  bootstrap_handler_ = std::make_shared<BootstrapHandler>(std::move(handler));
+}
+
 }  // namespace replicator
@@ -20,21 +20,38 @@
 
 #include <folly/io/async/EventBase.h>
 
+#include <condition_variable>
+#include <deque>
+#include <functional>
 #include <list>
 #include <memory>
 #include <mutex>
+#include <stdexcept>
 #include <string>
 #include <thread>
 #include <unordered_map>
 #include <utility>
+#include <vector>
 
+#include "common/jsoncpp/include/json/json.h"
 #include "common/thrift_client_pool.h"
-#include "rocksdb_replicator/fast_read_map.h"
+#include "rocksdb_replicator/checkpoint_fetcher.h"
+#include "rocksdb_replicator/checkpoint_store.h"
+#include "rocksdb_replicator/concurrent_read_map.h"
+#include "rocksdb_replicator/follower_ack_tracker.h"
 #include "rocksdb_replicator/max_number_box.h"
-#include "rocksdb_replicator/non_blocking_condition_variable.h"
+#include "rocksdb_replicator/replication_meter.h"
+#include "rocksdb_replicator/replicator_stats.h"
+#include "rocksdb_replicator/response_budget.h"
+#include "rocksdb_replicator/seq_no_condition_variable.h"
+#include "rocksdb_replicator/update_compression.h"
+#include "rocksdb_replicator/wal_iterator_manager.h"
+#include "rocksdb_replicator/wal_tail_cache.h"
+#include "rocksdb_replicator/write_batch_util.h"
 #include "rocksdb_replicator/db_wrapper.h"
 #include "rocksdb_replicator/thrift/gen-cpp2/Replicator.h"
 #include "folly/SocketAddress.h"
+#include "folly/futures/Future.h"
 #include "rocksdb/db.h"
 #include "thrift/lib/cpp2/server/ThriftServer.h"
 
@@ -60,9 +77,7 @@ const uint32_t kMinReplTimeoutMs = 1;
 struct LogExtractor : public rocksdb::WriteBatch::Handler {
  public:
   void LogData(const rocksdb::Slice& blob) override {
-    if (blob.size() == sizeof(ms)) {
-      memcpy(&ms, blob.data(), sizeof(ms));
-    }
+    ParseTimestamp(blob, &ms);
   }
 
   uint64_t ms;
@@ -77,11 +92,44 @@ enum class ReturnCode {
   WAIT_SLAVE_TIMEOUT = 5,
 };
 
+/*
+ * A future returned by ReplicatedDB::WriteAsync() fails with this exception
+ * when the write doesn't succeed. status() is what Write() would have returned.
+ */
+class WriteException : public std::runtime_error {
+ public:
+  explicit WriteException(const rocksdb::Status& status)
+    : std::runtime_error(status.ToString())
+    , status_(status) {}
+
+  const rocksdb::Status& status() const {
+    return status_;
+  }
+
+ private:
+  const rocksdb::Status status_;
+};
+
 /*
  * All public interfaces of RocksDBReplicator are thread safe.
  */
 class RocksDBReplicator {
  public:
+  /*
+   * Called once a follower or observer has downloaded a checkpoint of its
+   * upstream into checkpoint_dir, because the updates it needs have been
+   * purged from the upstream WAL. The handler is expected to remove db_name,
+   * replace the db with the checkpoint, and add it back with role and
+   * upstream_addr. It's called on a replicator thread, which is fine to block.
+   * It returns false if the db is not replaced, in which case the db resumes
+   * pulling if it's still around.
+   */
+  using BootstrapHandler = std::function<bool(
+    const std::string& db_name,
+    const std::string& checkpoint_dir,
+    const ReplicaRole role,
+    const folly::SocketAddress& upstream_addr)>;
+
   class ReplicatedDB : public std::enable_shared_from_this<ReplicatedDB> {
    public:
     // Similar to rocksdb::DB::Write(). Only two differences:
@@ -97,13 +145,40 @@ class RocksDBReplicator {
                           rocksdb::WriteBatch* updates,
                           rocksdb::SequenceNumber* seq_no = nullptr);
 
+    // Same as Write(), except that it doesn't block the calling thread while
+    // waiting for follower ACK in replication mode 1 and 2. The updates are
+    // written to the local db before WriteAsync() returns, so updates may be
+    // freed right after the call.
+    // The returned future is fulfilled with the sequence # after applying the
+    // updates once a follower ACKs it (or immediately in replication mode 0).
+    // It fails with WriteException if the write to the local db fails or no
+    // follower gets back to us in time.
+    // WRITE_TO_SLAVE will be thrown if this is a SLAVE db.
+    folly::Future<rocksdb::SequenceNumber> WriteAsync(
+        const rocksdb::WriteOptions& options,
+        rocksdb::WriteBatch* updates);
+
     // read APIs may be added later on demand. They can be simply implmented by
     // delegating to the internal rocksdb::DB object.
 
+    // Wait until this db has applied updates up to seq_no, e.g. the one
+    // Write() returned on the leader, so reads from a follower can see them.
+    // The returned future is fulfilled with true once it has, or with false
+    // if timeout_ms passes (0 means no timeout) or the db is removed first.
+    // The calling thread is not blocked.
+    folly::Future<bool> WaitForSeqNo(const rocksdb::SequenceNumber seq_no,
+                                     const uint64_t timeout_ms);
+
 
     // Introspect the internal replication state
     std::string Introspect();
 
+    // Same as Introspect(), plus replication lag and traffic, as a JSON
+    // object. The lag is only known on followers and observers. On the
+    // leader, max_seq_no_acked is how far followers have got in replication
+    // mode 1 and 2.
+    Json::Value IntrospectJson();
+
    private:
     ReplicatedDB(const std::string& db_name,
                  std::shared_ptr<DbWrapper> db_wrapper,
@@ -117,44 +192,221 @@ class RocksDBReplicator {
                  const std::string& replicator_helix_cluster = "");
 
     void pullFromUpstream();
+    // Keep up to FLAGS_replicator_pull_pipeline_depth pull requests in flight
+    // to catch up faster when upstream is far ahead of local_seq_no.
+    void pullFromUpstreamPipelined(const uint64_t local_seq_no);
+    void handlePullException(folly::Try<ReplicateResponse>& t);
+    // True if this db asks upstream to tell it when it needs to bootstrap
+    bool canBootstrap() const;
+    // Download a checkpoint of upstream, and hand it to bootstrap_handler_.
+    // Pulling stops meanwhile, and resumes if the download or the handler
+    // fails.
+    void bootstrapFromUpstream();
+    // Pull again, after a randomized delay if delay_next_pull is true
+    void schedulePull(bool delay_next_pull);
     void resetUpstream();
     rocksdb::Status writeWaitFollowerACK(uint64_t cur_seq_no);
+    // Account for the outcome of waiting for follower ACK, and enter or exit
+    // degradation mode accordingly.
+    rocksdb::Status checkFollowerACK(bool acked);
+    // Write updates to the local db and wake up followers. cur_seq_no is
+    // filled with the latest sequence # after the write.
+    rocksdb::Status writeToLeader(const rocksdb::WriteOptions& options,
+                                  rocksdb::WriteBatch* updates,
+                                  uint64_t write_begin,
+                                  rocksdb::SequenceNumber* cur_seq_no);
+    // The replication mode for this db, from DBConfigManager or gflags
+    int replicationMode() const;
+
+    // A caller of Write() queued for group commit
+    struct GroupCommitWriter {
+      GroupCommitWriter(const rocksdb::WriteOptions& options_arg,
+                        rocksdb::WriteBatch* batch_arg)
+        : options(options_arg)
+        , batch(batch_arg)
+        , done(false)
+        , written(false)
+        , status()
+        , seq_no(0)
+        , cv() {}
+
+      const rocksdb::WriteOptions& options;
+      rocksdb::WriteBatch* batch;
+      // all fields below are protected by writers_mutex_
+      bool done;
+      // true if the batch has been committed to the local db
+      bool written;
+      rocksdb::Status status;
+      rocksdb::SequenceNumber seq_no;
+      std::condition_variable cv;
+    };
+    // Same as Write(), but the caller at the front of writers_ writes the
+    // batches of all callers queued behind it in one go.
+    rocksdb::Status writeGroupCommit(const rocksdb::WriteOptions& options,
+                                     rocksdb::WriteBatch* updates,
+                                     rocksdb::SequenceNumber* seq_no);
     using CallbackType =
       apache::thrift::HandlerCallback<std::unique_ptr<ReplicateResponse>>;
     void handleReplicateRequest(std::unique_ptr<CallbackType> callback,
                                 std::unique_ptr<ReplicateRequest> request);
-    std::unique_ptr<rocksdb::TransactionLogIterator> getCachedIter(
-        rocksdb::SequenceNumber seq_no);
-    void putCachedIter(rocksdb::SequenceNumber seq_no,
-                       std::unique_ptr<rocksdb::TransactionLogIterator>);
-    void cleanIdleCachedIters();
+
+    // Push replication. A downstream subscribes to its upstream, which then
+    // pushes updates to the downstream as soon as they are committed. The
+    // downstream falls back to pulling if the upstream doesn't support it.
+    struct Subscriber {
+      folly::SocketAddress addr;
+      // the id acks from this subscriber are tracked with
+      std::string follower_id;
+      std::shared_ptr<ReplicatorAsyncClient> client;
+      bool is_observer;
+      // the next sequence # to push, protected by subscribers_mutex_
+      rocksdb::SequenceNumber next_seq_no;
+      // true if a push to this subscriber is in progress, protected by
+      // subscribers_mutex_
+      bool pushing;
+      // consecutive failed pushes, protected by subscribers_mutex_
+      uint32_t failures;
+      // same as ReplicateRequest.can_bootstrap
+      bool can_bootstrap;
+    };
+    using SubscribeCallbackType =
+      apache::thrift::HandlerCallback<std::unique_ptr<SubscribeResponse>>;
+    void handleSubscribeRequest(std::unique_ptr<SubscribeCallbackType> callback,
+                                std::unique_ptr<SubscribeRequest> request,
+                                const folly::SocketAddress& downstream_addr);
+    // Does the work of handleSubscribeRequest() on executor_, as turning
+    // away downstreams that need to bootstrap reads the WAL.
+    void addSubscriber(std::unique_ptr<SubscribeCallbackType> callback,
+                       std::unique_ptr<SubscribeRequest> request,
+                       const folly::SocketAddress& downstream_addr);
+    using PushCallbackType =
+      apache::thrift::HandlerCallback<std::unique_ptr<PushResponse>>;
+    void handlePushRequest(std::unique_ptr<PushCallbackType> callback,
+                           std::unique_ptr<PushRequest> request);
+    // Serve checkpoints for downstreams to bootstrap from
+    using CreateCheckpointCallbackType =
+      apache::thrift::HandlerCallback<std::unique_ptr<CheckpointResponse>>;
+    void handleCreateCheckpointRequest(
+      std::unique_ptr<CreateCheckpointCallbackType> callback,
+      std::unique_ptr<CheckpointRequest> request);
+    using GetCheckpointChunkCallbackType =
+      apache::thrift::HandlerCallback<
+        std::unique_ptr<CheckpointChunkResponse>>;
+    void handleGetCheckpointChunkRequest(
+      std::unique_ptr<GetCheckpointChunkCallbackType> callback,
+      std::unique_ptr<CheckpointChunkRequest> request);
+    // Start pushing to subscribers that are not up to date and have no push
+    // in progress.
+    void pushToSubscribers();
+    void pushUpdates(std::shared_ptr<Subscriber> subscriber);
+    // Push to subscriber again after a delay, or drop it once it has failed
+    // replicator_push_max_retries times in a row.
+    void retryPush(std::shared_ptr<Subscriber> subscriber);
+    void removeSubscriber(const std::shared_ptr<Subscriber>& subscriber);
+    void subscribeToUpstream();
+    // Re-subscribe if upstream has not pushed anything for a while
+    void scheduleSubscriptionCheck();
+    // Read updates following request.seq_no into updates, honoring the limits
+    // in request. next_seq_no is set to the sequence # following the updates
+    // read, and their size is added to read_bytes.
+    // Return a non-ok status if the WAL can't be read, and Incomplete if
+    // request.can_bootstrap is set and the updates have been purged from it.
+    rocksdb::Status readUpdates(const ReplicateRequest& request,
+                                std::vector<Update>* updates,
+                                rocksdb::SequenceNumber* next_seq_no,
+                                uint64_t* read_bytes);
+
+    // Compress the updates in response with the current dictionary, and
+    // attach the dictionary if the downstream has a different one. Feed the
+    // updates to the dictionary trainer as well.
+    void compressUpdates(const int32_t downstream_dict_id,
+                         ReplicateResponse* response);
+    // Decompress the updates in response in place. Return false if any of
+    // them can't be decompressed.
+    bool decompressUpdates(ReplicateResponse* response);
+
+    // Record that follower_id has applied updates up to applied_seq_no, and
+    // post the sequence # acked by the quorum to max_seq_no_acked_
+    void ackFromFollower(const std::string& follower_id,
+                         const uint64_t applied_seq_no);
+    // While writes wait for acks, re-evaluate the health of the followers
+    // every replicator_follower_max_expected_ack_ms, so that one which
+    // stopped acking drops out of the quorum before the writes time out.
+    void scheduleAckQuorumCheck();
+    void checkAckQuorum();
+    void reportFollowerExcluded();
+
+    // Remember the timestamp of the last one of the n_applied updates from
+    // begin, for telling the replication lag in ms.
+    void recordApplied(std::vector<Update>::const_iterator begin,
+                       const size_t n_applied);
+
+    // Move the WriteBatch in result into update->raw_data without copying
+    // its content, and fill update->seq_no and update->timestamp.
+    // Return the size of the WriteBatch in bytes.
+    static uint64_t fillUpdate(rocksdb::BatchResult* result, Update* update);
 
     const std::string db_name_;
+    const DbStats stats_;
     std::shared_ptr<replicator::DbWrapper> db_wrapper_;
     folly::Executor* const executor_;
     const ReplicaRole role_;
     const char* role_str_;
     folly::SocketAddress upstream_addr_;
+    // how this db identifies itself to its upstream
+    const std::string follower_id_;
     uint32_t pullFromUpstreamNoUpdates_ {0};
+    // the latest sequence # upstream told us about
+    std::atomic<uint64_t> upstream_latest_seq_no_ {0};
+    // the timestamp of the latest update applied from upstream
+    std::atomic<uint64_t> last_applied_timestamp_ms_ {0};
     uint32_t resetUpstreamAttempts_ {0}; // currently only used for unit tests
     common::ThriftClientPool<ReplicatorAsyncClient>* const client_pool_;
     std::shared_ptr<ReplicatorAsyncClient> client_;
-    detail::NonBlockingConditionVariable cond_var_;
+    // replicate requests parked until this db has updates they don't have
+    detail::SeqNoConditionVariable cond_var_;
     apache::thrift::RpcOptions rpc_options_;
     rocksdb::WriteOptions write_options_;
-    std::unordered_multimap<rocksdb::SequenceNumber,
-      std::pair<std::unique_ptr<rocksdb::TransactionLogIterator>,
-                uint64_t>> cached_iters_;
-    std::mutex cached_iters_mutex_;
+    std::deque<GroupCommitWriter*> writers_;
+    std::mutex writers_mutex_;
+    // warm WAL iterators for downstreams
+    std::shared_ptr<detail::WalIteratorManager> wal_iters_;
+    // nullptr if the cache is disabled
+    std::unique_ptr<detail::WalTailCache> wal_tail_cache_;
+    // nullptr if compression is disabled
+    std::unique_ptr<detail::UpdateCompressor> compressor_;
+    // only accessed by the pull loop
+    detail::UpdateDecompressor decompressor_;
+    // only accessed by the pull loop
+    detail::ResponseBudget response_budget_;
+    // the sequence # acked by the quorum of followers
     detail::MaxNumberBox max_seq_no_acked_;
+    detail::FollowerAckTracker ack_tracker_;
+    // true while a checkAckQuorum() is scheduled
+    std::atomic<bool> ack_check_scheduled_ {false};
+    // bytes replicated in and out, and pull RTTs
+    detail::ReplicationMeter meter_;
+    // checkpoints downstreams are bootstrapping from
+    std::shared_ptr<detail::CheckpointStore> checkpoints_;
+    // set by RocksDBReplicator before this db starts replicating
+    std::shared_ptr<BootstrapHandler> bootstrap_handler_;
+    // true while downloading a checkpoint to bootstrap from
+    std::atomic<bool> bootstrapping_ {false};
     std::atomic<uint32_t> current_replicator_timeout_ms_ {kMinReplTimeoutMs};
     std::atomic<uint32_t> numConsecutiveReplTimeout_ {0};
     std::string replicator_zk_cluster_;
     std::string replicator_helix_cluster_;
+    std::vector<std::shared_ptr<Subscriber>> subscribers_;
+    std::mutex subscribers_mutex_;
+    std::atomic<uint32_t> num_subscribers_ {0};
+    // serializes pushes applied to this db, and protects subscribed_
+    std::mutex push_mutex_;
+    bool subscribed_ {false};
+    std::atomic<uint64_t> last_push_ms_ {0};
+    std::atomic<uint64_t> last_subscribe_ms_ {0};
 
     friend class ReplicatorHandler;
     friend class RocksDBReplicator;
-    friend class CachedIterCleaner;
   };
 
   static RocksDBReplicator* instance() {
@@ -215,25 +467,25 @@ class RocksDBReplicator {
                    rocksdb::WriteBatch* updates,
                    rocksdb::SequenceNumber* seq_no = nullptr);
 
+  /*
+   * The replication state of all dbs, as a JSON object keyed by db name.
+   * See ReplicatedDB::IntrospectJson() for what's in it.
+   */
+  std::string introspectJson();
+
+  /*
+   * Set the handler replacing a follower or observer with a checkpoint of its
+   * upstream, when it can no longer catch up from the upstream WAL. Followers
+   * only bootstrap if replicator_bootstrap_from_checkpoint is set, and only
+   * dbs added after this call do.
+   */
+  void setBootstrapHandler(BootstrapHandler handler);
+
   // no copy or move
   RocksDBReplicator(const RocksDBReplicator&) = delete;
   RocksDBReplicator& operator=(const RocksDBReplicator&) = delete;
 
  private:
-  class CachedIterCleaner {
-   public:
-    CachedIterCleaner();
-    void addDB(std::weak_ptr<ReplicatedDB> db);
-    void stopAndWait();
-
-   private:
-    void scheduleCleanup();
-    std::list<std::weak_ptr<ReplicatedDB>> dbs_;
-    std::mutex dbs_mutex_;
-    std::thread thread_;
-    folly::EventBase evb_;
-  };
-
   RocksDBReplicator();
   ~RocksDBReplicator();
 
@@ -245,14 +497,14 @@ class RocksDBReplicator {
 
   common::ThriftClientPool<ReplicatorAsyncClient> client_pool_;
 
-  detail::FastReadMap<std::string,
+  std::shared_ptr<BootstrapHandler> bootstrap_handler_;
+
+  detail::ConcurrentReadMap<std::string,
     std::shared_ptr<RocksDBReplicator::ReplicatedDB>> db_map_;
 
   apache::thrift::ThriftServer server_;
 
   std::thread thread_;
-
-  CachedIterCleaner cleaner_;
 };
 
 }  // namespace replicator
@@ -1,5 +1,17 @@
 #include "rocksdb_replicator/rocksdb_wrapper.h"
 
+#include <fcntl.h>
+#include <gflags/gflags.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+
+#include "rocksdb/utilities/checkpoint.h"
+#include "rocksdb_replicator/write_batch_util.h"
+
+DECLARE_bool(replicator_tagged_timestamps);
+
 namespace replicator {
 uint64_t RocksDbWrapper::LatestSequenceNumber() { return db_->GetLatestSequenceNumber(); }
 rocksdb::Status RocksDbWrapper::WriteToLeader(const rocksdb::WriteOptions& options,
@@ -10,14 +22,115 @@ rocksdb::Status RocksDbWrapper::GetUpdatesFromLeader(
     rocksdb::SequenceNumber seq_number, std::unique_ptr<rocksdb::TransactionLogIterator>* iter) {
   return db_->GetUpdatesSince(seq_number, iter);
 }
-bool RocksDbWrapper::HandleReplicateResponse(Update* update) {
+
+void RocksDbWrapper::PrefetchWal(rocksdb::SequenceNumber seq_no, uint64_t max_bytes) {
+  rocksdb::VectorLogPtr files;
+  auto status = db_->GetSortedWalFiles(files);
+  if (!status.ok()) {
+    LOG(WARNING) << "Failed to list WAL files for " << db_name_ << " " << status.ToString();
+    return;
+  }
+
+  // files are sorted by log number, start from the last one starting at or
+  // before seq_no
+  size_t first = 0;
+  for (size_t i = 0; i < files.size() && files[i]->StartSequence() <= seq_no; ++i) {
+    first = i;
+  }
+
+  auto wal_dir = db_->GetDBOptions().wal_dir;
+  if (wal_dir.empty()) {
+    wal_dir = db_->GetName();
+  }
+
+  // Creating the iterator has read the first file up to seq_no already, start
+  // from about where seq_no is in it. WAL records have no index, so estimate
+  // the offset assuming the file's updates are evenly sized.
+  uint64_t offset = 0;
+  if (first < files.size() && files[first]->StartSequence() <= seq_no) {
+    const auto start = files[first]->StartSequence();
+    const auto end = first + 1 < files.size() ?
+      files[first + 1]->StartSequence() : db_->GetLatestSequenceNumber() + 1;
+    if (end > start) {
+      offset = static_cast<uint64_t>(
+        static_cast<double>(files[first]->SizeFileBytes()) *
+        (seq_no - start) / (end - start));
+    }
+  }
+
+  // Only hint max_bytes in total, a whole WAL file may be much larger
+  uint64_t bytes = 0;
+  for (size_t i = first; i < files.size() && bytes < max_bytes; ++i) {
+    const auto from = i == first ? offset : 0;
+    if (files[i]->SizeFileBytes() <= from) {
+      continue;
+    }
+    // PathName() is relative to the WAL dir, e.g. /000012.log or
+    // /archive/000012.log
+    const auto path = wal_dir + files[i]->PathName();
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      // archived or purged since listed
+      continue;
+    }
+    const auto len = std::min(files[i]->SizeFileBytes() - from,
+                              max_bytes - bytes);
+    posix_fadvise(fd, from, len, POSIX_FADV_WILLNEED);
+    close(fd);
+    bytes += len;
+  }
+}
+
+rocksdb::Status RocksDbWrapper::CreateCheckpoint(const std::string& dir, uint64_t* seq_no) {
+  rocksdb::Checkpoint* checkpoint;
+  auto status = rocksdb::Checkpoint::Create(db_.get(), &checkpoint);
+  if (!status.ok()) {
+    return status;
+  }
+  std::unique_ptr<rocksdb::Checkpoint> checkpoint_holder(checkpoint);
+
+  status = checkpoint->CreateCheckpoint(dir);
+  if (!status.ok()) {
+    return status;
+  }
+
+  // The checkpoint may come with WAL files, whose updates only count once
+  // replayed. Open it to find out its latest sequence #.
+  auto options = db_->GetOptions();
+  options.wal_dir.clear();
+  rocksdb::DB* db;
+  status = rocksdb::DB::OpenForReadOnly(options, dir, &db);
+  if (!status.ok()) {
+    return status;
+  }
+  *seq_no = db->GetLatestSequenceNumber();
+  delete db;
+  return status;
+}
+
+rocksdb::Status RocksDbWrapper::GetDbIdentity(std::string* identity) {
+  return db_->GetDbIdentity(*identity);
+}
+
+namespace {
+
+// Rebuild the WriteBatch carried by update, and append its timestamp as
+// LogData, the same way the leader did.
+rocksdb::WriteBatch ToWriteBatch(Update* update) {
   // Is this bad for perf?
   // If so pass in the IOBuf returned by coalesce separately
   auto byteRange = update->raw_data.coalesce();
   rocksdb::WriteBatch write_batch(
       std::string(reinterpret_cast<const char*>(byteRange.data()), byteRange.size()));
-  write_batch.PutLogData(
-      rocksdb::Slice(reinterpret_cast<const char*>(&update->timestamp), sizeof(update->timestamp)));
+  AppendTimestamp(&write_batch, update->timestamp,
+                  FLAGS_replicator_tagged_timestamps);
+  return write_batch;
+}
+
+}  // namespace
+
+bool RocksDbWrapper::HandleReplicateResponse(Update* update) {
+  auto write_batch = ToWriteBatch(update);
 
   auto status = db_->Write(write_options_, &write_batch);
   bool ret_status = status.ok();
@@ -27,6 +140,31 @@ bool RocksDbWrapper::HandleReplicateResponse(Update* update) {
   return ret_status;
 }
 
+size_t RocksDbWrapper::HandleReplicateResponses(
+    std::vector<Update>::iterator begin,
+    std::vector<Update>::iterator end) {
+  // Write each update on its own, even though one merged write would be
+  // cheaper. A merged write would be a single WAL record, which downstreams
+  // of this db, or of it once promoted, would see instead of the records the
+  // leader has. A downstream positioned inside such a record would then be
+  // served updates it already has.
+  size_t n_applied = 0;
+  for (auto itor = begin; itor != end; ++itor) {
+    auto write_batch = ToWriteBatch(&*itor);
+    auto status = db_->Write(write_options_, &write_batch);
+    if (!status.ok()) {
+      LOG(ERROR) << "Failed to apply updates to FOLLOWER " << db_name_ << " " << status.ToString();
+      break;
+    }
+    ++n_applied;
+  }
+
+  if (n_applied > 0) {
+    logMetric(kReplicatorFollowerApplyBatchSize, n_applied, db_name_);
+  }
+  return n_applied;
+}
+
 RocksDbWrapper::RocksDbWrapper(const std::string& db_name, std::shared_ptr<rocksdb::DB> db)
     : db_name_(db_name), db_(std::move(db)), write_options_() {}
 }  // namespace replicator
\ No newline at end of file
@@ -1,4 +1,6 @@
 
+#include <vector>
+
 #include "rocksdb_replicator/db_wrapper.h"
 #include "rocksdb_replicator/replicator_stats.h"
 #include "rocksdb_replicator/rocksdb_replicator.h"
@@ -9,12 +11,20 @@ class RocksDbWrapper : public replicator::DbWrapper,
                        public std::enable_shared_from_this<RocksDbWrapper> {
 public:
   uint64_t LatestSequenceNumber() override;
+  // fadvise the WAL files from the one containing seq_no on, up to max_bytes
+  void PrefetchWal(rocksdb::SequenceNumber seq_no, uint64_t max_bytes) override;
+  rocksdb::Status CreateCheckpoint(const std::string& dir, uint64_t* seq_no) override;
+  rocksdb::Status GetDbIdentity(std::string* identity) override;
   rocksdb::Status WriteToLeader(const rocksdb::WriteOptions& options,
                                 rocksdb::WriteBatch* updates) override;
   rocksdb::Status GetUpdatesFromLeader(
       rocksdb::SequenceNumber seq_number,
       std::unique_ptr<rocksdb::TransactionLogIterator>* iter) override;
   bool HandleReplicateResponse(Update* update) override;
+  // Apply each update in its own rocksdb::DB::Write(), keeping the WAL record
+  // boundaries of upstream
+  size_t HandleReplicateResponses(std::vector<Update>::iterator begin,
+                                  std::vector<Update>::iterator end) override;
   RocksDbWrapper(const std::string& db_name, std::shared_ptr<rocksdb::DB> db);
 
 private:
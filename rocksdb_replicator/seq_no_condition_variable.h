@@ -0,0 +1,199 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "folly/Executor.h"
+#include "rocksdb_replicator/timer_wheel.h"
+
+namespace replicator { namespace detail {
+
+/*
+ * SeqNoConditionVariable is a NonBlockingConditionVariable specialized for
+ * tasks waiting for a sequence # to advance, e.g. replicate requests parked
+ * until the db has updates newer than what the follower already has.
+ *
+ * Tasks are kept ordered by the sequence # they wait for. notify() only
+ * schedules the tasks whose sequence # is now below the latest one, instead of
+ * every pending task. Timeouts come from a shared TimerWheel.
+ */
+class SeqNoConditionVariable {
+ private:
+  struct Task {
+    template <typename Func>
+    explicit Task(Func&& f)
+        : func(std::move(f))
+        , has_done(false) {
+    }
+
+    bool should_i_run() {
+      return !has_done.exchange(true);
+    }
+
+    std::function<void()> func;
+    std::atomic<bool> has_done;
+  };
+
+ public:
+  // latest_seq_no() returns the current latest sequence #. It's called on
+  // every runIfGreaterOrWaitForNotify() and notify().
+  // executor and timer_wheel must outlive *this and the time of the last call
+  // of runIfGreaterOrWaitForNotify + the corresponding timeout_ms
+  SeqNoConditionVariable(folly::Executor* executor,
+                         std::function<uint64_t()> latest_seq_no,
+                         TimerWheel* timer_wheel = TimerWheel::shared())
+      : tasks_()
+      , tasks_mutex_()
+      , purge_threshold_(kMinPurgeThreshold)
+      , executor_(executor)
+      , latest_seq_no_(std::move(latest_seq_no))
+      , timer_wheel_(timer_wheel) {
+  }
+
+  // no copy or move
+  SeqNoConditionVariable(const SeqNoConditionVariable&) = delete;
+  SeqNoConditionVariable& operator=(const SeqNoConditionVariable&) = delete;
+
+  // run f() in the executor if latest_seq_no() > seq_no. Otherwise, put f into
+  // the pending task list, which will be scheduled to run later.
+  //
+  // f() will run in the executor exactly once in one of the four possible
+  // conditions.
+  // 1. If latest_seq_no() > seq_no, run it immediately.
+  // 2. If notify() is called later before timeout_ms, and latest_seq_no() >
+  //    seq_no by then.
+  // 3. If timeout_ms has passed.
+  // 4. If none of aboves happen before the destructor of *this is called.
+  template <typename Func>
+  void runIfGreaterOrWaitForNotify(Func f, const uint64_t seq_no,
+                                   const uint64_t timeout_ms) {
+    if (latest_seq_no_() > seq_no) {
+      executor_->add(std::move(f));
+      return;
+    }
+
+    auto task = std::make_shared<Task>(std::move(f));
+
+    {
+      std::lock_guard<std::mutex> g(tasks_mutex_);
+      if (tasks_.size() >= purge_threshold_) {
+        purgeDoneTasks();
+      }
+      tasks_.emplace(seq_no, task);
+    }
+
+    // we need to recheck the condition in case missing a notification
+    if (latest_seq_no_() > seq_no && task->should_i_run()) {
+      executor_->add(std::move(task->func));
+      return;
+    }
+
+    if (timeout_ms > 0) {
+      // Put a weak_ptr instead of shared_ptr in the timeout lambda. Otherwise,
+      // we may accumulate some unnecessary tasks if they have run before the
+      // timeout.
+      std::weak_ptr<Task> weak_task(task);
+      timer_wheel_->schedule(
+        [weak_task = std::move(weak_task), executor = executor_] {
+          auto task = weak_task.lock();
+          if (task && task->should_i_run()) {
+            executor->add(std::move(task->func));
+          }
+        },
+        timeout_ms);
+    }
+  }
+
+  // put the pending tasks waiting for a sequence # below latest_seq_no() to be
+  // run in the executor.
+  void notify() {
+    const auto latest_seq_no = latest_seq_no_();
+    std::vector<std::shared_ptr<Task>> local_tasks;
+
+    {
+      std::lock_guard<std::mutex> g(tasks_mutex_);
+      auto end = tasks_.lower_bound(latest_seq_no);
+      for (auto itor = tasks_.begin(); itor != end; ++itor) {
+        local_tasks.push_back(std::move(itor->second));
+      }
+      tasks_.erase(tasks_.begin(), end);
+    }
+
+    runTasks(&local_tasks);
+  }
+
+  ~SeqNoConditionVariable() {
+    // no need to do any synchronizations, because we are in the destructor,
+    // and thus no others are working on *this. Otherwise, there is a bug in
+    // the client side code.
+    std::vector<std::shared_ptr<Task>> local_tasks;
+    for (auto& seq_no_and_task : tasks_) {
+      local_tasks.push_back(std::move(seq_no_and_task.second));
+    }
+    runTasks(&local_tasks);
+  }
+
+ private:
+  static const size_t kMinPurgeThreshold = 1024;
+
+  void runTasks(std::vector<std::shared_ptr<Task>>* tasks) {
+    for (auto& task : *tasks) {
+      if (task->should_i_run()) {
+        executor_->add(std::move(task->func));
+      }
+    }
+  }
+
+  // Drop the tasks run by timeout. Otherwise, tasks waiting on an idle db
+  // would pile up, because notify() never gets to them. The threshold doubles
+  // with the # of live tasks, so purging is amortized O(1) per task.
+  // Caller must hold tasks_mutex_.
+  void purgeDoneTasks() {
+    for (auto itor = tasks_.begin(); itor != tasks_.end();) {
+      if (itor->second->has_done.load()) {
+        itor = tasks_.erase(itor);
+      } else {
+        ++itor;
+      }
+    }
+    purge_threshold_ = 2 * tasks_.size();
+    if (purge_threshold_ < kMinPurgeThreshold) {
+      purge_threshold_ = kMinPurgeThreshold;
+    }
+  }
+
+  // pending tasks keyed by the sequence # they wait for
+  std::multimap<uint64_t, std::shared_ptr<Task>> tasks_;
+  std::mutex tasks_mutex_;
+  size_t purge_threshold_;
+
+  folly::Executor* const executor_;
+  const std::function<uint64_t()> latest_seq_no_;
+  TimerWheel* const timer_wheel_;
+};
+
+}  // namespace detail
+}  // namespace replicator
@@ -0,0 +1,176 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include "boost/filesystem.hpp"
+#include "folly/Executor.h"
+#include "folly/io/IOBuf.h"
+#include "gtest/gtest.h"
+#include "rocksdb/db.h"
+#include "rocksdb_replicator/checkpoint_store.h"
+#include "rocksdb_replicator/rocksdb_wrapper.h"
+#include "rocksdb_replicator/timer_wheel.h"
+
+using boost::filesystem::exists;
+using boost::filesystem::remove_all;
+using replicator::CheckpointResponse;
+using replicator::RocksDbWrapper;
+using replicator::detail::CheckpointStore;
+using replicator::detail::TimerWheel;
+using rocksdb::DB;
+using rocksdb::Options;
+using std::make_shared;
+using std::shared_ptr;
+using std::string;
+
+namespace {
+
+// Run tasks inline in the thread adding them
+class InlineExecutor : public folly::Executor {
+ public:
+  void add(folly::Func f) override {
+    f();
+  }
+};
+
+shared_ptr<DB> CleanAndOpenDB(const string& path) {
+  EXPECT_NO_THROW(remove_all(path));
+  Options options;
+  options.create_if_missing = true;
+  options.error_if_exists = true;
+  DB* db;
+  EXPECT_TRUE(DB::Open(options, path, &db).ok());
+  return shared_ptr<DB>(db);
+}
+
+void WriteKeys(DB* db, int n) {
+  for (int i = 0; i < n; ++i) {
+    EXPECT_TRUE(db->Put(rocksdb::WriteOptions(), "key" + std::to_string(i),
+                        "value" + std::to_string(i)).ok());
+  }
+}
+
+string ToString(const folly::IOBuf& buf) {
+  auto copy = buf.clone();
+  copy->coalesce();
+  return string(reinterpret_cast<const char*>(copy->data()), copy->length());
+}
+
+}  // namespace
+
+TEST(CheckpointStoreTest, CreateAndRead) {
+  const string dir = "/tmp/checkpoint_store_test_checkpoints";
+  EXPECT_NO_THROW(remove_all(dir));
+  auto db = CleanAndOpenDB("/tmp/checkpoint_store_test");
+  WriteKeys(db.get(), 100);
+  RocksDbWrapper wrapper("db", db);
+  InlineExecutor executor;
+  TimerWheel timer_wheel(1, 16);
+  auto store = make_shared<CheckpointStore>(dir, &executor, 60 * 1000,
+                                            60 * 1000, &timer_wheel);
+
+  CheckpointResponse checkpoint;
+  ASSERT_TRUE(store->create(&wrapper, &checkpoint).ok());
+  EXPECT_EQ(checkpoint.seq_no, 100);
+  EXPECT_FALSE(checkpoint.files.empty());
+  string identity;
+  EXPECT_TRUE(db->GetDbIdentity(identity).ok());
+  EXPECT_TRUE(checkpoint.__isset.db_identity);
+  EXPECT_EQ(checkpoint.db_identity, identity);
+  EXPECT_EQ(store->size(), 1u);
+
+  // handed out again while it's recent
+  WriteKeys(db.get(), 10);
+  CheckpointResponse again;
+  ASSERT_TRUE(store->create(&wrapper, &again).ok());
+  EXPECT_EQ(again.checkpoint_id, checkpoint.checkpoint_id);
+  EXPECT_EQ(again.seq_no, 100);
+  EXPECT_EQ(store->size(), 1u);
+
+  // every file reads back whole, in chunks
+  for (const auto& file : checkpoint.files) {
+    string content;
+    for (uint64_t offset = 0; ; offset += 100) {
+      folly::IOBuf data;
+      ASSERT_TRUE(store->read(checkpoint.checkpoint_id, file.name, offset, 100,
+                              &data).ok());
+      if (data.computeChainDataLength() == 0) {
+        break;
+      }
+      content += ToString(data);
+    }
+    EXPECT_EQ(content.size(), static_cast<size_t>(file.size));
+  }
+
+  folly::IOBuf data;
+  EXPECT_TRUE(store->read("no_such_id", checkpoint.files[0].name, 0, 100,
+                          &data).IsNotFound());
+  EXPECT_TRUE(store->read(checkpoint.checkpoint_id, "../CURRENT", 0, 100,
+                          &data).IsNotFound());
+
+  // the checkpoint is a db at its sequence #
+  DB* checkpoint_db;
+  ASSERT_TRUE(DB::OpenForReadOnly(Options(),
+                                  dir + "/" + checkpoint.checkpoint_id,
+                                  &checkpoint_db).ok());
+  EXPECT_EQ(checkpoint_db->GetLatestSequenceNumber(), 100u);
+  string value;
+  EXPECT_TRUE(checkpoint_db->Get(rocksdb::ReadOptions(), "key99",
+                                 &value).ok());
+  EXPECT_EQ(value, "value99");
+  delete checkpoint_db;
+
+  store.reset();
+  EXPECT_FALSE(exists(dir + "/" + checkpoint.checkpoint_id));
+}
+
+TEST(CheckpointStoreTest, Expire) {
+  const string dir = "/tmp/checkpoint_store_test_checkpoints";
+  EXPECT_NO_THROW(remove_all(dir));
+  auto db = CleanAndOpenDB("/tmp/checkpoint_store_test");
+  WriteKeys(db.get(), 10);
+  RocksDbWrapper wrapper("db", db);
+  InlineExecutor executor;
+  TimerWheel timer_wheel(1, 16);
+  auto store = make_shared<CheckpointStore>(dir, &executor, 50, 0,
+                                            &timer_wheel);
+
+  CheckpointResponse first;
+  ASSERT_TRUE(store->create(&wrapper, &first).ok());
+  // not reused with reuse_ms of 0
+  WriteKeys(db.get(), 10);
+  CheckpointResponse second;
+  ASSERT_TRUE(store->create(&wrapper, &second).ok());
+  EXPECT_NE(first.checkpoint_id, second.checkpoint_id);
+  EXPECT_EQ(second.seq_no, 20);
+  EXPECT_EQ(store->size(), 2u);
+
+  std::this_thread::sleep_for(std::chrono::milliseconds(500));
+  EXPECT_EQ(store->size(), 0u);
+  EXPECT_FALSE(exists(dir + "/" + first.checkpoint_id));
+  EXPECT_FALSE(exists(dir + "/" + second.checkpoint_id));
+}
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,160 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+#include <gflags/gflags.h>
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "folly/Benchmark.h"
+#include "rocksdb_replicator/concurrent_read_map.h"
+#include "rocksdb_replicator/fast_read_map.h"
+
+using replicator::detail::ConcurrentReadMap;
+using replicator::detail::FastReadMap;
+
+namespace {
+
+// About the # of shards on a busy host
+const int kNumKeys = 4096;
+
+std::vector<std::string> makeKeys() {
+  std::vector<std::string> keys;
+  for (int i = 0; i < kNumKeys; ++i) {
+    keys.push_back("seg" + std::to_string(i % 64) + "000" +
+                   std::to_string(i));
+  }
+  return keys;
+}
+
+const std::vector<std::string>& keys() {
+  static const auto keys = makeKeys();
+  return keys;
+}
+
+template <typename Map>
+void fill(Map* map) {
+  for (const auto& key : keys()) {
+    map->add(key, std::make_shared<int>(0));
+  }
+}
+
+// Look up values the way the replicator handler does: FastReadMap::get()
+// copies the shared_ptr, ConcurrentReadMap::visit() doesn't.
+bool lookup(FastReadMap<std::string, std::shared_ptr<int>>* map,
+            const std::string& key) {
+  std::shared_ptr<int> value;
+  return map->get(key, &value) && *value == 0;
+}
+
+bool lookup(ConcurrentReadMap<std::string, std::shared_ptr<int>>* map,
+            const std::string& key) {
+  bool ok = false;
+  map->visit(key, [&ok] (const std::shared_ptr<int>& value) {
+      ok = *value == 0;
+    });
+  return ok;
+}
+
+// Run n lookups split across num_threads threads
+template <typename Map>
+void runGet(uint32_t n, const size_t num_threads) {
+  Map map;
+  std::atomic<bool> go(false);
+  std::vector<std::thread> threads;
+  const uint64_t ops_per_thread = n / num_threads + 1;
+
+  BENCHMARK_SUSPEND {
+    fill(&map);
+    for (size_t i = 0; i < num_threads; ++i) {
+      threads.emplace_back([&map, &go, ops_per_thread, i] {
+          while (!go.load()) {
+            std::this_thread::yield();
+          }
+
+          const auto& all_keys = keys();
+          for (uint64_t j = 0; j < ops_per_thread; ++j) {
+            folly::doNotOptimizeAway(
+              lookup(&map, all_keys[(i * 131 + j) % kNumKeys]));
+          }
+        });
+    }
+  }
+
+  go.store(true);
+  for (auto& t : threads) {
+    t.join();
+  }
+}
+
+// Add and remove a key n times with kNumKeys keys in the map, like shards
+// moving around during a Helix rebalance.
+template <typename Map>
+void runAddRemove(uint32_t n) {
+  Map map;
+  BENCHMARK_SUSPEND {
+    fill(&map);
+  }
+
+  auto value = std::make_shared<int>(0);
+  for (uint32_t i = 0; i < n; ++i) {
+    map.add("new_shard", value);
+    map.remove("new_shard");
+  }
+}
+
+using FastMap = FastReadMap<std::string, std::shared_ptr<int>>;
+using ConcurrentMap = ConcurrentReadMap<std::string, std::shared_ptr<int>>;
+
+void FastReadMapGet(uint32_t n, size_t num_threads) {
+  runGet<FastMap>(n, num_threads);
+}
+
+void ConcurrentReadMapGet(uint32_t n, size_t num_threads) {
+  runGet<ConcurrentMap>(n, num_threads);
+}
+
+}  // namespace
+
+BENCHMARK_PARAM(FastReadMapGet, 1)
+BENCHMARK_RELATIVE_PARAM(ConcurrentReadMapGet, 1)
+BENCHMARK_PARAM(FastReadMapGet, 4)
+BENCHMARK_RELATIVE_PARAM(ConcurrentReadMapGet, 4)
+BENCHMARK_PARAM(FastReadMapGet, 16)
+BENCHMARK_RELATIVE_PARAM(ConcurrentReadMapGet, 16)
+BENCHMARK_PARAM(FastReadMapGet, 32)
+BENCHMARK_RELATIVE_PARAM(ConcurrentReadMapGet, 32)
+BENCHMARK_PARAM(FastReadMapGet, 64)
+BENCHMARK_RELATIVE_PARAM(ConcurrentReadMapGet, 64)
+
+BENCHMARK_DRAW_LINE();
+
+BENCHMARK(FastReadMapAddRemove, n) {
+  runAddRemove<FastMap>(n);
+}
+
+BENCHMARK_RELATIVE(ConcurrentReadMapAddRemove, n) {
+  runAddRemove<ConcurrentMap>(n);
+}
+
+int main(int argc, char **argv) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  folly::runBenchmarks();
+}
@@ -98,6 +98,25 @@ TEST(FastReadMapTest, Basics) {
   EXPECT_FALSE(map.get("3", &value));
 }
 
+TEST(FastReadMapTest, ForEach) {
+  FastReadMap<string, int> map;
+  EXPECT_TRUE(map.add("1", 1));
+  EXPECT_TRUE(map.add("2", 2));
+
+  int sum = 0;
+  map.forEach([&map, &sum] (const string& key, int value) {
+      EXPECT_EQ(to_string(value), key);
+      sum += value;
+      // not visible to the ongoing iteration
+      map.add(to_string(value + 10), value + 10);
+    });
+  EXPECT_EQ(sum, 3);
+
+  sum = 0;
+  map.forEach([&sum] (const string&, int value) { sum += value; });
+  EXPECT_EQ(sum, 26);
+}
+
 int main(int argc, char** argv) {
   ::testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
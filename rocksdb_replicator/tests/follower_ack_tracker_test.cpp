@@ -0,0 +1,145 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "rocksdb_replicator/follower_ack_tracker.h"
+
+using replicator::detail::FollowerAckTracker;
+
+TEST(FollowerAckTrackerTest, AnyFollower) {
+  FollowerAckTracker tracker(1, 100, 1000);
+  int64_t ack_ms;
+  bool became_unhealthy;
+
+  EXPECT_EQ(tracker.ack("a", 10, 0, &ack_ms, &became_unhealthy), 10u);
+  EXPECT_EQ(ack_ms, -1);
+  EXPECT_FALSE(became_unhealthy);
+  EXPECT_EQ(tracker.ack("b", 5, 0, &ack_ms, &became_unhealthy), 10u);
+  EXPECT_EQ(tracker.ack("b", 20, 1, &ack_ms, &became_unhealthy), 20u);
+  // acks never go backwards
+  EXPECT_EQ(tracker.ack("b", 15, 2, &ack_ms, &became_unhealthy), 20u);
+
+  auto followers = tracker.getFollowers(2);
+  ASSERT_EQ(followers.size(), 2u);
+  EXPECT_EQ(followers[0].id, "a");
+  EXPECT_EQ(followers[0].acked_seq_no, 10u);
+  EXPECT_EQ(followers[1].id, "b");
+  EXPECT_EQ(followers[1].acked_seq_no, 20u);
+  EXPECT_TRUE(followers[0].healthy);
+  EXPECT_TRUE(followers[1].healthy);
+}
+
+TEST(FollowerAckTrackerTest, AckLatency) {
+  FollowerAckTracker tracker(1, 100, 1000);
+  int64_t ack_ms;
+  bool became_unhealthy;
+
+  // not tracked before its first ack
+  tracker.sent("a", 10, 0);
+  tracker.ack("a", 0, 0, &ack_ms, &became_unhealthy);
+  EXPECT_EQ(ack_ms, -1);
+
+  tracker.sent("a", 10, 100);
+  // only the earliest unacked send is timed
+  tracker.sent("a", 20, 110);
+  tracker.ack("a", 9, 105, &ack_ms, &became_unhealthy);
+  EXPECT_EQ(ack_ms, -1);
+  tracker.ack("a", 20, 120, &ack_ms, &became_unhealthy);
+  EXPECT_EQ(ack_ms, 20);
+  EXPECT_DOUBLE_EQ(tracker.getFollowers(120)[0].expected_ack_ms, 20);
+
+  tracker.sent("a", 30, 200);
+  tracker.ack("a", 30, 230, &ack_ms, &became_unhealthy);
+  EXPECT_EQ(ack_ms, 30);
+  EXPECT_DOUBLE_EQ(tracker.getFollowers(230)[0].expected_ack_ms,
+                   0.2 * 30 + 0.8 * 20);
+
+  // a send already acked is not timed
+  tracker.sent("a", 25, 300);
+  tracker.ack("a", 30, 400, &ack_ms, &became_unhealthy);
+  EXPECT_EQ(ack_ms, -1);
+}
+
+TEST(FollowerAckTrackerTest, QuorumExcludesSlowFollowers) {
+  FollowerAckTracker tracker(2, 100, 1000);
+  int64_t ack_ms;
+  bool became_unhealthy;
+
+  EXPECT_EQ(tracker.ack("a", 10, 0, &ack_ms, &became_unhealthy), 10u);
+  EXPECT_EQ(tracker.ack("b", 5, 0, &ack_ms, &became_unhealthy), 5u);
+  EXPECT_EQ(tracker.ack("c", 8, 0, &ack_ms, &became_unhealthy), 8u);
+  EXPECT_EQ(tracker.ack("b", 12, 1, &ack_ms, &became_unhealthy), 10u);
+
+  // c takes 500ms to ack what's sent to it
+  tracker.sent("c", 20, 10);
+  tracker.ack("c", 20, 510, &ack_ms, &became_unhealthy);
+  EXPECT_EQ(ack_ms, 500);
+  EXPECT_TRUE(became_unhealthy);
+  EXPECT_FALSE(tracker.getFollowers(510)[2].healthy);
+
+  // a and b make the quorum now, but acks from c still count
+  tracker.sent("a", 30, 510);
+  tracker.sent("b", 30, 510);
+  EXPECT_EQ(tracker.ack("a", 30, 520, &ack_ms, &became_unhealthy), 20u);
+  EXPECT_FALSE(became_unhealthy);
+  EXPECT_EQ(tracker.ack("b", 30, 520, &ack_ms, &became_unhealthy), 30u);
+
+  // b is gone, a alone is the quorum once b is stale
+  tracker.sent("b", 40, 600);
+  EXPECT_EQ(tracker.ack("a", 40, 610, &ack_ms, &became_unhealthy), 30u);
+  EXPECT_EQ(tracker.ack("a", 40, 1600, &ack_ms, &became_unhealthy), 40u);
+  EXPECT_TRUE(became_unhealthy);
+
+  // and forgotten after a while
+  tracker.ack("a", 40, 20000, &ack_ms, &became_unhealthy);
+  auto followers = tracker.getFollowers(20000);
+  ASSERT_EQ(followers.size(), 1u);
+  EXPECT_EQ(followers[0].id, "a");
+}
+
+TEST(FollowerAckTrackerTest, RefreshExcludesStalledFollowers) {
+  FollowerAckTracker tracker(2, 100, 1000);
+  int64_t ack_ms;
+  bool became_unhealthy;
+
+  EXPECT_EQ(tracker.refresh(0, &became_unhealthy), 0u);
+  EXPECT_FALSE(became_unhealthy);
+
+  tracker.ack("a", 10, 0, &ack_ms, &became_unhealthy);
+  tracker.ack("b", 10, 0, &ack_ms, &became_unhealthy);
+  tracker.sent("a", 20, 10);
+  tracker.sent("b", 20, 10);
+  // a acks, but b has stopped acking
+  EXPECT_EQ(tracker.ack("a", 20, 20, &ack_ms, &became_unhealthy), 10u);
+  EXPECT_EQ(tracker.refresh(100, &became_unhealthy), 10u);
+  EXPECT_FALSE(became_unhealthy);
+
+  // without another ack, b drops out once its send is overdue
+  EXPECT_EQ(tracker.refresh(111, &became_unhealthy), 20u);
+  EXPECT_TRUE(became_unhealthy);
+  EXPECT_EQ(tracker.refresh(120, &became_unhealthy), 20u);
+  EXPECT_FALSE(became_unhealthy);
+}
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,182 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#include <gflags/gflags.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "folly/Benchmark.h"
+#include "rocksdb_replicator/max_number_box.h"
+
+using replicator::detail::MaxNumberBox;
+
+namespace {
+
+// The previous MaxNumberBox, which takes a single mutex in both post() and
+// wait(). Kept here as the baseline.
+class MutexMaxNumberBox {
+ public:
+  void post(const uint64_t num) {
+    std::vector<Waiter*> waiters_to_notify;
+    std::vector<Waiter*> waiters_to_wait;
+
+    {
+      std::unique_lock<std::mutex> lk(mtx_);
+      if (num <= max_number_) {
+        return;
+      }
+
+      max_number_ = num;
+
+      if (waiters_.empty()) {
+        return;
+      }
+
+      std::partition_copy(waiters_.begin(), waiters_.end(),
+                          std::back_inserter(waiters_to_notify),
+                          std::back_inserter(waiters_to_wait),
+                          [this] (Waiter* w) {
+                            return w->num_to_wait <= this->max_number_;
+                          });
+
+      waiters_.swap(waiters_to_wait);
+    }
+
+    for (auto w : waiters_to_notify) {
+      w->cv.notify_one();
+    }
+  }
+
+  // Only timeout_ms == 0 is needed by the benchmarks
+  bool wait(const uint64_t num, const uint64_t /* timeout_ms */) {
+    thread_local Waiter me;
+
+    std::unique_lock<std::mutex> lk(mtx_);
+    if (num <= max_number_) {
+      return true;
+    }
+
+    me.num_to_wait = num;
+    waiters_.push_back(&me);
+    me.cv.wait(lk, [this, num] { return num <= this->max_number_; });
+    return true;
+  }
+
+ private:
+  struct Waiter {
+    uint64_t num_to_wait;
+    std::condition_variable cv;
+  };
+
+  std::mutex mtx_;
+  uint64_t max_number_ = 0;
+  std::vector<Waiter*> waiters_;
+};
+
+// Run n operations split across num_threads threads. Every thread posts
+// increasing numbers. If with_waiters is true, every other thread waits for
+// those numbers instead.
+template <typename Box>
+void runContention(uint32_t n, const size_t num_threads,
+                   const bool with_waiters) {
+  Box box;
+  std::atomic<bool> go(false);
+  std::vector<std::thread> threads;
+  const uint64_t ops_per_thread = n / num_threads + 1;
+
+  BENCHMARK_SUSPEND {
+    for (size_t i = 0; i < num_threads; ++i) {
+      const bool is_waiter = with_waiters && i % 2 == 1;
+      threads.emplace_back([&box, &go, ops_per_thread, is_waiter] {
+          while (!go.load()) {
+            std::this_thread::yield();
+          }
+
+          for (uint64_t num = 1; num <= ops_per_thread; ++num) {
+            if (is_waiter) {
+              box.wait(num, 0);
+            } else {
+              box.post(num);
+            }
+          }
+        });
+    }
+  }
+
+  go.store(true);
+  for (auto& t : threads) {
+    t.join();
+  }
+}
+
+void MutexPost(uint32_t n, size_t num_threads) {
+  runContention<MutexMaxNumberBox>(n, num_threads, false);
+}
+
+void LockFreePost(uint32_t n, size_t num_threads) {
+  runContention<MaxNumberBox>(n, num_threads, false);
+}
+
+void MutexPostWait(uint32_t n, size_t num_threads) {
+  runContention<MutexMaxNumberBox>(n, num_threads, true);
+}
+
+void LockFreePostWait(uint32_t n, size_t num_threads) {
+  runContention<MaxNumberBox>(n, num_threads, true);
+}
+
+}  // namespace
+
+BENCHMARK_PARAM(MutexPost, 2)
+BENCHMARK_RELATIVE_PARAM(LockFreePost, 2)
+BENCHMARK_PARAM(MutexPost, 4)
+BENCHMARK_RELATIVE_PARAM(LockFreePost, 4)
+BENCHMARK_PARAM(MutexPost, 8)
+BENCHMARK_RELATIVE_PARAM(LockFreePost, 8)
+BENCHMARK_PARAM(MutexPost, 16)
+BENCHMARK_RELATIVE_PARAM(LockFreePost, 16)
+BENCHMARK_PARAM(MutexPost, 32)
+BENCHMARK_RELATIVE_PARAM(LockFreePost, 32)
+BENCHMARK_PARAM(MutexPost, 64)
+BENCHMARK_RELATIVE_PARAM(LockFreePost, 64)
+
+BENCHMARK_DRAW_LINE();
+
+BENCHMARK_PARAM(MutexPostWait, 2)
+BENCHMARK_RELATIVE_PARAM(LockFreePostWait, 2)
+BENCHMARK_PARAM(MutexPostWait, 4)
+BENCHMARK_RELATIVE_PARAM(LockFreePostWait, 4)
+BENCHMARK_PARAM(MutexPostWait, 8)
+BENCHMARK_RELATIVE_PARAM(LockFreePostWait, 8)
+BENCHMARK_PARAM(MutexPostWait, 16)
+BENCHMARK_RELATIVE_PARAM(LockFreePostWait, 16)
+BENCHMARK_PARAM(MutexPostWait, 32)
+BENCHMARK_RELATIVE_PARAM(LockFreePostWait, 32)
+BENCHMARK_PARAM(MutexPostWait, 64)
+BENCHMARK_RELATIVE_PARAM(LockFreePostWait, 64)
+
+int main(int argc, char **argv) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  folly::runBenchmarks();
+}
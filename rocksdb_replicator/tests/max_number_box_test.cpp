@@ -18,6 +18,7 @@
 
 #include <atomic>
 #include <chrono>
+#include <memory>
 #include <thread>
 #include <vector>
 
@@ -64,6 +65,83 @@ TEST(MaxNumberBoxTest, Basics) {
   poster.join();
 }
 
+TEST(MaxNumberBoxTest, WaitAsync) {
+  MaxNumberBox box;
+  auto f0 = box.waitAsync(0, 10);
+  EXPECT_TRUE(f0.isReady());
+  EXPECT_TRUE(f0.value());
+
+  auto f5 = box.waitAsync(5, 0);
+  auto f3 = box.waitAsync(3, 0);
+  auto f8 = box.waitAsync(8, 0);
+  auto f_timeout = box.waitAsync(10, 10);
+  EXPECT_FALSE(f5.isReady());
+  EXPECT_FALSE(f3.isReady());
+
+  // only the satisfied waiters are fulfilled
+  box.post(5);
+  EXPECT_TRUE(f3.isReady());
+  EXPECT_TRUE(f3.value());
+  EXPECT_TRUE(f5.isReady());
+  EXPECT_TRUE(f5.value());
+  EXPECT_FALSE(f8.isReady());
+
+  EXPECT_FALSE(std::move(f_timeout).get());
+
+  // waiters left are fulfilled with false on destruction
+  auto box2 = std::make_unique<MaxNumberBox>();
+  auto f = box2->waitAsync(1, 0);
+  EXPECT_FALSE(f.isReady());
+  box2.reset();
+  EXPECT_TRUE(f.isReady());
+  EXPECT_FALSE(f.value());
+
+  box.post(20);
+  EXPECT_TRUE(f8.isReady());
+  EXPECT_TRUE(f8.value());
+}
+
+TEST(MaxNumberBoxTest, TimedOutWaitersLeave) {
+  MaxNumberBox box;
+  auto f_timeout = box.waitAsync(10, 10);
+  auto f_pending = box.waitAsync(20, 0);
+  EXPECT_EQ(box.numWaiters(), 2u);
+
+  EXPECT_FALSE(std::move(f_timeout).get());
+  EXPECT_EQ(box.numWaiters(), 1u);
+
+  EXPECT_FALSE(box.wait(15, 10));
+  EXPECT_EQ(box.numWaiters(), 1u);
+
+  box.post(20);
+  EXPECT_TRUE(f_pending.isReady());
+  EXPECT_TRUE(f_pending.value());
+  EXPECT_EQ(box.numWaiters(), 0u);
+
+  // a timed out waiter in the middle of the heap is left there until it's
+  // popped, but no longer counted
+  auto f30 = box.waitAsync(30, 0);
+  auto f35 = box.waitAsync(35, 10);
+  auto f40 = box.waitAsync(40, 0);
+  auto f50 = box.waitAsync(50, 0);
+  EXPECT_FALSE(std::move(f35).get());
+  EXPECT_EQ(box.numWaiters(), 3u);
+  box.post(40);
+  EXPECT_TRUE(f30.isReady());
+  EXPECT_TRUE(f40.isReady());
+  EXPECT_FALSE(f50.isReady());
+  EXPECT_EQ(box.numWaiters(), 1u);
+  box.post(50);
+  EXPECT_EQ(box.numWaiters(), 0u);
+
+  // a timeout firing after the box is gone is harmless
+  auto box2 = std::make_unique<MaxNumberBox>();
+  auto f = box2->waitAsync(1, 10);
+  box2.reset();
+  EXPECT_FALSE(std::move(f).get());
+  std::this_thread::sleep_for(milliseconds(20));
+}
+
 TEST(MaxNumberBoxTest, Stress) {
   // reduce the number of threads to make travis happy.
   // we may need to restore the numbers if we need to stress test it.
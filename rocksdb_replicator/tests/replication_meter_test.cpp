@@ -0,0 +1,94 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "rocksdb_replicator/replication_meter.h"
+
+using replicator::detail::ReplicationMeter;
+using std::vector;
+
+TEST(ReplicationMeterTest, Rates) {
+  ReplicationMeter meter(1000);
+  double in_per_sec;
+  double out_per_sec;
+
+  // nothing recorded yet
+  meter.getRates(9000, &in_per_sec, &out_per_sec);
+  EXPECT_EQ(in_per_sec, 0);
+  EXPECT_EQ(out_per_sec, 0);
+
+  // the first recording starts the window
+  meter.addBytesIn(100, 10000);
+  meter.getRates(10000, &in_per_sec, &out_per_sec);
+  EXPECT_EQ(in_per_sec, 0);
+  EXPECT_EQ(out_per_sec, 0);
+
+  meter.addBytesIn(500, 10200);
+  meter.addBytesOut(1000, 10300);
+  meter.getRates(10500, &in_per_sec, &out_per_sec);
+  EXPECT_EQ(in_per_sec, 1200);
+  EXPECT_EQ(out_per_sec, 2000);
+  EXPECT_EQ(meter.bytesIn(), 600u);
+  EXPECT_EQ(meter.bytesOut(), 1000u);
+
+  // reading has no side effect
+  meter.getRates(10500, &in_per_sec, &out_per_sec);
+  EXPECT_EQ(in_per_sec, 1200);
+  EXPECT_EQ(out_per_sec, 2000);
+
+  // recording rolls over, still averaged from 10000
+  meter.addBytesIn(500, 11000);
+  meter.getRates(11000, &in_per_sec, &out_per_sec);
+  EXPECT_EQ(in_per_sec, 1100);
+  EXPECT_EQ(out_per_sec, 1000);
+
+  // a window after the roll over, only the traffic since 11000 counts
+  meter.getRates(12000, &in_per_sec, &out_per_sec);
+  EXPECT_EQ(in_per_sec, 500);
+  EXPECT_EQ(out_per_sec, 0);
+
+  // and it fades out while idle
+  meter.getRates(13000, &in_per_sec, &out_per_sec);
+  EXPECT_EQ(in_per_sec, 250);
+  EXPECT_EQ(out_per_sec, 0);
+}
+
+TEST(ReplicationMeterTest, RttPercentiles) {
+  ReplicationMeter meter;
+  EXPECT_TRUE(meter.getRttPercentiles({50, 99}).empty());
+
+  for (uint64_t i = 1; i <= 101; ++i) {
+    meter.addRtt(i);
+  }
+  EXPECT_EQ(meter.getRttPercentiles({0, 50, 90, 100}),
+            (vector<uint64_t>{1, 51, 91, 101}));
+
+  // only the recent samples count
+  for (size_t i = 0; i < ReplicationMeter::kNumRttSamples; ++i) {
+    meter.addRtt(1000);
+  }
+  EXPECT_EQ(meter.getRttPercentiles({0, 100}),
+            (vector<uint64_t>{1000, 1000}));
+}
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
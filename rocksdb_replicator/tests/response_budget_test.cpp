@@ -0,0 +1,68 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+#include "gtest/gtest.h"
+#include "rocksdb_replicator/response_budget.h"
+
+using replicator::detail::ResponseBudget;
+
+TEST(ResponseBudgetTest, GrowWhenBehind) {
+  ResponseBudget budget(100, 1000, 50);
+  EXPECT_EQ(budget.get(), 100);
+
+  // the response filled the budget, and we are still behind
+  budget.update(1000, 10, 100);
+  EXPECT_EQ(budget.get(), 200);
+  budget.update(1000, 10, 250);
+  EXPECT_EQ(budget.get(), 400);
+
+  // the response was not limited by the budget
+  budget.update(1000, 10, 300);
+  EXPECT_EQ(budget.get(), 400);
+
+  budget.update(1000, 10, 400);
+  budget.update(1000, 10, 800);
+  EXPECT_EQ(budget.get(), 1000);
+  budget.update(1000, 10, 1000);
+  EXPECT_EQ(budget.get(), 1000);
+}
+
+TEST(ResponseBudgetTest, ShrinkWhenCaughtUpOrSlow) {
+  ResponseBudget budget(100, 1000, 50);
+  for (int i = 0; i < 4; ++i) {
+    budget.update(1000, 10, budget.get());
+  }
+  EXPECT_EQ(budget.get(), 1000);
+
+  // RTT is over the limit
+  budget.update(1000, 60, 1000);
+  EXPECT_EQ(budget.get(), 500);
+
+  // caught up
+  budget.update(0, 10, 500);
+  EXPECT_EQ(budget.get(), 250);
+  budget.update(0, 10, 0);
+  budget.update(0, 10, 0);
+  EXPECT_EQ(budget.get(), 100);
+  budget.update(0, 10, 0);
+  EXPECT_EQ(budget.get(), 100);
+}
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
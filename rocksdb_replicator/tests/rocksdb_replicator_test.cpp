@@ -207,6 +207,50 @@ TEST(RocksDBReplicatorTest, 1_master_1_slave) {
   EXPECT_EQ(db_slave->GetLatestSequenceNumber(), n_keys * 2);
 }
 
+TEST(RocksDBReplicatorTest, WaitForSeqNo) {
+  int16_t master_port = 9098;
+  int16_t slave_port = 9099;
+  Host master(master_port);
+  Host slave(slave_port);
+
+  auto db_master = cleanAndOpenDB("/tmp/db_master");
+  auto db_slave = cleanAndOpenDB("/tmp/db_slave");
+
+  RocksDBReplicator::ReplicatedDB* replicated_db_master = nullptr;
+  RocksDBReplicator::ReplicatedDB* replicated_db_slave = nullptr;
+  EXPECT_EQ(master.replicator_->addDB("shard1", db_master, ReplicaRole::LEADER,
+                                      SocketAddress(), &replicated_db_master),
+            ReturnCode::OK);
+  SocketAddress addr_master("127.0.0.1", master_port);
+  EXPECT_EQ(slave.replicator_->addDB("shard1", db_slave, ReplicaRole::FOLLOWER,
+                                     addr_master, &replicated_db_slave),
+            ReturnCode::OK);
+
+  // nothing to wait for
+  EXPECT_TRUE(replicated_db_slave->WaitForSeqNo(0, 100).get());
+
+  WriteOptions options;
+  ReadOptions read_options;
+  for (uint32_t i = 0; i < 10; ++i) {
+    WriteBatch updates;
+    auto str = to_string(i);
+    updates.Put(str + "key", str + "value");
+    rocksdb::SequenceNumber seq_no;
+    EXPECT_TRUE(replicated_db_master->Write(options, &updates, &seq_no).ok());
+    EXPECT_EQ(seq_no, i + 1);
+
+    // once the wait is over, the follower has the write
+    EXPECT_TRUE(replicated_db_slave->WaitForSeqNo(seq_no, 5000).get());
+    string value;
+    EXPECT_TRUE(db_slave->Get(read_options, str + "key", &value).ok());
+    EXPECT_EQ(value, str + "value");
+  }
+
+  // the leader never gets there
+  EXPECT_FALSE(replicated_db_slave->WaitForSeqNo(100, 200).get());
+  EXPECT_TRUE(replicated_db_master->WaitForSeqNo(10, 0).get());
+}
+
 TEST(RocksDBReplicatorTest, 1_master_2_slaves_tree) {
   int16_t master_port = 9094;
   int16_t slave_port_1 = 9095;
@@ -0,0 +1,114 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "boost/filesystem.hpp"
+#include "folly/io/IOBuf.h"
+#include "gtest/gtest.h"
+#include "rocksdb/db.h"
+#include "rocksdb_replicator/rocksdb_wrapper.h"
+#include "rocksdb_replicator/write_batch_util.h"
+
+using boost::filesystem::remove_all;
+using replicator::RocksDbWrapper;
+using replicator::Update;
+using rocksdb::DB;
+using rocksdb::Options;
+using rocksdb::WriteBatch;
+using std::shared_ptr;
+using std::string;
+using std::vector;
+
+namespace {
+
+shared_ptr<DB> CleanAndOpenDB(const string& path) {
+  EXPECT_NO_THROW(remove_all(path));
+  Options options;
+  options.create_if_missing = true;
+  options.error_if_exists = true;
+  DB* db;
+  EXPECT_TRUE(DB::Open(options, path, &db).ok());
+  return shared_ptr<DB>(db);
+}
+
+// Three updates from upstream, with 2, 1 and 1 records
+vector<Update> MakeUpdates() {
+  vector<Update> updates;
+  uint64_t seq_no = 1;
+  for (int n_records : {2, 1, 1}) {
+    WriteBatch batch;
+    for (int i = 0; i < n_records; ++i) {
+      batch.Put("key" + std::to_string(seq_no + i), "value");
+    }
+
+    Update update;
+    update.raw_data = folly::IOBuf(folly::IOBuf::COPY_BUFFER,
+                                   batch.Data().data(), batch.Data().size());
+    update.timestamp = 1000 + seq_no;
+    update.set_seq_no(seq_no);
+    seq_no += n_records;
+    updates.push_back(std::move(update));
+  }
+
+  return updates;
+}
+
+// Return the # of batches in the WAL of db, and the timestamp of the last one
+int CountWalBatches(DB* db, uint64_t* last_timestamp) {
+  std::unique_ptr<rocksdb::TransactionLogIterator> iter;
+  EXPECT_TRUE(db->GetUpdatesSince(1, &iter).ok());
+  int n = 0;
+  for (; iter->Valid(); iter->Next()) {
+    auto result = iter->GetBatch();
+    EXPECT_TRUE(replicator::ExtractTrailingTimestamp(*result.writeBatchPtr,
+                                                     last_timestamp));
+    ++n;
+  }
+  return n;
+}
+
+}  // namespace
+
+TEST(RocksDbWrapperTest, ApplyKeepsRecordBoundaries) {
+  auto db = CleanAndOpenDB("/tmp/rocksdb_wrapper_test");
+  RocksDbWrapper wrapper("follower", db);
+  auto updates = MakeUpdates();
+
+  EXPECT_EQ(wrapper.HandleReplicateResponses(updates.begin(), updates.end()),
+            3u);
+  EXPECT_EQ(wrapper.LatestSequenceNumber(), 4u);
+  for (int i = 1; i <= 4; ++i) {
+    string value;
+    EXPECT_TRUE(db->Get(rocksdb::ReadOptions(), "key" + std::to_string(i),
+                        &value).ok());
+    EXPECT_EQ(value, "value");
+  }
+
+  // one WAL record per update, as upstream has them
+  uint64_t timestamp = 0;
+  EXPECT_EQ(CountWalBatches(db.get(), &timestamp), 3);
+  EXPECT_EQ(timestamp, 1004u);
+}
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
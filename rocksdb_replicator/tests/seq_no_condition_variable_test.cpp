@@ -0,0 +1,120 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <thread>
+
+#include "folly/Executor.h"
+#include "gtest/gtest.h"
+#include "rocksdb_replicator/seq_no_condition_variable.h"
+#include "rocksdb_replicator/timer_wheel.h"
+
+using replicator::detail::SeqNoConditionVariable;
+using replicator::detail::TimerWheel;
+using std::atomic;
+using std::chrono::milliseconds;
+using std::this_thread::sleep_for;
+
+namespace {
+
+// Run tasks inline in the thread adding them
+class InlineExecutor : public folly::Executor {
+ public:
+  void add(folly::Func f) override {
+    f();
+  }
+};
+
+const int kPauseTimeMs = 100;
+
+}  // namespace
+
+TEST(SeqNoConditionVariableTest, Basics) {
+  InlineExecutor executor;
+  TimerWheel timer_wheel(1, 16);
+  atomic<uint64_t> latest(3);
+  auto variable = std::make_unique<SeqNoConditionVariable>(
+    &executor, [&latest] { return latest.load(); }, &timer_wheel);
+  atomic<int> counter_2(0);
+  atomic<int> counter_5(0);
+  atomic<int> counter_8(0);
+
+  // trigger immediately
+  variable->runIfGreaterOrWaitForNotify([&counter_2] { ++counter_2; }, 2, 0);
+  EXPECT_EQ(counter_2, 1);
+
+  // only the satisfied tasks are triggered by notify()
+  variable->runIfGreaterOrWaitForNotify([&counter_5] { ++counter_5; }, 5, 0);
+  variable->runIfGreaterOrWaitForNotify([&counter_8] { ++counter_8; }, 8, 0);
+  variable->notify();
+  EXPECT_EQ(counter_5, 0);
+  latest.store(5);
+  variable->notify();
+  EXPECT_EQ(counter_5, 0);
+  latest.store(6);
+  variable->notify();
+  EXPECT_EQ(counter_5, 1);
+  EXPECT_EQ(counter_8, 0);
+
+  // trigger by timeout
+  variable->runIfGreaterOrWaitForNotify([&counter_5] { ++counter_5; }, 6,
+                                        kPauseTimeMs / 2);
+  EXPECT_EQ(counter_5, 1);
+  sleep_for(milliseconds(kPauseTimeMs));
+  EXPECT_EQ(counter_5, 2);
+
+  // a timed out task doesn't run again
+  latest.store(7);
+  variable->notify();
+  EXPECT_EQ(counter_5, 2);
+  EXPECT_EQ(counter_8, 0);
+
+  // trigger by destructor
+  variable.reset();
+  EXPECT_EQ(counter_8, 1);
+}
+
+TEST(SeqNoConditionVariableTest, ManyTimedOutTasks) {
+  InlineExecutor executor;
+  TimerWheel timer_wheel(1, 16);
+  atomic<uint64_t> latest(0);
+  SeqNoConditionVariable variable(
+    &executor, [&latest] { return latest.load(); }, &timer_wheel);
+  atomic<int> counter(0);
+
+  // tasks on an idle db time out over and over without notify()
+  for (int i = 0; i < 10000; ++i) {
+    variable.runIfGreaterOrWaitForNotify([&counter] { ++counter; }, 0, 1);
+    if (i % 1000 == 0) {
+      sleep_for(milliseconds(10));
+    }
+  }
+  sleep_for(milliseconds(kPauseTimeMs));
+  EXPECT_EQ(counter, 10000);
+
+  latest.store(1);
+  variable.notify();
+  EXPECT_EQ(counter, 10000);
+}
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,91 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <thread>
+
+#include "gtest/gtest.h"
+#include "rocksdb_replicator/timer_wheel.h"
+
+using replicator::detail::TimerWheel;
+using std::atomic;
+using std::chrono::milliseconds;
+using std::chrono::steady_clock;
+using std::this_thread::sleep_for;
+
+TEST(TimerWheelTest, Basics) {
+  TimerWheel timer_wheel(1, 8);
+  atomic<int> counter(0);
+
+  timer_wheel.schedule([&counter] { ++counter; }, 0);
+  timer_wheel.schedule([&counter] { ++counter; }, 20);
+  sleep_for(milliseconds(10));
+  EXPECT_EQ(counter, 1);
+  sleep_for(milliseconds(30));
+  EXPECT_EQ(counter, 2);
+}
+
+TEST(TimerWheelTest, NotEarly) {
+  // timeouts longer than one round of the wheel
+  TimerWheel timer_wheel(2, 4);
+  const int n_timers = 10;
+  atomic<int> counter(0);
+  atomic<bool> early(false);
+
+  auto start = steady_clock::now();
+  for (int i = 0; i < n_timers; ++i) {
+    const auto timeout_ms = 5 * i;
+    timer_wheel.schedule([&counter, &early, start, timeout_ms] {
+        if (steady_clock::now() - start < milliseconds(timeout_ms)) {
+          early.store(true);
+        }
+        ++counter;
+      }, timeout_ms);
+  }
+
+  sleep_for(milliseconds(5 * n_timers + 50));
+  EXPECT_EQ(counter, n_timers);
+  EXPECT_FALSE(early.load());
+}
+
+TEST(TimerWheelTest, ScheduleFromCallback) {
+  TimerWheel timer_wheel(1, 8);
+  atomic<int> counter(0);
+
+  timer_wheel.schedule([&timer_wheel, &counter] {
+      ++counter;
+      timer_wheel.schedule([&counter] { ++counter; }, 1);
+    }, 1);
+  sleep_for(milliseconds(50));
+  EXPECT_EQ(counter, 2);
+}
+
+TEST(TimerWheelTest, DropOnDestruction) {
+  atomic<int> counter(0);
+  auto timer_wheel = std::make_unique<TimerWheel>(1, 8);
+  timer_wheel->schedule([&counter] { ++counter; }, 1000);
+  timer_wheel.reset();
+  EXPECT_EQ(counter, 0);
+}
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
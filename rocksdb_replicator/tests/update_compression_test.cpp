@@ -0,0 +1,138 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#include <memory>
+#include <string>
+
+#include "folly/io/IOBuf.h"
+#include "gtest/gtest.h"
+#include "rocksdb/write_batch.h"
+#include "rocksdb_replicator/update_compression.h"
+
+using folly::IOBuf;
+using replicator::detail::UpdateCompressor;
+using replicator::detail::UpdateDecompressor;
+using std::string;
+using std::to_string;
+using std::unique_ptr;
+
+namespace {
+
+// A WriteBatch looking like what a counter shard writes
+unique_ptr<IOBuf> MakeRecord(int i) {
+  rocksdb::WriteBatch batch;
+  batch.Put("counter_service/segment_" + to_string(i % 7) + "/user_" +
+            to_string(i), "value_" + to_string(i * 31) + string(64, 'x'));
+  return IOBuf::copyBuffer(batch.Data());
+}
+
+string ToString(const IOBuf& buf) {
+  auto copy = buf.clone();
+  copy->coalesce();
+  return string(reinterpret_cast<const char*>(copy->data()), copy->length());
+}
+
+}  // namespace
+
+TEST(UpdateCompressionTest, Basics) {
+  UpdateCompressor compressor(3, 16 * 1024, 512 * 1024, 1000 * 1000);
+  EXPECT_TRUE(compressor.dict() == nullptr);
+  EXPECT_FALSE(compressor.shouldTrain());
+
+  for (int i = 0; i < 10000; ++i) {
+    compressor.addSample(*MakeRecord(i));
+  }
+
+  EXPECT_TRUE(compressor.shouldTrain());
+  // only one caller gets to train
+  EXPECT_FALSE(compressor.shouldTrain());
+  compressor.train();
+  auto dict = compressor.dict();
+  ASSERT_TRUE(dict != nullptr);
+  EXPECT_NE(dict->id, 0u);
+  // not due until refresh_ms has passed
+  for (int i = 0; i < 10000; ++i) {
+    compressor.addSample(*MakeRecord(i));
+  }
+  EXPECT_FALSE(compressor.shouldTrain());
+
+  auto record = MakeRecord(12345);
+  auto compressed = UpdateCompressor::compress(*dict, *record);
+  ASSERT_TRUE(compressed != nullptr);
+  EXPECT_LT(compressed->computeChainDataLength(),
+            record->computeChainDataLength());
+
+  UpdateDecompressor decompressor(1024 * 1024);
+  EXPECT_EQ(decompressor.dictId(), 0u);
+  EXPECT_TRUE(decompressor.decompress(*compressed, record->length()) ==
+              nullptr);
+
+  EXPECT_TRUE(decompressor.setDict(dict->bytes));
+  EXPECT_EQ(decompressor.dictId(), dict->id);
+  auto decompressed = decompressor.decompress(*compressed, record->length());
+  ASSERT_TRUE(decompressed != nullptr);
+  EXPECT_EQ(ToString(*decompressed), ToString(*record));
+
+  // a wrong uncompressed size is a failure
+  EXPECT_TRUE(decompressor.decompress(*compressed, record->length() - 1) ==
+              nullptr);
+  EXPECT_TRUE(decompressor.decompress(*compressed, record->length() + 1000) ==
+              nullptr);
+
+  // so is one over the limit
+  UpdateDecompressor small_decompressor(record->length() - 1);
+  EXPECT_TRUE(small_decompressor.setDict(dict->bytes));
+  EXPECT_TRUE(small_decompressor.decompress(*compressed, record->length()) ==
+              nullptr);
+
+  decompressor.clear();
+  EXPECT_EQ(decompressor.dictId(), 0u);
+  EXPECT_TRUE(decompressor.decompress(*compressed, record->length()) ==
+              nullptr);
+}
+
+TEST(UpdateCompressionTest, ChainedInput) {
+  UpdateCompressor compressor(3, 16 * 1024, 512 * 1024, 0);
+  for (int i = 0; i < 10000; ++i) {
+    compressor.addSample(*MakeRecord(i));
+  }
+  ASSERT_TRUE(compressor.shouldTrain());
+  compressor.train();
+  auto dict = compressor.dict();
+  ASSERT_TRUE(dict != nullptr);
+
+  auto record = MakeRecord(42);
+  auto expected = ToString(*record);
+  auto chained = IOBuf::copyBuffer(expected.data(), expected.size() / 2);
+  chained->prependChain(IOBuf::copyBuffer(expected.data() + expected.size() / 2,
+                                          expected.size() - expected.size() / 2));
+
+  auto compressed = UpdateCompressor::compress(*dict, *chained);
+  ASSERT_TRUE(compressed != nullptr);
+
+  UpdateDecompressor decompressor(1024 * 1024);
+  ASSERT_TRUE(decompressor.setDict(dict->bytes));
+  auto decompressed = decompressor.decompress(*compressed, expected.size());
+  ASSERT_TRUE(decompressed != nullptr);
+  EXPECT_EQ(ToString(*decompressed), expected);
+}
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
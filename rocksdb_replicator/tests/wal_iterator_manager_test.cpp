@@ -0,0 +1,247 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include "boost/filesystem.hpp"
+#include "folly/Executor.h"
+#include "gtest/gtest.h"
+#include "rocksdb/db.h"
+#include "rocksdb_replicator/rocksdb_wrapper.h"
+#include "rocksdb_replicator/timer_wheel.h"
+#include "rocksdb_replicator/wal_iterator_manager.h"
+
+using boost::filesystem::remove_all;
+using replicator::RocksDbWrapper;
+using replicator::detail::TimerWheel;
+using replicator::detail::WalIterator;
+using replicator::detail::WalIteratorManager;
+using rocksdb::DB;
+using rocksdb::Options;
+using std::atomic;
+using std::make_shared;
+using std::shared_ptr;
+using std::string;
+using std::unique_ptr;
+
+using Source = WalIteratorManager::Source;
+
+namespace {
+
+// Run tasks inline in the thread adding them
+class InlineExecutor : public folly::Executor {
+ public:
+  void add(folly::Func f) override {
+    f();
+  }
+};
+
+// Count the iterators created and the prefetches
+class CountingDbWrapper : public RocksDbWrapper {
+ public:
+  CountingDbWrapper(const string& db_name, shared_ptr<DB> db)
+    : RocksDbWrapper(db_name, std::move(db)) {}
+
+  rocksdb::Status GetUpdatesFromLeader(
+      rocksdb::SequenceNumber seq_no,
+      unique_ptr<rocksdb::TransactionLogIterator>* iter) override {
+    ++num_opens;
+    return RocksDbWrapper::GetUpdatesFromLeader(seq_no, iter);
+  }
+
+  void PrefetchWal(rocksdb::SequenceNumber seq_no,
+                   uint64_t max_bytes) override {
+    ++num_prefetches;
+    RocksDbWrapper::PrefetchWal(seq_no, max_bytes);
+  }
+
+  atomic<int> num_opens {0};
+  atomic<int> num_prefetches {0};
+};
+
+shared_ptr<DB> CleanAndOpenDB(const string& path) {
+  EXPECT_NO_THROW(remove_all(path));
+  Options options;
+  options.create_if_missing = true;
+  options.error_if_exists = true;
+  DB* db;
+  EXPECT_TRUE(DB::Open(options, path, &db).ok());
+  return shared_ptr<DB>(db);
+}
+
+// Write n batches of one record each
+void WriteBatches(DB* db, int n) {
+  for (int i = 0; i < n; ++i) {
+    EXPECT_TRUE(db->Put(rocksdb::WriteOptions(), "key" + std::to_string(i),
+                        "value").ok());
+  }
+}
+
+// The sequence # of the batch iter is at
+uint64_t CurrentSeqNo(WalIterator* iter) {
+  EXPECT_TRUE(iter->Valid());
+  return iter->GetBatch().sequence;
+}
+
+}  // namespace
+
+TEST(WalIteratorManagerTest, ExactAndForked) {
+  auto db = CleanAndOpenDB("/tmp/wal_iterator_manager_test");
+  WriteBatches(db.get(), 10);
+  auto wrapper = make_shared<CountingDbWrapper>("db", db);
+  InlineExecutor executor;
+  TimerWheel timer_wheel(1, 16);
+  auto manager = make_shared<WalIteratorManager>(
+    wrapper, &executor, 8, 5, 0, 1024 * 1024, 60 * 1000, &timer_wheel);
+
+  unique_ptr<WalIterator> iter;
+  Source source;
+  EXPECT_TRUE(manager->get(1, &iter, &source).ok());
+  EXPECT_TRUE(source == Source::kNew);
+  EXPECT_EQ(wrapper->num_opens.load(), 1);
+  EXPECT_EQ(wrapper->num_prefetches.load(), 1);
+  EXPECT_EQ(CurrentSeqNo(iter.get()), 1u);
+  iter->Next();
+  manager->put(2, std::move(iter));
+  EXPECT_EQ(manager->size(), 1u);
+
+  // the exact one
+  EXPECT_TRUE(manager->get(2, &iter, &source).ok());
+  EXPECT_TRUE(source == Source::kExact);
+  EXPECT_EQ(manager->size(), 0u);
+  EXPECT_EQ(CurrentSeqNo(iter.get()), 2u);
+  iter->Next();
+  manager->put(3, std::move(iter));
+
+  // forked from the one at 3
+  EXPECT_TRUE(manager->get(7, &iter, &source).ok());
+  EXPECT_TRUE(source == Source::kForked);
+  EXPECT_EQ(CurrentSeqNo(iter.get()), 7u);
+  EXPECT_EQ(wrapper->num_opens.load(), 1);
+  iter->Next();
+  manager->put(8, std::move(iter));
+
+  // too far behind to fork
+  EXPECT_TRUE(manager->get(2, &iter, &source).ok());
+  EXPECT_TRUE(source == Source::kNew);
+  EXPECT_EQ(wrapper->num_opens.load(), 2);
+  // prefetched a moment ago already
+  EXPECT_EQ(wrapper->num_prefetches.load(), 1);
+  EXPECT_EQ(CurrentSeqNo(iter.get()), 2u);
+  EXPECT_EQ(manager->size(), 1u);
+
+  // the one at 8 runs out before getting to 11
+  manager->get(11, &iter, &source);
+  EXPECT_TRUE(source == Source::kNew);
+  EXPECT_EQ(manager->size(), 0u);
+}
+
+TEST(WalIteratorManagerTest, ForkOnlyIdle) {
+  auto db = CleanAndOpenDB("/tmp/wal_iterator_manager_test");
+  WriteBatches(db.get(), 10);
+  auto wrapper = make_shared<CountingDbWrapper>("db", db);
+  InlineExecutor executor;
+  TimerWheel timer_wheel(1, 16);
+  auto manager = make_shared<WalIteratorManager>(
+    wrapper, &executor, 8, 5, 50, 0, 60 * 1000, &timer_wheel);
+
+  unique_ptr<WalIterator> iter;
+  Source source;
+  EXPECT_TRUE(manager->get(3, &iter, &source).ok());
+  manager->put(3, std::move(iter));
+
+  // the one at 3 may still be used by its downstream
+  EXPECT_TRUE(manager->get(7, &iter, &source).ok());
+  EXPECT_TRUE(source == Source::kNew);
+  EXPECT_EQ(wrapper->num_opens.load(), 2);
+  EXPECT_EQ(manager->size(), 1u);
+
+  // but not after sitting idle for a while
+  std::this_thread::sleep_for(std::chrono::milliseconds(60));
+  EXPECT_TRUE(manager->get(7, &iter, &source).ok());
+  EXPECT_TRUE(source == Source::kForked);
+  EXPECT_EQ(CurrentSeqNo(iter.get()), 7u);
+  EXPECT_EQ(wrapper->num_opens.load(), 2);
+  EXPECT_EQ(manager->size(), 0u);
+}
+
+TEST(WalIteratorManagerTest, TailRefresh) {
+  auto db = CleanAndOpenDB("/tmp/wal_iterator_manager_test");
+  WriteBatches(db.get(), 3);
+  auto wrapper = make_shared<CountingDbWrapper>("db", db);
+  InlineExecutor executor;
+  TimerWheel timer_wheel(1, 16);
+  auto manager = make_shared<WalIteratorManager>(
+    wrapper, &executor, 8, 0, 0, 0, 60 * 1000, &timer_wheel);
+
+  unique_ptr<WalIterator> iter;
+  Source source;
+  EXPECT_TRUE(manager->get(1, &iter, &source).ok());
+  for (int i = 0; i < 3; ++i) {
+    EXPECT_TRUE(iter->Valid());
+    iter->Next();
+  }
+  EXPECT_FALSE(iter->Valid());
+  manager->put(4, std::move(iter));
+
+  // the iterator at the end of the WAL picks up new updates
+  WriteBatches(db.get(), 2);
+  EXPECT_TRUE(manager->get(4, &iter, &source).ok());
+  EXPECT_TRUE(source == Source::kExact);
+  EXPECT_EQ(CurrentSeqNo(iter.get()), 4u);
+  EXPECT_EQ(wrapper->num_opens.load(), 1);
+  EXPECT_EQ(wrapper->num_prefetches.load(), 0);
+}
+
+TEST(WalIteratorManagerTest, EvictAndExpire) {
+  auto db = CleanAndOpenDB("/tmp/wal_iterator_manager_test");
+  WriteBatches(db.get(), 10);
+  auto wrapper = make_shared<CountingDbWrapper>("db", db);
+  InlineExecutor executor;
+  TimerWheel timer_wheel(1, 16);
+  auto manager = make_shared<WalIteratorManager>(
+    wrapper, &executor, 2, 0, 0, 0, 50, &timer_wheel);
+
+  unique_ptr<WalIterator> iter;
+  Source source;
+  for (uint64_t seq_no : {1, 4, 7}) {
+    EXPECT_TRUE(manager->get(seq_no, &iter, &source).ok());
+    manager->put(seq_no, std::move(iter));
+    std::this_thread::sleep_for(std::chrono::milliseconds(2));
+  }
+  EXPECT_EQ(manager->size(), 2u);
+
+  // the least recently used one is gone
+  EXPECT_TRUE(manager->get(1, &iter, &source).ok());
+  EXPECT_TRUE(source == Source::kNew);
+  EXPECT_TRUE(manager->get(4, &iter, &source).ok());
+  EXPECT_TRUE(source == Source::kExact);
+  manager->put(4, std::move(iter));
+
+  std::this_thread::sleep_for(std::chrono::milliseconds(500));
+  EXPECT_EQ(manager->size(), 0u);
+}
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
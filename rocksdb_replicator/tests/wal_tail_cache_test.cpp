@@ -0,0 +1,120 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "rocksdb_replicator/wal_tail_cache.h"
+
+using replicator::Update;
+using replicator::detail::WalTailCache;
+
+namespace {
+
+Update makeUpdate(uint64_t seq_no, const std::string& data) {
+  Update update;
+  update.raw_data = *folly::IOBuf::copyBuffer(data);
+  update.timestamp = seq_no * 10;
+  update.set_seq_no(seq_no);
+  return update;
+}
+
+}  // namespace
+
+TEST(WalTailCacheTest, Basics) {
+  WalTailCache cache(100, 1024);
+  std::vector<Update> updates;
+  uint64_t next_seq_no = 0;
+  uint64_t bytes = 0;
+
+  EXPECT_EQ(cache.get(1, 10, 0, &updates, &next_seq_no, &bytes), 0);
+  EXPECT_TRUE(updates.empty());
+
+  // batches covering [1, 2], [3], [4, 6], and [10]
+  cache.add(makeUpdate(1, "ab"), 2);
+  cache.add(makeUpdate(3, "c"), 1);
+  cache.add(makeUpdate(4, "def"), 3);
+  cache.add(makeUpdate(10, "j"), 1);
+
+  EXPECT_EQ(cache.get(1, 10, 0, &updates, &next_seq_no, &bytes), 3);
+  ASSERT_EQ(updates.size(), 3);
+  EXPECT_EQ(next_seq_no, 7);
+  EXPECT_EQ(bytes, 6);
+  EXPECT_EQ(updates[0].seq_no, 1);
+  EXPECT_EQ(updates[0].timestamp, 10);
+  EXPECT_EQ(updates[1].seq_no, 3);
+  EXPECT_EQ(updates[2].seq_no, 4);
+  EXPECT_EQ(updates[2].raw_data.moveToFbString().toStdString(), "def");
+
+  // not the first record of a cached batch
+  updates.clear();
+  EXPECT_EQ(cache.get(2, 10, 0, &updates, &next_seq_no, &bytes), 0);
+  EXPECT_EQ(cache.get(7, 10, 0, &updates, &next_seq_no, &bytes), 0);
+
+  // max_updates is honored
+  bytes = 0;
+  EXPECT_EQ(cache.get(3, 1, 0, &updates, &next_seq_no, &bytes), 1);
+  EXPECT_EQ(next_seq_no, 4);
+  EXPECT_EQ(bytes, 1);
+
+  updates.clear();
+  EXPECT_EQ(cache.get(10, 10, 0, &updates, &next_seq_no, &bytes), 1);
+  EXPECT_EQ(next_seq_no, 11);
+
+  // max_bytes is honored, and may be exceeded by the last update
+  updates.clear();
+  bytes = 0;
+  EXPECT_EQ(cache.get(1, 10, 2, &updates, &next_seq_no, &bytes), 1);
+  EXPECT_EQ(next_seq_no, 3);
+  EXPECT_EQ(bytes, 2);
+  EXPECT_EQ(cache.get(1, 10, 3, &updates, &next_seq_no, &bytes), 2);
+  EXPECT_EQ(next_seq_no, 4);
+  EXPECT_EQ(cache.get(1, 10, 4, &updates, &next_seq_no, &bytes), 3);
+  EXPECT_EQ(next_seq_no, 7);
+}
+
+TEST(WalTailCacheTest, Eviction) {
+  WalTailCache cache(3, 10);
+  std::vector<Update> updates;
+  uint64_t next_seq_no = 0;
+  uint64_t bytes = 0;
+
+  for (uint64_t i = 1; i <= 5; ++i) {
+    cache.add(makeUpdate(i, "x"), 1);
+  }
+
+  // only the latest 3 updates are kept
+  EXPECT_EQ(cache.get(1, 10, 0, &updates, &next_seq_no, &bytes), 0);
+  EXPECT_EQ(cache.get(2, 10, 0, &updates, &next_seq_no, &bytes), 0);
+  EXPECT_EQ(cache.get(3, 10, 0, &updates, &next_seq_no, &bytes), 3);
+
+  // an old update is evicted right away when the cache is full
+  updates.clear();
+  cache.add(makeUpdate(1, "x"), 1);
+  EXPECT_EQ(cache.get(1, 10, 0, &updates, &next_seq_no, &bytes), 0);
+
+  // evict by size
+  cache.add(makeUpdate(6, "0123456789"), 1);
+  EXPECT_EQ(cache.get(5, 10, 0, &updates, &next_seq_no, &bytes), 0);
+  EXPECT_EQ(cache.get(6, 10, 0, &updates, &next_seq_no, &bytes), 1);
+}
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
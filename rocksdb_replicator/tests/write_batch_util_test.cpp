@@ -0,0 +1,161 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "rocksdb/db.h"
+#include "rocksdb_replicator/rocksdb_replicator.h"
+#include "rocksdb_replicator/write_batch_util.h"
+
+using replicator::AppendTimestamp;
+using replicator::ExtractTrailingTimestamp;
+using replicator::GetWriteBatchSequence;
+using replicator::MergeWriteBatches;
+using rocksdb::DB;
+using rocksdb::Slice;
+using rocksdb::WriteBatch;
+using std::string;
+using std::vector;
+
+namespace {
+
+// Record all Put()s and LogData()s of a WriteBatch
+struct Recorder : public WriteBatch::Handler {
+  void Put(const Slice& key, const Slice& value) override {
+    records.push_back("put:" + key.ToString() + "=" + value.ToString());
+  }
+
+  void LogData(const Slice& blob) override {
+    records.push_back("log:" + blob.ToString());
+  }
+
+  vector<string> records;
+};
+
+}  // namespace
+
+TEST(WriteBatchUtilTest, ExtractTrailingTimestamp) {
+  WriteBatch batch;
+  uint64_t ms = 0;
+  EXPECT_FALSE(ExtractTrailingTimestamp(batch, &ms));
+
+  batch.Put("key", "value");
+  EXPECT_FALSE(ExtractTrailingTimestamp(batch, &ms));
+
+  const uint64_t now = 1234567890123;
+  AppendTimestamp(&batch, now, true);
+  EXPECT_TRUE(ExtractTrailingTimestamp(batch, &ms));
+  EXPECT_EQ(ms, now);
+
+  // the timestamp must be the last record
+  batch.Put("key2", "value2");
+  EXPECT_FALSE(ExtractTrailingTimestamp(batch, &ms));
+
+  // an untagged 8-byte LogData, as older versions read, is only found by a
+  // full Iterate()
+  WriteBatch legacy;
+  legacy.Put("key", "value");
+  AppendTimestamp(&legacy, now, false);
+  Recorder recorder;
+  ASSERT_TRUE(legacy.Iterate(&recorder).ok());
+  ASSERT_EQ(recorder.records.size(), 2);
+  EXPECT_EQ(recorder.records[1],
+            "log:" + string(reinterpret_cast<const char*>(&now), sizeof(now)));
+  EXPECT_FALSE(ExtractTrailingTimestamp(legacy, &ms));
+  replicator::LogExtractor extractor;
+  extractor.ms = 0;
+  ASSERT_TRUE(legacy.Iterate(&extractor).ok());
+  EXPECT_EQ(extractor.ms, now);
+}
+
+TEST(WriteBatchUtilTest, ValueLookingLikeTimestamp) {
+  // A value ending in what an untagged trailer used to look like
+  const uint64_t fake = 42;
+  string value = "value";
+  value.push_back(0x3);
+  value.push_back(0x8);
+  value.append(reinterpret_cast<const char*>(&fake), sizeof(fake));
+
+  WriteBatch batch;
+  batch.Put("key", value);
+  uint64_t ms = 0;
+  EXPECT_FALSE(ExtractTrailingTimestamp(batch, &ms));
+
+  const uint64_t now = 1234567890123;
+  AppendTimestamp(&batch, now, true);
+  EXPECT_TRUE(ExtractTrailingTimestamp(batch, &ms));
+  EXPECT_EQ(ms, now);
+
+  // The timestamp record is a regular LogData record
+  Recorder recorder;
+  ASSERT_TRUE(batch.Iterate(&recorder).ok());
+  ASSERT_EQ(recorder.records.size(), 2);
+  EXPECT_EQ(recorder.records[0], "put:key=" + value);
+  replicator::LogExtractor extractor;
+  extractor.ms = 0;
+  ASSERT_TRUE(batch.Iterate(&extractor).ok());
+  EXPECT_EQ(extractor.ms, now);
+}
+
+TEST(WriteBatchUtilTest, MergeWriteBatches) {
+  WriteBatch batch1;
+  batch1.Put("k1", "v1");
+  batch1.Put("k2", "v2");
+  WriteBatch batch2;
+  WriteBatch batch3;
+  batch3.PutLogData("blob");
+  batch3.Put("k3", "v3");
+
+  vector<const WriteBatch*> batches{&batch1, &batch2, &batch3};
+  auto merged = MergeWriteBatches(batches.begin(), batches.end());
+  EXPECT_EQ(merged.Count(), 3);
+
+  Recorder recorder;
+  ASSERT_TRUE(merged.Iterate(&recorder).ok());
+  EXPECT_EQ(recorder.records,
+            vector<string>({"put:k1=v1", "put:k2=v2", "log:blob", "put:k3=v3"}));
+}
+
+TEST(WriteBatchUtilTest, GetWriteBatchSequence) {
+  const string path = "/tmp/write_batch_util_test";
+  rocksdb::Options options;
+  options.create_if_missing = true;
+  rocksdb::DestroyDB(path, options);
+  DB* db;
+  ASSERT_TRUE(DB::Open(options, path, &db).ok());
+  std::unique_ptr<DB> db_guard(db);
+
+  WriteBatch batch1;
+  batch1.Put("k1", "v1");
+  batch1.Put("k2", "v2");
+  EXPECT_EQ(GetWriteBatchSequence(batch1), 0);
+  ASSERT_TRUE(db->Write(rocksdb::WriteOptions(), &batch1).ok());
+  EXPECT_EQ(GetWriteBatchSequence(batch1), 1);
+
+  WriteBatch batch2;
+  batch2.Put("k3", "v3");
+  ASSERT_TRUE(db->Write(rocksdb::WriteOptions(), &batch2).ok());
+  EXPECT_EQ(GetWriteBatchSequence(batch2), 3);
+}
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -39,6 +39,35 @@ struct ReplicateRequest {
 
   # role is the replica role of the downstream host requesting the updates
   5: optional ReplicaRole role;
+
+  # The upper limit of the total size of raw_data in a response. The server
+  # stops adding updates to a response once this is reached, so a response may
+  # go over it by at most one update.
+  # Absent or a value of 0 means no limit
+  6: optional i64 max_bytes;
+
+  # If set, the request asks for a window of updates for pipelining. Only
+  # updates whose sequence number is in (seq_no, max_seq_no] are returned, and
+  # an update starting before seq_no + 1 is skipped instead of being returned
+  # from its start.
+  7: optional i64 max_seq_no;
+
+  # The largest sequence number the downstream has applied, if it is not
+  # seq_no. This is the case for pipelined requests other than the first one.
+  8: optional i64 applied_seq_no;
+
+  # If set, the downstream can decompress updates compressed with a zstd
+  # dictionary, and this is the id of the dictionary it has (0 for none). The
+  # upstream attaches its dictionary to the response if the ids differ.
+  9: optional i32 compression_dict_id;
+  # Identifies the downstream host across requests, so that the upstream can
+  # track the acks of each follower. Downstreams not setting it are tracked as
+  # one follower.
+  10: optional string follower_id;
+  # If set, the downstream can bootstrap from a checkpoint of the upstream.
+  # The upstream then fails the request with SOURCE_SEQ_NO_PURGED if the
+  # updates requested have been purged from its WAL, instead of skipping them.
+  11: optional bool can_bootstrap;
 }
 
 typedef binary (cpp.type = "folly::IOBuf") IOBuf
@@ -54,6 +83,10 @@ struct Update {
 
   # The sequence number of this update on the leader
   3: optional i64 seq_no,
+
+  # If set, raw_data is compressed with the dictionary of the response, and
+  # this is its size after decompression
+  4: optional i64 uncompressed_size,
 }
 
 enum ReplicaRole {
@@ -69,6 +102,16 @@ struct ReplicateResponse {
   1: required list<Update> updates,
   // role is the replica role of the upstream that provides the updates.
   2: optional ReplicaRole role;
+
+  # The latest sequence number on the upstream when the response was built.
+  # It lets the downstream know how far behind it is.
+  3: optional i64 latest_seq_no;
+
+  # The id of the zstd dictionary the compressed updates in this response use
+  4: optional i32 compression_dict_id;
+
+  # The dictionary itself, if the downstream doesn't have it yet
+  5: optional binary compression_dict;
 }
 
 enum ErrorCode {
@@ -79,6 +122,11 @@ enum ErrorCode {
   # helix, and there is no harm if the upstream fails to distinguish between
   # SOURCE_REMOVED and SOURCE_NOT_FOUND
   SOURCE_REMOVED = 3,
+  # The updates requested have been purged from the upstream WAL. The
+  # downstream needs to bootstrap from a checkpoint before replicating again.
+  SOURCE_SEQ_NO_PURGED = 4,
+  # The checkpoint asked for doesn't exist (any more)
+  CHECKPOINT_NOT_FOUND = 5,
 }
 
 exception ReplicateException {
@@ -86,7 +134,113 @@ exception ReplicateException {
   2: required ErrorCode code,
 }
 
+struct SubscribeRequest {
+  # The name of the db to subscribe to
+  1: required binary db_name,
+
+  # The largest sequence number currently in the local DB. Updates of sequence
+  # (seq_no + 1) and larger will be pushed
+  2: required i64 seq_no,
+
+  # The port of the Replicator service on the downstream host. Updates are
+  # pushed to it, at the ip address the subscribe request comes from
+  3: required i32 port,
+
+  # role is the replica role of the downstream host subscribing
+  4: optional ReplicaRole role;
+  # Same as ReplicateRequest.follower_id. The downstream ip address is used if
+  # it's not set.
+  5: optional string follower_id;
+  # Same as ReplicateRequest.can_bootstrap. The upstream fails the request
+  # with SOURCE_SEQ_NO_PURGED if it can't push from seq_no, and stops pushing
+  # if the updates to push get purged later on.
+  6: optional bool can_bootstrap;
+}
+
+struct SubscribeResponse {
+  # role is the replica role of the upstream that will push the updates.
+  1: optional ReplicaRole role;
+}
+
+struct PushRequest {
+  # The name of the db the updates are for
+  1: required binary db_name,
+
+  # updates is an ordered continuous range of updates. The downstream skips
+  # updates it already has, and stops at the first gap.
+  2: required list<Update> updates,
+
+  # role is the replica role of the upstream that pushes the updates.
+  3: optional ReplicaRole role;
+
+  # The latest sequence number on the upstream when the request was built.
+  4: optional i64 latest_seq_no;
+}
+
+struct PushResponse {
+  # The largest sequence number the downstream has applied. The next push
+  # starts from (applied_seq_no + 1)
+  1: required i64 applied_seq_no,
+}
+
+struct CheckpointRequest {
+  # The name of the db to create a checkpoint of
+  1: required binary db_name,
+}
+
+struct CheckpointFile {
+  1: required string name,
+  2: required i64 size,
+}
+
+struct CheckpointResponse {
+  # Identifies the checkpoint in getCheckpointChunk() requests
+  1: required string checkpoint_id,
+  # The latest sequence number in the checkpoint. A downstream bootstrapped
+  # from it replicates updates of sequence (seq_no + 1) and larger
+  2: required i64 seq_no,
+  # All files in the checkpoint, which is a flat directory
+  3: required list<CheckpointFile> files,
+  # The identity of the upstream db (rocksdb::DB::GetDbIdentity()). sst files
+  # of the same name in checkpoints of the same db are the same
+  4: optional string db_identity,
+}
+
+struct CheckpointChunkRequest {
+  1: required binary db_name,
+  2: required string checkpoint_id,
+  3: required string file_name,
+  4: required i64 offset,
+  5: required i32 max_bytes,
+}
+
+struct CheckpointChunkResponse {
+  # Up to max_bytes of the file from offset. It's shorter than max_bytes only
+  # at the end of the file
+  1: required IOBuf data,
+}
+
 service Replicator {
   ReplicateResponse replicate(1:ReplicateRequest request)
       throws (1:ReplicateException e)
+
+  # Ask the upstream to push updates to the caller as they are committed,
+  # instead of having the caller pull them with replicate(). Upstreams not
+  # supporting it throw, and the caller keeps pulling.
+  SubscribeResponse subscribe(1:SubscribeRequest request)
+      throws (1:ReplicateException e)
+
+  # Called by an upstream on its subscribed downstreams.
+  PushResponse push(1:PushRequest request)
+      throws (1:ReplicateException e)
+
+  # Create a checkpoint of the db for a downstream to bootstrap from. The
+  # upstream keeps it until it has not been read for a while, and hands a
+  # recent checkpoint out again instead of creating a new one.
+  CheckpointResponse createCheckpoint(1:CheckpointRequest request)
+      throws (1:ReplicateException e)
+
+  # Read a chunk of a file in a checkpoint
+  CheckpointChunkResponse getCheckpointChunk(1:CheckpointChunkRequest request)
+      throws (1:ReplicateException e)
 }
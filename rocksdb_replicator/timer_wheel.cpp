@@ -0,0 +1,108 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#include "rocksdb_replicator/timer_wheel.h"
+
+#include <algorithm>
+#include <iterator>
+#include <utility>
+
+#include "glog/logging.h"
+
+namespace {
+
+const uint64_t kSharedTickMs = 10;
+const size_t kSharedNumSlots = 1024;
+
+}  // namespace
+
+namespace replicator { namespace detail {
+
+TimerWheel::TimerWheel(const uint64_t tick_ms, const size_t num_slots)
+    : tick_(tick_ms)
+    , mtx_()
+    , cv_()
+    , stop_(false)
+    , current_tick_(0)
+    , slots_(num_slots)
+    , thread_() {
+  CHECK(tick_ms > 0 && num_slots > 0);
+  thread_ = std::thread(&TimerWheel::run, this);
+}
+
+TimerWheel::~TimerWheel() {
+  {
+    std::lock_guard<std::mutex> g(mtx_);
+    stop_ = true;
+  }
+  cv_.notify_one();
+  thread_.join();
+}
+
+void TimerWheel::schedule(std::function<void()> f, const uint64_t timeout_ms) {
+  // round up, and always wait for at least one tick
+  auto ticks = std::max<uint64_t>(
+    (timeout_ms + tick_.count() - 1) / tick_.count(), 1);
+
+  std::lock_guard<std::mutex> g(mtx_);
+  auto expire_tick = current_tick_ + ticks;
+  slots_[expire_tick % slots_.size()].push_back(
+    Timer{expire_tick, std::move(f)});
+}
+
+TimerWheel* TimerWheel::shared() {
+  static TimerWheel wheel(kSharedTickMs, kSharedNumSlots);
+  return &wheel;
+}
+
+void TimerWheel::run() {
+  auto next_tick_time = std::chrono::steady_clock::now() + tick_;
+  std::vector<Timer> expired;
+
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lk(mtx_);
+      if (cv_.wait_until(lk, next_tick_time, [this] { return stop_; })) {
+        return;
+      }
+
+      // Catch up on every tick we missed, e.g. due to slow callbacks.
+      auto now = std::chrono::steady_clock::now();
+      while (next_tick_time <= now) {
+        ++current_tick_;
+        next_tick_time += tick_;
+
+        auto& slot = slots_[current_tick_ % slots_.size()];
+        auto new_end = std::partition(
+          slot.begin(), slot.end(),
+          [this] (const Timer& t) { return t.expire_tick > current_tick_; });
+        std::move(new_end, slot.end(), std::back_inserter(expired));
+        slot.erase(new_end, slot.end());
+      }
+    }
+
+    // run callbacks without holding mtx_, so that they may schedule timers
+    for (auto& t : expired) {
+      t.func();
+    }
+    expired.clear();
+  }
+}
+
+}  // namespace detail
+}  // namespace replicator
@@ -0,0 +1,85 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace replicator { namespace detail {
+
+/*
+ * A hashed timing wheel. Timers are hashed into num_slots buckets by the tick
+ * they expire at, and a single thread advances the wheel every tick_ms and
+ * runs the timers expiring at the current tick.
+ *
+ * Compared with one folly::futures::sleep() per timer, scheduling a timer is
+ * a vector push_back under a mutex, and there is no per timer future or
+ * timekeeper entry. The price is that timers fire up to tick_ms late.
+ *
+ * There is no cancellation. Callbacks are expected to hold weak references to
+ * whatever they may time out, and do nothing if it's gone or already done.
+ *
+ * @note All public interface of TimerWheel are thread safe.
+ */
+class TimerWheel {
+ public:
+  TimerWheel(const uint64_t tick_ms, const size_t num_slots);
+
+  // Stop the wheel thread. Timers not fired yet are dropped.
+  ~TimerWheel();
+
+  // no copy or move
+  TimerWheel(const TimerWheel&) = delete;
+  TimerWheel& operator=(const TimerWheel&) = delete;
+
+  // Run f in the wheel thread after timeout_ms, rounded up to the next tick.
+  // f should be cheap, e.g. handing work to an executor, since all timers
+  // share one thread.
+  void schedule(std::function<void()> f, const uint64_t timeout_ms);
+
+  // The wheel shared by all replicated dbs in the process
+  static TimerWheel* shared();
+
+ private:
+  struct Timer {
+    uint64_t expire_tick;
+    std::function<void()> func;
+  };
+
+  void run();
+
+  const std::chrono::milliseconds tick_;
+
+  // mtx_ protects everything below
+  std::mutex mtx_;
+  std::condition_variable cv_;
+  bool stop_;
+  uint64_t current_tick_;
+  std::vector<std::vector<Timer>> slots_;
+
+  std::thread thread_;
+};
+
+}  // namespace detail
+}  // namespace replicator
@@ -0,0 +1,245 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+#include "rocksdb_replicator/update_compression.h"
+
+#include <zdict.h>
+#include <zstd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+
+#include "glog/logging.h"
+
+namespace {
+
+// Records larger than this are truncated when sampled
+const size_t kMaxSampleSize = 64 * 1024;
+
+uint64_t NowMs() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Return a contiguous view of data. Only a chained data is copied into buf.
+folly::ByteRange Contiguous(const folly::IOBuf& data, std::string* buf) {
+  if (!data.isChained()) {
+    return folly::ByteRange(data.data(), data.length());
+  }
+
+  buf->reserve(data.computeChainDataLength());
+  for (const auto& range : data) {
+    buf->append(reinterpret_cast<const char*>(range.data()), range.size());
+  }
+  return folly::ByteRange(reinterpret_cast<const uint8_t*>(buf->data()),
+                          buf->size());
+}
+
+ZSTD_CCtx* ThreadLocalCCtx() {
+  thread_local std::unique_ptr<ZSTD_CCtx, size_t (*)(ZSTD_CCtx*)> cctx(
+    ZSTD_createCCtx(), ZSTD_freeCCtx);
+  return cctx.get();
+}
+
+ZSTD_DCtx* ThreadLocalDCtx() {
+  thread_local std::unique_ptr<ZSTD_DCtx, size_t (*)(ZSTD_DCtx*)> dctx(
+    ZSTD_createDCtx(), ZSTD_freeDCtx);
+  return dctx.get();
+}
+
+}  // namespace
+
+namespace replicator { namespace detail {
+
+CompressionDict::CompressionDict(std::string bytes_arg, const int level)
+    : bytes(std::move(bytes_arg))
+    , id(ZDICT_getDictID(bytes.data(), bytes.size()))
+    , cdict(ZSTD_createCDict(bytes.data(), bytes.size(), level)) {
+  CHECK(cdict);
+}
+
+CompressionDict::~CompressionDict() {
+  ZSTD_freeCDict(cdict);
+}
+
+UpdateCompressor::UpdateCompressor(const int level, const size_t dict_bytes,
+                                   const size_t sample_bytes,
+                                   const uint64_t refresh_ms)
+    : level_(level)
+    , dict_bytes_(dict_bytes)
+    , sample_bytes_(sample_bytes)
+    , refresh_ms_(refresh_ms)
+    , mtx_()
+    , samples_()
+    , sample_sizes_()
+    , dict_()
+    , samples_full_(false)
+    , training_(false)
+    , next_train_ms_(0) {}
+
+void UpdateCompressor::addSample(const folly::IOBuf& data) {
+  if (samples_full_.load()) {
+    return;
+  }
+
+  std::lock_guard<std::mutex> g(mtx_);
+  const auto size = std::min<size_t>(data.computeChainDataLength(),
+                                     kMaxSampleSize);
+  if (samples_.size() + size > sample_bytes_) {
+    samples_full_.store(true);
+    return;
+  }
+
+  size_t left = size;
+  for (const auto& range : data) {
+    const auto n = std::min<size_t>(range.size(), left);
+    samples_.append(reinterpret_cast<const char*>(range.data()), n);
+    left -= n;
+    if (left == 0) {
+      break;
+    }
+  }
+  sample_sizes_.push_back(size);
+}
+
+bool UpdateCompressor::shouldTrain() {
+  if (NowMs() < next_train_ms_.load()) {
+    return false;
+  }
+
+  {
+    std::lock_guard<std::mutex> g(mtx_);
+    if (samples_.size() < sample_bytes_ / 2) {
+      return false;
+    }
+  }
+
+  return !training_.exchange(true);
+}
+
+void UpdateCompressor::train() {
+  std::string samples;
+  std::vector<size_t> sample_sizes;
+  {
+    std::lock_guard<std::mutex> g(mtx_);
+    samples.swap(samples_);
+    sample_sizes.swap(sample_sizes_);
+  }
+
+  std::string bytes(dict_bytes_, '\0');
+  auto size = ZDICT_trainFromBuffer(&bytes[0], bytes.size(), samples.data(),
+                                    sample_sizes.data(), sample_sizes.size());
+  if (ZDICT_isError(size)) {
+    LOG(ERROR) << "Failed to train compression dictionary: "
+               << ZDICT_getErrorName(size);
+  } else {
+    bytes.resize(size);
+    auto dict = std::make_shared<const CompressionDict>(std::move(bytes),
+                                                        level_);
+    std::lock_guard<std::mutex> g(mtx_);
+    dict_ = std::move(dict);
+  }
+
+  next_train_ms_.store(NowMs() + refresh_ms_);
+  samples_full_.store(false);
+  training_.store(false);
+}
+
+std::shared_ptr<const CompressionDict> UpdateCompressor::dict() {
+  std::lock_guard<std::mutex> g(mtx_);
+  return dict_;
+}
+
+std::unique_ptr<folly::IOBuf> UpdateCompressor::compress(
+    const CompressionDict& dict,
+    const folly::IOBuf& data) {
+  std::string buf;
+  auto input = Contiguous(data, &buf);
+  const auto bound = ZSTD_compressBound(input.size());
+  auto output = folly::IOBuf::create(bound);
+  auto size = ZSTD_compress_usingCDict(ThreadLocalCCtx(),
+                                       output->writableData(), bound,
+                                       input.data(), input.size(),
+                                       dict.cdict);
+  if (ZSTD_isError(size) || size >= input.size()) {
+    return nullptr;
+  }
+
+  output->append(size);
+  return output;
+}
+
+UpdateDecompressor::UpdateDecompressor(const uint64_t max_uncompressed_bytes)
+    : max_uncompressed_bytes_(max_uncompressed_bytes)
+    , dict_id_(0)
+    , ddict_(nullptr) {}
+
+UpdateDecompressor::~UpdateDecompressor() {
+  ZSTD_freeDDict(ddict_);
+}
+
+bool UpdateDecompressor::setDict(const std::string& bytes) {
+  auto ddict = ZSTD_createDDict(bytes.data(), bytes.size());
+  if (ddict == nullptr) {
+    return false;
+  }
+
+  ZSTD_freeDDict(ddict_);
+  ddict_ = ddict;
+  dict_id_ = ZDICT_getDictID(bytes.data(), bytes.size());
+  return true;
+}
+
+void UpdateDecompressor::clear() {
+  ZSTD_freeDDict(ddict_);
+  ddict_ = nullptr;
+  dict_id_ = 0;
+}
+
+std::unique_ptr<folly::IOBuf> UpdateDecompressor::decompress(
+    const folly::IOBuf& data,
+    const uint64_t uncompressed_size) {
+  if (ddict_ == nullptr || uncompressed_size > max_uncompressed_bytes_) {
+    return nullptr;
+  }
+
+  std::string buf;
+  auto input = Contiguous(data, &buf);
+  // uncompressed_size comes off the wire. Check it against the frame before
+  // allocating for it.
+  if (ZSTD_getFrameContentSize(input.data(), input.size()) !=
+      uncompressed_size) {
+    return nullptr;
+  }
+
+  auto output = folly::IOBuf::create(uncompressed_size);
+  auto size = ZSTD_decompress_usingDDict(ThreadLocalDCtx(),
+                                         output->writableData(),
+                                         uncompressed_size,
+                                         input.data(), input.size(),
+                                         ddict_);
+  if (ZSTD_isError(size) || size != uncompressed_size) {
+    return nullptr;
+  }
+
+  output->append(size);
+  return output;
+}
+
+}  // namespace detail
+}  // namespace replicator
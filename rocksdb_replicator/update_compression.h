@@ -0,0 +1,172 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "folly/io/IOBuf.h"
+
+struct ZSTD_CDict_s;
+struct ZSTD_DDict_s;
+
+namespace replicator { namespace detail {
+
+/*
+ * A zstd dictionary trained from a db's own WAL records. WriteBatches of a
+ * shard share key prefixes and value layouts, which a per-frame compressor
+ * can't exploit for small records, but a dictionary can.
+ *
+ * id is the dictionary ID zstd stamps into the dictionary, and into every
+ * frame compressed with it.
+ */
+struct CompressionDict {
+  CompressionDict(std::string bytes_arg, const int level);
+  ~CompressionDict();
+
+  // no copy or move
+  CompressionDict(const CompressionDict&) = delete;
+  CompressionDict& operator=(const CompressionDict&) = delete;
+
+  const std::string bytes;
+  const uint32_t id;
+  ZSTD_CDict_s* const cdict;
+};
+
+/*
+ * UpdateCompressor compresses the raw_data of updates served by a leader.
+ *
+ * Records served are sampled through addSample() until sample_bytes have been
+ * collected. Once at least half of that has been collected and refresh_ms has
+ * passed since the last training, shouldTrain() returns true and the caller
+ * is expected to call train(), which replaces the current dictionary with one
+ * trained from the samples. Training takes time, so it's left to the caller
+ * to run it off the serving path.
+ *
+ * @note All public interface of UpdateCompressor are thread safe.
+ */
+class UpdateCompressor {
+ public:
+  UpdateCompressor(const int level, const size_t dict_bytes,
+                   const size_t sample_bytes, const uint64_t refresh_ms);
+
+  // no copy or move
+  UpdateCompressor(const UpdateCompressor&) = delete;
+  UpdateCompressor& operator=(const UpdateCompressor&) = delete;
+
+  /*
+   * Sample a record served. It's cheap once the sample buffer is full.
+   */
+  void addSample(const folly::IOBuf& data);
+
+  /*
+   * Return true if train() is due. At most one caller gets true until train()
+   * returns.
+   */
+  bool shouldTrain();
+
+  /*
+   * Train a new dictionary from the samples collected, and start collecting
+   * samples again.
+   */
+  void train();
+
+  /*
+   * The current dictionary, nullptr if none has been trained yet.
+   */
+  std::shared_ptr<const CompressionDict> dict();
+
+  /*
+   * Compress data with dict. Return nullptr if that doesn't make it smaller.
+   */
+  static std::unique_ptr<folly::IOBuf> compress(const CompressionDict& dict,
+                                                const folly::IOBuf& data);
+
+ private:
+  const int level_;
+  const size_t dict_bytes_;
+  const size_t sample_bytes_;
+  const uint64_t refresh_ms_;
+
+  // mtx_ protects samples_, sample_sizes_ and dict_
+  std::mutex mtx_;
+  std::string samples_;
+  std::vector<size_t> sample_sizes_;
+  std::shared_ptr<const CompressionDict> dict_;
+
+  std::atomic<bool> samples_full_;
+  std::atomic<bool> training_;
+  std::atomic<uint64_t> next_train_ms_;
+};
+
+/*
+ * UpdateDecompressor holds the dictionary a downstream got from its upstream.
+ *
+ * @note It's NOT thread safe. It's only used by the pull loop of a db.
+ */
+class UpdateDecompressor {
+ public:
+  /*
+   * Updates claiming to be larger than max_uncompressed_bytes once
+   * decompressed are rejected without allocating for them.
+   */
+  explicit UpdateDecompressor(const uint64_t max_uncompressed_bytes);
+  ~UpdateDecompressor();
+
+  // no copy or move
+  UpdateDecompressor(const UpdateDecompressor&) = delete;
+  UpdateDecompressor& operator=(const UpdateDecompressor&) = delete;
+
+  /*
+   * The id of the dictionary held, 0 if none.
+   */
+  uint32_t dictId() const {
+    return dict_id_;
+  }
+
+  /*
+   * Replace the dictionary held. Return false if bytes is not a valid
+   * dictionary.
+   */
+  bool setDict(const std::string& bytes);
+
+  /*
+   * Drop the dictionary held, so that upstream sends its dictionary again.
+   */
+  void clear();
+
+  /*
+   * Decompress data compressed with the dictionary held. uncompressed_size
+   * must match the size recorded in data.
+   * Return nullptr on failure.
+   */
+  std::unique_ptr<folly::IOBuf> decompress(const folly::IOBuf& data,
+                                           const uint64_t uncompressed_size);
+
+ private:
+  const uint64_t max_uncompressed_bytes_;
+  uint32_t dict_id_;
+  ZSTD_DDict_s* ddict_;
+};
+
+}  // namespace detail
+}  // namespace replicator
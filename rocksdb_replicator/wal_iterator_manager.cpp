@@ -0,0 +1,270 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#include "rocksdb_replicator/wal_iterator_manager.h"
+
+#include <chrono>
+#include <utility>
+
+namespace {
+
+uint64_t NowMs() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Listing the WAL files isn't free either, so don't prefetch more often than
+// this, however many new iterators are created.
+const uint64_t kMinPrefetchIntervalMs = 1000;
+
+}  // namespace
+
+namespace replicator { namespace detail {
+
+void WalIterator::Next() {
+  peeked_batch_.reset();
+  iter_->Next();
+}
+
+rocksdb::SequenceNumber WalIterator::PeekNextSeqNo() {
+  if (peeked_batch_ == nullptr) {
+    auto result = iter_->GetBatch();
+    peeked_seq_no_ = result.sequence;
+    peeked_batch_ = std::move(result.writeBatchPtr);
+  }
+
+  return peeked_seq_no_ + peeked_batch_->Count();
+}
+
+rocksdb::BatchResult WalIterator::GetBatch() {
+  if (peeked_batch_ == nullptr) {
+    return iter_->GetBatch();
+  }
+
+  rocksdb::BatchResult result;
+  result.sequence = peeked_seq_no_;
+  result.writeBatchPtr = std::move(peeked_batch_);
+  return result;
+}
+
+WalIteratorManager::WalIteratorManager(std::shared_ptr<DbWrapper> db_wrapper,
+                                       folly::Executor* executor,
+                                       const size_t max_iters,
+                                       const uint64_t max_skip_seq_nos,
+                                       const uint64_t min_fork_idle_ms,
+                                       const uint64_t prefetch_bytes,
+                                       const uint64_t idle_timeout_ms,
+                                       TimerWheel* timer_wheel)
+    : db_wrapper_(std::move(db_wrapper))
+    , executor_(executor)
+    , max_iters_(max_iters)
+    , max_skip_seq_nos_(max_skip_seq_nos)
+    , min_fork_idle_ms_(min_fork_idle_ms)
+    , prefetch_bytes_(prefetch_bytes)
+    , idle_timeout_ms_(idle_timeout_ms)
+    , timer_wheel_(timer_wheel)
+    , prefetching_(false)
+    , last_prefetch_ms_(0)
+    , mtx_()
+    , iters_()
+    , expiry_scheduled_(false) {}
+
+rocksdb::Status WalIteratorManager::get(const rocksdb::SequenceNumber seq_no,
+                                        std::unique_ptr<WalIterator>* iter,
+                                        Source* source) {
+  *iter = take(seq_no, source);
+  if (*iter) {
+    return rocksdb::Status::OK();
+  }
+
+  *source = Source::kNew;
+  std::unique_ptr<rocksdb::TransactionLogIterator> log_iter;
+  auto status = db_wrapper_->GetUpdatesFromLeader(seq_no, &log_iter);
+  if (log_iter) {
+    *iter = std::make_unique<WalIterator>(std::move(log_iter));
+  }
+
+  if (status.ok() && prefetch_bytes_ > 0) {
+    prefetch(seq_no);
+  }
+
+  return status;
+}
+
+void WalIteratorManager::put(const rocksdb::SequenceNumber next_seq_no,
+                             std::unique_ptr<WalIterator> iter) {
+  if (iter == nullptr || max_iters_ == 0) {
+    return;
+  }
+
+  // destroyed after mtx_ is released
+  std::unique_ptr<WalIterator> evicted;
+  std::lock_guard<std::mutex> g(mtx_);
+  if (iters_.size() >= max_iters_) {
+    auto lru = iters_.begin();
+    for (auto itor = iters_.begin(); itor != iters_.end(); ++itor) {
+      if (itor->second.last_used_ms < lru->second.last_used_ms) {
+        lru = itor;
+      }
+    }
+    evicted = std::move(lru->second.iter);
+    iters_.erase(lru);
+  }
+
+  iters_.emplace(next_seq_no, Entry{std::move(iter), NowMs()});
+  scheduleExpiry();
+}
+
+size_t WalIteratorManager::size() {
+  std::lock_guard<std::mutex> g(mtx_);
+  return iters_.size();
+}
+
+std::unique_ptr<WalIterator> WalIteratorManager::take(
+    const rocksdb::SequenceNumber seq_no, Source* source) {
+  std::unique_ptr<WalIterator> iter;
+  {
+    std::lock_guard<std::mutex> g(mtx_);
+    auto itor = iters_.find(seq_no);
+    *source = Source::kExact;
+    if (itor == iters_.end() && max_skip_seq_nos_ > 0) {
+      const auto lowest = seq_no > max_skip_seq_nos_ ?
+        seq_no - max_skip_seq_nos_ : 0;
+      const auto end = iters_.lower_bound(seq_no);
+      const auto now = NowMs();
+      for (auto i = iters_.lower_bound(lowest); i != end; ++i) {
+        if (i->second.last_used_ms + min_fork_idle_ms_ > now) {
+          continue;
+        }
+        if (itor == iters_.end() ||
+            i->second.last_used_ms < itor->second.last_used_ms) {
+          itor = i;
+        }
+      }
+      *source = Source::kForked;
+    }
+
+    if (itor == iters_.end()) {
+      return nullptr;
+    }
+
+    iter = std::move(itor->second.iter);
+    iters_.erase(itor);
+  }
+
+  if (!iter->Valid()) {
+    // An iterator at the end of the WAL doesn't see the updates written after
+    // it got there until Next() is called. If it's still invalid, a new log
+    // file may have been created, and a new iterator is required.
+    iter->Next();
+  }
+
+  if (*source == Source::kForked && !fastForward(seq_no, iter.get())) {
+    return nullptr;
+  }
+
+  if (!iter->Valid()) {
+    return nullptr;
+  }
+
+  return iter;
+}
+
+bool WalIteratorManager::fastForward(const rocksdb::SequenceNumber seq_no,
+                                     WalIterator* iter) {
+  while (iter->Valid() && iter->status().ok()) {
+    if (iter->PeekNextSeqNo() > seq_no) {
+      return true;
+    }
+    iter->Next();
+  }
+
+  return false;
+}
+
+void WalIteratorManager::prefetch(const rocksdb::SequenceNumber seq_no) {
+  const auto now = NowMs();
+  auto last_prefetch_ms = last_prefetch_ms_.load();
+  if ((last_prefetch_ms != 0 &&
+       now < last_prefetch_ms + kMinPrefetchIntervalMs) ||
+      prefetching_.exchange(true)) {
+    return;
+  }
+
+  last_prefetch_ms_.store(now);
+
+  std::weak_ptr<WalIteratorManager> weak_self = shared_from_this();
+  executor_->add([weak_self = std::move(weak_self), seq_no] {
+      auto self = weak_self.lock();
+      if (self == nullptr) {
+        return;
+      }
+
+      self->db_wrapper_->PrefetchWal(seq_no, self->prefetch_bytes_);
+      self->prefetching_.store(false);
+    });
+}
+
+void WalIteratorManager::scheduleExpiry() {
+  if (expiry_scheduled_ || idle_timeout_ms_ == 0) {
+    return;
+  }
+
+  expiry_scheduled_ = true;
+  std::weak_ptr<WalIteratorManager> weak_self = shared_from_this();
+  timer_wheel_->schedule(
+    [weak_self = std::move(weak_self), executor = executor_] {
+      if (weak_self.lock() == nullptr) {
+        return;
+      }
+
+      // closing iterators may touch files, keep it off the wheel thread
+      executor->add([weak_self] {
+          auto self = weak_self.lock();
+          if (self) {
+            self->expire();
+          }
+        });
+    },
+    idle_timeout_ms_);
+}
+
+void WalIteratorManager::expire() {
+  const auto now = NowMs();
+  // destroyed after mtx_ is released
+  std::vector<std::unique_ptr<WalIterator>> expired;
+  std::lock_guard<std::mutex> g(mtx_);
+  auto itor = iters_.begin();
+  while (itor != iters_.end()) {
+    if (itor->second.last_used_ms + idle_timeout_ms_ <= now) {
+      expired.push_back(std::move(itor->second.iter));
+      itor = iters_.erase(itor);
+      continue;
+    }
+
+    ++itor;
+  }
+
+  expiry_scheduled_ = false;
+  if (!iters_.empty()) {
+    scheduleExpiry();
+  }
+}
+
+}  // namespace detail
+}  // namespace replicator
@@ -0,0 +1,180 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+
+#pragma once
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "folly/Executor.h"
+#include "rocksdb/db.h"
+#include "rocksdb_replicator/db_wrapper.h"
+#include "rocksdb_replicator/timer_wheel.h"
+
+namespace replicator { namespace detail {
+
+/*
+ * A rocksdb::TransactionLogIterator which can look at the batch it is at
+ * without consuming it. TransactionLogIterator::GetBatch() moves the batch
+ * out, so a peeked batch is held here until GetBatch() or Next().
+ */
+class WalIterator {
+ public:
+  explicit WalIterator(std::unique_ptr<rocksdb::TransactionLogIterator> iter)
+    : iter_(std::move(iter))
+    , peeked_seq_no_(0)
+    , peeked_batch_() {}
+
+  bool Valid() const {
+    return peeked_batch_ != nullptr || iter_->Valid();
+  }
+
+  void Next();
+
+  rocksdb::Status status() const {
+    return iter_->status();
+  }
+
+  // The sequence # following the batch the iterator is at, i.e. the sequence
+  // # of the batch plus its # of records. Requires Valid().
+  rocksdb::SequenceNumber PeekNextSeqNo();
+
+  rocksdb::BatchResult GetBatch();
+
+ private:
+  std::unique_ptr<rocksdb::TransactionLogIterator> iter_;
+  rocksdb::SequenceNumber peeked_seq_no_;
+  std::unique_ptr<rocksdb::WriteBatch> peeked_batch_;
+};
+
+/*
+ * WalIteratorManager pools the WAL iterators of a db for its downstreams.
+ *
+ * Creating an iterator with GetUpdatesSince() opens and searches WAL files,
+ * which gets expensive when many downstreams (re)connect at once, e.g. after
+ * a failover. Instead, every downstream leaves its iterator here after a
+ * read, positioned at the sequence # it is going to ask for next. get() then
+ * serves a request from, in order of preference:
+ *  1. the iterator left at exactly the requested sequence #.
+ *  2. an iterator left at most max_skip_seq_nos before it, fast forwarded to
+ *     the requested sequence #. Only iterators unused for min_fork_idle_ms
+ *     are taken, as those are likely left by downstreams that went away,
+ *     while taking one from a live downstream would just make it create a
+ *     new one. The least recently used one goes first.
+ *  3. a new iterator. Up to prefetch_bytes of the WAL from about where the
+ *     requested sequence # is is then prefetched on executor, so the reads
+ *     following this one don't block on disk. It's done at most once a
+ *     second, so downstreams reconnecting together don't flood the page
+ *     cache.
+ *
+ * At most max_iters iterators are kept, the least recently used one is
+ * dropped first. Iterators not used for idle_timeout_ms are dropped as well.
+ *
+ * @note All public interface of WalIteratorManager are thread safe.
+ */
+class WalIteratorManager
+    : public std::enable_shared_from_this<WalIteratorManager> {
+ public:
+  // Where the iterator returned by get() comes from
+  enum class Source {
+    kExact,
+    kForked,
+    kNew,
+  };
+
+  WalIteratorManager(std::shared_ptr<DbWrapper> db_wrapper,
+                     folly::Executor* executor,
+                     const size_t max_iters,
+                     const uint64_t max_skip_seq_nos,
+                     const uint64_t min_fork_idle_ms,
+                     const uint64_t prefetch_bytes,
+                     const uint64_t idle_timeout_ms,
+                     TimerWheel* timer_wheel = TimerWheel::shared());
+
+  // no copy or move
+  WalIteratorManager(const WalIteratorManager&) = delete;
+  WalIteratorManager& operator=(const WalIteratorManager&) = delete;
+
+  /*
+   * Get an iterator at seq_no into iter.
+   * iter may be nullptr if the returned status is not ok.
+   */
+  rocksdb::Status get(const rocksdb::SequenceNumber seq_no,
+                      std::unique_ptr<WalIterator>* iter,
+                      Source* source);
+
+  /*
+   * Keep iter for the downstream which is going to ask for next_seq_no.
+   */
+  void put(const rocksdb::SequenceNumber next_seq_no,
+           std::unique_ptr<WalIterator> iter);
+
+  // The # of iterators kept
+  size_t size();
+
+ private:
+  struct Entry {
+    std::unique_ptr<WalIterator> iter;
+    uint64_t last_used_ms;
+  };
+
+  using EntryMap = std::multimap<rocksdb::SequenceNumber, Entry>;
+
+  // Take the iterator at seq_no, or the least recently used one within
+  // max_skip_seq_nos_ before it and idle for min_fork_idle_ms_, out of
+  // iters_. Return nullptr if there is none.
+  std::unique_ptr<WalIterator> take(const rocksdb::SequenceNumber seq_no,
+                                    Source* source);
+
+  // Move iter to the batch containing seq_no. Return false if iter runs out
+  // before that.
+  static bool fastForward(const rocksdb::SequenceNumber seq_no,
+                          WalIterator* iter);
+
+  // Prefetch the WAL files following seq_no on executor_, unless a prefetch
+  // is in flight already, or one started less than a second ago
+  void prefetch(const rocksdb::SequenceNumber seq_no);
+
+  // Arm the idle timer unless it's armed. Caller must hold mtx_.
+  void scheduleExpiry();
+
+  // Drop the idle iterators
+  void expire();
+
+  const std::shared_ptr<DbWrapper> db_wrapper_;
+  folly::Executor* const executor_;
+  const size_t max_iters_;
+  const uint64_t max_skip_seq_nos_;
+  const uint64_t min_fork_idle_ms_;
+  const uint64_t prefetch_bytes_;
+  const uint64_t idle_timeout_ms_;
+  TimerWheel* const timer_wheel_;
+  std::atomic<bool> prefetching_;
+  std::atomic<uint64_t> last_prefetch_ms_;
+
+  // mtx_ protects iters_ and expiry_scheduled_
+  std::mutex mtx_;
+  EntryMap iters_;
+  bool expiry_scheduled_;
+};
+
+}  // namespace detail
+}  // namespace replicator
@@ -0,0 +1,67 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+#include "rocksdb_replicator/wal_tail_cache.h"
+
+namespace replicator { namespace detail {
+
+void WalTailCache::add(const Update& update, const uint32_t num_records) {
+  const uint64_t seq_no = update.seq_no;
+  const uint64_t size = update.raw_data.computeChainDataLength();
+
+  std::lock_guard<std::mutex> g(mtx_);
+  if (updates_.count(seq_no) != 0) {
+    // another follower has just cached it
+    return;
+  }
+
+  // Update's copy constructor shares the buffer of raw_data
+  updates_.emplace(seq_no, Entry{update, num_records, size});
+  bytes_ += size;
+
+  while (!updates_.empty() &&
+         (updates_.size() > max_updates_ || bytes_ > max_bytes_)) {
+    bytes_ -= updates_.begin()->second.size;
+    updates_.erase(updates_.begin());
+  }
+}
+
+size_t WalTailCache::get(const uint64_t seq_no, const size_t max_updates,
+                         const uint64_t max_bytes,
+                         std::vector<Update>* updates, uint64_t* next_seq_no,
+                         uint64_t* bytes) {
+  std::lock_guard<std::mutex> g(mtx_);
+  auto itor = updates_.find(seq_no);
+  uint64_t expected_seq_no = seq_no;
+  uint64_t bytes_added = 0;
+  size_t n = 0;
+  while (n < max_updates && (max_bytes == 0 || bytes_added < max_bytes) &&
+         itor != updates_.end() && itor->first == expected_seq_no) {
+    updates->push_back(itor->second.update);
+    bytes_added += itor->second.size;
+    expected_seq_no += itor->second.num_records;
+    ++n;
+    ++itor;
+  }
+
+  *next_seq_no = expected_seq_no;
+  *bytes += bytes_added;
+  return n;
+}
+
+}  // namespace detail
+}  // namespace replicator
@@ -0,0 +1,93 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+//
+// @author bol (bol@pinterest.com)
+//
+#pragma once
+
+#include <map>
+#include <mutex>
+#include <vector>
+
+#include "rocksdb_replicator/thrift/gen-cpp2/replicator_types.h"
+
+namespace replicator { namespace detail {
+
+/*
+ * WalTailCache is a bounded in-memory cache of recently served WAL records,
+ * shared by all downstreams pulling from the same db. A record decoded from
+ * the WAL for one follower can then be served to every other follower and
+ * observer asking for it without touching the WAL again.
+ *
+ * Updates are kept in their serialized form, and raw_data is shared with the
+ * cached copy instead of being copied when served.
+ *
+ * Once the cache holds more than max_updates updates or max_bytes bytes, the
+ * updates with the smallest sequence #s are evicted first, so the cache always
+ * covers the tail of the WAL that followers are most likely to ask for.
+ *
+ * @note All public interface of WalTailCache are thread safe.
+ */
+class WalTailCache {
+ public:
+  WalTailCache(const size_t max_updates, const uint64_t max_bytes)
+    : mtx_()
+    , updates_()
+    , bytes_(0)
+    , max_updates_(max_updates)
+    , max_bytes_(max_bytes) {}
+
+  // no copy or move
+  WalTailCache(const WalTailCache&) = delete;
+  WalTailCache& operator=(const WalTailCache&) = delete;
+
+  /*
+   * Add a WAL record to the cache.
+   * update.seq_no must be the sequence # of the first record in the batch, and
+   * num_records is the # of records in the batch.
+   */
+  void add(const Update& update, const uint32_t num_records);
+
+  /*
+   * Append up to max_updates continuous updates to updates, starting from the
+   * one whose sequence # is seq_no. No more updates are appended once their
+   * total size reaches max_bytes. max_bytes == 0 means no limit.
+   * next_seq_no is set to the sequence # following the last appended update,
+   * and the size of the appended updates is added to bytes.
+   *
+   * @return the # of updates appended. 0 means seq_no is not in the cache.
+   */
+  size_t get(const uint64_t seq_no, const size_t max_updates,
+             const uint64_t max_bytes, std::vector<Update>* updates,
+             uint64_t* next_seq_no, uint64_t* bytes);
+
+ private:
+  struct Entry {
+    Update update;
+    uint32_t num_records;
+    uint64_t size;
+  };
+
+  // mtx_ protects updates_ and bytes_
+  std::mutex mtx_;
+  // keyed by the sequence # of the first record in the batch
+  std::map<uint64_t, Entry> updates_;
+  uint64_t bytes_;
+  const size_t max_updates_;
+  const uint64_t max_bytes_;
+};
+
+}  // namespace detail
+}  // namespace replicator
@@ -0,0 +1,177 @@
+/// Copyright 2016 Pinterest Inc.
+///
+/// Licensed under the Apache License, Version 2.0 (the "License");
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an "AS IS" BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#include "rocksdb/write_batch.h"
+
+namespace replicator {
+
+/*
+ * Helpers working directly on the serialized representation of a
+ * rocksdb::WriteBatch. The layout is stable across RocksDB releases:
+ *
+ *   rep :=
+ *      sequence: fixed64
+ *      count: fixed32
+ *      data: record[count]
+ *
+ * A LogData record is encoded as kTypeLogData (0x3) followed by a
+ * varint32-length-prefixed blob.
+ */
+namespace detail {
+
+const size_t kWriteBatchHeaderSize = 12;
+const char kWriteBatchTypeLogData = 0x3;
+
+inline uint64_t DecodeFixed(const char* buf, const size_t size) {
+  uint64_t value = 0;
+  for (size_t i = 0; i < size; ++i) {
+    value |= static_cast<uint64_t>(static_cast<unsigned char>(buf[i])) << (8 * i);
+  }
+  return value;
+}
+
+inline void EncodeFixed(char* buf, const size_t size, uint64_t value) {
+  for (size_t i = 0; i < size; ++i) {
+    buf[i] = static_cast<char>(value & 0xff);
+    value >>= 8;
+  }
+}
+
+}  // namespace detail
+
+/*
+ * Return the sequence # of the first record in batch. RocksDB stamps it into
+ * the batch when the batch is written. 0 means it's not available.
+ */
+inline uint64_t GetWriteBatchSequence(const rocksdb::WriteBatch& batch) {
+  const auto& rep = batch.Data();
+  if (rep.size() < detail::kWriteBatchHeaderSize) {
+    return 0;
+  }
+
+  return detail::DecodeFixed(rep.data(), 8);
+}
+
+/*
+ * Merge the records of batches, in order, into a single WriteBatch, the same
+ * way RocksDB merges the batches of a write group.
+ */
+template <typename Iter>
+rocksdb::WriteBatch MergeWriteBatches(Iter begin, Iter end) {
+  std::string rep(detail::kWriteBatchHeaderSize, '\0');
+  uint64_t count = 0;
+  for (auto itor = begin; itor != end; ++itor) {
+    const auto& src = (*itor)->Data();
+    if (src.size() > detail::kWriteBatchHeaderSize) {
+      rep.append(src.data() + detail::kWriteBatchHeaderSize,
+                 src.size() - detail::kWriteBatchHeaderSize);
+    }
+    count += (*itor)->Count();
+  }
+
+  detail::EncodeFixed(&rep[8], 4, count);
+  return rocksdb::WriteBatch(rep);
+}
+
+/*
+ * ReplicatedDB::Write() appends the write time as the last record of every
+ * WriteBatch. It is a LogData record whose blob is the timestamp in ms, 8
+ * bytes, optionally followed by kTimestampTag. So a batch stamped with a tag
+ * always ends with
+ *
+ *   kTypeLogData, varint32(16), ms: 8 bytes, kTimestampTag: 8 bytes
+ *
+ * The tag tells it apart from a record which merely happens to end in a
+ * LogData header and 8 bytes, e.g. a Put() with such a value, so the
+ * timestamp is read without iterating the batch.
+ *
+ * Older versions only read the bare 8-byte form. Rolling out the tagged form
+ * takes two steps: upgrade every host to a version which reads both, then
+ * turn on FLAGS_replicator_tagged_timestamps everywhere.
+ */
+namespace detail {
+
+const char kTimestampTag[] = { 'r', 'p', 'l', 'c', 't', 's', 'm', 's' };
+const size_t kTimestampBlobSize = 8 + sizeof(kTimestampTag);
+const size_t kTimestampTrailerSize = 2 + kTimestampBlobSize;
+
+}  // namespace detail
+
+/*
+ * Append the timestamp record for ms to batch, tagged or in the bare 8-byte
+ * form older versions read.
+ */
+inline void AppendTimestamp(rocksdb::WriteBatch* batch, const uint64_t ms,
+                            const bool tagged) {
+  if (!tagged) {
+    batch->PutLogData(
+      rocksdb::Slice(reinterpret_cast<const char*>(&ms), sizeof(ms)));
+    return;
+  }
+
+  char blob[detail::kTimestampBlobSize];
+  memcpy(blob, &ms, sizeof(ms));
+  memcpy(blob + sizeof(ms), detail::kTimestampTag,
+         sizeof(detail::kTimestampTag));
+  batch->PutLogData(rocksdb::Slice(blob, sizeof(blob)));
+}
+
+/*
+ * Return true and fill ms if blob is the payload of a timestamp record,
+ * tagged or not.
+ */
+inline bool ParseTimestamp(const rocksdb::Slice& blob, uint64_t* ms) {
+  if (blob.size() == sizeof(*ms) ||
+      (blob.size() == detail::kTimestampBlobSize &&
+       memcmp(blob.data() + sizeof(*ms), detail::kTimestampTag,
+              sizeof(detail::kTimestampTag)) == 0)) {
+    memcpy(ms, blob.data(), sizeof(*ms));
+    return true;
+  }
+
+  return false;
+}
+
+/*
+ * Return true and fill ms if batch ends with a tagged timestamp record.
+ * Otherwise, e.g. for a bare 8-byte timestamp, return false, and the caller
+ * may fall back to a full Iterate().
+ */
+inline bool ExtractTrailingTimestamp(const rocksdb::WriteBatch& batch,
+                                     uint64_t* ms) {
+  const auto& rep = batch.Data();
+  if (rep.size() < detail::kWriteBatchHeaderSize +
+                   detail::kTimestampTrailerSize) {
+    return false;
+  }
+
+  const char* trailer = rep.data() + rep.size() - detail::kTimestampTrailerSize;
+  if (trailer[0] != detail::kWriteBatchTypeLogData ||
+      trailer[1] != static_cast<char>(detail::kTimestampBlobSize) ||
+      memcmp(trailer + 2 + sizeof(*ms), detail::kTimestampTag,
+             sizeof(detail::kTimestampTag)) != 0) {
+    return false;
+  }
+
+  memcpy(ms, trailer + 2, sizeof(*ms));
+  return true;
+}
+
+}  // namespace replicator